@@ -12,6 +12,20 @@ DEL_REQ = 2
 GET_RESP = 3
 RESP = 4
 INFO = 11
+SCAN_REQ = 12
+SCAN_RESP = 13
+MGET_REQ = 14
+MGET_RESP = 15
+MPUT_REQ = 16
+MDEL_REQ = 17
+INGEST_REQ = 18
+SNAPSHOT_REQ = 19
+
+# Maximum number of entries the server returns for a single SCAN request
+SCAN_PAGE = 1000
+
+# Maximum number of keys the server accepts in a single MGET, MPUT or MDEL
+BATCH_MAX = 1000
 
 # Default timeout (in seconds)
 TIMEOUT = 3
@@ -74,13 +88,28 @@ class KVClient:
         try:
             unpacker = struct.Struct('I')
             size = socket.ntohl(unpacker.unpack(self._sock.recv(4))[0])
-            data = self._sock.recv(size)
+            data = b""
+            while len(data) < size:
+                chunk = self._sock.recv(size - len(data))
+                if not chunk:
+                    break
+                data += chunk
         except Exception as e:
             raise e
         if not data:
             raise Exception(ERRORS["no_data"])
 
-        return KVMessage(json_data=data)
+        message = KVMessage(json_data=data)
+        if message.vallen is not None:
+            # Large values follow the JSON as raw bytes instead of within it.
+            value = b""
+            while len(value) < message.vallen:
+                chunk = self._sock.recv(message.vallen - len(value))
+                if not chunk:
+                    raise Exception(ERRORS["no_data"])
+                value += chunk
+            message.value = value.decode("utf-8")
+        return message
 
     def _disconnect(self):
         """
@@ -113,6 +142,130 @@ class KVClient:
         self._check_key(key)
         return self._send_request(DEL_REQ, key)
 
+    def scan(self, start=None, end=None, limit=0):
+        """
+        Returns a list of (key, value) pairs for every key which is at least
+        START and less than END, in key order. Either end may be None to leave
+        the range open. Returns at most LIMIT pairs unless LIMIT is 0.
+        """
+        entries = []
+        while True:
+            page = SCAN_PAGE
+            if limit:
+                page = min(page, limit - len(entries))
+            message = KVMessage(msg_type=SCAN_REQ, key=start, value=end)
+            message.limit = page
+            self._connect()
+            message.send(self._sock)
+            response = self._listen()
+            self._disconnect()
+            if response.type != SCAN_RESP:
+                raise Exception(response.message or ERRORS["generic"])
+            keys = response.keys or []
+            entries.extend(zip(keys, response.values or []))
+            if len(keys) < page or (limit and len(entries) >= limit):
+                return entries
+            # Keys cannot contain NUL, so this is the next key after the last.
+            start = keys[-1] + "\x01"
+
+    def prefix_scan(self, prefix, limit=0):
+        """
+        Returns a list of (key, value) pairs for every key starting with
+        PREFIX, in key order.
+        """
+        self._check_key(prefix)
+        end = prefix[:-1] + chr(ord(prefix[-1]) + 1)
+        return self.scan(prefix, end, limit)
+
+    def mget(self, keys):
+        """
+        GETs the values for every key in KEYS from the KV server, and returns
+        a dict mapping each key to its value, or to None if it is absent.
+        """
+        for key in keys:
+            self._check_key(key)
+        keys = list(keys)
+        result = {}
+        for i in range(0, len(keys), BATCH_MAX):
+            batch = keys[i:i + BATCH_MAX]
+            response = self._send_batch(MGET_REQ, batch)
+            if response.type != MGET_RESP:
+                raise Exception(response.message or ERRORS["generic"])
+            result.update(zip(response.keys or [], response.values or []))
+        return result
+
+    def mput(self, entries):
+        """
+        PUTs every (key, value) pair in ENTRIES (a dict or a list of pairs) to
+        the KV server.
+        """
+        if isinstance(entries, dict):
+            entries = list(entries.items())
+        for key, value in entries:
+            self._check_key(key)
+            self._check_value(value)
+        for i in range(0, len(entries), BATCH_MAX):
+            batch = entries[i:i + BATCH_MAX]
+            self._check_response(self._send_batch(
+                MPUT_REQ, [k for k, _ in batch], [v for _, v in batch]))
+        return "SUCCESS"
+
+    def mdelete(self, keys):
+        """
+        DELs every key in KEYS from the KV server. Keys which are absent are
+        skipped.
+        """
+        for key in keys:
+            self._check_key(key)
+        keys = list(keys)
+        for i in range(0, len(keys), BATCH_MAX):
+            self._check_response(self._send_batch(
+                MDEL_REQ, keys[i:i + BATCH_MAX]))
+        return "SUCCESS"
+
+    def ingest(self, name):
+        """
+        Has the KV server adopt the entries which kvingest built in NAME, a
+        directory within the ingest root of the server (its -I option).
+        NAME may not contain a '/'.
+        """
+        if not name or "/" in name or name in (".", ".."):
+            raise Exception(ERRORS["invalid_key"])
+        return self._send_request(INGEST_REQ, name)
+
+    def snapshot(self, name):
+        """
+        Has the KV server take a snapshot of its stores into NAME, a
+        directory which does not exist yet within the snapshot root of the
+        server (its -S option). NAME may not contain a '/'.
+        """
+        if not name or "/" in name or name in (".", ".."):
+            raise Exception(ERRORS["invalid_key"])
+        return self._send_request(SNAPSHOT_REQ, name)
+
+    def _send_batch(self, req_type, keys, values=None):
+        """
+        Sends a batch request carrying KEYS (and VALUES) and returns the
+        response.
+        """
+        message = KVMessage(msg_type=req_type)
+        message.keys = keys
+        message.values = values
+        self._connect()
+        message.send(self._sock)
+        response = self._listen()
+        self._disconnect()
+        return response
+
+    def _check_response(self, response):
+        """
+        Raises an Exception unless RESPONSE reports success.
+        """
+        if response.type != RESP:
+            raise Exception(ERRORS["generic"])
+        if response.message != "SUCCESS":
+            raise Exception(response.message)
+
     def _send_request(self, req_type, key, value=None):
         """
         Helper function for sending the three different types of request.
@@ -167,6 +320,10 @@ class KVMessage:
             1) with a msg_type (mandatory) and optional key, value, msg
             2) with a JSON string (json_data -- incoming data from a connection)
         """
+        self.limit = 0
+        self.keys = None
+        self.values = None
+        self.vallen = None
         if json_data:
             self._from_json(json_data)
         else:
@@ -193,8 +350,14 @@ class KVMessage:
             self.key = decoded["key"]
         if "value" in decoded:
             self.value = decoded["value"]
+        if "vallen" in decoded:
+            self.vallen = decoded["vallen"]
         if "message" in decoded:
             self.message = decoded["message"]
+        if "keys" in decoded:
+            self.keys = decoded["keys"]
+        if "values" in decoded:
+            self.values = decoded["values"]
 
     def _to_json(self):
         """
@@ -208,6 +371,12 @@ class KVMessage:
             d["value"] = self.value
         if self.message:
             d["message"] = self.message
+        if self.limit:
+            d["limit"] = self.limit
+        if self.keys is not None:
+            d["keys"] = self.keys
+        if self.values is not None:
+            d["values"] = self.values
 
         return json.dumps(d)
 
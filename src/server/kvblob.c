@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "kvblob.h"
+#include "kvcrc32c.h"
+#include "kvstore.h"
+
+/* Returns true if the file NAME ends with TYPE. */
+static bool has_filetype(const char *name, const char *type) {
+  size_t len = strlen(name), typelen = strlen(type);
+  return len > typelen && strcmp(name + len - typelen, type) == 0;
+}
+
+/* Initializes BLOBS, which keeps its blobs within the KVBLOB_DIRNAME
+ * subdirectory of DIRNAME (created when the first blob is written) and syncs
+ * them according to SYNC_MODE. Blobs left half-written are removed. Returns
+ * 0 if successful, else a negative error code. */
+int kvblob_init(kvblob_t *blobs, char *dirname, kvsync_mode_t sync_mode) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  unsigned long long id;
+  DIR *dir;
+  /* Room is left for the names of the blob files themselves. */
+  if (strlen(dirname) + strlen(KVBLOB_DIRNAME) + 24 >= MAX_FILENAME ||
+      kvstore_path(blobs->dirname, "%s/%s", dirname, KVBLOB_DIRNAME) != 0)
+    return ERRFILLEN;
+  blobs->sync_mode = sync_mode;
+  blobs->count = 0;
+  blobs->snapshotting = false;
+  pthread_mutex_init(&blobs->snapshot_lock, NULL);
+  /* IDs start from the time, so that they are not reused even once every
+   * blob with a higher ID has been removed. */
+  blobs->next_id = (uint64_t) time(NULL) << 20;
+  if ((dir = opendir(blobs->dirname)) == NULL)
+    return 0;
+  while ((dent = readdir(dir)) != NULL) {
+    if (has_filetype(dent->d_name, KVBLOB_TMP_FILETYPE)) {
+      if (kvstore_path(filename, "%s/%s", blobs->dirname, dent->d_name) == 0)
+        remove(filename);
+    } else if (has_filetype(dent->d_name, KVBLOB_FILETYPE) &&
+        sscanf(dent->d_name, "%16llx", &id) == 1) {
+      blobs->count++;
+      if (id >= blobs->next_id)
+        blobs->next_id = id + 1;
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+/* Places the ID and LENGTH of the blob named by REF into ID and LENGTH.
+ * Returns 0 if successful, else ERRCHECKSUM if REF is not a reference. */
+static int ref_parse(const char *ref, uint64_t *id, uint64_t *length) {
+  unsigned long long i, l;
+  if (sscanf(ref, "blob:%16llx:%llu", &i, &l) != 2)
+    return ERRCHECKSUM;
+  *id = i;
+  *length = l;
+  return 0;
+}
+
+/* Writes the LEN bytes at BUF to FD. Returns 0 if successful, else -1. */
+static int write_all(int fd, const char *buf, size_t len) {
+  ssize_t n;
+  while (len > 0) {
+    if ((n = write(fd, buf, len)) <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Syncs the directory DIRNAME, so that a rename within it is durable.
+ * Returns 0 if successful, else -1. */
+static int sync_dir(const char *dirname) {
+  int fd = open(dirname, O_RDONLY | O_DIRECTORY), ret;
+  if (fd < 0)
+    return -1;
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+/* Creates the directory of BLOBS, and the store directory above it, if they
+ * do not exist yet. Returns 0 if successful, else ERRFILCRT. */
+static int make_dirs(kvblob_t *blobs) {
+  char parent[MAX_FILENAME];
+  char *slash;
+  strcpy(parent, blobs->dirname);
+  if ((slash = strrchr(parent, '/')) != NULL) {
+    *slash = '\0';
+    if (mkdir(parent, 0700) == -1 && errno != EEXIST)
+      return ERRFILCRT;
+  }
+  if (mkdir(blobs->dirname, 0700) == -1 && errno != EEXIST)
+    return ERRFILCRT;
+  return 0;
+}
+
+/* Writes a blob of LENGTH bytes for KEY into BLOBS, reading it with READER
+ * (passed ARG) KVBLOB_CHUNK_SIZE bytes at a time, and places a reference to
+ * it into REF, which must hold KVBLOB_REF_SIZE bytes. Returns 0 if
+ * successful, ERRVALLEN if LENGTH is more than MAX_BLOB_VALLEN, ERRINVLDMSG
+ * if READER fails or ends early, else a negative error code (or ENOMEM). */
+int kvblob_write(kvblob_t *blobs, kvkey_t *key, size_t length,
+    kvblob_read_t reader, void *arg, char *ref) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  kvblob_header_t header;
+  unsigned long long id;
+  size_t done = 0, want;
+  uint32_t crc = 0;
+  ssize_t n;
+  char *buf;
+  int fd, ret = 0;
+  if (length > MAX_BLOB_VALLEN)
+    return ERRVALLEN;
+  if ((ret = make_dirs(blobs)) != 0)
+    return ret;
+  if ((buf = malloc(KVBLOB_CHUNK_SIZE)) == NULL)
+    return ENOMEM;
+  id = __atomic_fetch_add(&blobs->next_id, 1, __ATOMIC_RELAXED);
+  if (kvstore_path(filename, "%s/%016llx%s", blobs->dirname, id,
+      KVBLOB_FILETYPE) != 0 || kvstore_path(tmpname, "%s/%016llx%s",
+      blobs->dirname, id, KVBLOB_TMP_FILETYPE) != 0 ||
+      (fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    free(buf);
+    return ERRFILCRT;
+  }
+  memset(&header, 0, sizeof(kvblob_header_t));
+  header.magic = KVBLOB_MAGIC;
+  header.keylen = key->len;
+  header.length = length;
+  /* The header is written again once the checksum is known. */
+  if (write_all(fd, (char *) &header, sizeof(kvblob_header_t)) < 0 ||
+      write_all(fd, key->str, key->len) < 0)
+    ret = ERRFILACCESS;
+  while (ret == 0 && done < length) {
+    want = length - done;
+    if (want > KVBLOB_CHUNK_SIZE)
+      want = KVBLOB_CHUNK_SIZE;
+    if ((n = reader(arg, buf, want)) <= 0 || (size_t) n > want) {
+      ret = ERRINVLDMSG;
+      break;
+    }
+    if (write_all(fd, buf, n) < 0)
+      ret = ERRFILACCESS;
+    crc = kvcrc32c(crc, buf, n);
+    done += n;
+  }
+  free(buf);
+  header.checksum = crc;
+  if (ret == 0 && pwrite(fd, &header, sizeof(kvblob_header_t), 0) !=
+      sizeof(kvblob_header_t))
+    ret = ERRFILACCESS;
+  if (ret == 0 && blobs->sync_mode != KVSYNC_NONE && fdatasync(fd) < 0)
+    ret = ERRFILACCESS;
+  if (close(fd) < 0 && ret == 0)
+    ret = ERRFILACCESS;
+  if (ret == 0 && rename(tmpname, filename) < 0)
+    ret = ERRFILACCESS;
+  if (ret != 0) {
+    remove(tmpname);
+    return ret;
+  }
+  if (blobs->sync_mode != KVSYNC_NONE && sync_dir(blobs->dirname) < 0) {
+    remove(filename);
+    return ERRFILACCESS;
+  }
+  __atomic_fetch_add(&blobs->count, 1, __ATOMIC_RELAXED);
+  snprintf(ref, KVBLOB_REF_SIZE, "blob:%016llx:%llu", id,
+      (unsigned long long) length);
+  return 0;
+}
+
+/* Checks that the LENGTH bytes at OFFSET within FD match CHECKSUM, reading
+ * them KVBLOB_CHUNK_SIZE bytes at a time. Returns 0 if they do, ERRCHECKSUM
+ * if they do not, else a negative error code (or ENOMEM). */
+static int verify_value(int fd, off_t offset, size_t length,
+    uint32_t checksum) {
+  uint32_t crc = 0;
+  size_t want;
+  char *buf;
+  int ret = 0;
+  if ((buf = malloc(KVBLOB_CHUNK_SIZE)) == NULL)
+    return ENOMEM;
+  while (length > 0) {
+    want = (length > KVBLOB_CHUNK_SIZE) ? KVBLOB_CHUNK_SIZE : length;
+    if (pread(fd, buf, want, offset) != (ssize_t) want) {
+      ret = ERRFILACCESS;
+      break;
+    }
+    crc = kvcrc32c(crc, buf, want);
+    offset += want;
+    length -= want;
+  }
+  free(buf);
+  if (ret == 0 && crc != checksum)
+    ret = ERRCHECKSUM;
+  return ret;
+}
+
+/* Opens the blob of BLOBS named by REF, placing an open file descriptor for
+ * it (to be close()d by the caller) into FD, and the offset and length of
+ * the value within it into OFFSET and LENGTH. The layout of the file is
+ * checked, as is the checksum of the value if VERIFY is set. Returns 0 if
+ * successful, ERRNOKEY if the blob does not exist, ERRCHECKSUM if it is
+ * damaged, else a negative error code (or ENOMEM). */
+int kvblob_open(kvblob_t *blobs, const char *ref, bool verify, int *fd,
+    off_t *offset, size_t *length) {
+  char filename[MAX_FILENAME];
+  kvblob_header_t header;
+  uint64_t id, len;
+  struct stat st;
+  int ret;
+  if ((ret = ref_parse(ref, &id, &len)) != 0)
+    return ret;
+  *fd = -1;
+  if (kvstore_path(filename, "%s/%016llx%s", blobs->dirname,
+      (unsigned long long) id, KVBLOB_FILETYPE) != 0)
+    return ERRFILACCESS;
+  if ((*fd = open(filename, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  if (pread(*fd, &header, sizeof(kvblob_header_t), 0) !=
+      sizeof(kvblob_header_t) || fstat(*fd, &st) < 0) {
+    ret = ERRFILACCESS;
+  } else if (header.magic != KVBLOB_MAGIC || header.length != len ||
+      header.keylen > MAX_KEYLEN || st.st_size != (off_t)
+      (sizeof(kvblob_header_t) + header.keylen + header.length)) {
+    ret = ERRCHECKSUM;
+  }
+  *offset = sizeof(kvblob_header_t) + header.keylen;
+  *length = header.length;
+  if (ret == 0 && verify)
+    ret = verify_value(*fd, *offset, *length, header.checksum);
+  if (ret != 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  return ret;
+}
+
+/* Links the blob file NAME of BLOBS into the snapshot being taken, unless
+ * it is there already. Must be called with the snapshot lock held. Returns
+ * 0 if successful, ERRNOKEY if the blob does not exist, else a negative
+ * error code. */
+static int snapshot_link(kvblob_t *blobs, const char *name) {
+  char filename[MAX_FILENAME], dstname[MAX_FILENAME];
+  if (kvstore_path(filename, "%s/%s", blobs->dirname, name) != 0 ||
+      kvstore_path(dstname, "%s/%s", blobs->snapshot, name) != 0)
+    return ERRFILACCESS;
+  if (access(dstname, F_OK) == 0)
+    return 0;
+  return kvstore_snapshot_link(filename, dstname);
+}
+
+/* Removes the blob of BLOBS named by REF. Returns 0 if successful, ERRNOKEY
+ * if it does not exist, else a negative error code. A blob which cannot be
+ * linked into the snapshot being taken is kept, as an orphan. */
+int kvblob_remove(kvblob_t *blobs, const char *ref) {
+  char filename[MAX_FILENAME];
+  uint64_t id, len;
+  int ret;
+  if ((ret = ref_parse(ref, &id, &len)) != 0)
+    return ret;
+  if (kvstore_path(filename, "%s/%016llx%s", blobs->dirname,
+      (unsigned long long) id, KVBLOB_FILETYPE) != 0)
+    return ERRFILACCESS;
+  if (__atomic_load_n(&blobs->snapshotting, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&blobs->snapshot_lock);
+    ret = snapshot_link(blobs, filename + strlen(blobs->dirname) + 1);
+    if (ret == 0 && remove(filename) < 0)
+      ret = (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+    pthread_mutex_unlock(&blobs->snapshot_lock);
+    if (ret != 0)
+      return ret;
+  } else if (remove(filename) < 0) {
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  }
+  __atomic_fetch_sub(&blobs->count, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Calls CALLBACK with ARG on the key and reference of every blob of BLOBS,
+ * in no particular order. Blob files which are too damaged to tell what
+ * they hold are skipped. Returns 0 if successful, else a negative error
+ * code. */
+int kvblob_list(kvblob_t *blobs, kvblob_cb_t callback, void *arg) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME], key[MAX_KEYLEN + 1], ref[KVBLOB_REF_SIZE];
+  kvblob_header_t header;
+  unsigned long long id;
+  DIR *dir;
+  int fd, ret = 0;
+  if ((dir = opendir(blobs->dirname)) == NULL)
+    return (errno == ENOENT) ? 0 : ERRFILACCESS;
+  while (ret == 0 && (dent = readdir(dir)) != NULL) {
+    if (!has_filetype(dent->d_name, KVBLOB_FILETYPE) ||
+        sscanf(dent->d_name, "%16llx", &id) != 1)
+      continue;
+    if (kvstore_path(filename, "%s/%s", blobs->dirname, dent->d_name) != 0 ||
+        (fd = open(filename, O_RDONLY)) < 0)
+      continue;
+    if (pread(fd, &header, sizeof(kvblob_header_t), 0) !=
+        sizeof(kvblob_header_t) || header.magic != KVBLOB_MAGIC ||
+        header.keylen > MAX_KEYLEN ||
+        pread(fd, key, header.keylen, sizeof(kvblob_header_t)) !=
+        (ssize_t) header.keylen) {
+      close(fd);
+      continue;
+    }
+    close(fd);
+    key[header.keylen] = '\0';
+    snprintf(ref, KVBLOB_REF_SIZE, "blob:%016llx:%llu", id,
+        (unsigned long long) header.length);
+    ret = callback(key, ref, arg);
+  }
+  closedir(dir);
+  return ret < 0 ? ret : 0;
+}
+
+/* Starts linking the blobs of BLOBS into the KVBLOB_DIRNAME subdirectory of
+ * DIRNAME, the directory of a snapshot, which is created. From now on until
+ * kvblob_snapshot_end, a blob is linked into it before it is removed.
+ * Returns 0 if successful, else a negative error code. */
+int kvblob_snapshot_begin(kvblob_t *blobs, char *dirname) {
+  if (strlen(dirname) + strlen(KVBLOB_DIRNAME) + 24 >= MAX_FILENAME)
+    return ERRFILLEN;
+  pthread_mutex_lock(&blobs->snapshot_lock);
+  if (kvstore_path(blobs->snapshot, "%s/%s", dirname, KVBLOB_DIRNAME) != 0 ||
+      mkdir(blobs->snapshot, 0700) == -1) {
+    pthread_mutex_unlock(&blobs->snapshot_lock);
+    return ERRFILCRT;
+  }
+  __atomic_store_n(&blobs->snapshotting, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&blobs->snapshot_lock);
+  return 0;
+}
+
+/* Links every blob which BLOBS still holds into the snapshot started by
+ * kvblob_snapshot_begin, which then stops receiving blobs. Returns 0 if
+ * successful, else a negative error code. */
+int kvblob_snapshot_end(kvblob_t *blobs) {
+  struct dirent *dent;
+  DIR *dir;
+  int ret = 0;
+  pthread_mutex_lock(&blobs->snapshot_lock);
+  if ((dir = opendir(blobs->dirname)) == NULL) {
+    if (errno != ENOENT)
+      ret = ERRFILACCESS;
+  } else {
+    while (ret == 0 && (dent = readdir(dir)) != NULL) {
+      if (!has_filetype(dent->d_name, KVBLOB_FILETYPE))
+        continue;
+      /* A blob removed in the meantime was linked as it went. */
+      if ((ret = snapshot_link(blobs, dent->d_name)) == ERRNOKEY)
+        ret = 0;
+    }
+    closedir(dir);
+  }
+  if (ret == 0 && sync_dir(blobs->snapshot) < 0)
+    ret = ERRFILACCESS;
+  __atomic_store_n(&blobs->snapshotting, false, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&blobs->snapshot_lock);
+  return ret;
+}
+
+/* Removes every blob of BLOBS, and their directory. */
+int kvblob_clean(kvblob_t *blobs) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  DIR *dir;
+  if ((dir = opendir(blobs->dirname)) == NULL)
+    return 0;
+  while ((dent = readdir(dir)) != NULL) {
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+    if (kvstore_path(filename, "%s/%s", blobs->dirname, dent->d_name) == 0)
+      remove(filename);
+  }
+  closedir(dir);
+  rmdir(blobs->dirname);
+  blobs->count = 0;
+  return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef __KV_BLOB__
+#define __KV_BLOB__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "kvconstants.h"
+#include "kvkey.h"
+#include "kvsync.h"
+
+/* KVBlob stores values too long for the storage engines (longer than
+ * MAX_VALLEN, and at most MAX_BLOB_VALLEN bytes) out of line, each in a blob
+ * file of its own within the KVBLOB_DIRNAME subdirectory of the store
+ * directory. The engine stores a short reference to the blob in place of the
+ * value, marked as a reference rather than a value, and KVStore resolves it
+ * (see kvstore.h).
+ *
+ * A blob is written from a reader callback, KVBLOB_CHUNK_SIZE bytes at a
+ * time, so storing one takes the same memory however long it is. It is read
+ * back by locating it within its file, so that it can be sent without being
+ * read into memory at all. Blobs are binary-safe: their length is recorded,
+ * rather than implied by a null terminator.
+ *
+ * Each blob file holds a kvblob_header_t, then the key the blob was written
+ * for, then the value. It is written under a temporary name and renamed into
+ * place once complete (and synced, unless the sync mode is KVSYNC_NONE), so a
+ * reference never names a partial blob. A blob is removed as soon as the
+ * engine no longer refers to it; blobs orphaned by a crash, or by two writes
+ * of the same key racing, are found by listing the blobs (kvblob_list) when
+ * the store is opened and checking each against the engine.
+ *
+ * While a snapshot of the store is taken (see kvstore_snapshot), from just
+ * before its moment until every blob has been linked into it, a blob which
+ * is removed is linked into the snapshot first, so that the snapshot holds
+ * every blob its entries may refer to. It may also hold some which they do
+ * not, which are removed when it is opened, like any orphan.
+ */
+
+/* The name of the subdirectory of the store directory holding blobs. */
+#define KVBLOB_DIRNAME "blobs"
+
+/* The filetype of blob files, and of blob files still being written. */
+#define KVBLOB_FILETYPE ".blob"
+#define KVBLOB_TMP_FILETYPE ".blob.tmp"
+
+/* Identifies a blob file. */
+#define KVBLOB_MAGIC 0x4b56424fU
+
+/* The number of bytes of a blob read or written at once. */
+#define KVBLOB_CHUNK_SIZE (256 * 1024)
+
+/* The size of a buffer which holds any reference to a blob, including its
+ * null terminator. */
+#define KVBLOB_REF_SIZE 48
+
+/* The header of a blob file. */
+typedef struct {
+  uint32_t magic;               /* Always KVBLOB_MAGIC. */
+  uint32_t keylen;              /* The length of the key which follows. */
+  uint64_t length;              /* The length of the value which follows the key. */
+  uint32_t checksum;            /* The CRC-32C of the value. */
+  uint32_t pad;                 /* Always 0. */
+} kvblob_header_t;
+
+/* Reads up to SIZE bytes of a value being stored into BUF. Returns the
+ * number of bytes read, which is 0 only at the end of the value, or -1 if
+ * the value cannot be read. */
+typedef ssize_t (*kvblob_read_t)(void *arg, char *buf, size_t size);
+
+/* Called by kvblob_list with the key and reference of each blob. Returning
+ * nonzero ends the listing. */
+typedef int (*kvblob_cb_t)(char *key, char *ref, void *arg);
+
+/* The blobs of a store. */
+typedef struct {
+  char dirname[MAX_FILENAME];   /* The directory holding the blob files. */
+  kvsync_mode_t sync_mode;      /* Blobs are synced before they are published unless this is KVSYNC_NONE. */
+  uint64_t next_id;             /* The ID of the next blob to be written. */
+  uint64_t count;               /* The number of blobs which exist, or may. */
+  char snapshot[MAX_FILENAME];  /* The directory blobs are linked into while a snapshot is taken. */
+  bool snapshotting;            /* true while blobs are to be linked into SNAPSHOT before they are removed. */
+  pthread_mutex_t snapshot_lock; /* Protects SNAPSHOT and SNAPSHOTTING. */
+} kvblob_t;
+
+int kvblob_init(kvblob_t *, char *dirname, kvsync_mode_t sync_mode);
+
+int kvblob_write(kvblob_t *, kvkey_t *key, size_t length,
+    kvblob_read_t reader, void *arg, char *ref);
+int kvblob_open(kvblob_t *, const char *ref, bool verify, int *fd,
+    off_t *offset, size_t *length);
+int kvblob_remove(kvblob_t *, const char *ref);
+
+int kvblob_list(kvblob_t *, kvblob_cb_t callback, void *arg);
+
+int kvblob_snapshot_begin(kvblob_t *, char *dirname);
+int kvblob_snapshot_end(kvblob_t *);
+
+int kvblob_clean(kvblob_t *);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include "kvbloom.h"
+
+/* The number of 64-bit words in each block. */
+#define BLOCK_WORDS (KVBLOOM_BLOCK_BITS / 64)
+
+/* Initializes BLOOM to be empty, with room for CAPACITY keys (at least
+ * KVBLOOM_MIN_KEYS). Returns 0 if successful, else a negative error code. */
+int kvbloom_init(kvbloom_t *bloom, uint64_t capacity) {
+  memset(bloom, 0, sizeof(kvbloom_t));
+  if (capacity < KVBLOOM_MIN_KEYS)
+    capacity = KVBLOOM_MIN_KEYS;
+  bloom->num_blocks = (capacity * KVBLOOM_BITS_PER_KEY + KVBLOOM_BLOCK_BITS - 1)
+      / KVBLOOM_BLOCK_BITS;
+  if ((bloom->bits = calloc(bloom->num_blocks * BLOCK_WORDS,
+      sizeof(uint64_t))) == NULL)
+    return ENOMEM;
+  return 0;
+}
+
+/* Adds KEY to BLOOM. */
+void kvbloom_add(kvbloom_t *bloom, kvkey_t *key) {
+  uint64_t h = key->bloom_hash, *block, bit, old;
+  uint32_t h1 = h, h2 = (h >> 17) | 1;
+  int i;
+  block = &bloom->bits[((h >> 32) % bloom->num_blocks) * BLOCK_WORDS];
+  for (i = 0; i < KVBLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) % KVBLOOM_BLOCK_BITS;
+    old = __atomic_fetch_or(&block[bit / 64], 1ULL << (bit % 64),
+        __ATOMIC_RELAXED);
+    if (!(old & (1ULL << (bit % 64))))
+      __atomic_fetch_add(&bloom->set_bits, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&bloom->count, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns false if KEY has definitely never been added to BLOOM, else
+ * true. */
+bool kvbloom_may_contain(kvbloom_t *bloom, kvkey_t *key) {
+  uint64_t h = key->bloom_hash, *block, bit;
+  uint32_t h1 = h, h2 = (h >> 17) | 1;
+  int i;
+  block = &bloom->bits[((h >> 32) % bloom->num_blocks) * BLOCK_WORDS];
+  for (i = 0; i < KVBLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) % KVBLOOM_BLOCK_BITS;
+    if (!(__atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED) &
+        (1ULL << (bit % 64)))) {
+      __atomic_fetch_add(&bloom->negatives, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Records that a key which was added to BLOOM has been deleted. */
+void kvbloom_remove(kvbloom_t *bloom) {
+  __atomic_fetch_add(&bloom->stale, 1, __ATOMIC_RELAXED);
+}
+
+/* Records that BLOOM answered a lookup as possibly present for a key which
+ * turned out to be absent. */
+void kvbloom_false_positive(kvbloom_t *bloom) {
+  __atomic_fetch_add(&bloom->false_positives, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of keys BLOOM was sized for. */
+uint64_t kvbloom_capacity(kvbloom_t *bloom) {
+  return bloom->num_blocks * KVBLOOM_BLOCK_BITS / KVBLOOM_BITS_PER_KEY;
+}
+
+/* Returns the expected false positive rate of BLOOM given how full it is:
+ * the chance that every bit probed for an absent key is already set. */
+double kvbloom_fpr(kvbloom_t *bloom) {
+  double fill = (double) __atomic_load_n(&bloom->set_bits, __ATOMIC_RELAXED) /
+      (bloom->num_blocks * KVBLOOM_BLOCK_BITS), fpr = 1;
+  int i;
+  for (i = 0; i < KVBLOOM_HASHES; i++)
+    fpr *= fill;
+  return fpr;
+}
+
+/* Returns the fraction of lookups for absent keys which BLOOM failed to
+ * reject since it was created, or 0 if there have been none. */
+double kvbloom_observed_fpr(kvbloom_t *bloom) {
+  uint64_t fp = __atomic_load_n(&bloom->false_positives, __ATOMIC_RELAXED);
+  uint64_t neg = __atomic_load_n(&bloom->negatives, __ATOMIC_RELAXED);
+  return (fp + neg == 0) ? 0 : (double) fp / (fp + neg);
+}
+
+/* Writes BLOOM to the file FILENAME, replacing it atomically. Returns 0 if
+ * successful, else a negative error code. */
+int kvbloom_save(kvbloom_t *bloom, char *filename) {
+  char tmpname[MAX_FILENAME];
+  kvbloom_header_t header;
+  size_t words = bloom->num_blocks * BLOCK_WORDS;
+  FILE *file;
+  if (strlen(filename) + 4 >= MAX_FILENAME)
+    return ERRFILLEN;
+  sprintf(tmpname, "%s.tmp", filename);
+  if ((file = fopen(tmpname, "w")) == NULL)
+    return ERRFILCRT;
+  memset(&header, 0, sizeof(kvbloom_header_t));
+  header.magic = KVBLOOM_MAGIC;
+  header.num_blocks = bloom->num_blocks;
+  header.count = bloom->count;
+  header.stale = bloom->stale;
+  header.set_bits = bloom->set_bits;
+  if (fwrite(&header, sizeof(kvbloom_header_t), 1, file) != 1 ||
+      fwrite(bloom->bits, sizeof(uint64_t), words, file) != words ||
+      fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  if (rename(tmpname, filename) < 0) {
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  return 0;
+}
+
+/* Initializes BLOOM from the file FILENAME, as written by kvbloom_save.
+ * Returns 0 if successful, else a negative error code (ERRNOKEY if there is
+ * no such file). */
+int kvbloom_load(kvbloom_t *bloom, char *filename) {
+  kvbloom_header_t header;
+  size_t words;
+  FILE *file;
+  memset(bloom, 0, sizeof(kvbloom_t));
+  if ((file = fopen(filename, "r")) == NULL)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  if (fread(&header, sizeof(kvbloom_header_t), 1, file) != 1 ||
+      header.magic != KVBLOOM_MAGIC || header.num_blocks == 0 ||
+      header.num_blocks > SIZE_MAX / KVBLOOM_BLOCK_BITS) {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  words = header.num_blocks * BLOCK_WORDS;
+  if ((bloom->bits = malloc(words * sizeof(uint64_t))) == NULL) {
+    fclose(file);
+    return ENOMEM;
+  }
+  if (fread(bloom->bits, sizeof(uint64_t), words, file) != words) {
+    fclose(file);
+    kvbloom_free(bloom);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  bloom->num_blocks = header.num_blocks;
+  bloom->count = header.count;
+  bloom->stale = header.stale;
+  bloom->set_bits = header.set_bits;
+  return 0;
+}
+
+/* Frees the memory used by BLOOM. */
+void kvbloom_free(kvbloom_t *bloom) {
+  free(bloom->bits);
+  bloom->bits = NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef __KV_BLOOM__
+#define __KV_BLOOM__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "kvconstants.h"
+#include "kvkey.h"
+
+/* KVBloom is a blocked Bloom filter over keys, used by KVStore to answer
+ * lookups of absent keys without touching the engine.
+ *
+ * The filter is an array of 512-bit blocks, each the size of a cache line.
+ * A key hashes (by the BLOOM_HASH of its kvkey_t) to a single block, and
+ * sets KVBLOOM_HASHES bits within it, so an add or a lookup costs one cache
+ * miss however large the filter is. With
+ * KVBLOOM_BITS_PER_KEY bits per key this gives a false positive rate of
+ * around 1% while the filter is within its capacity.
+ *
+ * Bloom filters cannot forget keys, so deleting a key only counts it as
+ * stale. The owner is expected to rebuild the filter once it holds too many
+ * stale keys or more keys than its capacity.
+ *
+ * Adds and lookups may run concurrently with one another.
+ */
+
+/* The number of bits in each block. */
+#define KVBLOOM_BLOCK_BITS 512
+
+/* The number of bits set for each key. */
+#define KVBLOOM_HASHES 7
+
+/* The number of bits provisioned per key of capacity. */
+#define KVBLOOM_BITS_PER_KEY 10
+
+/* The smallest capacity a filter is created with. */
+#define KVBLOOM_MIN_KEYS 65536
+
+/* Identifies a valid saved filter. */
+#define KVBLOOM_MAGIC 0x4b56424cU
+
+/* The header of a saved filter, which is followed by its blocks. */
+typedef struct {
+  uint32_t magic;               /* Always KVBLOOM_MAGIC. */
+  uint32_t pad;
+  uint64_t num_blocks;          /* The number of blocks in the filter. */
+  uint64_t count;               /* The number of keys added. */
+  uint64_t stale;               /* The number of keys deleted. */
+  uint64_t set_bits;            /* The number of bits set. */
+} kvbloom_header_t;
+
+/* A KVBloom. */
+typedef struct {
+  uint64_t num_blocks;          /* The number of blocks in the filter. */
+  uint64_t *bits;               /* The blocks, KVBLOOM_BLOCK_BITS / 64 words each. */
+  uint64_t count;               /* The number of keys added. */
+  uint64_t stale;               /* The number of keys deleted since they were added. */
+  uint64_t set_bits;            /* The number of bits set. */
+  uint64_t negatives;           /* The number of lookups the filter answered as absent. */
+  uint64_t false_positives;     /* The number of lookups it passed on for keys which were absent. */
+} kvbloom_t;
+
+int kvbloom_init(kvbloom_t *, uint64_t capacity);
+
+void kvbloom_add(kvbloom_t *, kvkey_t *key);
+bool kvbloom_may_contain(kvbloom_t *, kvkey_t *key);
+void kvbloom_remove(kvbloom_t *);
+void kvbloom_false_positive(kvbloom_t *);
+
+uint64_t kvbloom_capacity(kvbloom_t *);
+double kvbloom_fpr(kvbloom_t *);
+double kvbloom_observed_fpr(kvbloom_t *);
+
+int kvbloom_save(kvbloom_t *, char *filename);
+int kvbloom_load(kvbloom_t *, char *filename);
+
+void kvbloom_free(kvbloom_t *);
+
+#endif
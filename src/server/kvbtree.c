@@ -0,0 +1,920 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kvcrc32c.h"
+#include "kvbtree.h"
+#include "kvstore.h"
+
+/* The space within a page available for entries and their offsets. */
+#define USABLE (KVBTREE_PAGE_SIZE - sizeof(kvbtree_page_t))
+
+/* A page holding less than this much is merged with a sibling. */
+#define MERGE_THRESHOLD (USABLE / 4)
+
+/* Rounds N up to a multiple of 4, so that entries stay aligned. */
+#define ALIGN4(n) (((n) + 3) & ~(size_t) 3)
+
+/* A leaf or branch entry, as held in memory while pages are rebuilt. KEY and
+ * VALUE point into a mapped page. */
+typedef struct {
+  const char *key;              /* The key, not null terminated. */
+  size_t keylen;                /* The length of KEY. */
+  const char *value;            /* The value of a leaf entry, not null terminated. */
+  size_t vallen;                /* The length of VALUE. */
+  bool ref;                     /* Whether VALUE is a reference to a blob. */
+  uint32_t child;               /* The child of a branch entry. */
+} item_t;
+
+/* A growable list of items. */
+typedef struct {
+  item_t *items;
+  int count;
+  int cap;
+} itemlist_t;
+
+/* Returns a pointer to page PGNO of TREE. */
+static kvbtree_page_t *page_at(kvbtree_t *tree, uint32_t pgno) {
+  return (kvbtree_page_t *) (tree->map + (size_t) pgno * KVBTREE_PAGE_SIZE);
+}
+
+/* Returns the checksum of PAGE, which covers everything but the checksum. */
+static uint32_t page_checksum(kvbtree_page_t *page) {
+  return kvcrc32c(0, (char *) page + sizeof(uint32_t),
+      KVBTREE_PAGE_SIZE - sizeof(uint32_t));
+}
+
+/* Marks page PGNO of TREE as verified. */
+static void page_set_verified(kvbtree_t *tree, uint32_t pgno) {
+  __atomic_fetch_or(&tree->verified[pgno / 8], 1 << (pgno % 8),
+      __ATOMIC_RELAXED);
+}
+
+/* Places a pointer to the leaf or branch page PGNO of TREE into PAGE,
+ * verifying it if it has not been read before. NPAGES is the number of pages
+ * in the version of the tree being read. Returns 0 if successful, else
+ * ERRFILACCESS if the page is out of range or corrupt. */
+static int page_get(kvbtree_t *tree, uint32_t pgno, uint32_t npages,
+    kvbtree_page_t **page) {
+  kvbtree_page_t *p;
+  if (pgno < KVBTREE_META_PAGES || pgno >= npages)
+    return ERRFILACCESS;
+  p = page_at(tree, pgno);
+  if (!(__atomic_load_n(&tree->verified[pgno / 8], __ATOMIC_RELAXED) &
+      (1 << (pgno % 8)))) {
+    if (p->checksum != page_checksum(p) || p->pgno != pgno ||
+        !(p->flags & (KVBTREE_BRANCH | KVBTREE_LEAF)) ||
+        p->upper > KVBTREE_PAGE_SIZE ||
+        sizeof(kvbtree_page_t) + p->count * sizeof(uint16_t) > p->upper)
+      return ERRFILACCESS;
+    page_set_verified(tree, pgno);
+  }
+  *page = p;
+  return 0;
+}
+
+/* Compares two keys which are not null terminated, in the same order as
+ * strcmp() would. */
+static int key_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  int cmp = memcmp(a, b, (alen < blen) ? alen : blen);
+  if (cmp != 0)
+    return cmp;
+  return (alen > blen) - (alen < blen);
+}
+
+/* Places the key of entry I of PAGE into KEY and KEYLEN. */
+static void page_key(kvbtree_page_t *page, int i, const char **key,
+    size_t *keylen) {
+  char *entry = (char *) page + page->slots[i];
+  if (page->flags & KVBTREE_LEAF) {
+    *key = ((kvbtree_leaf_t *) entry)->data;
+    *keylen = ((kvbtree_leaf_t *) entry)->keylen;
+  } else {
+    *key = ((kvbtree_branch_t *) entry)->data;
+    *keylen = ((kvbtree_branch_t *) entry)->keylen;
+  }
+}
+
+/* Returns the index of the first entry of PAGE whose key is not less than
+ * KEY, or PAGE->count if there is none. EXACT is set if that entry's key
+ * equals KEY. */
+static int page_search(kvbtree_page_t *page, const char *key, size_t keylen,
+    bool *exact) {
+  int lo = 0, hi = page->count, mid, cmp;
+  const char *k;
+  size_t klen;
+  *exact = false;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    page_key(page, mid, &k, &klen);
+    cmp = key_cmp(k, klen, key, keylen);
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+      if (cmp == 0)
+        *exact = true;
+    }
+  }
+  return lo;
+}
+
+/* Returns the index of the child of the branch PAGE whose subtree would hold
+ * KEY. */
+static int branch_search(kvbtree_page_t *page, const char *key, size_t keylen) {
+  bool exact;
+  int i = page_search(page, key, keylen, &exact);
+  return (exact || i == 0) ? i : i - 1;
+}
+
+/* Returns the page number of child I of the branch PAGE. */
+static uint32_t branch_child(kvbtree_page_t *page, int i) {
+  return ((kvbtree_branch_t *) ((char *) page + page->slots[i]))->child;
+}
+
+/* Returns the space used by ITEM within a page of type FLAGS. */
+static size_t item_size(item_t *item, uint16_t flags) {
+  if (flags & KVBTREE_LEAF)
+    return sizeof(uint16_t) + ALIGN4(sizeof(kvbtree_leaf_t) + item->keylen +
+        item->vallen);
+  return sizeof(uint16_t) + ALIGN4(sizeof(kvbtree_branch_t) + item->keylen);
+}
+
+/* Replaces the N items of LIST starting at POS with the NUM_ITEMS ITEMS.
+ * Returns 0 if successful, else a negative error code. */
+static int list_splice(itemlist_t *list, int pos, int n, item_t *items,
+    int num_items) {
+  item_t *tmp;
+  int count = list->count - n + num_items;
+  if (count > list->cap) {
+    if ((tmp = realloc(list->items, count * 2 * sizeof(item_t))) == NULL)
+      return ENOMEM;
+    list->items = tmp;
+    list->cap = count * 2;
+  }
+  memmove(&list->items[pos + num_items], &list->items[pos + n],
+      (list->count - pos - n) * sizeof(item_t));
+  if (num_items > 0)
+    memcpy(&list->items[pos], items, num_items * sizeof(item_t));
+  list->count = count;
+  return 0;
+}
+
+/* Appends the entries of PAGE to LIST. Returns 0 if successful, else a
+ * negative error code. */
+static int list_load(itemlist_t *list, kvbtree_page_t *page) {
+  kvbtree_leaf_t *leaf;
+  kvbtree_branch_t *branch;
+  item_t item;
+  int i, ret;
+  for (i = 0; i < page->count; i++) {
+    memset(&item, 0, sizeof(item_t));
+    if (page->flags & KVBTREE_LEAF) {
+      leaf = (kvbtree_leaf_t *) ((char *) page + page->slots[i]);
+      item.key = leaf->data;
+      item.keylen = leaf->keylen;
+      item.value = leaf->data + leaf->keylen;
+      item.vallen = leaf->vallen & ~KVBTREE_REF;
+      item.ref = (leaf->vallen & KVBTREE_REF) != 0;
+    } else {
+      branch = (kvbtree_branch_t *) ((char *) page + page->slots[i]);
+      item.key = branch->data;
+      item.keylen = branch->keylen;
+      item.child = branch->child;
+    }
+    if ((ret = list_splice(list, list->count, 0, &item, 1)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Appends PGNO to LIST. Returns 0 if successful, else a negative error code. */
+static int pglist_push(kvbtree_pglist_t *list, uint32_t pgno) {
+  size_t cap = (list->cap == 0) ? 64 : list->cap * 2;
+  uint32_t *tmp;
+  if (list->count == list->cap) {
+    if ((tmp = realloc(list->pgnos, cap * sizeof(uint32_t))) == NULL)
+      return ENOMEM;
+    list->pgnos = tmp;
+    list->cap = cap;
+  }
+  list->pgnos[list->count++] = pgno;
+  return 0;
+}
+
+/* Allocates a page for the current write of TREE, reusing a free page if
+ * there is one and otherwise growing the file. Returns 0 if successful, else
+ * a negative error code. */
+static int page_alloc(kvbtree_t *tree, uint32_t *pgno) {
+  uint64_t grow;
+  int ret;
+  if (tree->free.count > 0) {
+    *pgno = tree->free.pgnos[--tree->free.count];
+  } else {
+    if (tree->txn.npages >= tree->filepages) {
+      grow = tree->filepages / 8;
+      if (grow < KVBTREE_GROW_PAGES)
+        grow = KVBTREE_GROW_PAGES;
+      if ((tree->filepages + grow) * KVBTREE_PAGE_SIZE > KVBTREE_MAP_SIZE)
+        grow = KVBTREE_MAP_SIZE / KVBTREE_PAGE_SIZE - tree->filepages;
+      if (grow == 0 || ftruncate(tree->fd, (off_t) (tree->filepages + grow) *
+          KVBTREE_PAGE_SIZE) < 0)
+        return ERRFILACCESS;
+      tree->filepages += grow;
+    }
+    *pgno = tree->txn.npages++;
+  }
+  if ((ret = pglist_push(&tree->dirty, *pgno)) != 0) {
+    pglist_push(&tree->free, *pgno);
+    return ret;
+  }
+  return 0;
+}
+
+/* Releases page PGNO, which is part of the committed tree, once the current
+ * write of TREE commits. Returns 0 if successful, else a negative error code. */
+static int page_free(kvbtree_t *tree, uint32_t pgno) {
+  return pglist_push(&tree->pending, pgno);
+}
+
+/* Writes the NUM_ITEMS ITEMS into as few new pages of type FLAGS as will
+ * hold them, filling the pages evenly. A branch item naming each new page is
+ * appended to OUT. Returns 0 if successful, else a negative error code. */
+static int write_items(kvbtree_t *tree, uint16_t flags, item_t *items,
+    int num_items, itemlist_t *out) {
+  kvbtree_page_t *page;
+  kvbtree_leaf_t *leaf;
+  kvbtree_branch_t *branch;
+  size_t remaining = 0, used, target, size;
+  int i, start, j, ret;
+  uint32_t pgno;
+  item_t item;
+  for (i = 0; i < num_items; i++)
+    remaining += item_size(&items[i], flags);
+
+  for (i = 0; i < num_items; ) {
+    target = remaining / ((remaining + USABLE - 1) / USABLE);
+    start = i;
+    used = 0;
+    while (i < num_items && (i == start ||
+        (used < target && used + item_size(&items[i], flags) <= USABLE))) {
+      used += item_size(&items[i], flags);
+      i++;
+    }
+    remaining -= used;
+
+    if ((ret = page_alloc(tree, &pgno)) != 0)
+      return ret;
+    page = page_at(tree, pgno);
+    memset(page, 0, sizeof(kvbtree_page_t));
+    page->pgno = pgno;
+    page->flags = flags;
+    page->count = i - start;
+    page->upper = KVBTREE_PAGE_SIZE;
+    for (j = start; j < i; j++) {
+      size = item_size(&items[j], flags) - sizeof(uint16_t);
+      page->upper -= size;
+      page->slots[j - start] = page->upper;
+      if (flags & KVBTREE_LEAF) {
+        leaf = (kvbtree_leaf_t *) ((char *) page + page->upper);
+        leaf->keylen = items[j].keylen;
+        leaf->vallen = items[j].vallen | (items[j].ref ? KVBTREE_REF : 0);
+        memcpy(leaf->data, items[j].key, items[j].keylen);
+        memcpy(leaf->data + items[j].keylen, items[j].value, items[j].vallen);
+      } else {
+        branch = (kvbtree_branch_t *) ((char *) page + page->upper);
+        branch->keylen = items[j].keylen;
+        branch->pad = 0;
+        branch->child = items[j].child;
+        memcpy(branch->data, items[j].key, items[j].keylen);
+      }
+    }
+    memset((char *) page + sizeof(kvbtree_page_t) + page->count *
+        sizeof(uint16_t), 0, page->upper - sizeof(kvbtree_page_t) -
+        page->count * sizeof(uint16_t));
+    page->checksum = page_checksum(page);
+    page_set_verified(tree, pgno);
+
+    memset(&item, 0, sizeof(item_t));
+    page_key(page, 0, &item.key, &item.keylen);
+    item.child = pgno;
+    if ((ret = list_splice(out, out->count, 0, &item, 1)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Returns the space used within PAGE. */
+static size_t page_used(kvbtree_page_t *page) {
+  return page->count * sizeof(uint16_t) + KVBTREE_PAGE_SIZE - page->upper;
+}
+
+/* Applies a PUT of KEY and VALUE, which is a reference to a blob if REF is
+ * set, or a DEL of KEY if VALUE is NULL, to the subtree rooted at page PGNO,
+ * which is DEPTH levels tall. The pages which replace it (none if it is left
+ * empty) are appended to OUT. Returns 0 if successful, else a negative error
+ * code. */
+static int modify(kvbtree_t *tree, uint32_t pgno, int depth, char *key,
+    char *value, bool ref, itemlist_t *out) {
+  size_t keylen = strlen(key);
+  itemlist_t items = {0}, sub = {0}, merged = {0};
+  kvbtree_page_t *page, *child, *sibling;
+  int i, sib, first, ret;
+  item_t item;
+  bool exact;
+  if ((ret = page_get(tree, pgno, tree->txn.npages, &page)) != 0)
+    return ret;
+  if ((page->flags & KVBTREE_LEAF) != (depth == 1 ? KVBTREE_LEAF : 0))
+    return ERRFILACCESS;
+  if ((ret = list_load(&items, page)) != 0)
+    goto done;
+
+  if (depth == 1) {
+    i = page_search(page, key, keylen, &exact);
+    if (value == NULL) {
+      if (!exact) {
+        ret = ERRNOKEY;
+        goto done;
+      }
+      ret = list_splice(&items, i, 1, NULL, 0);
+      tree->txn.count--;
+    } else {
+      memset(&item, 0, sizeof(item_t));
+      item.key = key;
+      item.keylen = keylen;
+      item.value = value;
+      item.vallen = strlen(value);
+      item.ref = ref;
+      ret = list_splice(&items, i, exact ? 1 : 0, &item, 1);
+      if (!exact)
+        tree->txn.count++;
+    }
+  } else {
+    i = branch_search(page, key, keylen);
+    if ((ret = modify(tree, items.items[i].child, depth - 1, key, value, ref,
+        &sub)) != 0)
+      goto done;
+    /* Merge a child which has become too small into one of its siblings. */
+    if (sub.count == 1 && items.count > 1 &&
+        page_used(page_at(tree, sub.items[0].child)) < MERGE_THRESHOLD) {
+      sib = (i + 1 < items.count) ? i + 1 : i - 1;
+      first = (sib < i) ? sib : i;
+      if ((ret = page_get(tree, items.items[sib].child, tree->txn.npages,
+          &sibling)) != 0)
+        goto done;
+      child = page_at(tree, sub.items[0].child);
+      if ((ret = list_load(&merged, (sib < i) ? sibling : child)) != 0 ||
+          (ret = list_load(&merged, (sib < i) ? child : sibling)) != 0 ||
+          (ret = page_free(tree, items.items[sib].child)) != 0 ||
+          (ret = page_free(tree, sub.items[0].child)) != 0)
+        goto done;
+      sub.count = 0;
+      if ((ret = write_items(tree, child->flags, merged.items, merged.count,
+          &sub)) != 0)
+        goto done;
+      ret = list_splice(&items, first, 2, sub.items, sub.count);
+    } else {
+      ret = list_splice(&items, i, 1, sub.items, sub.count);
+    }
+  }
+  if (ret == 0)
+    ret = page_free(tree, pgno);
+  if (ret == 0)
+    ret = write_items(tree, page->flags, items.items, items.count, out);
+
+done:
+  free(items.items);
+  free(sub.items);
+  free(merged.items);
+  return ret;
+}
+
+/* Fills PAGE in as meta page PGNO holding META. */
+static void meta_fill(kvbtree_page_t *page, uint32_t pgno,
+    kvbtree_meta_t *meta) {
+  memset(page, 0, KVBTREE_PAGE_SIZE);
+  page->pgno = pgno;
+  page->flags = KVBTREE_META;
+  memcpy(page->slots, meta, sizeof(kvbtree_meta_t));
+  page->checksum = page_checksum(page);
+}
+
+/* Writes META into the meta page for its transaction id. */
+static int meta_write(kvbtree_t *tree, kvbtree_meta_t *meta) {
+  uint32_t pgno = meta->txnid % KVBTREE_META_PAGES;
+  kvbtree_page_t *page = page_at(tree, pgno);
+  meta_fill(page, pgno, meta);
+  if (msync(page, KVBTREE_PAGE_SIZE, MS_SYNC) < 0)
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Discards the current write of TREE, returning the pages it allocated. */
+static void txn_abort(kvbtree_t *tree) {
+  size_t i;
+  for (i = 0; i < tree->dirty.count; i++) {
+    /* Pages past the committed end of the file are simply allocated again. */
+    if (tree->dirty.pgnos[i] < tree->meta.npages)
+      pglist_push(&tree->free, tree->dirty.pgnos[i]);
+  }
+  tree->dirty.count = 0;
+  tree->pending.count = 0;
+}
+
+/* Syncs every page written by the current write of TREE, then makes the
+ * write visible by writing a new meta page. Returns 0 if successful, else a
+ * negative error code. */
+static int txn_commit(kvbtree_t *tree) {
+  size_t i;
+  int ret;
+  for (i = 0; i < tree->dirty.count; i++) {
+    if (msync(page_at(tree, tree->dirty.pgnos[i]), KVBTREE_PAGE_SIZE,
+        MS_SYNC) < 0) {
+      txn_abort(tree);
+      return ERRFILACCESS;
+    }
+  }
+  tree->txn.txnid++;
+  if ((ret = meta_write(tree, &tree->txn)) != 0) {
+    txn_abort(tree);
+    return ret;
+  }
+  pthread_rwlock_wrlock(&tree->lock);
+  tree->meta = tree->txn;
+  pthread_rwlock_unlock(&tree->lock);
+  /* Readers of the old tree have all finished, so its pages can be reused,
+   * unless a snapshot is still copying them. */
+  for (i = 0; i < tree->pending.count; i++)
+    pglist_push(tree->pinned ? &tree->held : &tree->free,
+        tree->pending.pgnos[i]);
+  tree->pending.count = 0;
+  tree->dirty.count = 0;
+  return 0;
+}
+
+/* Applies a PUT of KEY and VALUE, which is a reference to a blob if REF is
+ * set, or a DEL of KEY if VALUE is NULL, to TREE as a single write. Returns 0
+ * if successful, else a negative error code. */
+static int write_entry(kvbtree_t *tree, char *key, char *value, bool ref) {
+  itemlist_t out = {0}, up;
+  kvbtree_page_t *root;
+  item_t item;
+  int ret = 0;
+  pthread_mutex_lock(&tree->write_lock);
+  tree->txn = tree->meta;
+  if (tree->txn.root == 0) {
+    if (value == NULL) {
+      ret = ERRNOKEY;
+    } else {
+      memset(&item, 0, sizeof(item_t));
+      item.key = key;
+      item.keylen = strlen(key);
+      item.value = value;
+      item.vallen = strlen(value);
+      item.ref = ref;
+      ret = write_items(tree, KVBTREE_LEAF, &item, 1, &out);
+      tree->txn.depth = 1;
+      tree->txn.count = 1;
+    }
+  } else {
+    ret = modify(tree, tree->txn.root, tree->txn.depth, key, value, ref,
+        &out);
+  }
+
+  /* Grow a new root while the old one was split. */
+  while (ret == 0 && out.count > 1) {
+    memset(&up, 0, sizeof(itemlist_t));
+    ret = write_items(tree, KVBTREE_BRANCH, out.items, out.count, &up);
+    free(out.items);
+    out = up;
+    if (++tree->txn.depth > KVBTREE_MAX_DEPTH)
+      ret = ERRFILACCESS;
+  }
+  if (ret == 0) {
+    tree->txn.root = (out.count == 0) ? 0 : out.items[0].child;
+    if (out.count == 0)
+      tree->txn.depth = 0;
+    /* Shrink the tree while the root has a single child. */
+    while (tree->txn.depth > 1 &&
+        (root = page_at(tree, tree->txn.root))->count == 1) {
+      if ((ret = page_free(tree, tree->txn.root)) != 0)
+        break;
+      tree->txn.root = branch_child(root, 0);
+      tree->txn.depth--;
+    }
+  }
+  free(out.items);
+  if (ret == 0)
+    ret = txn_commit(tree);
+  else
+    txn_abort(tree);
+  pthread_mutex_unlock(&tree->write_lock);
+  return ret;
+}
+
+/* Reads and validates meta page PGNO of TREE into META. Returns 0 if it is
+ * valid, else ERRFILACCESS. */
+static int meta_read(kvbtree_t *tree, uint32_t pgno, kvbtree_meta_t *meta) {
+  kvbtree_page_t *page = page_at(tree, pgno);
+  if (page->checksum != page_checksum(page) || page->pgno != pgno ||
+      page->flags != KVBTREE_META)
+    return ERRFILACCESS;
+  memcpy(meta, page->slots, sizeof(kvbtree_meta_t));
+  if (meta->magic != KVBTREE_MAGIC || meta->version != KVBTREE_VERSION ||
+      meta->page_size != KVBTREE_PAGE_SIZE ||
+      meta->npages < KVBTREE_META_PAGES || meta->npages > tree->filepages ||
+      meta->depth > KVBTREE_MAX_DEPTH)
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Sets the bit in USED for every page of the subtree rooted at PGNO, which
+ * is DEPTH levels tall. Leaves are not read. Returns 0 if successful, else a
+ * negative error code. */
+static int mark_used(kvbtree_t *tree, uint32_t pgno, int depth,
+    unsigned char *used) {
+  kvbtree_page_t *page;
+  int i, ret;
+  if (pgno < KVBTREE_META_PAGES || pgno >= tree->meta.npages)
+    return ERRFILACCESS;
+  used[pgno / 8] |= 1 << (pgno % 8);
+  if (depth == 1)
+    return 0;
+  if ((ret = page_get(tree, pgno, tree->meta.npages, &page)) != 0)
+    return ret;
+  if (!(page->flags & KVBTREE_BRANCH))
+    return ERRFILACCESS;
+  for (i = 0; i < page->count; i++) {
+    if ((ret = mark_used(tree, branch_child(page, i), depth - 1, used)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Initializes kvbtree TREE. Uses DIRNAME as the directory in which to store
+ * the tree file, which must already exist. An existing tree file is opened
+ * and recovered to its most recently committed version. Returns 0 if
+ * successful, else a negative error code. */
+int kvbtree_init(kvbtree_t *tree, char *dirname) {
+  char filename[MAX_FILENAME];
+  kvbtree_meta_t metas[KVBTREE_META_PAGES];
+  unsigned char *used;
+  struct stat st;
+  uint32_t pgno;
+  bool valid[KVBTREE_META_PAGES];
+  int i, ret;
+  memset(tree, 0, sizeof(kvbtree_t));
+  strcpy(tree->dirname, dirname);
+  tree->fd = -1;
+  tree->map = MAP_FAILED;
+  pthread_rwlock_init(&tree->lock, NULL);
+  pthread_mutex_init(&tree->write_lock, NULL);
+  if (kvstore_path(filename, "%s/%s", dirname, KVBTREE_FILENAME) != 0)
+    return ERRFILLEN;
+  if ((tree->fd = open(filename, O_RDWR | O_CREAT, 0600)) < 0)
+    return ERRFILCRT;
+  if (fstat(tree->fd, &st) < 0 || (uint64_t) st.st_size > KVBTREE_MAP_SIZE)
+    return ERRFILACCESS;
+  tree->map = mmap(NULL, KVBTREE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      tree->fd, 0);
+  if (tree->map == MAP_FAILED)
+    return ERRFILACCESS;
+  if ((tree->verified = calloc(KVBTREE_MAP_SIZE / KVBTREE_PAGE_SIZE / 8, 1))
+      == NULL)
+    return ENOMEM;
+
+  if (st.st_size < KVBTREE_META_PAGES * KVBTREE_PAGE_SIZE) {
+    /* A new tree: write an empty version into both meta pages. */
+    if (ftruncate(tree->fd, KVBTREE_META_PAGES * KVBTREE_PAGE_SIZE) < 0)
+      return ERRFILACCESS;
+    tree->filepages = KVBTREE_META_PAGES;
+    tree->meta.magic = KVBTREE_MAGIC;
+    tree->meta.version = KVBTREE_VERSION;
+    tree->meta.page_size = KVBTREE_PAGE_SIZE;
+    tree->meta.npages = KVBTREE_META_PAGES;
+    for (i = 0; i < KVBTREE_META_PAGES; i++) {
+      tree->meta.txnid = i;
+      if ((ret = meta_write(tree, &tree->meta)) != 0)
+        return ret;
+    }
+    return 0;
+  }
+
+  tree->filepages = st.st_size / KVBTREE_PAGE_SIZE;
+  for (i = 0; i < KVBTREE_META_PAGES; i++)
+    valid[i] = meta_read(tree, i, &metas[i]) == 0;
+  if (!valid[0] && !valid[1])
+    return ERRFILACCESS;
+  tree->meta = (valid[0] && (!valid[1] || metas[0].txnid > metas[1].txnid)) ?
+      metas[0] : metas[1];
+
+  /* Every page which is not part of the tree is free. */
+  if ((used = calloc(tree->meta.npages / 8 + 1, 1)) == NULL)
+    return ENOMEM;
+  ret = (tree->meta.root == 0) ? 0 :
+      mark_used(tree, tree->meta.root, tree->meta.depth, used);
+  for (pgno = KVBTREE_META_PAGES; ret == 0 && pgno < tree->meta.npages;
+      pgno++) {
+    if (!(used[pgno / 8] & (1 << (pgno % 8))))
+      ret = pglist_push(&tree->free, pgno);
+  }
+  free(used);
+  return ret;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from TREE.
+ * Returns 0 if successful, ERRBLOB if its value is a reference to a blob,
+ * else a negative error code. If VALUE is not NULL, the entry's value will
+ * be placed into VALUE using malloc()d memory which should be free()d later. */
+int kvbtree_get(kvbtree_t *tree, char *key, char **value) {
+  size_t keylen = strlen(key);
+  kvbtree_page_t *page;
+  kvbtree_leaf_t *leaf;
+  uint32_t pgno, depth;
+  size_t vallen;
+  int i, ret = 0;
+  bool exact;
+  pthread_rwlock_rdlock(&tree->lock);
+  pgno = tree->meta.root;
+  depth = tree->meta.depth;
+  if (pgno == 0) {
+    ret = ERRNOKEY;
+    goto done;
+  }
+  for (; depth > 1; depth--) {
+    if ((ret = page_get(tree, pgno, tree->meta.npages, &page)) != 0)
+      goto done;
+    pgno = branch_child(page, branch_search(page, key, keylen));
+  }
+  if ((ret = page_get(tree, pgno, tree->meta.npages, &page)) != 0)
+    goto done;
+  i = page_search(page, key, keylen, &exact);
+  if (!exact) {
+    ret = ERRNOKEY;
+    goto done;
+  }
+  leaf = (kvbtree_leaf_t *) ((char *) page + page->slots[i]);
+  vallen = leaf->vallen & ~KVBTREE_REF;
+  if (value != NULL) {
+    if ((*value = malloc(vallen + 1)) == NULL) {
+      ret = ENOMEM;
+      goto done;
+    }
+    memcpy(*value, leaf->data + leaf->keylen, vallen);
+    (*value)[vallen] = '\0';
+  }
+  if (leaf->vallen & KVBTREE_REF)
+    ret = ERRBLOB;
+done:
+  pthread_rwlock_unlock(&tree->lock);
+  return ret;
+}
+
+/* Returns true if TREE contains KEY, else false. */
+bool kvbtree_haskey(kvbtree_t *tree, char *key) {
+  int ret = kvbtree_get(tree, key, NULL);
+  return ret == 0 || ret == ERRBLOB;
+}
+
+/* Adds the given KEY, VALUE entry to TREE, where VALUE is a reference to a
+ * blob if REF is set. Returns 0 if successful, else a negative error code. */
+int kvbtree_put(kvbtree_t *tree, char *key, char *value, bool ref) {
+  return write_entry(tree, key, value, ref);
+}
+
+/* Removes the given KEY entry from TREE. Returns 0 if successful, else a
+ * negative error code. */
+int kvbtree_del(kvbtree_t *tree, char *key) {
+  return write_entry(tree, key, NULL, false);
+}
+
+/* Calls CALLBACK with ARG on every entry of TREE whose key is at least START
+ * and less than END, in key order, with a NULL value for an entry whose value
+ * is a reference to a blob. A NULL START or END leaves that end of the
+ * range open. Stops after LIMIT entries if LIMIT is not 0, or as soon as
+ * CALLBACK returns nonzero. CALLBACK must not modify TREE. Returns the number
+ * of entries passed to CALLBACK if successful, else a negative error code. */
+int kvbtree_scan(kvbtree_t *tree, char *start, char *end, unsigned int limit,
+    kvscan_cb_t callback, void *arg) {
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  kvbtree_page_t *pages[KVBTREE_MAX_DEPTH];
+  int index[KVBTREE_MAX_DEPTH], depth, level;
+  size_t startlen = (start == NULL) ? 0 : strlen(start);
+  size_t endlen = (end == NULL) ? 0 : strlen(end);
+  kvbtree_leaf_t *leaf;
+  uint32_t pgno;
+  size_t vallen;
+  int ret = 0, count = 0;
+  bool exact;
+  pthread_rwlock_rdlock(&tree->lock);
+  depth = tree->meta.depth;
+  pgno = tree->meta.root;
+  if (pgno == 0)
+    goto done;
+
+  /* Find the first entry not less than START. */
+  for (level = 0; level < depth; level++) {
+    if ((ret = page_get(tree, pgno, tree->meta.npages, &pages[level])) != 0)
+      goto done;
+    if (level < depth - 1) {
+      index[level] = (start == NULL) ? 0 :
+          branch_search(pages[level], start, startlen);
+      pgno = branch_child(pages[level], index[level]);
+    } else {
+      index[level] = (start == NULL) ? 0 :
+          page_search(pages[level], start, startlen, &exact);
+    }
+  }
+
+  while (1) {
+    for (; index[depth - 1] < pages[depth - 1]->count; index[depth - 1]++) {
+      leaf = (kvbtree_leaf_t *) ((char *) pages[depth - 1] +
+          pages[depth - 1]->slots[index[depth - 1]]);
+      if (end != NULL && key_cmp(leaf->data, leaf->keylen, end, endlen) >= 0)
+        goto done;
+      memcpy(key, leaf->data, leaf->keylen);
+      key[leaf->keylen] = '\0';
+      vallen = leaf->vallen & ~KVBTREE_REF;
+      memcpy(value, leaf->data + leaf->keylen, vallen);
+      value[vallen] = '\0';
+      count++;
+      if (callback(key, (leaf->vallen & KVBTREE_REF) ? NULL : value,
+          arg) != 0 || (limit != 0 && count >= limit))
+        goto done;
+    }
+    /* Move on to the leftmost leaf of the next subtree. */
+    for (level = depth - 2; level >= 0; level--) {
+      if (++index[level] < pages[level]->count)
+        break;
+    }
+    if (level < 0)
+      goto done;
+    for (level++; level < depth; level++) {
+      pgno = branch_child(pages[level - 1], index[level - 1]);
+      if ((ret = page_get(tree, pgno, tree->meta.npages, &pages[level])) != 0)
+        goto done;
+      index[level] = 0;
+    }
+  }
+done:
+  pthread_rwlock_unlock(&tree->lock);
+  return (ret < 0) ? ret : count;
+}
+
+/* Writes every page of the subtree rooted at PGNO, which is DEPTH levels
+ * tall and part of the version of TREE described by META, to the same offset
+ * within FD. Returns 0 if successful, else a negative error code. */
+static int snapshot_pages(kvbtree_t *tree, kvbtree_meta_t *meta, int fd,
+    uint32_t pgno, int depth) {
+  kvbtree_page_t *page;
+  int i, ret;
+  if ((ret = page_get(tree, pgno, meta->npages, &page)) != 0)
+    return ret;
+  if (pwrite(fd, page, KVBTREE_PAGE_SIZE, (off_t) pgno * KVBTREE_PAGE_SIZE)
+      != KVBTREE_PAGE_SIZE)
+    return ERRFILACCESS;
+  if (depth == 1)
+    return 0;
+  if (!(page->flags & KVBTREE_BRANCH))
+    return ERRFILACCESS;
+  for (i = 0; i < page->count; i++) {
+    if ((ret = snapshot_pages(tree, meta, fd, branch_child(page, i),
+        depth - 1)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Takes a snapshot of TREE into DIRNAME, an empty directory (see kvbtree.h).
+ * Returns 0 if successful, else a negative error code (or ENOMEM). */
+int kvbtree_snapshot(kvbtree_t *tree, char *dirname) {
+  char filename[MAX_FILENAME];
+  kvbtree_page_t *page;
+  kvbtree_meta_t meta;
+  size_t i;
+  int fd, ret = 0;
+  if (kvstore_path(filename, "%s/%s", dirname, KVBTREE_FILENAME) != 0)
+    return ERRFILACCESS;
+  if ((page = malloc(KVBTREE_PAGE_SIZE)) == NULL)
+    return ENOMEM;
+  if ((fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+    free(page);
+    return ERRFILCRT;
+  }
+  pthread_mutex_lock(&tree->write_lock);
+  meta = tree->meta;
+  tree->pinned = true;
+  pthread_mutex_unlock(&tree->write_lock);
+
+  /* The pages of the pinned version are neither changed nor reused, so they
+   * are copied without holding up writers. Pages which are not part of it
+   * are left as holes, and found free when the snapshot is opened. */
+  if (meta.root != 0)
+    ret = snapshot_pages(tree, &meta, fd, meta.root, meta.depth);
+  for (i = 0; ret == 0 && i < KVBTREE_META_PAGES; i++) {
+    meta_fill(page, i, &meta);
+    if (pwrite(fd, page, KVBTREE_PAGE_SIZE, (off_t) i * KVBTREE_PAGE_SIZE)
+        != KVBTREE_PAGE_SIZE)
+      ret = ERRFILACCESS;
+  }
+  if (ret == 0 && (ftruncate(fd, (off_t) meta.npages * KVBTREE_PAGE_SIZE) < 0
+      || fsync(fd) < 0))
+    ret = ERRFILACCESS;
+  close(fd);
+  if (ret != 0)
+    remove(filename);
+  free(page);
+
+  pthread_mutex_lock(&tree->write_lock);
+  tree->pinned = false;
+  for (i = 0; i < tree->held.count; i++)
+    pglist_push(&tree->free, tree->held.pgnos[i]);
+  tree->held.count = 0;
+  pthread_mutex_unlock(&tree->write_lock);
+  return ret;
+}
+
+/* Closes TREE and deletes its file. */
+int kvbtree_clean(kvbtree_t *tree) {
+  char filename[MAX_FILENAME];
+  pthread_mutex_lock(&tree->write_lock);
+  pthread_rwlock_wrlock(&tree->lock);
+  if (tree->map != MAP_FAILED)
+    munmap(tree->map, KVBTREE_MAP_SIZE);
+  if (tree->fd >= 0)
+    close(tree->fd);
+  free(tree->verified);
+  free(tree->free.pgnos);
+  free(tree->pending.pgnos);
+  free(tree->dirty.pgnos);
+  free(tree->held.pgnos);
+  if (kvstore_path(filename, "%s/%s", tree->dirname, KVBTREE_FILENAME) == 0)
+    remove(filename);
+  pthread_rwlock_unlock(&tree->lock);
+  pthread_mutex_unlock(&tree->write_lock);
+  return 0;
+}
+
+static int engine_init(kvstore_t *store, char *dirname) {
+  kvbtree_t *tree = malloc(sizeof(kvbtree_t));
+  if (tree == NULL)
+    return ENOMEM;
+  store->state = tree;
+  return kvbtree_init(tree, dirname);
+}
+
+static int engine_get(kvstore_t *store, kvkey_t *key, char **value) {
+  return kvbtree_get(store->state, key->str, value);
+}
+
+static int engine_put(kvstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  return kvbtree_put(store->state, key->str, value, ref);
+}
+
+static int engine_del(kvstore_t *store, kvkey_t *key) {
+  return kvbtree_del(store->state, key->str);
+}
+
+static bool engine_haskey(kvstore_t *store, kvkey_t *key) {
+  return kvbtree_haskey(store->state, key->str);
+}
+
+static int engine_scan(kvstore_t *store, char *start, char *end,
+    unsigned int limit, kvscan_cb_t callback, void *arg) {
+  return kvbtree_scan(store->state, start, end, limit, callback, arg);
+}
+
+static int engine_keys(kvstore_t *store, kvscan_cb_t callback, void *arg) {
+  int ret = kvbtree_scan(store->state, NULL, NULL, 0, callback, arg);
+  return ret < 0 ? ret : 0;
+}
+
+static int engine_snapshot(kvstore_t *store, char *dirname) {
+  return kvbtree_snapshot(store->state, dirname);
+}
+
+static int engine_clean(kvstore_t *store) {
+  int ret = kvbtree_clean(store->state);
+  free(store->state);
+  return ret;
+}
+
+/* The copy-on-write B+tree engine, as used by KVStore. */
+const kvstore_engine_t kvbtree_engine = {
+  .name = "btree",
+  .persistent = true,
+  .init = engine_init,
+  .get = engine_get,
+  .put = engine_put,
+  .del = engine_del,
+  .haskey = engine_haskey,
+  .scan = engine_scan,
+  .keys = engine_keys,
+  .snapshot = engine_snapshot,
+  .clean = engine_clean,
+};
@@ -0,0 +1,170 @@
+#ifndef __KV_BTREE__
+#define __KV_BTREE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+
+/* KVBTree is a copy-on-write B+tree storage engine for KVStore, selected with
+ * the name "btree". It keeps entries in key order, so it can answer range
+ * scans (see kvstore_scan) without reading the whole store.
+ *
+ * The whole tree lives in a single file (KVBTREE_FILENAME) within the store
+ * directory, divided into KVBTREE_PAGE_SIZE byte pages, which is mapped into
+ * memory with mmap(). Pages 0 and 1 are meta pages; every other page is
+ * either a leaf page holding entries, or a branch page holding the first key
+ * and page number of each of its children. All leaves are at the same depth.
+ *
+ * Pages are never modified once they are part of the tree. A PUT or DEL
+ * instead writes new copies of every page on the path from the root to the
+ * affected leaf (splitting or merging pages as needed), syncs them to disk,
+ * and then writes a new meta page naming the new root. The two meta pages
+ * are written alternately, each with an increasing transaction id, so a
+ * crash at any point leaves at least one intact meta page describing a
+ * complete tree; initialization uses the newest one.
+ *
+ * Every page carries a CRC-32C checksum of its contents, which is verified
+ * the first time the page is read after the store is opened (pages are
+ * immutable, so once is enough). A page which fails verification makes the
+ * operation which read it fail with ERRFILACCESS rather than return corrupt
+ * data.
+ *
+ * Readers run concurrently with each other and with the single writer, which
+ * only excludes readers for the moment it installs a new root. Pages replaced
+ * by a write are reused only after every reader which could still see them
+ * has finished. The list of free pages is not stored on disk; it is rebuilt
+ * when the store is opened by walking the branch pages of the tree.
+ *
+ * The mapping reserves KVBTREE_MAP_SIZE bytes of address space up front, so
+ * it never has to move; this also bounds the size of the file.
+ *
+ * A snapshot (see kvstore_snapshot) pins the most recently committed version
+ * of the tree, holding the writer lock only to note its meta. Until the
+ * snapshot is done, pages replaced by writes are held back rather than freed,
+ * so the pages of the pinned version can be copied into the snapshot's tree
+ * file, at the same offsets, while writes carry on. Both meta pages of the
+ * snapshot describe the pinned version.
+ */
+
+/* The name of the file holding the tree within the store directory. */
+#define KVBTREE_FILENAME "btree.db"
+
+/* The size of a single page. Must hold at least three maximum size entries. */
+#define KVBTREE_PAGE_SIZE 8192
+
+/* The number of meta pages at the start of the file. */
+#define KVBTREE_META_PAGES 2
+
+/* The maximum size of the file, and the amount of address space reserved. */
+#define KVBTREE_MAP_SIZE (16ULL * 1024 * 1024 * 1024)
+
+/* The minimum number of pages by which the file is grown when it is full. */
+#define KVBTREE_GROW_PAGES 256
+
+/* The maximum depth of a tree. */
+#define KVBTREE_MAX_DEPTH 32
+
+/* Identifies a valid meta page. */
+#define KVBTREE_MAGIC 0x4b564254U
+
+/* The version of the file format. */
+#define KVBTREE_VERSION 1
+
+/* Page types. */
+#define KVBTREE_META 0x1
+#define KVBTREE_BRANCH 0x2
+#define KVBTREE_LEAF 0x4
+
+/* Set in the VALLEN of a leaf entry whose value is a reference to a blob
+ * (see kvblob.h). */
+#define KVBTREE_REF 0x8000
+
+/* The header at the start of every page. Leaf and branch pages follow it
+ * with an array of COUNT entry offsets in key order; the entries themselves
+ * are packed at the end of the page, starting at offset UPPER. Meta pages
+ * follow it with a kvbtree_meta_t. */
+typedef struct {
+  uint32_t checksum;            /* CRC-32C of the rest of the page. */
+  uint32_t pgno;                /* The number of this page, to catch misplaced writes. */
+  uint16_t flags;               /* KVBTREE_META, KVBTREE_BRANCH or KVBTREE_LEAF. */
+  uint16_t count;               /* The number of entries in this page. */
+  uint16_t upper;               /* The offset of the lowest entry within the page. */
+  uint16_t pad;
+  uint16_t slots[0];            /* The offset of each entry within the page. */
+} kvbtree_page_t;
+
+/* An entry within a leaf page. data holds the key followed by the value,
+ * neither of them null terminated. */
+typedef struct {
+  uint16_t keylen;              /* The length of the key. */
+  uint16_t vallen;              /* The length of the value, and KVBTREE_REF. */
+  char data[0];                 /* Described above. */
+} kvbtree_leaf_t;
+
+/* An entry within a branch page. data holds the smallest key within the
+ * child's subtree, not null terminated. */
+typedef struct {
+  uint16_t keylen;              /* The length of the key. */
+  uint16_t pad;
+  uint32_t child;               /* The page number of the child. */
+  char data[0];                 /* Described above. */
+} kvbtree_branch_t;
+
+/* The contents of a meta page, describing one committed version of the tree. */
+typedef struct {
+  uint32_t magic;               /* Always KVBTREE_MAGIC. */
+  uint32_t version;             /* Always KVBTREE_VERSION. */
+  uint32_t page_size;           /* Always KVBTREE_PAGE_SIZE. */
+  uint32_t root;                /* The page number of the root, or 0 if the tree is empty. */
+  uint32_t depth;               /* The number of levels in the tree, or 0 if it is empty. */
+  uint32_t npages;              /* The number of pages in use, including free pages. */
+  uint64_t txnid;               /* Incremented by every write. */
+  uint64_t count;               /* The number of entries in the tree. */
+} kvbtree_meta_t;
+
+/* A growable list of page numbers. */
+typedef struct {
+  uint32_t *pgnos;              /* The page numbers. */
+  size_t count;                 /* The number of page numbers in the list. */
+  size_t cap;                   /* The capacity of PGNOS. */
+} kvbtree_pglist_t;
+
+/* A KVBTree. */
+typedef struct {
+  char dirname[MAX_FILENAME];   /* The name of the directory holding the tree file. */
+  int fd;                       /* An open file descriptor for the tree file. */
+  char *map;                    /* The mapping of the tree file. */
+  uint32_t filepages;           /* The size of the tree file in pages. */
+  kvbtree_meta_t meta;          /* The most recently committed meta. */
+  kvbtree_meta_t txn;           /* The meta being built by the current write. */
+  kvbtree_pglist_t free;        /* Pages which the next write may reuse. */
+  kvbtree_pglist_t pending;     /* Pages freed by the current write. */
+  kvbtree_pglist_t dirty;       /* Pages written by the current write. */
+  kvbtree_pglist_t held;        /* Pages freed while PINNED, reused once it is not. */
+  bool pinned;                  /* true while a snapshot is copying a version of the tree. */
+  unsigned char *verified;      /* A bitmap of the pages whose checksums have been verified. */
+  pthread_rwlock_t lock;        /* Held by readers, and by the writer while it installs a new meta. */
+  pthread_mutex_t write_lock;   /* Serializes writers. */
+} kvbtree_t;
+
+extern const kvstore_engine_t kvbtree_engine;
+
+int kvbtree_init(kvbtree_t *, char *dirname);
+
+int kvbtree_get(kvbtree_t *, char *key, char **value);
+int kvbtree_put(kvbtree_t *, char *key, char *value, bool ref);
+int kvbtree_del(kvbtree_t *, char *key);
+
+bool kvbtree_haskey(kvbtree_t *, char *key);
+
+int kvbtree_scan(kvbtree_t *, char *start, char *end, unsigned int limit,
+    kvscan_cb_t callback, void *arg);
+
+int kvbtree_snapshot(kvbtree_t *, char *dirname);
+
+int kvbtree_clean(kvbtree_t *);
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kvbuf.h"
+
+/* Frees BUF, which was made by kvbuf_alloc. */
+static void release_alloc(kvbuf_t *buf) {
+  free(buf);
+}
+
+/* Frees BUF, which was made by kvbuf_wrap, along with its value. */
+static void release_wrap(kvbuf_t *buf) {
+  free(buf->data);
+  free(buf);
+}
+
+/* Returns a new buffer holding a single reference, with room for a value of
+ * LEN bytes (and its null terminator) at its DATA, which the caller should
+ * fill in before sharing it. Returns NULL if memory runs out. */
+kvbuf_t *kvbuf_alloc(size_t len) {
+  kvbuf_t *buf = malloc(sizeof(kvbuf_t) + len + 1);
+  if (buf == NULL)
+    return NULL;
+  buf->refs = 1;
+  buf->len = len;
+  buf->release = release_alloc;
+  buf->data = (char *) (buf + 1);
+  buf->data[len] = '\0';
+  return buf;
+}
+
+/* Returns a new buffer holding a single reference to VALUE, a null
+ * terminated string allocated using malloc(), which the buffer takes over.
+ * Returns NULL if memory runs out, in which case VALUE is left as it is. */
+kvbuf_t *kvbuf_wrap(char *value) {
+  kvbuf_t *buf = malloc(sizeof(kvbuf_t));
+  if (buf == NULL)
+    return NULL;
+  buf->refs = 1;
+  buf->len = strlen(value);
+  buf->release = release_wrap;
+  buf->data = value;
+  return buf;
+}
+
+/* Takes another reference to BUF, on behalf of a caller which already holds
+ * one. */
+void kvbuf_ref(kvbuf_t *buf) {
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to BUF, releasing it if it was the last. BUF may not be
+ * used by the caller afterwards. */
+void kvbuf_unref(kvbuf_t *buf) {
+  if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    buf->release(buf);
+}
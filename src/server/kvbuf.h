@@ -0,0 +1,40 @@
+#ifndef __KV_BUF__
+#define __KV_BUF__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVBuf is an immutable, reference counted value, which the layers a value
+ * passes through can share rather than each copying it.
+ *
+ * A buffer holds a null terminated value of LEN bytes at DATA, which never
+ * changes while anyone holds a reference to it. Whoever needs the value to
+ * outlive the layer it came from takes a reference with kvbuf_ref, and drops
+ * it with kvbuf_unref once done; the last reference to be dropped calls
+ * RELEASE, which frees the buffer or hands it back to whatever it came from.
+ * References may be taken and dropped from any thread.
+ *
+ * kvbuf_alloc and kvbuf_wrap make buffers which are free()d once released,
+ * the first with room for a value of a given length within the same
+ * allocation, the second around a value which was already malloc()d. A
+ * KVCache hands out its own entries as buffers (see kvcacheset.h), so that a
+ * cache hit is returned without copying the value: the entry stays as it is
+ * until the response carrying it has been sent, even if it is replaced or
+ * evicted meanwhile.
+ */
+
+/* A reference counted value. */
+typedef struct kvbuf {
+  unsigned int refs;            /* The number of references held to this buffer. */
+  uint32_t len;                 /* The length of DATA. */
+  void (*release)(struct kvbuf *); /* Called once the last reference is dropped. */
+  char *data;                   /* The value, null terminated. */
+} kvbuf_t;
+
+kvbuf_t *kvbuf_alloc(size_t len);
+kvbuf_t *kvbuf_wrap(char *value);
+
+void kvbuf_ref(kvbuf_t *);
+void kvbuf_unref(kvbuf_t *);
+
+#endif
@@ -1,51 +1,114 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include "kvconstants.h"
 #include "kvcache.h"
 #include "kvstore.h"
 
-/* Initializes KVCache CACHE. The cache will contains NUM_SETS KVCacheSets,
- * each containing up to ELEM_PER_SET entries. Returns 0 if successful, else a
- * negative error code. */
-int kvcache_init(kvcache_t *cache, unsigned int num_sets,
-    unsigned int elem_per_set) {
+/* The names of the policies, indexed by policy. */
+static const char *policy_names[] = { "clock", "tinylfu" };
+
+/* Returns the policy called NAME, or -1 if there is none. */
+int kvcache_policy_lookup(const char *name) {
   int i;
-  if (num_sets == 0 || elem_per_set == 0)
+  for (i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+    if (strcmp(policy_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Returns the name of POLICY. */
+const char *kvcache_policy_name(kvcache_policy_t policy) {
+  return policy_names[policy];
+}
+
+/* Initializes KVCache CACHE. The cache will contains NUM_SETS KVCacheSets,
+ * which share a budget of MAX_BYTES bytes equally; each set's share must be
+ * at least KVCACHESET_SLAB_SIZE. The sets choose the entries they keep
+ * according to POLICY. Returns 0 if successful, else a negative error code
+ * (or ENOMEM), in which case nothing is left allocated. */
+int kvcache_init(kvcache_t *cache, unsigned int num_sets, size_t max_bytes,
+    kvcache_policy_t policy) {
+  unsigned int i;
+  int ret;
+  if (num_sets == 0 || max_bytes / num_sets < KVCACHESET_SLAB_SIZE)
     return -1;
-  cache->sets = (kvcacheset_t *)malloc(num_sets * sizeof(kvcacheset_t));
-  if (cache->sets == NULL)
+  /* Each set keeps its counters on cache lines of their own. */
+  if (posix_memalign((void **) &cache->sets, 64,
+      num_sets * sizeof(kvcacheset_t)) != 0)
     return ENOMEM;
   cache->num_sets = num_sets;
-  cache->elem_per_set = elem_per_set;
+  cache->max_bytes = max_bytes;
+  cache->policy = policy;
   for (i = 0; i < num_sets; ++i) {
-    int ret = kvcacheset_init(&cache->sets[i], elem_per_set);
-    if(ret < 0) return ret;
+    if ((ret = kvcacheset_init(&cache->sets[i], max_bytes / num_sets,
+        policy)) != 0) {
+      /* The sets initialized so far are freed along with the array. */
+      while (i > 0)
+        kvcacheset_destroy(&cache->sets[--i]);
+      free(cache->sets);
+      cache->sets = NULL;
+      return ret;
+    }
   }
   return 0;
 }
 
-/* Retrieves the cache set associated with a given KEY. The correct set can be
- * determined based on the hash of the KEY using the hash() function defined
- * within kvstore.h. */
-kvcacheset_t *get_cache_set(kvcache_t *cache, char *key) {
-  return &cache->sets[hash(key) % (cache->num_sets)];
+/* Retrieves the cache set associated with a given KEY. The correct set is
+ * determined by the hash of the KEY, as computed by the hash() function
+ * defined within kvstore.h, which the descriptor already holds. */
+kvcacheset_t *get_cache_set(kvcache_t *cache, kvkey_t *key) {
+  return &cache->sets[key->hash % (cache->num_sets)];
 }
 
-/* Attempts to retrieve KEY from CACHE. If successful, returns 0 and stores the
- * associated value inside VALUE using malloc()d memory which should be free()d
- * later. Otherwise, returns a negative error code. */
-int kvcache_get(kvcache_t *cache, char *key, char **value) {
-  if (strlen(key) > MAX_KEYLEN)
+/* Attempts to retrieve KEY from CACHE. If successful, returns 0 and places a
+ * reference to the cached value into VALUE, which should be dropped with
+ * kvbuf_unref() once it is no longer needed; the value is not copied.
+ * Otherwise, returns a negative error code. */
+int kvcache_get_buf(kvcache_t *cache, kvkey_t *key, kvbuf_t **value) {
+  if (key->len > MAX_KEYLEN)
     return ERRKEYLEN;
   return kvcacheset_get(get_cache_set(cache, key), key, value);
 }
 
+/* Attempts to retrieve KEY from CACHE. If successful, returns 0 and stores the
+ * associated value inside VALUE using malloc()d memory which should be free()d
+ * later. Otherwise, returns a negative error code (or ENOMEM). */
+int kvcache_get(kvcache_t *cache, kvkey_t *key, char **value) {
+  kvbuf_t *buf;
+  int ret = kvcache_get_buf(cache, key, &buf);
+  if (ret != 0)
+    return ret;
+  if ((*value = malloc(buf->len + 1)) != NULL)
+    memcpy(*value, buf->data, buf->len + 1);
+  kvbuf_unref(buf);
+  return *value == NULL ? ENOMEM : 0;
+}
+
+/* Attempts to retrieve the COUNT KEYS from CACHE. The value of each key which
+ * is cached is placed into the corresponding entry of VALUES using malloc()d
+ * memory which should be free()d later; the entries of keys which are not
+ * cached are set to NULL. Returns the number of keys which were found. */
+int kvcache_mget(kvcache_t *cache, kvkey_t *keys, unsigned int count,
+    char **values) {
+  unsigned int i;
+  int found = 0;
+  for (i = 0; i < count; i++) {
+    if (kvcache_get(cache, &keys[i], &values[i]) == 0)
+      found++;
+    else
+      values[i] = NULL;
+  }
+  return found;
+}
+
 /* Attempts to place the given KEY, VALUE entry into CACHE. Returns 0 if
  * successful, else a negative error code. */
-int kvcache_put(kvcache_t *cache, char *key, char *value) {
-  if (strlen(key) > MAX_KEYLEN)
+int kvcache_put(kvcache_t *cache, kvkey_t *key, char *value) {
+  if (key->len > MAX_KEYLEN)
     return ERRKEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERRVALLEN;
@@ -54,21 +117,54 @@ int kvcache_put(kvcache_t *cache, char *key, char *value) {
 
 /* Attempts to delete the given KEY from CACHE. Returns 0 if successful, else a
  * negative error code. */
-int kvcache_del(kvcache_t *cache, char *key) {
-  if (strlen(key) > MAX_KEYLEN)
+int kvcache_del(kvcache_t *cache, kvkey_t *key) {
+  if (key->len > MAX_KEYLEN)
     return ERRKEYLEN;
   return kvcacheset_del(get_cache_set(cache, key), key);
 }
 
 /* Returns the read-write lock associated with a given KEY within CACHE. Each
  * cache set has a separate lock. */
-pthread_rwlock_t *kvcache_getlock(kvcache_t *cache, char *key) {
-  if (strlen(key) > MAX_KEYLEN)
+pthread_rwlock_t *kvcache_getlock(kvcache_t *cache, kvkey_t *key) {
+  if (key->len > MAX_KEYLEN)
     return NULL;
   return &get_cache_set(cache, key)->lock;
 }
 
-/* Completely clears this cache. For testing purposes. */
+/* Writes a description of the state of CACHE into BUF, which holds SIZE
+ * bytes, as a series of "name: value" lines. The hits and misses are those
+ * of every GET since the cache was initialized. Returns the number of bytes
+ * written, excluding the null terminator. */
+int kvcache_stats(kvcache_t *cache, char *buf, size_t size) {
+  unsigned long long bytes = 0, entries = 0, hits = 0, misses = 0,
+      rejected = 0;
+  kvcacheset_t *set;
+  unsigned int i, j;
+  int len;
+  for (i = 0; i < cache->num_sets; i++) {
+    set = &cache->sets[i];
+    pthread_rwlock_rdlock(&set->lock);
+    bytes += set->bytes;
+    entries += set->num_entries;
+    rejected += set->rejected;
+    pthread_rwlock_unlock(&set->lock);
+    for (j = 0; j < KVCACHESET_PIN_STRIPES; j++) {
+      hits += __atomic_load_n(&set->pinning[j].hits, __ATOMIC_RELAXED);
+      misses += __atomic_load_n(&set->pinning[j].misses, __ATOMIC_RELAXED);
+    }
+  }
+  len = snprintf(buf, size, "cache_budget: %llu\ncache_bytes: %llu\n"
+      "cache_entries: %llu\ncache_policy: %s\ncache_hits: %llu\n"
+      "cache_misses: %llu\ncache_hit_ratio: %.4f\ncache_rejected: %llu\n",
+      (unsigned long long) cache->max_bytes, bytes, entries,
+      kvcache_policy_name(cache->policy), hits, misses,
+      hits + misses == 0 ? 0.0 : (double) hits / (hits + misses), rejected);
+  if (len < 0 || (size_t) len >= size)
+    return len < 0 ? 0 : (int) size - 1;
+  return len;
+}
+
+/* Completely clears this cache, leaving it ready to be used again. */
 void kvcache_clear(kvcache_t *cache) {
   for (int i = 0; i < cache->num_sets; i++)
     kvcacheset_clear(&cache->sets[i]);
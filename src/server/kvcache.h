@@ -2,7 +2,9 @@
 #define __KV_CACHE__
 
 #include <pthread.h>
+#include "kvbuf.h"
 #include "kvcacheset.h"
+#include "kvkey.h"
 
 /* KVCache defines the in-memory cache which is used by KVServers to quickly
  * access data without going to disk. It is set-associative.
@@ -10,37 +12,73 @@
  * A KVCache maintains a list of KVCacheSets, each of which represents a subset
  * of entries in the cache. Each KVCacheSet maintains separate data structures;
  * thus, entries in different cache sets can be accessed/modified concurrently.
- * However, entries in the same cache set must be modified sequentially. This
- * is achieved using a read-write lock maintained by each cache set. The lock 
- * should be acquired/released from whoever will be calling the cache methods 
- * (i.e. KVServer and, later, TPCMaster).
+ * Each cache set guards its entries itself (see kvcacheset.h): GETs take no
+ * lock at all, and only PUTs, DELs and clearing the cache lock the set.
  *
  * The cache uses a second-chance replacement policy implemented within each
- * cache set.  You can think of this as a FIFO queue, where the entry that has
- * been in the cache the longest is evicted, except that it will receive a
- * second chance if it has been accessed while it has been in the cache. Each
- * entry should maintain a reference bit, initially set to false.  When an
- * entry is accessed (GET or PUT), its reference bit is set to true.  When an
- * entry needs to be evicted, iterate through the list of entries starting at
- * the front of the queue. Once an entry with a reference bit of false is
- * reached, evict that entry.  If an entry with a reference bit of true is
- * seen, set its reference bit to false, and move it to the back of the queue.
+ * cache set, run as a CLOCK.  You can think of this as a FIFO queue, where the
+ * entry that has been in the cache the longest is evicted, except that it
+ * will receive a second chance if it has been accessed while it has been in
+ * the cache. Each entry maintains a reference bit, initially set to false.
+ * When an entry is accessed (GET or PUT), its reference bit is set to true.
+ * When an entry needs to be evicted, a hand moves through the entries of the
+ * set in a circle, starting where it last stopped. Once an entry with a
+ * reference bit of false is reached, that entry is evicted.  If an entry with
+ * a reference bit of true is seen, its reference bit is set to false, which
+ * is as good as moving it to the back of the queue. Each set runs a clock
+ * for each size class of its entries (see kvcacheset.h), since the cache is
+ * sized in bytes rather than entries: it is given a budget, which its sets
+ * share equally, and an entry is evicted to make room for one of about the
+ * same size. Lookups, updates and evictions take constant time however many
+ * entries each set holds, so sets may be made large, which cuts the misses
+ * caused by keys competing for a small set.
+ *
+ * That is the KVCACHE_CLOCK policy. A cache which is filled by every miss
+ * loses its working set to any scan of keys which are read once, since each
+ * of them takes the place of an entry which is used over and over. The
+ * KVCACHE_TINYLFU policy guards against this in the manner of W-TinyLFU:
+ * each set estimates how often each key has been asked for, new entries go
+ * to a small window of their class, and an entry leaving the window only
+ * takes the place of the entry the clock would evict if its key has been
+ * asked for more often (see kvcacheset.h). The policy is chosen for each
+ * cache when it is initialized, and kvcache_stats reports the hits and
+ * misses of GETs, so that policies can be compared on the same traffic.
+ *
+ * kvcache_get_buf hands out a reference to the cached value itself (see
+ * kvbuf.h) rather than a copy, which stays valid however the cache changes
+ * until it is dropped; kvcache_get copies the value out instead.
  */
 
+/* The default budget of a cache, in bytes. */
+#define KVCACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+
+/* The default policy of a cache. */
+#define KVCACHE_DEFAULT_POLICY KVCACHE_CLOCK
+
 /* A KVCache. */
 typedef struct {
   unsigned int num_sets;        /* The number of sets within this cache. */
-  unsigned int elem_per_set;    /* The max number of elements that can be stored within each set. */
+  size_t max_bytes;             /* The number of bytes of entries the cache may hold, shared equally by its sets. */
+  kvcache_policy_t policy;      /* How the sets choose the entries they keep. */
   kvcacheset_t *sets;           /* An array of all of the sets used in this cache. */
 } kvcache_t;
 
-int kvcache_init(kvcache_t *, unsigned int num_sets, unsigned int elem_per_set);
+int kvcache_init(kvcache_t *, unsigned int num_sets, size_t max_bytes,
+    kvcache_policy_t policy);
+
+int kvcache_policy_lookup(const char *name);
+const char *kvcache_policy_name(kvcache_policy_t policy);
+
+int kvcache_get(kvcache_t *, kvkey_t *key, char **value);
+int kvcache_get_buf(kvcache_t *, kvkey_t *key, kvbuf_t **value);
+int kvcache_mget(kvcache_t *, kvkey_t *keys, unsigned int count,
+    char **values);
+int kvcache_put(kvcache_t *, kvkey_t *key, char *value);
+int kvcache_del(kvcache_t *, kvkey_t *key);
 
-int kvcache_get(kvcache_t *, char *key, char **value);
-int kvcache_put(kvcache_t *, char *key, char *value);
-int kvcache_del(kvcache_t *, char *key);
+pthread_rwlock_t *kvcache_getlock(kvcache_t *, kvkey_t *key);
 
-pthread_rwlock_t *kvcache_getlock(kvcache_t *, char *key);
+int kvcache_stats(kvcache_t *, char *buf, size_t size);
 
 void kvcache_clear(kvcache_t *);
 
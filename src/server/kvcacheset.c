@@ -1,196 +1,716 @@
 #include <pthread.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include "uthash.h"
-#include "utlist.h"
 #include "kvconstants.h"
 #include "kvcacheset.h"
 
-/* enum operations.
- * update.
- * insert.
- * delete.*/
-enum operations{
-	update,
-	insert,
-	delete,
-};
-
-/* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements.
- * ELEM_PER_SET must be at least 2.
- * Returns 0 if successful, else a negative error code. */
-int kvcacheset_init(kvcacheset_t *cacheset, unsigned int elem_per_set) {
-  int ret;
-  if (elem_per_set < 2) return -1;
-  cacheset->elem_per_set = elem_per_set;
-  if ((ret = pthread_rwlock_init(&(cacheset->lock), NULL)) < 0)
-    return ret;
-  if ((ret = pthread_mutex_init(&(cacheset->mutex), NULL)) < 0)
-	return ret;
-  cacheset->num_entries = 0;
-  cacheset->entries = (kvcacheset_entry *)malloc(elem_per_set * sizeof(kvcacheset_entry));
-  if(cacheset->entries == NULL) return ENOMEM;
-  memset(cacheset->entries, 0 , elem_per_set * sizeof(kvcacheset_entry));
-  cacheset->entry_queue = (int *)malloc(elem_per_set * sizeof(int));
-  if(cacheset->entry_queue == NULL) return ENOMEM;
+/* Returned by lookup when what it read was changed under it. */
+#define TORN 1
+
+/* Rounds N up to a multiple of 8, so that chunks stay aligned. */
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+/* Returns the slot of INDEX at which a probe for HASH starts. */
+static unsigned int home_slot(kvcacheset_index_t *index, uint64_t hash) {
+  return (unsigned int) (hash ^ (hash >> 32)) & index->mask;
+}
+
+/* Looks KEY up in CACHESET, placing its entry into CHUNK. May be called
+ * without the lock, since it only reads, in which case the result must be
+ * checked against the sequence number of the set. Returns 0 if successful,
+ * ERRNOKEY if KEY is not in the set, else TORN if the set was seen to change
+ * during the lookup. */
+static int lookup(kvcacheset_t *cacheset, kvkey_t *key,
+    kvcacheset_chunk_t **chunk) {
+  kvcacheset_index_t *index = __atomic_load_n(&cacheset->index,
+      __ATOMIC_ACQUIRE);
+  unsigned int slot = home_slot(index, key->bloom_hash), probes;
+  kvcacheset_chunk_t *c;
+  uint32_t keylen;
+  for (probes = 0; probes <= index->mask; probes++) {
+    if ((c = __atomic_load_n(&index->slots[slot], __ATOMIC_RELAXED)) == NULL)
+      return ERRNOKEY;
+    if (__atomic_load_n(&c->hash, __ATOMIC_RELAXED) == key->bloom_hash) {
+      keylen = __atomic_load_n(&c->keylen, __ATOMIC_RELAXED);
+      /* The chunk may be being rewritten, or carved anew; a length in range
+       * keeps the comparison within its page. */
+      if (keylen > MAX_KEYLEN)
+        return TORN;
+      if (keylen == key->len && memcmp(c->data, key->str, keylen) == 0) {
+        *chunk = c;
+        return 0;
+      }
+    }
+    slot = (slot + 1) & index->mask;
+  }
+  return TORN;
+}
+
+/* Returns the slot of the index of CACHESET which holds CHUNK, which must be
+ * in use. */
+static unsigned int find_slot(kvcacheset_t *cacheset,
+    kvcacheset_chunk_t *chunk) {
+  kvcacheset_index_t *index = cacheset->index;
+  unsigned int slot = home_slot(index, chunk->hash);
+  while (index->slots[slot] != chunk)
+    slot = (slot + 1) & index->mask;
+  return slot;
+}
+
+/* Adds CHUNK to INDEX, which must have an empty slot. */
+static void index_insert(kvcacheset_index_t *index, kvcacheset_chunk_t *chunk) {
+  unsigned int slot = home_slot(index, chunk->hash);
+  while (index->slots[slot] != NULL)
+    slot = (slot + 1) & index->mask;
+  __atomic_store_n(&index->slots[slot], chunk, __ATOMIC_RELAXED);
+}
+
+/* Returns a new, empty index with SLOTS slots, or NULL if memory runs out. */
+static kvcacheset_index_t *index_new(unsigned int slots) {
+  kvcacheset_index_t *index = calloc(1, sizeof(kvcacheset_index_t) +
+      slots * sizeof(kvcacheset_chunk_t *));
+  if (index != NULL)
+    index->mask = slots - 1;
+  return index;
+}
+
+/* Adds CHUNK to the index of CACHESET, first doubling the index if it would
+ * become more than half full. Returns 0 if successful, else ENOMEM. */
+static int index_add(kvcacheset_t *cacheset, kvcacheset_chunk_t *chunk) {
+  kvcacheset_index_t *old = cacheset->index, *index;
+  unsigned int i;
+  if (2 * (cacheset->num_entries + 1) > old->mask + 1) {
+    if ((index = index_new(2 * (old->mask + 1))) != NULL) {
+      for (i = 0; i <= old->mask; i++) {
+        if (old->slots[i] != NULL)
+          index_insert(index, old->slots[i]);
+      }
+      __atomic_store_n(&cacheset->index, index, __ATOMIC_RELEASE);
+      old->next = cacheset->retired;
+      cacheset->retired = old;
+    } else if (cacheset->num_entries + 1 > old->mask) {
+      /* A probe must always reach an empty slot. */
+      return ENOMEM;
+    }
+  }
+  index_insert(cacheset->index, chunk);
+  return 0;
+}
+
+/* Empties SLOT of the index of CACHESET, moving back any entry further along
+ * the same probe sequence which could no longer be found past the hole. */
+static void index_remove(kvcacheset_t *cacheset, unsigned int slot) {
+  kvcacheset_index_t *index = cacheset->index;
+  unsigned int next = slot, home;
+  __atomic_store_n(&index->slots[slot], NULL, __ATOMIC_RELAXED);
+  for (;;) {
+    next = (next + 1) & index->mask;
+    if (index->slots[next] == NULL)
+      return;
+    home = home_slot(index, index->slots[next]->hash);
+    /* The entry stays put if its home lies cyclically within (SLOT, NEXT]. */
+    if (((next - home) & index->mask) < ((next - slot) & index->mask))
+      continue;
+    __atomic_store_n(&index->slots[slot], index->slots[next],
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&index->slots[next], NULL, __ATOMIC_RELAXED);
+    slot = next;
+  }
+}
+
+/* Returns the position of counter I of the frequency sketch of CACHESET for
+ * HASH, counting in counters rather than bytes. */
+static uint32_t sketch_pos(kvcacheset_t *cacheset, uint64_t hash,
+    unsigned int i) {
+  uint32_t step = (uint32_t) (hash >> 32) | 1;
+  return ((uint32_t) hash + i * step) & cacheset->sketch_mask;
+}
+
+/* Returns how often the key whose BLOOM_HASH is HASH has been seen by
+ * CACHESET, as far as its frequency sketch can tell. */
+static unsigned int sketch_estimate(kvcacheset_t *cacheset, uint64_t hash) {
+  unsigned int i, count, min = KVCACHESET_SKETCH_MAX;
+  uint32_t pos;
+  for (i = 0; i < KVCACHESET_SKETCH_DEPTH; i++) {
+    pos = sketch_pos(cacheset, hash, i);
+    count = (__atomic_load_n(&cacheset->sketch[pos / 2], __ATOMIC_RELAXED) >>
+        (pos % 2 * 4)) & 0xf;
+    if (count < min)
+      min = count;
+  }
+  return min;
+}
+
+/* Records in the frequency sketch of CACHESET that the key whose BLOOM_HASH
+ * is HASH was seen, counting it in STRIPE. May be called without the lock;
+ * an increment lost to a racing one only makes the estimate a little low. */
+static void sketch_record(kvcacheset_t *cacheset, uint64_t hash,
+    kvcacheset_stripe_t *stripe) {
+  unsigned int i, shift;
+  uint8_t *counter, pair;
+  uint32_t pos;
+  for (i = 0; i < KVCACHESET_SKETCH_DEPTH; i++) {
+    pos = sketch_pos(cacheset, hash, i);
+    counter = &cacheset->sketch[pos / 2];
+    shift = pos % 2 * 4;
+    pair = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    /* The other counter of the byte must not be overwritten. */
+    if (((pair >> shift) & 0xf) < KVCACHESET_SKETCH_MAX)
+      __atomic_compare_exchange_n(counter, &pair, pair + (1 << shift), true,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&stripe->added, 1, __ATOMIC_RELAXED);
+}
+
+/* Halves every counter of the frequency sketch of CACHESET once GETs have
+ * bumped it half as many times as it has counters since it was last aged,
+ * so that keys which were popular once fade. Must be called with the lock
+ * held for writing. */
+static void sketch_age(kvcacheset_t *cacheset) {
+  unsigned long added = 0;
+  unsigned int i;
+  uint8_t pair;
+  for (i = 0; i < KVCACHESET_PIN_STRIPES; i++)
+    added += __atomic_load_n(&cacheset->pinning[i].added, __ATOMIC_RELAXED);
+  if (added - cacheset->sketch_aged < (cacheset->sketch_mask + 1) / 2)
+    return;
+  for (i = 0; i <= cacheset->sketch_mask / 2; i++) {
+    pair = __atomic_load_n(&cacheset->sketch[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&cacheset->sketch[i], (pair >> 1) & 0x77,
+        __ATOMIC_RELAXED);
+  }
+  cacheset->sketch_aged = added;
+}
+
+/* Returns the number of entries the window of class CLS may hold. */
+static unsigned int window_limit(kvcacheset_class_t *cls) {
+  unsigned int limit = cls->num_pages * cls->per_page *
+      KVCACHESET_WINDOW_PERCENT / 100;
+  return limit > 0 ? limit : 1;
+}
+
+/* Takes CHUNK out of the window of class CLS. */
+static void window_unlink(kvcacheset_class_t *cls, kvcacheset_chunk_t *chunk) {
+  if (chunk->prev != NULL)
+    chunk->prev->next = chunk->next;
+  else
+    cls->window_head = chunk->next;
+  if (chunk->next != NULL)
+    chunk->next->prev = chunk->prev;
+  else
+    cls->window_tail = chunk->prev;
+  chunk->window = false;
+  cls->window_len--;
+}
+
+/* Adds CHUNK, which holds an entry, to the back of the window of class CLS.
+ * If the window then holds more entries than it may, the entry at its front
+ * joins the rest of the class, as it only need be weighed against another
+ * entry when the class is out of chunks. */
+static void window_push(kvcacheset_class_t *cls, kvcacheset_chunk_t *chunk) {
+  chunk->window = true;
+  chunk->next = NULL;
+  chunk->prev = cls->window_tail;
+  if (cls->window_tail != NULL)
+    cls->window_tail->next = chunk;
+  else
+    cls->window_head = chunk;
+  cls->window_tail = chunk;
+  cls->window_len++;
+  if (cls->window_len > window_limit(cls))
+    window_unlink(cls, cls->window_head);
+}
+
+/* Returns true if the window of class CLS holds at least as many entries
+ * as it may. */
+static bool window_full(kvcacheset_class_t *cls) {
+  return cls->window_len >= window_limit(cls);
+}
+
+/* Returns the entry of the window of class CLS, which must not be empty,
+ * which is next to leave it: the one at the front, once those which have
+ * been used since they were last passed over have had their reference bits
+ * cleared and gone to the back. */
+static kvcacheset_chunk_t *window_candidate(kvcacheset_class_t *cls) {
+  kvcacheset_chunk_t *chunk;
+  unsigned int i;
+  for (i = 0; i < cls->window_len; i++) {
+    chunk = cls->window_head;
+    if (!__atomic_load_n(&chunk->refbit, __ATOMIC_RELAXED))
+      break;
+    __atomic_store_n(&chunk->refbit, false, __ATOMIC_RELAXED);
+    window_unlink(cls, chunk);
+    window_push(cls, chunk);
+  }
+  return cls->window_head;
+}
+
+/* Returns chunk POS of class CLS, counting across its pages in order. */
+static kvcacheset_chunk_t *class_chunk(kvcacheset_class_t *cls,
+    unsigned int pos) {
+  return (kvcacheset_chunk_t *) (cls->pages[pos / cls->per_page] +
+      (size_t) (pos % cls->per_page) * cls->size);
+}
+
+static void chunk_release(kvbuf_t *buf);
+
+/* Carves PAGE into free chunks of class CLS, numbered ID within CACHESET. No
+ * GET may hold a reference to any chunk on the page. */
+static void page_carve(kvcacheset_t *cacheset, unsigned int id, char *page) {
+  kvcacheset_class_t *cls = &cacheset->classes[id];
+  kvcacheset_chunk_t *chunk;
+  unsigned int i;
+  for (i = 0; i < cls->per_page; i++) {
+    chunk = (kvcacheset_chunk_t *) (page + (size_t) i * cls->size);
+    __atomic_store_n(&chunk->keylen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->buf.refs, 0, __ATOMIC_RELAXED);
+    chunk->buf.len = 0;
+    chunk->buf.release = chunk_release;
+    chunk->set = cacheset;
+    chunk->class = id;
+    chunk->used = false;
+    chunk->listed = true;
+    chunk->refbit = false;
+    chunk->window = false;
+    chunk->next = cls->free;
+    cls->free = chunk;
+  }
+}
+
+/* Adds PAGE to class ID of CACHESET. Returns 0 if successful, else ENOMEM. */
+static int page_add(kvcacheset_t *cacheset, unsigned int id, char *page) {
+  kvcacheset_class_t *cls = &cacheset->classes[id];
+  unsigned int cap = (cls->cap_pages == 0) ? 8 : cls->cap_pages * 2;
+  char **pages;
+  if (cls->num_pages == cls->cap_pages) {
+    if ((pages = realloc(cls->pages, cap * sizeof(char *))) == NULL)
+      return ENOMEM;
+    cls->pages = pages;
+    cls->cap_pages = cap;
+  }
+  cls->pages[cls->num_pages++] = page;
+  page_carve(cacheset, id, page);
+  return 0;
+}
+
+/* Returns CHUNK, which holds no entry and to which no references are held,
+ * to the free list of its class within CACHESET. */
+static void chunk_push(kvcacheset_t *cacheset, kvcacheset_chunk_t *chunk) {
+  kvcacheset_class_t *cls = &cacheset->classes[chunk->class];
+  __atomic_store_n(&chunk->refbit, false, __ATOMIC_RELAXED);
+  chunk->listed = true;
+  chunk->next = cls->free;
+  cls->free = chunk;
+}
+
+/* Releases the chunk holding BUF once the last reference to it is dropped,
+ * which happens only after its entry has left its set. */
+static void chunk_release(kvbuf_t *buf) {
+  kvcacheset_chunk_t *chunk = (kvcacheset_chunk_t *) ((char *) buf -
+      offsetof(kvcacheset_chunk_t, buf));
+  kvcacheset_t *cacheset = chunk->set;
+  pthread_rwlock_wrlock(&(cacheset->lock));
+  chunk_push(cacheset, chunk);
+  pthread_rwlock_unlock(&(cacheset->lock));
+}
+
+/* Drops the reference of CACHESET to CHUNK, whose entry has left the set,
+ * returning it to the free list unless a GET still holds a reference. */
+static void chunk_drop(kvcacheset_t *cacheset, kvcacheset_chunk_t *chunk) {
+  if (__atomic_sub_fetch(&chunk->buf.refs, 1, __ATOMIC_SEQ_CST) == 0)
+    chunk_push(cacheset, chunk);
+}
+
+/* Removes CHUNK, whose entry is in the index of CACHESET, from the set. */
+static void chunk_remove(kvcacheset_t *cacheset, kvcacheset_chunk_t *chunk) {
+  if (chunk->window)
+    window_unlink(&cacheset->classes[chunk->class], chunk);
+  index_remove(cacheset, find_slot(cacheset, chunk));
+  chunk->used = false;
+  cacheset->num_entries--;
+  chunk_drop(cacheset, chunk);
+}
+
+/* Returns true if a GET holds a reference to CHUNK, so that it may be neither
+ * evicted nor carved anew. */
+static bool chunk_pinned(kvcacheset_chunk_t *chunk) {
+  if (chunk->used)
+    return __atomic_load_n(&chunk->buf.refs, __ATOMIC_SEQ_CST) > 1;
+  /* A chunk whose entry has left the set is referenced until it is back on
+   * the free list, even once the last reference has been dropped, since
+   * chunk_release is still waiting for the lock to put it there. */
+  return !chunk->listed;
+}
+
+/* Advances the clock hand of class CLS, which must have no free chunks, to
+ * the next entry outside its window whose reference bit is clear and to
+ * which no GET holds a reference, clearing the bits of those it passes.
+ * Returns that entry, which is the one to evict, or NULL if GETs hold
+ * references to them all. */
+static kvcacheset_chunk_t *clock_victim(kvcacheset_class_t *cls) {
+  unsigned int total = cls->num_pages * cls->per_page, i;
+  kvcacheset_chunk_t *chunk;
+  for (i = 0; i < 2 * total; i++) {
+    if (cls->hand >= total)
+      cls->hand = 0;
+    chunk = class_chunk(cls, cls->hand++);
+    if (!chunk->used || chunk->window || chunk_pinned(chunk))
+      continue;
+    if (!__atomic_load_n(&chunk->refbit, __ATOMIC_RELAXED))
+      return chunk;
+    __atomic_store_n(&chunk->refbit, false, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* Returns the position of the last page of class CLS to which no GET holds a
+ * reference, or -1 if there is none. */
+static int page_unpinned(kvcacheset_class_t *cls) {
+  unsigned int i;
+  int p;
+  for (p = cls->num_pages - 1; p >= 0; p--) {
+    for (i = 0; i < cls->per_page; i++) {
+      if (chunk_pinned(class_chunk(cls, p * cls->per_page + i)))
+        break;
+    }
+    if (i == cls->per_page)
+      return p;
+  }
+  return -1;
+}
+
+/* Takes a page of the class of CACHESET which holds the most pages, other
+ * than class ID, choosing the last to which no GET holds a reference,
+ * evicting the entries on it, and gives it to class ID. Must be called with
+ * the sequence number of the set odd. Returns 0 if successful, else
+ * ENOMEM. */
+static int page_steal(kvcacheset_t *cacheset, unsigned int id) {
+  kvcacheset_class_t *cls, *from = NULL;
+  kvcacheset_chunk_t *chunk, **prev;
+  unsigned int i;
+  int p, pos = -1;
+  char *page;
+  /* A GET may still be taking a reference to a chunk it found before the
+   * sequence number moved; once they have all finished, no more can. */
+  for (i = 0; i < KVCACHESET_PIN_STRIPES; i++) {
+    while (__atomic_load_n(&cacheset->pinning[i].count, __ATOMIC_SEQ_CST) != 0)
+      sched_yield();
+  }
+  for (i = 0; i < cacheset->num_classes; i++) {
+    cls = &cacheset->classes[i];
+    if (i == id || cls->num_pages == 0 ||
+        (from != NULL && cls->num_pages <= from->num_pages))
+      continue;
+    if ((p = page_unpinned(cls)) >= 0) {
+      from = cls;
+      pos = p;
+    }
+  }
+  if (from == NULL)
+    return ENOMEM;
+  page = from->pages[pos];
+  from->pages[pos] = from->pages[from->num_pages - 1];
+  from->pages[from->num_pages - 1] = page;
+  for (i = 0; i < from->per_page; i++) {
+    chunk = (kvcacheset_chunk_t *) (page + (size_t) i * from->size);
+    if (chunk->used)
+      chunk_remove(cacheset, chunk);
+  }
+  /* Every chunk of the page is free now; take them off the free list. */
+  for (prev = &from->free; *prev != NULL; ) {
+    if ((char *) *prev >= page && (char *) *prev < page + KVCACHESET_SLAB_SIZE)
+      *prev = (*prev)->next;
+    else
+      prev = &(*prev)->next;
+  }
+  if (page_add(cacheset, id, page) != 0) {
+    page_carve(cacheset, from - cacheset->classes, page);
+    return ENOMEM;
+  }
+  from->num_pages--;
   return 0;
 }
 
-/* update the last visited data*/
-void update_queue(kvcacheset_t *cacheset, int entry_num, int op){
-	pthread_mutex_lock(&(cacheset->mutex));
-	if(op == update){
-		int index;
-		for(index=0; index<cacheset->num_entries; index++){
-			if(cacheset->entry_queue[index] == entry_num){
-				break;
-			}
-		}
-		for(int i=index; i>0; i--){
-			cacheset->entry_queue[i] = cacheset->entry_queue[i-1];
-		}
-		cacheset->entry_queue[0] = entry_num;
-	}
-	else if(op == insert){
-		int entries = cacheset->num_entries;
-        for(int i=entries; i>0; i--){
-          cacheset->entry_queue[i] = cacheset->entry_queue[i-1];
-        }
-		cacheset->entry_queue[0] = entry_num;
-	}
-	else if(op == delete){
-		int index;
-		for(index=0; index<cacheset->num_entries; index++){
-			if(cacheset->entry_queue[index] == entry_num){
-				break;
-			}
-		}
-		for(int i=index; i<cacheset->num_entries; i++){
-            if(i == (cacheset->elem_per_set-1)){
-                break;
-            }
-			cacheset->entry_queue[i] = cacheset->entry_queue[i+1];
-		}
-	}
-	pthread_mutex_unlock(&(cacheset->mutex));
-}
-
-/* get the entry_num when no spare entry space exist */
-int get_entry_index(kvcacheset_t *cacheset){
-	int index = cacheset->num_entries - 1;
-	return cacheset->entry_queue[index];
+/* Makes room in class CLS of CACHESET, whose window is full, by weighing the
+ * entry next to leave the window against the entry the clock would evict
+ * from the rest of the class, and evicting whichever of them has been seen
+ * less often. Ties go against the entry from the window. */
+static void window_admit(kvcacheset_t *cacheset, kvcacheset_class_t *cls) {
+  kvcacheset_chunk_t *candidate = window_candidate(cls), *victim;
+  victim = clock_victim(cls);
+  if (victim != NULL && sketch_estimate(cacheset, candidate->hash) <=
+      sketch_estimate(cacheset, victim->hash)) {
+    chunk_remove(cacheset, candidate);
+    cacheset->rejected++;
+  } else {
+    window_unlink(cls, candidate);
+    if (victim != NULL)
+      chunk_remove(cacheset, victim);
+  }
+}
+
+/* Takes a free chunk of class ID of CACHESET, allocating a page for the
+ * class while the budget allows and otherwise evicting an entry to make
+ * room. Must be called with the sequence number of the set odd. Returns the
+ * chunk, or NULL if memory runs out. */
+static kvcacheset_chunk_t *chunk_alloc(kvcacheset_t *cacheset,
+    unsigned int id) {
+  kvcacheset_class_t *cls = &cacheset->classes[id];
+  kvcacheset_chunk_t *chunk;
+  char *page;
+  if (cls->free == NULL &&
+      cacheset->bytes + KVCACHESET_SLAB_SIZE <= cacheset->max_bytes &&
+      (page = malloc(KVCACHESET_SLAB_SIZE + KVCACHESET_MAX_ENTRY)) != NULL) {
+    if (page_add(cacheset, id, page) == 0)
+      cacheset->bytes += KVCACHESET_SLAB_SIZE;
+    else
+      free(page);
+  }
+  /* An evicted entry which a GET has just taken a reference to stays out of
+   * the free list, so evict until a chunk is free. */
+  while (cls->free == NULL) {
+    if (cacheset->policy == KVCACHE_TINYLFU && window_full(cls))
+      window_admit(cacheset, cls);
+    else if (cls->num_pages > 0 && (chunk = clock_victim(cls)) != NULL)
+      chunk_remove(cacheset, chunk);
+    else if (cls->window_head != NULL)
+      chunk_remove(cacheset, window_candidate(cls));
+    else if (page_steal(cacheset, id) != 0)
+      return NULL;
+  }
+  chunk = cls->free;
+  cls->free = chunk->next;
+  chunk->listed = false;
+  return chunk;
+}
+
+/* Initializes CACHESET to hold at most MAX_BYTES bytes of entries, which
+ * must be at least KVCACHESET_SLAB_SIZE, choosing the entries it keeps
+ * according to POLICY. With KVCACHE_TINYLFU, the frequency sketch takes
+ * about two bytes for each entry of the smallest class the budget could
+ * hold. Returns 0 if successful, else a negative error code. */
+int kvcacheset_init(kvcacheset_t *cacheset, size_t max_bytes,
+    kvcache_policy_t policy) {
+  kvcacheset_class_t *cls;
+  size_t size = KVCACHESET_MIN_CHUNK, counters = 2;
+  int ret;
+  if (max_bytes < KVCACHESET_SLAB_SIZE) return -1;
+  memset(cacheset, 0, sizeof(kvcacheset_t));
+  cacheset->max_bytes = max_bytes;
+  cacheset->policy = policy;
+  if (policy == KVCACHE_TINYLFU) {
+    while (counters < max_bytes / KVCACHESET_MIN_CHUNK *
+        KVCACHESET_SKETCH_WIDTH)
+      counters *= 2;
+    if ((cacheset->sketch = calloc(counters / 2, 1)) == NULL)
+      return ENOMEM;
+    cacheset->sketch_mask = counters - 1;
+  }
+  if ((ret = pthread_rwlock_init(&(cacheset->lock), NULL)) != 0) {
+    free(cacheset->sketch);
+    return -1;
+  }
+  while (cacheset->num_classes < KVCACHESET_MAX_CLASSES) {
+    cls = &cacheset->classes[cacheset->num_classes++];
+    if (size >= KVCACHESET_MAX_ENTRY ||
+        cacheset->num_classes == KVCACHESET_MAX_CLASSES)
+      size = ALIGN8(KVCACHESET_MAX_ENTRY);
+    cls->size = size;
+    cls->per_page = KVCACHESET_SLAB_SIZE / size;
+    if (size == ALIGN8(KVCACHESET_MAX_ENTRY))
+      break;
+    size = ALIGN8((size_t) (size * KVCACHESET_GROWTH));
+  }
+  if ((cacheset->index = index_new(KVCACHESET_MIN_INDEX)) == NULL) {
+    pthread_rwlock_destroy(&(cacheset->lock));
+    free(cacheset->sketch);
+    return ENOMEM;
+  }
+  return 0;
 }
 
 /* Get the entry corresponding to KEY from CACHESET. Returns 0 if successful,
- * else returns a negative error code. If successful, populates VALUE with a
- * malloced string which should later be freed. */
-int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
-  int i = 0;
-  for(; i < cacheset->elem_per_set; i++){
-    if(cacheset->entries[i].refbit && strcmp(key, cacheset->entries[i].key) == 0){
-	  pthread_rwlock_rdlock(&(cacheset->lock));
-      *value = cacheset->entries[i].value;
-      update_queue(cacheset, i, update);
-	  pthread_rwlock_unlock(&(cacheset->lock));
-      return 0;
+ * else returns a negative error code. If successful, places a reference to
+ * the value of the entry into VALUE, which should later be dropped with
+ * kvbuf_unref(). */
+int kvcacheset_get(kvcacheset_t *cacheset, kvkey_t *key, kvbuf_t **value) {
+  kvcacheset_stripe_t *stripe =
+      &cacheset->pinning[key->bloom_hash % KVCACHESET_PIN_STRIPES];
+  unsigned int *pinning = &stripe->count;
+  kvcacheset_chunk_t *chunk;
+  unsigned int before, tries, refs;
+  int ret = TORN;
+  for (tries = 0; tries < KVCACHESET_READ_RETRIES && ret == TORN; tries++) {
+    before = __atomic_load_n(&cacheset->seq, __ATOMIC_ACQUIRE);
+    /* A write is under way. */
+    if (before & 1)
+      continue;
+    ret = lookup(cacheset, key, &chunk);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&cacheset->seq, __ATOMIC_RELAXED) != before)
+      ret = TORN;
+    if (ret != 0)
+      continue;
+    /* Take a reference, unless the chunk has been freed meanwhile. */
+    ret = TORN;
+    __atomic_add_fetch(pinning, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cacheset->seq, __ATOMIC_SEQ_CST) == before) {
+      refs = __atomic_load_n(&chunk->buf.refs, __ATOMIC_RELAXED);
+      while (refs != 0 && !__atomic_compare_exchange_n(&chunk->buf.refs,
+          &refs, refs + 1, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+      if (refs != 0)
+        ret = 0;
+    }
+    __atomic_sub_fetch(pinning, 1, __ATOMIC_RELEASE);
+    if (ret == 0 &&
+        __atomic_load_n(&cacheset->seq, __ATOMIC_SEQ_CST) != before) {
+      kvbuf_unref(&chunk->buf);
+      ret = TORN;
     }
   }
-  return ERRNOKEY;
+  if (ret == TORN) {
+    pthread_rwlock_rdlock(&(cacheset->lock));
+    if ((ret = lookup(cacheset, key, &chunk)) == 0)
+      __atomic_add_fetch(&chunk->buf.refs, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&(cacheset->lock));
+  }
+  if (cacheset->policy == KVCACHE_TINYLFU)
+    sketch_record(cacheset, key->bloom_hash, stripe);
+  __atomic_add_fetch(ret == 0 ? &stripe->hits : &stripe->misses, 1,
+      __ATOMIC_RELAXED);
+  if (ret != 0)
+    return ret;
+  /* Only set the bit if it is clear, so that hot entries stay shared. */
+  if (!__atomic_load_n(&chunk->refbit, __ATOMIC_RELAXED))
+    __atomic_store_n(&chunk->refbit, true, __ATOMIC_RELAXED);
+  *value = &chunk->buf;
+  return 0;
 }
 
 /* Add the given KEY, VALUE pair to CACHESET. Returns 0 if successful, else
- * returns a negative error code. Should evict elements if necessary to not
- * exceed CACHESET->elem_per_set total entries. */
-int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
-  // check key exist or not
-  for(int i=0; i<cacheset->num_entries; i++){
-	  if(cacheset->entries[i].refbit && strcmp(cacheset->entries[i].key, key) == 0){
-		  pthread_rwlock_wrlock(&(cacheset->lock));
-		  free(cacheset->entries[i].value);
-		  int length = strlen(value) + 1;
-		  cacheset->entries[i].value = (char *)malloc(length);
-		  if(cacheset->entries[i].value == NULL){
-              pthread_rwlock_unlock(&(cacheset->lock));
-			  return ENOMEM;
-		  }
-		  strncpy(cacheset->entries[i].value, value, length);
- 		  update_queue(cacheset, i, update); 
-		  pthread_rwlock_unlock(&(cacheset->lock));
-		  return 0;
-	  }
-  }
-
-  // key not exist
-  // exist ununsed slot or not
+ * returns a negative error code. Evicts entries, chosen by the policy of the
+ * set, if necessary to not exceed CACHESET->max_bytes; with KVCACHE_TINYLFU,
+ * the entry itself may be evicted by later PUTs before any other. */
+int kvcacheset_put(kvcacheset_t *cacheset, kvkey_t *key, char *value) {
+  size_t vallen = strlen(value);
+  size_t need = sizeof(kvcacheset_chunk_t) + key->len + vallen + 2;
+  kvcacheset_chunk_t *chunk, *old = NULL;
+  unsigned int id;
+  bool found, in_place;
+  int ret = 0;
+  for (id = 0; cacheset->classes[id].size < need; id++);
   pthread_rwlock_wrlock(&(cacheset->lock));
-  int index, operation;
-  if(cacheset->num_entries < cacheset->elem_per_set){
-	  for(index=0; index<cacheset->elem_per_set; index++){
-		  if(!cacheset->entries[index].refbit){
-			  operation = insert;
-			  break;
-		  }
-	  }
-  }
-  else{
-	  index = get_entry_index(cacheset);
-	  operation = update;
-  }
-  free(cacheset->entries[index].key);
-  free(cacheset->entries[index].value);
-  int length_key = strlen(key) + 1;
-  int length_value = strlen(value) + 1;
-  cacheset->entries[index].key = (char *)malloc(length_key);
-  if(cacheset->entries[index].key == NULL){
-      pthread_rwlock_unlock(&(cacheset->lock));
-      return ENOMEM;
+  found = lookup(cacheset, key, &old) == 0;
+  __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
+  if (cacheset->policy == KVCACHE_TINYLFU)
+    sketch_age(cacheset);
+  /* A value which a GET holds a reference to may not change. */
+  in_place = found && old->class == id && !chunk_pinned(old);
+  if (in_place) {
+    chunk = old;
+  } else {
+    if (found)
+      chunk_remove(cacheset, old);
+    if ((chunk = chunk_alloc(cacheset, id)) == NULL)
+      ret = ENOMEM;
   }
-  cacheset->entries[index].value = (char *)malloc(length_value);
-  if(cacheset->entries[index].value == NULL){
-      pthread_rwlock_unlock(&(cacheset->lock));
-      return ENOMEM;
-  }
-  strncpy(cacheset->entries[index].key, key, length_key);
-  strncpy(cacheset->entries[index].value, value, length_value);
-  cacheset->entries[index].refbit = true;
-  update_queue(cacheset, index, operation);
-  if(operation == insert){
-	  cacheset->num_entries += 1;
+  if (ret == 0) {
+    __atomic_store_n(&chunk->keylen, key->len, __ATOMIC_RELAXED);
+    memcpy(chunk->data, key->str, key->len + 1);
+    memcpy(chunk->data + key->len + 1, value, vallen + 1);
+    chunk->buf.len = vallen;
+    chunk->buf.data = chunk->data + key->len + 1;
+    /* A new entry starts without its reference bit; an updated one is used. */
+    __atomic_store_n(&chunk->refbit, found, __ATOMIC_RELAXED);
+    /* The new chunk may be where OLD was, if its page was taken. */
+    if (!in_place) {
+      __atomic_store_n(&chunk->hash, key->bloom_hash, __ATOMIC_RELAXED);
+      __atomic_store_n(&chunk->buf.refs, 1, __ATOMIC_SEQ_CST);
+      chunk->used = true;
+      if ((ret = index_add(cacheset, chunk)) == 0) {
+        cacheset->num_entries++;
+        if (cacheset->policy == KVCACHE_TINYLFU)
+          window_push(&cacheset->classes[id], chunk);
+      } else {
+        chunk->used = false;
+        chunk_drop(cacheset, chunk);
+      }
+    }
   }
+  __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
   pthread_rwlock_unlock(&(cacheset->lock));
-  return 0;
+  return ret;
 }
 
 /* Deletes the entry corresponding to KEY from CACHESET. Returns 0 if
  * successful, else returns a negative error code. */
-int kvcacheset_del(kvcacheset_t *cacheset, char *key) {
-  int index = 0;
-  for(; index < cacheset->elem_per_set; index++){
-    if(strcmp(key, cacheset->entries[index].key) == 0 && cacheset->entries[index].refbit){
-	  pthread_rwlock_wrlock(&(cacheset->lock));
-      free(cacheset->entries[index].key);
-      free(cacheset->entries[index].value);
-      cacheset->entries[index].refbit = false;
-      update_queue(cacheset, index, delete);
-	  cacheset->num_entries -= 1;
-	  pthread_rwlock_unlock(&(cacheset->lock));
-	  return 0;
-    }
+int kvcacheset_del(kvcacheset_t *cacheset, kvkey_t *key) {
+  kvcacheset_chunk_t *chunk;
+  int ret;
+  pthread_rwlock_wrlock(&(cacheset->lock));
+  if ((ret = lookup(cacheset, key, &chunk)) == 0) {
+    __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
+    chunk_remove(cacheset, chunk);
+    __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
   }
-  return ERRNOKEY;
+  pthread_rwlock_unlock(&(cacheset->lock));
+  return ret;
 }
 
-/* Completely clears this cache set. For testing purposes. */
+/* Completely clears this cache set, leaving it ready to be used again. Its
+ * pages are kept for the entries to come; the chunks of entries which GETs
+ * still hold references to are freed once those are dropped. */
 void kvcacheset_clear(kvcacheset_t *cacheset) {
-  int index = 0;
-  int elem_per_set = cacheset->elem_per_set;
-  for(;index < elem_per_set; index++){
-    if(cacheset->entries[index].refbit){
-      free(cacheset->entries[index].key);
-      free(cacheset->entries[index].value);
-      cacheset->entries[index].refbit = false;
+  kvcacheset_index_t *index;
+  kvcacheset_class_t *cls;
+  kvcacheset_chunk_t *chunk;
+  unsigned int id, i;
+  pthread_rwlock_wrlock(&(cacheset->lock));
+  __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
+  index = cacheset->index;
+  for (i = 0; i <= index->mask; i++)
+    __atomic_store_n(&index->slots[i], NULL, __ATOMIC_RELAXED);
+  for (id = 0; id < cacheset->num_classes; id++) {
+    cls = &cacheset->classes[id];
+    cls->hand = 0;
+    cls->window_head = cls->window_tail = NULL;
+    cls->window_len = 0;
+    for (i = 0; i < cls->num_pages * cls->per_page; i++) {
+      chunk = class_chunk(cls, i);
+      if (chunk->used) {
+        chunk->used = false;
+        chunk->window = false;
+        chunk_drop(cacheset, chunk);
+      }
     }
   }
+  cacheset->num_entries = 0;
+  __atomic_add_fetch(&cacheset->seq, 1, __ATOMIC_SEQ_CST);
+  pthread_rwlock_unlock(&(cacheset->lock));
+}
+
+/* Frees everything held by CACHESET, which was initialized by
+ * kvcacheset_init. Must only be called once nothing else uses the set, nor
+ * holds a reference to any of its values. */
+void kvcacheset_destroy(kvcacheset_t *cacheset) {
+  kvcacheset_index_t *index;
+  unsigned int id, i;
+  kvcacheset_clear(cacheset);
+  for (id = 0; id < cacheset->num_classes; id++) {
+    for (i = 0; i < cacheset->classes[id].num_pages; i++)
+      free(cacheset->classes[id].pages[i]);
+    free(cacheset->classes[id].pages);
+  }
+  while ((index = cacheset->retired) != NULL) {
+    cacheset->retired = index->next;
+    free(index);
+  }
+  free(cacheset->index);
+  free(cacheset->sketch);
+  pthread_rwlock_destroy(&(cacheset->lock));
 }
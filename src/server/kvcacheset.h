@@ -3,43 +3,220 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "uthash.h"
+#include "kvbuf.h"
+#include "kvconstants.h"
+#include "kvkey.h"
 
 /* KVCacheSet represents a single distinct set of elements within a KVCache.
  *
- * Elements within a KVCacheSet may not be accessed/modified concurrently. The
- * read-write lock within the KVCacheSet struct should be used to enforce this.
- * The lock should be acquired/released from whoever will be calling the 
- * cache methods (i.e. KVServer and, later, TPCMaster).
+ * A KVCacheSet may not hold more than MAX_BYTES bytes of entries. Each entry
+ * is stored whole, a kvcacheset_chunk_t header followed by its key and
+ * value, in a chunk carved from a slab page of KVCACHESET_SLAB_SIZE bytes,
+ * in the manner of memcached. Chunks come in size classes, each
+ * KVCACHESET_GROWTH times larger than the last, from KVCACHESET_MIN_CHUNK
+ * bytes up to the largest entry the cache accepts, and an entry takes a
+ * chunk of the smallest class it fits. Every page belongs to one class,
+ * which carves it into chunks of that size. Freed chunks go back to the free
+ * list of their class, so entries are stored without calling malloc() and
+ * free(), and pages are only allocated, never freed, until the set holds
+ * MAX_BYTES worth of them. The memory a set takes is therefore fixed by its
+ * budget, not by the sizes of the keys and values which pass through it;
+ * only its index (a pointer or two per entry) and the few bytes spared at
+ * the end of each page (see below) come on top.
  *
- * A KVCacheSet may not store more than ELEM_PER_SET entries. The eviction
- * policy used is the second-chance algorithm. See kvcache.h for more details
- * on this algorithm.
+ * Once the budget is spent, a PUT which finds no free chunk of its class
+ * evicts an entry of that class, so that bytes, not entry counts, drive
+ * eviction. If the class has no pages at all, a page is taken from the
+ * class which holds the most, evicting the entries on it.
+ *
+ * Entries are found through an open-addressing hash index with linear
+ * probing, keyed on the BLOOM_HASH of the key (see kvkey.h), which is
+ * independent of the hash that picked the set. The index is doubled whenever
+ * it would become more than half full, so probe sequences stay short, and
+ * deletion shifts later entries of a probe sequence back rather than leaving
+ * tombstones, so it never degrades. A GET, PUT, DEL or eviction therefore
+ * takes the same time however large the set is.
+ *
+ * Entries are evicted with the CLOCK algorithm, the usual way of running the
+ * second-chance policy described in kvcache.h: each class has a hand which
+ * sweeps its chunks in page order, clearing the reference bit of each entry
+ * it passes which has one set and evicting the first which does not. A hit
+ * only sets the reference bit of its entry (if it is not set already), so it
+ * writes nothing other hits contend for.
+ *
+ * An entry is handed out by a GET as a reference to the value within its
+ * chunk (see kvbuf.h), not as a copy. The BUF of each chunk counts one
+ * reference for the set itself while the chunk holds an entry, and one for
+ * each GET whose value is still in use. A value never changes while it is
+ * referenced: a PUT of a key whose entry is referenced writes the new value
+ * to another chunk, and the clock passes over referenced entries. An entry
+ * which is replaced or deleted while referenced leaves the index at once,
+ * but its chunk only returns to the free list of its class once the last
+ * reference to it is dropped.
+ *
+ * GETs take no lock. PUT, DEL and clearing the set hold the read-write lock
+ * within the KVCacheSet struct for writing, and bump the sequence number of
+ * the set before and after they change anything, so that it is odd while
+ * they do. A GET looks its key up optimistically and takes a reference to
+ * the entry it finds, and keeps it only if the sequence number was even and
+ * unchanged throughout; otherwise it drops the reference and looks again,
+ * and after KVCACHESET_READ_RETRIES attempts shares the lock instead. Since
+ * a writer reads the reference count of an entry only after bumping the
+ * sequence number, and a GET the sequence number only after taking its
+ * reference, the one always sees the other. For this to be safe, memory a
+ * reader may be looking at is never freed while the set is in use: pages
+ * are reused rather than freed, with KVCACHESET_MAX_ENTRY bytes to spare at
+ * the end so that a reader which reads a chunk as it is carved anew stays
+ * within the page, and an index which is outgrown is retired to a list
+ * rather than freed. Since the index doubles, the retired ones never add up
+ * to more than the one in use. Taking a reference writes to the chunk, so a
+ * GET does so only while it counts itself in one of KVCACHESET_PIN_STRIPES
+ * counters (chosen by its key, so that GETs of different keys seldom share
+ * one), and a page is only carved into chunks of another class once every
+ * counter has drained; a GET which counts itself after that sees the
+ * sequence number move and takes no reference.
+ *
+ * A set run with the KVCACHE_TINYLFU policy (see kvcache.h) also keeps a
+ * frequency sketch: a count-min sketch of four-bit counters, two to a byte,
+ * KVCACHESET_SKETCH_WIDTH of them for each entry of the smallest class the
+ * budget could hold. Every GET of the set, hit or miss, bumps
+ * KVCACHESET_SKETCH_DEPTH counters of its key without a lock, and once GETs
+ * have bumped the sketch half as many times as it has counters, every
+ * counter is halved, so that keys which were popular once fade. A new entry
+ * goes to the back of the window of its class, a FIFO of at most
+ * KVCACHESET_WINDOW_PERCENT percent of its chunks in which an entry which has
+ * been used since it was last passed over goes round again; while the class
+ * has free chunks, the entry at the front of a full window simply joins the
+ * rest of the class. Once the class needs a chunk, the entry at the front of
+ * the window is weighed against the entry the clock would evict from the
+ * rest: it joins the rest, evicting that entry, only if its key has been
+ * seen more often, and is evicted itself otherwise. A burst of
+ * keys seen once therefore churns the window, not the entries which are
+ * used over and over.
  */
 
-/* An entry within the KVCacheSet. */
-typedef struct kvcacheentry {
-  char *key;                      /* The entry's key. */
-  char *value;                    /* The entry's value. */
+/* The size of a slab page. */
+#define KVCACHESET_SLAB_SIZE (64 * 1024)
+
+/* The size of the chunks of the smallest class. */
+#define KVCACHESET_MIN_CHUNK 96
+
+/* The factor by which the chunks of each class are larger than the last. */
+#define KVCACHESET_GROWTH 1.25
+
+/* The maximum number of size classes. */
+#define KVCACHESET_MAX_CLASSES 32
+
+/* The number of slots of the index of an empty set. */
+#define KVCACHESET_MIN_INDEX 64
+
+/* The number of times a GET looks for a key without a lock before it takes
+ * the lock of its set. */
+#define KVCACHESET_READ_RETRIES 3
+
+/* The number of counters of the GETs taking a reference to an entry. */
+#define KVCACHESET_PIN_STRIPES 16
+
+/* The number of counters of the frequency sketch per key. */
+#define KVCACHESET_SKETCH_DEPTH 4
+
+/* The number of counters of the frequency sketch for each entry of the
+ * smallest class the budget of a set could hold. */
+#define KVCACHESET_SKETCH_WIDTH 4
+
+/* The largest count a counter of the frequency sketch reaches. */
+#define KVCACHESET_SKETCH_MAX 15
+
+/* The share of the chunks of each class, in percent, which its window may
+ * hold. */
+#define KVCACHESET_WINDOW_PERCENT 1
+
+/* How a set chooses the entries it keeps. Described in kvcache.h. */
+typedef enum {
+  KVCACHE_CLOCK,
+  KVCACHE_TINYLFU
+} kvcache_policy_t;
+
+/* An entry within the KVCacheSet, or a free chunk. DATA holds the key
+ * followed by the value, each null terminated. */
+typedef struct kvcachechunk {
+  struct kvcachechunk *next;      /* The next free chunk of its class while this one is free, or the next entry of the window while it is in it. */
+  struct kvcachechunk *prev;      /* The previous entry of the window, while this one is in it. */
+  struct kvcacheset *set;         /* The set this chunk belongs to. */
+  uint64_t hash;                  /* The BLOOM_HASH of the key, which places it in the index. */
+  kvbuf_t buf;                    /* The value, within DATA, and the references to it (see above). */
+  uint32_t keylen;                /* The length of the key. */
+  uint8_t class;                  /* The class of this chunk. */
+  bool used;                      /* true if this chunk holds an entry. */
+  bool listed;                    /* true while this chunk is on the free list of its class. */
   bool refbit;                    /* Used to determine if this entry has been used. */
-}kvcacheset_entry;
+  bool window;                    /* true while this entry is in the window of its class. */
+  char data[0];                   /* Described above. */
+} kvcacheset_chunk_t;
 
-/* A KVCacheSet. */
+/* The largest chunk needed, for the longest key and value. */
+#define KVCACHESET_MAX_ENTRY \
+    (sizeof(kvcacheset_chunk_t) + MAX_KEYLEN + MAX_VALLEN + 2)
+
+/* A size class. */
+typedef struct {
+  uint32_t size;                  /* The size of its chunks. */
+  unsigned int per_page;          /* The number of chunks carved from each page. */
+  char **pages;                   /* The pages of this class. */
+  unsigned int num_pages;         /* The number of PAGES. */
+  unsigned int cap_pages;         /* The capacity of PAGES. */
+  kvcacheset_chunk_t *free;       /* The first free chunk, or NULL. */
+  unsigned int hand;              /* The position of the clock hand among the chunks of this class. */
+  kvcacheset_chunk_t *window_head; /* The entry at the front of the window, or NULL. */
+  kvcacheset_chunk_t *window_tail; /* The entry at the back of the window, or NULL. */
+  unsigned int window_len;        /* The number of entries in the window. */
+} kvcacheset_class_t;
+
+/* The hash index of a KVCacheSet. */
+typedef struct kvcacheindex {
+  struct kvcacheindex *next;      /* The next retired index, once this one is retired. */
+  unsigned int mask;              /* The number of SLOTS, a power of two, less one. */
+  kvcacheset_chunk_t *slots[0];   /* The entries, by hash, or NULL. */
+} kvcacheset_index_t;
+
+/* A counter of the GETs taking a reference, along with the counts of GETs
+ * kept for statistics, on a cache line of its own. */
 typedef struct {
-  unsigned int elem_per_set;      /* The max number of elements which can be stored in this set. */
-  pthread_rwlock_t lock;          /* The lock which can be used to lock this set. */
-  pthread_mutex_t mutex;          /* The mutex to protect entry_queue operation. */
+  unsigned int count;             /* The number of GETs counted. */
+  unsigned long hits;             /* The number of GETs which found their key. */
+  unsigned long misses;           /* The number of GETs which did not. */
+  unsigned long added;            /* The number of times GETs bumped the frequency sketch. */
+} __attribute__((aligned(64))) kvcacheset_stripe_t;
+
+/* A KVCacheSet. */
+typedef struct kvcacheset {
+  size_t max_bytes;               /* The number of bytes of pages this set may hold. */
+  size_t bytes;                   /* The number of bytes of pages this set holds. */
+  pthread_rwlock_t lock;          /* Held for writing by PUT, DEL and clear, and by GETs which give up reading optimistically. */
+  unsigned int seq;               /* The sequence number of this set, which is odd while it is changed. */
   int num_entries;                /* The current number of entries in this set. */
-  kvcacheset_entry *entries;      /* The entries in kvcacheset. */
-  int *entry_queue;               /* The queue to determine which item evicted when no space for new item. */
+  kvcacheset_index_t *index;      /* The hash index. */
+  kvcacheset_index_t *retired;    /* The indexes which this set has outgrown. */
+  kvcacheset_class_t classes[KVCACHESET_MAX_CLASSES]; /* The size classes, smallest first. */
+  unsigned int num_classes;       /* The number of CLASSES. */
+  kvcacheset_stripe_t pinning[KVCACHESET_PIN_STRIPES]; /* The GETs taking a reference, by key. */
+  kvcache_policy_t policy;        /* How this set chooses the entries it keeps. */
+  uint8_t *sketch;                /* The counters of the frequency sketch, two to a byte, with KVCACHE_TINYLFU. */
+  unsigned int sketch_mask;       /* The number of counters of SKETCH, a power of two, less one. */
+  unsigned long sketch_aged;      /* The sum of the ADDED counts when SKETCH was last aged. */
+  unsigned long rejected;         /* The number of entries evicted from a window rather than kept. */
 } kvcacheset_t;
 
-int kvcacheset_init(kvcacheset_t *, unsigned int elem_per_set);
+int kvcacheset_init(kvcacheset_t *, size_t max_bytes, kvcache_policy_t policy);
 
-int kvcacheset_get(kvcacheset_t *, char *key, char **value);
-int kvcacheset_put(kvcacheset_t *, char *key, char *value);
-int kvcacheset_del(kvcacheset_t *, char *key);
+int kvcacheset_get(kvcacheset_t *, kvkey_t *key, kvbuf_t **value);
+int kvcacheset_put(kvcacheset_t *, kvkey_t *key, char *value);
+int kvcacheset_del(kvcacheset_t *, kvkey_t *key);
 
 void kvcacheset_clear(kvcacheset_t *);
+void kvcacheset_destroy(kvcacheset_t *);
 
 #endif
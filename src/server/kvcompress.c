@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include "kvcompress.h"
+#include "kvcrc32c.h"
+
+/* The largest distance a match can reach back. */
+#define MAX_DISTANCE 65535
+
+/* The length of the substrings whose frequencies train a dictionary. */
+#define TRAIN_K 8
+
+/* The number of bits of the hash under which those substrings are counted. */
+#define TRAIN_BITS 16
+
+/* Returns the hash of the KVCOMPRESS_MIN_MATCH bytes at P. */
+static uint32_t match_hash(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return (v * 2654435761U) >> (32 - KVCOMPRESS_HASH_BITS);
+}
+
+/* Returns the most bytes which kvcompress can produce from LEN bytes. */
+size_t kvcompress_bound(size_t len) {
+  return len + len / 255 + 16;
+}
+
+/* Appends the length LEN, beyond what fitted in its nibble, at OUT. Returns
+ * the position after it. */
+static unsigned char *put_length(unsigned char *out, size_t len) {
+  while (len >= 255) {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+/* Compresses the LEN bytes at SRC into DST, which has room for CAP bytes,
+ * letting matches reach back into DICT if it is not NULL. Returns the number
+ * of bytes written, or 0 if they would not fit (in which case the value is
+ * best stored as it is). */
+size_t kvcompress(const kvcompress_dict_t *dict, const char *src, size_t len,
+    char *dst, size_t cap) {
+  size_t dictlen = (dict != NULL) ? dict->size : 0, end = dictlen + len;
+  size_t ip = dictlen, anchor = dictlen, mlen, lits, need;
+  unsigned char *win, *out = (unsigned char *) dst, *token;
+  unsigned char *limit = (unsigned char *) dst + cap;
+  int32_t table[1 << KVCOMPRESS_HASH_BITS], ref;
+  uint32_t h;
+  /* Matches are found within the dictionary followed by the value, as one
+   * window, so that they may run from one into the other. */
+  if ((win = malloc(end + 1)) == NULL)
+    return 0;
+  if (dict != NULL) {
+    memcpy(win, dict->data, dictlen);
+    memcpy(table, dict->table, sizeof(table));
+  } else {
+    memset(table, 0xff, sizeof(table));
+  }
+  memcpy(win + dictlen, src, len);
+  while (ip + KVCOMPRESS_MIN_MATCH <= end) {
+    h = match_hash(win + ip);
+    ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > MAX_DISTANCE ||
+        memcmp(win + ref, win + ip, KVCOMPRESS_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+    mlen = KVCOMPRESS_MIN_MATCH;
+    while (ip + mlen < end && win[ref + mlen] == win[ip + mlen])
+      mlen++;
+    lits = ip - anchor;
+    need = 1 + lits / 255 + 1 + lits + 2 + mlen / 255 + 1;
+    if ((size_t) (limit - out) < need) {
+      free(win);
+      return 0;
+    }
+    token = out++;
+    *token = (lits < 15 ? lits : 15) << 4;
+    if (lits >= 15)
+      out = put_length(out, lits - 15);
+    memcpy(out, win + anchor, lits);
+    out += lits;
+    *out++ = (ip - ref) & 0xff;
+    *out++ = (ip - ref) >> 8;
+    mlen -= KVCOMPRESS_MIN_MATCH;
+    *token |= (mlen < 15) ? mlen : 15;
+    if (mlen >= 15)
+      out = put_length(out, mlen - 15);
+    ip += mlen + KVCOMPRESS_MIN_MATCH;
+    anchor = ip;
+  }
+  lits = end - anchor;
+  if ((size_t) (limit - out) < 1 + lits / 255 + 1 + lits) {
+    free(win);
+    return 0;
+  }
+  token = out++;
+  *token = (lits < 15 ? lits : 15) << 4;
+  if (lits >= 15)
+    out = put_length(out, lits - 15);
+  memcpy(out, win + anchor, lits);
+  out += lits;
+  free(win);
+  return out - (unsigned char *) dst;
+}
+
+/* Reads a length, beyond what fitted in its nibble, from *IN (which ends at
+ * END) and adds it to *LEN. Returns 0 if successful, else -1. */
+static int get_length(const unsigned char **in, const unsigned char *end,
+    size_t *len) {
+  unsigned char b;
+  do {
+    if (*in >= end)
+      return -1;
+    b = *(*in)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/* Decompresses the LEN bytes at SRC, which were compressed with DICT (or
+ * without a dictionary if it is NULL), into the RAWLEN bytes at DST. Returns
+ * 0 if successful, else ERRCHECKSUM if SRC is not a valid block which
+ * decompresses to exactly RAWLEN bytes. */
+int kvdecompress(const kvcompress_dict_t *dict, const char *src, size_t len,
+    char *dst, size_t rawlen) {
+  const unsigned char *in = (const unsigned char *) src, *end = in + len;
+  size_t dictlen = (dict != NULL) ? dict->size : 0, op = 0, lits, mlen, dist;
+  unsigned char token;
+  while (in < end) {
+    token = *in++;
+    lits = token >> 4;
+    if (lits == 15 && get_length(&in, end, &lits) != 0)
+      return ERRCHECKSUM;
+    if (lits > (size_t) (end - in) || lits > rawlen - op)
+      return ERRCHECKSUM;
+    memcpy(dst + op, in, lits);
+    in += lits;
+    op += lits;
+    if (in == end)
+      break;
+    if (end - in < 2)
+      return ERRCHECKSUM;
+    dist = in[0] | (in[1] << 8);
+    in += 2;
+    mlen = token & 15;
+    if (mlen == 15 && get_length(&in, end, &mlen) != 0)
+      return ERRCHECKSUM;
+    mlen += KVCOMPRESS_MIN_MATCH;
+    if (dist == 0 || dist > op + dictlen || mlen > rawlen - op)
+      return ERRCHECKSUM;
+    /* Copy a byte at a time, since the match may overlap what it produces
+     * or start within the dictionary. */
+    for (; mlen > 0; mlen--, op++) {
+      dst[op] = (dist > op) ? dict->data[dictlen - (dist - op)] :
+          dst[op - dist];
+    }
+  }
+  return (op == rawlen) ? 0 : ERRCHECKSUM;
+}
+
+/* Returns the hash under which the TRAIN_K bytes at P are counted. */
+static uint32_t train_hash(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return (v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_BITS);
+}
+
+/* A segment of a sample which may be placed into a dictionary. */
+typedef struct {
+  const unsigned char *data;    /* The start of the segment. */
+  uint32_t score;               /* The frequencies of its substrings, when last counted. */
+} segment_t;
+
+/* Returns the sum of COUNTS of the substrings of SEGMENT. */
+static uint32_t segment_score(const segment_t *segment,
+    const uint16_t *counts) {
+  uint32_t score = 0;
+  int i;
+  for (i = 0; i + TRAIN_K <= KVCOMPRESS_SEGMENT; i++)
+    score += counts[train_hash(segment->data + i)];
+  return score;
+}
+
+/* Moves the segment at POS of the max-heap HEAP, of COUNT segments, down
+ * until it is in order. */
+static void heap_down(segment_t *heap, unsigned int count, unsigned int pos) {
+  segment_t tmp;
+  unsigned int child;
+  while ((child = 2 * pos + 1) < count) {
+    if (child + 1 < count && heap[child + 1].score > heap[child].score)
+      child++;
+    if (heap[pos].score >= heap[child].score)
+      break;
+    tmp = heap[pos];
+    heap[pos] = heap[child];
+    heap[child] = tmp;
+    pos = child;
+  }
+}
+
+/* Computes the table of positions within DICT which the compressor starts
+ * from, and the ID of DICT. */
+static void dict_prepare(kvcompress_dict_t *dict) {
+  size_t i;
+  memset(dict->table, 0xff, sizeof(dict->table));
+  for (i = 0; i + KVCOMPRESS_MIN_MATCH <= dict->size; i++)
+    dict->table[match_hash((unsigned char *) dict->data + i)] = i;
+  dict->id = kvcrc32c(0, dict->data, dict->size);
+}
+
+/* Trains DICT from the COUNT values at SAMPLES, whose lengths are LENS (see
+ * kvcompress.h). DICT is left with a SIZE of 0 if the samples are too short
+ * to build a dictionary from. Returns 0 if successful, else ENOMEM. */
+int kvcompress_train(kvcompress_dict_t *dict, char **samples, size_t *lens,
+    unsigned int count) {
+  uint16_t *counts = calloc(1 << TRAIN_BITS, sizeof(uint16_t));
+  segment_t *heap = NULL, top;
+  unsigned int num_segments = 0, i;
+  size_t pos, total = 0;
+  const unsigned char *p;
+  char *fill;
+  uint32_t score;
+  memset(dict, 0, sizeof(kvcompress_dict_t));
+  for (i = 0; i < count; i++)
+    total += lens[i] / (KVCOMPRESS_SEGMENT / 2) + 1;
+  if (counts == NULL || (heap = malloc(total * sizeof(segment_t))) == NULL) {
+    free(counts);
+    return ENOMEM;
+  }
+  /* Count how often each substring occurs across the samples. */
+  for (i = 0; i < count; i++) {
+    p = (unsigned char *) samples[i];
+    for (pos = 0; pos + TRAIN_K <= lens[i]; pos++) {
+      if (counts[train_hash(p + pos)] < UINT16_MAX)
+        counts[train_hash(p + pos)]++;
+    }
+  }
+  /* Segments overlap by half, so that a run of common substrings is not
+   * missed for straddling two of them. */
+  for (i = 0; i < count; i++) {
+    for (pos = 0; pos + KVCOMPRESS_SEGMENT <= lens[i];
+        pos += KVCOMPRESS_SEGMENT / 2) {
+      heap[num_segments].data = (unsigned char *) samples[i] + pos;
+      heap[num_segments].score = segment_score(&heap[num_segments], counts);
+      num_segments++;
+    }
+  }
+  for (i = num_segments / 2; i-- > 0; )
+    heap_down(heap, num_segments, i);
+  /* Take the best segment until the dictionary is full. Scores only fall as
+   * segments are taken, so one whose score has not changed since it was
+   * counted is the best left; any other is counted again and put back. */
+  fill = dict->data + KVCOMPRESS_DICT_SIZE;
+  while (num_segments > 0 && fill - dict->data >= KVCOMPRESS_SEGMENT) {
+    top = heap[0];
+    score = segment_score(&top, counts);
+    if (score == 0) {
+      heap[0] = heap[--num_segments];
+    } else if (score == top.score) {
+      fill -= KVCOMPRESS_SEGMENT;
+      memcpy(fill, top.data, KVCOMPRESS_SEGMENT);
+      for (pos = 0; pos + TRAIN_K <= KVCOMPRESS_SEGMENT; pos++)
+        counts[train_hash(top.data + pos)] = 0;
+      heap[0] = heap[--num_segments];
+    } else {
+      heap[0].score = score;
+    }
+    heap_down(heap, num_segments, 0);
+  }
+  dict->size = dict->data + KVCOMPRESS_DICT_SIZE - fill;
+  memmove(dict->data, fill, dict->size);
+  dict_prepare(dict);
+  free(counts);
+  free(heap);
+  return 0;
+}
+
+/* Writes DICT to the file FILENAME, by way of a temporary file so that the
+ * file is never seen half written. Returns 0 if successful, else a negative
+ * error code. */
+int kvcompress_dict_save(const kvcompress_dict_t *dict, const char *filename) {
+  char tmpname[MAX_FILENAME];
+  kvcompress_dict_header_t header;
+  FILE *file;
+  if (strlen(filename) + 4 >= MAX_FILENAME)
+    return ERRFILLEN;
+  sprintf(tmpname, "%s.tmp", filename);
+  if ((file = fopen(tmpname, "w")) == NULL)
+    return ERRFILCRT;
+  header.magic = KVCOMPRESS_DICT_MAGIC;
+  header.size = dict->size;
+  header.id = dict->id;
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(dict->data, 1, dict->size, file) != dict->size ||
+      fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  if (rename(tmpname, filename) < 0) {
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  return 0;
+}
+
+/* Initializes DICT from the file FILENAME, as written by
+ * kvcompress_dict_save. Returns 0 if successful, else a negative error code
+ * (ERRNOKEY if there is no such file, ERRCHECKSUM if it is damaged). */
+int kvcompress_dict_load(kvcompress_dict_t *dict, const char *filename) {
+  kvcompress_dict_header_t header;
+  FILE *file;
+  memset(dict, 0, sizeof(kvcompress_dict_t));
+  if ((file = fopen(filename, "r")) == NULL)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != KVCOMPRESS_DICT_MAGIC ||
+      header.size > KVCOMPRESS_DICT_SIZE ||
+      fread(dict->data, 1, header.size, file) != header.size) {
+    fclose(file);
+    return ERRCHECKSUM;
+  }
+  fclose(file);
+  dict->size = header.size;
+  dict_prepare(dict);
+  return (dict->id == header.id) ? 0 : ERRCHECKSUM;
+}
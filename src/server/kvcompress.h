@@ -0,0 +1,83 @@
+#ifndef __KV_COMPRESS__
+#define __KV_COMPRESS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvconstants.h"
+
+/* KVCompress is a small, fast LZ77 block codec used by storage engines to
+ * compress values, optionally with a dictionary trained from sample values.
+ *
+ * A compressed block is a series of sequences, each made of a token byte
+ * whose high nibble is a count of literal bytes and whose low nibble is the
+ * length of a match less KVCOMPRESS_MIN_MATCH (15 in either meaning that
+ * further bytes follow, each added to it, until one is not 255), then the
+ * literals, then the 2-byte little-endian distance back to the match. The
+ * last sequence ends after its literals. Matches may reach back past the
+ * start of the block into the dictionary, which acts as though it came
+ * immediately before the block; this is what makes short values, which have
+ * little history of their own, compress well.
+ *
+ * A dictionary is trained once from a sample of values: the substrings
+ * which recur most often across the samples are picked greedily, in
+ * segments of KVCOMPRESS_SEGMENT bytes, and laid out with the most valuable
+ * at the end of the dictionary, where matches are nearest. It is saved with
+ * a checksum, which also serves as its ID, so that blocks compressed with
+ * one dictionary are never decompressed with another.
+ *
+ * Decompression checks every length and distance against the block, the
+ * dictionary and the expected size, so a damaged block fails rather than
+ * overrunning a buffer.
+ */
+
+/* The shortest match which is encoded. */
+#define KVCOMPRESS_MIN_MATCH 4
+
+/* The shortest value worth compressing. */
+#define KVCOMPRESS_MIN_SIZE 64
+
+/* The largest dictionary which is trained. */
+#define KVCOMPRESS_DICT_SIZE (16 * 1024)
+
+/* The number of values sampled to train a dictionary. */
+#define KVCOMPRESS_SAMPLES 512
+
+/* The length of the segments a dictionary is built from. */
+#define KVCOMPRESS_SEGMENT 48
+
+/* The number of bits of the hash of each KVCOMPRESS_MIN_MATCH bytes which
+ * the compressor uses to find matches. */
+#define KVCOMPRESS_HASH_BITS 12
+
+/* Identifies a valid saved dictionary. */
+#define KVCOMPRESS_DICT_MAGIC 0x4b56445aU
+
+/* The header of a saved dictionary, which is followed by its data. */
+typedef struct {
+  uint32_t magic;               /* Always KVCOMPRESS_DICT_MAGIC. */
+  uint32_t size;                /* The number of bytes of data. */
+  uint32_t id;                  /* The CRC-32C of the data. */
+} kvcompress_dict_header_t;
+
+/* A dictionary. */
+typedef struct {
+  uint32_t id;                  /* The CRC-32C of DATA, recorded with every block compressed with it. */
+  size_t size;                  /* The number of bytes of DATA. */
+  int32_t table[1 << KVCOMPRESS_HASH_BITS]; /* The last position within DATA of each hash, or -1. */
+  char data[KVCOMPRESS_DICT_SIZE]; /* The dictionary itself. */
+} kvcompress_dict_t;
+
+size_t kvcompress_bound(size_t len);
+
+size_t kvcompress(const kvcompress_dict_t *, const char *src, size_t len,
+    char *dst, size_t cap);
+int kvdecompress(const kvcompress_dict_t *, const char *src, size_t len,
+    char *dst, size_t rawlen);
+
+int kvcompress_train(kvcompress_dict_t *, char **samples, size_t *lens,
+    unsigned int count);
+
+int kvcompress_dict_load(kvcompress_dict_t *, const char *filename);
+int kvcompress_dict_save(const kvcompress_dict_t *, const char *filename);
+
+#endif
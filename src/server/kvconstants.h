@@ -8,6 +8,15 @@
 #define MAX_KEYLEN 1024
 #define MAX_VALLEN 1024
 
+/* Maximum length for values stored out of line (see kvblob.h). */
+#define MAX_BLOB_VALLEN (64 * 1024 * 1024)
+
+/* Maximum number of entries returned by a single SCAN. */
+#define MAX_SCAN_ENTRIES 1000
+
+/* Maximum number of keys in a single MGET, MPUT or MDEL. */
+#define MAX_BATCH_ENTRIES 1000
+
 /* Maximum length for a file name. */
 #define MAX_FILENAME 1024
 
@@ -24,7 +33,8 @@
 #define GETMSG(error) ((error == ERRKEYLEN) ? ERRMSG_KEY_LEN : \
                       ((error == ERRVALLEN) ? ERRMSG_VAL_LEN : \
                       ((error == ERRNOKEY)  ? ERRMSG_NO_KEY  : \
-                                              ERRMSG_GENERIC_ERROR)))
+                      ((error == ERRNOTIMPL) ? ERRMSG_NOT_IMPLEMENTED : \
+                                              ERRMSG_GENERIC_ERROR))))
 
 /* Message types for use by KVMessage. */
 typedef enum {
@@ -39,7 +49,15 @@ typedef enum {
   VOTE_COMMIT,
   VOTE_ABORT,
   REGISTER,
-  INFO
+  INFO,
+  SCANREQ,
+  SCANRESP,
+  MGETREQ,
+  MGETRESP,
+  MPUTREQ,
+  MDELREQ,
+  INGESTREQ,
+  SNAPSHOTREQ
 } msgtype_t;
 
 /* Possible TPC states. */
@@ -66,5 +84,18 @@ typedef enum {
 #define ERRFILCRT -16
 /* Error returned if error was encountered accessing a file. */
 #define ERRFILACCESS -17
+/* Error returned if the store's engine does not support an operation. */
+#define ERRNOTIMPL -18
+/* Error returned if stored data is damaged (it fails its checksum, or is not
+ * laid out as it should be). */
+#define ERRCHECKSUM -19
+/* Error returned if a value is stored out of line (see kvblob.h), and so
+ * must be located rather than read into memory. */
+#define ERRBLOB -20
+/* Error returned if a data directory was last used as a different shard of
+ * a server's stores (see kvserver.h). */
+#define ERRSHARD -21
+/* Error returned if no storage engine has the name asked for. */
+#define ERRENGINE -22
 
 #endif
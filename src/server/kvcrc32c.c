@@ -0,0 +1,111 @@
+#include <string.h>
+#include <pthread.h>
+#include "kvcrc32c.h"
+
+/* The reflected CRC-32C polynomial. */
+#define POLY 0x82f63b78U
+
+/* TABLES[0] holds the CRC of every possible byte, and TABLES[K] the CRC of
+ * every possible byte followed by K zero bytes, so that eight bytes can be
+ * folded in with eight lookups. */
+static uint32_t tables[8][256];
+
+/* The implementation chosen for this CPU, and its name. */
+static uint32_t (*impl)(uint32_t, const unsigned char *, size_t);
+static const char *impl_name;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+/* Computes the CRC-32C of the LEN bytes at P continuing from the inverted
+ * CRC, one byte at a time. */
+static uint32_t crc_bytes(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len--)
+    crc = tables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+/* Computes the CRC-32C of the LEN bytes at P continuing from the inverted
+ * CRC, eight bytes at a time with slicing-by-8. */
+static uint32_t crc_slice8(uint32_t crc, const unsigned char *p, size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t word;
+  while (len > 0 && ((uintptr_t) p & 7) != 0) {
+    crc = tables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = tables[7][word & 0xff] ^
+        tables[6][(word >> 8) & 0xff] ^
+        tables[5][(word >> 16) & 0xff] ^
+        tables[4][(word >> 24) & 0xff] ^
+        tables[3][(word >> 32) & 0xff] ^
+        tables[2][(word >> 40) & 0xff] ^
+        tables[1][(word >> 48) & 0xff] ^
+        tables[0][word >> 56];
+  }
+#endif
+  return crc_bytes(crc, p, len);
+}
+
+#if defined(__x86_64__)
+/* Computes the CRC-32C of the LEN bytes at P continuing from the inverted
+ * CRC with the SSE4.2 crc32 instruction, which implements this very
+ * polynomial. */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t word, crc64;
+  while (len > 0 && ((uintptr_t) p & 7) != 0) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+    len--;
+  }
+  crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&word, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+  }
+  crc = (uint32_t) crc64;
+  while (len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+/* Fills TABLES, and chooses the fastest implementation the CPU supports. */
+static void impl_init(void) {
+  uint32_t crc;
+  int i, j;
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+    tables[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++)
+      tables[j][i] = (tables[j - 1][i] >> 8) ^
+          tables[0][tables[j - 1][i] & 0xff];
+  }
+  impl = crc_slice8;
+  impl_name = "slicing-by-8";
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    impl = crc_sse42;
+    impl_name = "sse4.2";
+  }
+#endif
+}
+
+/* Returns the CRC-32C of the LEN bytes at BUF, continuing from CRC (which
+ * should be 0 for the first piece of data). */
+uint32_t kvcrc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&impl_once, impl_init);
+  return ~impl(~crc, buf, len);
+}
+
+/* Returns the name of the implementation kvcrc32c uses on this CPU. */
+const char *kvcrc32c_impl(void) {
+  pthread_once(&impl_once, impl_init);
+  return impl_name;
+}
@@ -0,0 +1,24 @@
+#ifndef __KV_CRC32C__
+#define __KV_CRC32C__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVCRC32C computes CRC-32C (Castagnoli) checksums, as used to detect
+ * corrupted pages and records on disk.
+ *
+ * To checksum data in pieces, pass the result of each call as the CRC of the
+ * next one, starting from 0:
+ *    crc = kvcrc32c(0, header, sizeof(header));
+ *    crc = kvcrc32c(crc, data, len);
+ *
+ * On x86-64 CPUs with SSE4.2 the checksum is computed with the crc32
+ * instruction, eight bytes at a time. Elsewhere it falls back to
+ * slicing-by-8, which looks up eight bytes at once in eight tables.
+ * kvcrc32c_impl names the implementation in use.
+ */
+
+uint32_t kvcrc32c(uint32_t crc, const void *buf, size_t len);
+const char *kvcrc32c_impl(void);
+
+#endif
@@ -0,0 +1,1084 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "kvfilestore.h"
+#include "kvcrc32c.h"
+
+/* The size of the largest valid entry file. */
+#define MAX_ENTRY_SIZE (sizeof(kventry_t) + MAX_KEYLEN + MAX_VALLEN + 2)
+
+/* The size of the header of entries written before kventry_t had one, which
+ * held nothing but the length. */
+#define LEGACY_HEADER_SIZE sizeof(int)
+
+static void *reclaimer(void *);
+
+/* Loads the compression dictionary of STORE, if it has one, or prepares to
+ * sample values to train one if it compresses values. Returns 0 if
+ * successful, else a negative error code (or ENOMEM). */
+static int dict_open(kvfilestore_t *store) {
+  char filename[MAX_FILENAME];
+  kvcompress_dict_t *dict;
+  if (kvstore_path(filename, "%s/%s", store->dirname,
+      KVFILESTORE_DICT_FILENAME) != 0)
+    return ERRFILACCESS;
+  if ((dict = malloc(sizeof(kvcompress_dict_t))) == NULL)
+    return ENOMEM;
+  /* A dictionary which cannot be loaded is retrained; its ID keeps entries
+   * compressed with the old one from being decompressed with the new. */
+  if (kvcompress_dict_load(dict, filename) == 0) {
+    store->dict = dict;
+    return 0;
+  }
+  free(dict);
+  if (!store->compress)
+    return 0;
+  store->samples = calloc(KVCOMPRESS_SAMPLES, sizeof(char *));
+  store->sample_lens = calloc(KVCOMPRESS_SAMPLES, sizeof(size_t));
+  return (store->samples == NULL || store->sample_lens == NULL) ? ENOMEM : 0;
+}
+
+/* Removes every file within the subdirectory of STORE in which entries are
+ * written, which only holds files left behind by a crash or a failed write
+ * while no write is in progress. */
+static void tmp_clear(kvfilestore_t *store) {
+  struct dirent *dent;
+  char dirname[MAX_FILENAME], filename[MAX_FILENAME];
+  DIR *dir;
+  if (kvstore_path(dirname, "%s/%s", store->dirname,
+      KVFILESTORE_TMP_DIRNAME) != 0 || (dir = opendir(dirname)) == NULL)
+    return;
+  while ((dent = readdir(dir)) != NULL) {
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+    if (kvstore_path(filename, "%s/%s", dirname, dent->d_name) == 0)
+      remove(filename);
+  }
+  closedir(dir);
+}
+
+/* Initializes kvfilestore STORE. Uses DIRNAME, which must already exist, as
+ * the directory in which to store the entries of this store. Writes are made
+ * durable according to SYNC_MODE, the checksum of every entry read is
+ * verified if VERIFY is set, and values are compressed if COMPRESS is set.
+ * Returns 0 if successful, else a negative error code. */
+int kvfilestore_init(kvfilestore_t *store, char *dirname,
+    kvsync_mode_t sync_mode, bool verify, bool compress) {
+  char filename[MAX_FILENAME];
+  int i, ret;
+  strcpy(store->dirname, dirname);
+  store->verify = verify;
+  store->compress = compress;
+  store->dict = NULL;
+  store->samples = NULL;
+  store->sample_lens = NULL;
+  store->num_samples = 0;
+  store->raw_bytes = store->stored_bytes = store->compressed = 0;
+  store->tombstones = store->reclaimed = 0;
+  store->num_pending = 0;
+  /* Tombstones left by an earlier run are found by scanning for them. */
+  store->rescan = true;
+  store->stopping = false;
+  store->reclaimer = 0;
+  store->snapshot = NULL;
+  store->snapshot_chains = NULL;
+  store->snapshot_error = 0;
+  pthread_mutex_init(&store->snapshot_lock, NULL);
+  pthread_mutex_init(&store->sample_lock, NULL);
+  pthread_mutex_init(&store->reclaim_lock, NULL);
+  pthread_cond_init(&store->reclaim_cond, NULL);
+  for (i = 0; i < KVFILESTORE_STRIPES; i++) {
+    pthread_rwlock_init(&store->locks[i], NULL);
+    store->seqs[i] = 0;
+  }
+  store->sync.mode = KVSYNC_NONE;
+  if ((store->dirfd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return ERRFILACCESS;
+  if (kvstore_path(filename, "%s/%s", dirname, KVFILESTORE_TMP_DIRNAME) != 0 ||
+      (mkdir(filename, 0700) == -1 && errno != EEXIST))
+    return ERRFILACCESS;
+  tmp_clear(store);
+  if ((ret = dict_open(store)) != 0)
+    return ret;
+  /* Entry files are synced before they are renamed into place, so only the
+   * renames are left for the directory sync. */
+  if ((ret = kvsync_init(&store->sync, sync_mode, store->dirfd, false)) != 0)
+    return ret;
+  if (pthread_create(&store->reclaimer, NULL, reclaimer, store) != 0) {
+    store->reclaimer = 0;
+    return ERRFILACCESS;
+  }
+  return 0;
+}
+
+/* Samples VALUE, which is LEN bytes long, to train the compression
+ * dictionary of STORE, and trains it once KVCOMPRESS_SAMPLES values have
+ * been sampled. The dictionary is only used once it has been saved, since
+ * entries compressed with it are unreadable without it. Does nothing once
+ * the dictionary exists. */
+static void sample_value(kvfilestore_t *store, char *value, size_t len) {
+  char filename[MAX_FILENAME];
+  kvcompress_dict_t *dict;
+  unsigned int i;
+  if (__atomic_load_n(&store->dict, __ATOMIC_ACQUIRE) != NULL)
+    return;
+  pthread_mutex_lock(&store->sample_lock);
+  if (store->samples == NULL) {
+    pthread_mutex_unlock(&store->sample_lock);
+    return;
+  }
+  i = store->num_samples;
+  if ((store->samples[i] = malloc(len)) != NULL) {
+    memcpy(store->samples[i], value, len);
+    store->sample_lens[i] = len;
+    store->num_samples++;
+  }
+  if (store->num_samples < KVCOMPRESS_SAMPLES) {
+    pthread_mutex_unlock(&store->sample_lock);
+    return;
+  }
+  /* Training takes a few milliseconds, once. If it fails, sampling simply
+   * starts over. */
+  dict = malloc(sizeof(kvcompress_dict_t));
+  if (dict != NULL && kvcompress_train(dict, store->samples,
+      store->sample_lens, store->num_samples) == 0 && dict->size > 0) {
+    if (kvstore_path(filename, "%s/%s", store->dirname,
+        KVFILESTORE_DICT_FILENAME) == 0 &&
+        kvcompress_dict_save(dict, filename) == 0) {
+      __atomic_store_n(&store->dict, dict, __ATOMIC_RELEASE);
+      dict = NULL;
+    }
+  }
+  free(dict);
+  for (i = 0; i < store->num_samples; i++)
+    free(store->samples[i]);
+  store->num_samples = 0;
+  if (store->dict != NULL) {
+    free(store->samples);
+    free(store->sample_lens);
+    store->samples = NULL;
+    store->sample_lens = NULL;
+  }
+  pthread_mutex_unlock(&store->sample_lock);
+}
+
+/* Returns the lock which guards the hash chain of HASHVAL within STORE. */
+static pthread_rwlock_t *stripe_lock(kvfilestore_t *store,
+    unsigned long hashval) {
+  return &store->locks[hashval % KVFILESTORE_STRIPES];
+}
+
+/* Returns the sequence number of the stripe of HASHVAL within STORE. */
+static unsigned int *stripe_seq(kvfilestore_t *store, unsigned long hashval) {
+  return &store->seqs[hashval % KVFILESTORE_STRIPES];
+}
+
+/* Links every entry of the hash chain of HASHVAL within STORE into the
+ * snapshot being taken, if there is one and the chain has not been linked
+ * yet, so that the snapshot holds the chain as it was at its moment. Must be
+ * called with the lock of the chain held, and by writers before they first
+ * change the chain. A failure is left for kvfilestore_snapshot to report,
+ * rather than failing the change. Returns 0 if successful, else the first
+ * error of the snapshot. */
+static int snapshot_chain(kvfilestore_t *store, unsigned long hashval) {
+  char filename[MAX_FILENAME], dstname[MAX_FILENAME];
+  kvfilechain_t *chain;
+  unsigned int chainpos;
+  int ret = 0;
+  if (store->snapshot == NULL)
+    return 0;
+  pthread_mutex_lock(&store->snapshot_lock);
+  HASH_FIND(hh, store->snapshot_chains, &hashval, sizeof(unsigned long),
+      chain);
+  if (chain == NULL && (chain = malloc(sizeof(kvfilechain_t))) != NULL) {
+    chain->hashval = hashval;
+    HASH_ADD(hh, store->snapshot_chains, hashval, sizeof(unsigned long),
+        chain);
+    chain = NULL;
+  } else if (chain == NULL) {
+    ret = ENOMEM;
+  }
+  pthread_mutex_unlock(&store->snapshot_lock);
+  if (chain != NULL)
+    return 0;
+  for (chainpos = 0; ret == 0; chainpos++) {
+    if ((ret = kvstore_path(filename, "%s/%lu-%u%s", store->dirname, hashval,
+        chainpos, KVFILESTORE_FILETYPE)) != 0 ||
+        (ret = kvstore_path(dstname, "%s/%lu-%u%s", store->snapshot, hashval,
+        chainpos, KVFILESTORE_FILETYPE)) != 0)
+      break;
+    if ((ret = kvstore_snapshot_link(filename, dstname)) == ERRNOKEY) {
+      ret = 0;
+      break;
+    }
+  }
+  if (ret != 0) {
+    pthread_mutex_lock(&store->snapshot_lock);
+    if (store->snapshot_error == 0)
+      store->snapshot_error = ret;
+    ret = store->snapshot_error;
+    pthread_mutex_unlock(&store->snapshot_lock);
+  }
+  return ret;
+}
+
+/* Returns the checksum of ENTRY, which covers its LENGTH and DATA. */
+static uint32_t entry_checksum(kventry_t *entry) {
+  return kvcrc32c(0, &entry->length, sizeof(int) + entry->length);
+}
+
+/* Returns the number of bytes between the key and the compressed value of
+ * ENTRY: its uncompressed length, and the ID of its dictionary if it has
+ * one. */
+static size_t compressed_header_size(kventry_t *entry) {
+  return sizeof(uint32_t) + ((entry->flags & KVENTRY_DICT) ?
+      sizeof(uint32_t) : 0);
+}
+
+/* Reads the entry stored in FILENAME into ENTRY, using malloc()d memory
+ * which should be free()d later. Entries without a header are converted to
+ * the current layout (with a zero checksum). Checks that the entry is laid
+ * out correctly and, if VERIFY is set and it has a header, that it matches
+ * its checksum. A tombstone is returned like any other entry, with only a
+ * key as its data. Returns 0 if successful, ERRNOKEY if FILENAME does not exist,
+ * ERRCHECKSUM if it does not hold a valid entry, else a negative error code
+ * (or ENOMEM). */
+static int entry_load(char *filename, bool verify, kventry_t **entry) {
+  struct stat st;
+  char *buf, *data, *key_end;
+  size_t header;
+  ssize_t got;
+  int fd, ret = 0, length;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  if (st.st_size < (off_t) LEGACY_HEADER_SIZE + 2 ||
+      st.st_size > (off_t) MAX_ENTRY_SIZE) {
+    close(fd);
+    return ERRCHECKSUM;
+  }
+  /* Leave room in front of a headerless entry to convert it in place. */
+  if ((buf = malloc(sizeof(kventry_t) + st.st_size)) == NULL) {
+    close(fd);
+    return ENOMEM;
+  }
+  got = read(fd, buf + sizeof(kventry_t) - LEGACY_HEADER_SIZE, st.st_size);
+  close(fd);
+  if (got != st.st_size) {
+    free(buf);
+    return ERRFILACCESS;
+  }
+  *entry = (kventry_t *) buf;
+  if (*(uint32_t *) (buf + sizeof(kventry_t) - LEGACY_HEADER_SIZE) ==
+      KVFILESTORE_MAGIC) {
+    memmove(buf, buf + sizeof(kventry_t) - LEGACY_HEADER_SIZE, st.st_size);
+    header = sizeof(kventry_t);
+    if (st.st_size < (off_t) header || (*entry)->version == 0 ||
+        (*entry)->version > KVFILESTORE_VERSION ||
+        ((*entry)->flags & ~(KVENTRY_COMPRESSED | KVENTRY_DICT |
+        KVENTRY_TOMBSTONE | KVENTRY_REF)) != 0 ||
+        ((*entry)->version == 1 && (*entry)->flags != 0) ||
+        (((*entry)->flags & KVENTRY_TOMBSTONE) &&
+        (*entry)->flags != KVENTRY_TOMBSTONE))
+      ret = ERRCHECKSUM;
+  } else {
+    memcpy(&length, buf + sizeof(kventry_t) - LEGACY_HEADER_SIZE, sizeof(int));
+    header = LEGACY_HEADER_SIZE;
+    (*entry)->magic = KVFILESTORE_MAGIC;
+    (*entry)->version = 0;
+    (*entry)->flags = 0;
+    (*entry)->checksum = 0;
+    (*entry)->length = length;
+  }
+  /* DATA must fill the rest of the file with a key and a value, a key and
+   * the header of a compressed value, or just a key. */
+  data = (*entry)->data;
+  if (ret == 0 && (*entry)->length != st.st_size - (off_t) header)
+    ret = ERRCHECKSUM;
+  if (ret == 0 && ((*entry)->flags & KVENTRY_TOMBSTONE)) {
+    if (data[(*entry)->length - 1] != '\0' ||
+        strlen(data) + 1 != (size_t) (*entry)->length)
+      ret = ERRCHECKSUM;
+  } else if (ret == 0 && ((*entry)->flags & KVENTRY_COMPRESSED)) {
+    key_end = memchr(data, '\0', (*entry)->length);
+    if (key_end == NULL || data + (*entry)->length - (key_end + 1) <
+        (ptrdiff_t) compressed_header_size(*entry))
+      ret = ERRCHECKSUM;
+  } else if (ret == 0 && (data[(*entry)->length - 1] != '\0' ||
+      strlen(data) + 1 >= (size_t) (*entry)->length)) {
+    ret = ERRCHECKSUM;
+  }
+  if (ret == 0 && verify && (*entry)->version != 0 &&
+      (*entry)->checksum != entry_checksum(*entry))
+    ret = ERRCHECKSUM;
+  if (ret != 0) {
+    free(buf);
+    *entry = NULL;
+  }
+  return ret;
+}
+
+/* Places the value of ENTRY, whose key is KEYLEN bytes long, into VALUE
+ * using malloc()d memory which should be free()d later, decompressing it if
+ * it is compressed. Returns 0 if successful, ERRCHECKSUM if it cannot be
+ * decompressed, else ENOMEM. */
+static int entry_value(kvfilestore_t *store, kventry_t *entry, size_t keylen,
+    char **value) {
+  kvcompress_dict_t *dict = NULL;
+  char *data = entry->data + keylen + 1;
+  size_t header = compressed_header_size(entry);
+  uint32_t rawlen, id;
+  if (!(entry->flags & KVENTRY_COMPRESSED)) {
+    if ((*value = malloc(entry->length - keylen - 1)) == NULL)
+      return ENOMEM;
+    strcpy(*value, data);
+    return 0;
+  }
+  memcpy(&rawlen, data, sizeof(uint32_t));
+  if (rawlen > MAX_VALLEN)
+    return ERRCHECKSUM;
+  if (entry->flags & KVENTRY_DICT) {
+    memcpy(&id, data + sizeof(uint32_t), sizeof(uint32_t));
+    dict = __atomic_load_n(&store->dict, __ATOMIC_ACQUIRE);
+    if (dict == NULL || dict->id != id)
+      return ERRCHECKSUM;
+  }
+  if ((*value = malloc(rawlen + 1)) == NULL)
+    return ENOMEM;
+  if (kvdecompress(dict, data + header, entry->length - keylen - 1 - header,
+      *value, rawlen) != 0) {
+    free(*value);
+    *value = NULL;
+    return ERRCHECKSUM;
+  }
+  (*value)[rawlen] = '\0';
+  return 0;
+}
+
+/* Attempts to find an entry matching KEY within its hash chain, whose lock
+ * must be held by the caller unless it checks the sequence number of the
+ * stripe (see kvfilestore_get).
+ *
+ * Returns a nonnegative integer representing the location of the entry within
+ * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
+ *
+ * Returns a negative error code if the entry is not found or an error
+ * occurred: ERRNOKEY if the chain does not hold KEY or holds its tombstone,
+ * or ERRCHECKSUM if it does not hold it intact but holds a damaged entry
+ * which may have been it. If REF is not NULL, whether the value of the entry
+ * is a reference to a blob is placed into it. If CHAINLEN is not NULL, the
+ * length of the chain
+ * is placed into it when the whole chain was searched. If HOLE is not NULL,
+ * the position of the first tombstone met by the search is placed into it,
+ * or -1 if there was none.
+ *
+ * If VALUE is not NULL, the value of the entry will be placed into VALUE using
+ * malloced memory which should be freed later. */
+static int find_entry(kvfilestore_t *store, kvkey_t *key, char **value,
+    bool *ref, unsigned int *chainlen, int *hole) {
+  unsigned int counter = 0;
+  char currfile[MAX_FILENAME];
+  struct stat st;
+  kventry_t *entry;
+  size_t keylen;
+  bool damaged = false;
+  int ret;
+  if (hole != NULL)
+    *hole = -1;
+  if (key->len > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (stat(store->dirname, &st) == -1)
+    return ERRFILACCESS;
+  while (true) {
+    if (kvstore_path(currfile, "%s/%lu-%u%s", store->dirname, key->hash,
+        counter++, KVFILESTORE_FILETYPE) != 0)
+      return ERRFILACCESS;
+    ret = entry_load(currfile, store->verify, &entry);
+    if (ret == ERRNOKEY)
+      break;
+    if (ret == ERRCHECKSUM) {
+      damaged = true;
+      continue;
+    }
+    if (ret != 0)
+      return (ret < 0) ? ret : ERRFILACCESS;
+    keylen = strlen(entry->data);
+    if (entry->flags & KVENTRY_TOMBSTONE) {
+      if (hole != NULL && *hole < 0)
+        *hole = counter - 1;
+      ret = keylen == key->len && memcmp(key->str, entry->data, keylen) == 0;
+      free(entry);
+      /* The key is never written past its own tombstone. */
+      if (ret)
+        return ERRNOKEY;
+      continue;
+    }
+    if (keylen == key->len && memcmp(key->str, entry->data, keylen) == 0) {
+      ret = (value != NULL) ? entry_value(store, entry, keylen, value) : 0;
+      if (ref != NULL)
+        *ref = (entry->flags & KVENTRY_REF) != 0;
+      free(entry);
+      /* Running out of memory must not pass for a chain position. */
+      if (ret != 0)
+        return (ret < 0) ? ret : ERRFILACCESS;
+      return counter - 1;
+    }
+    free(entry);
+  }
+  if (chainlen != NULL)
+    *chainlen = counter - 1;
+  return damaged ? ERRCHECKSUM : ERRNOKEY;
+}
+
+/* Returns true if STORE contains KEY, else false. */
+bool kvfilestore_haskey(kvfilestore_t *store, kvkey_t *key) {
+  int ret = kvfilestore_get(store, key, NULL);
+  return ret == 0 || ret == ERRBLOB;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE.
+ * Returns 0 if successful, ERRBLOB if its value is a reference to a blob,
+ * else a negative error code. If VALUE is not NULL, the entry's value will
+ * be placed into VALUE using malloc()d memory which should be free()d later.
+ *
+ * The chain is searched without its lock. An entry found that way is
+ * current, since entries are replaced whole, but a miss may be an entry
+ * moved past the search by compaction, so it is only trusted if the
+ * sequence number of the stripe shows that no compaction overlapped it. */
+int kvfilestore_get(kvfilestore_t *store, kvkey_t *key, char **value) {
+  pthread_rwlock_t *lock = stripe_lock(store, key->hash);
+  unsigned int *seq = stripe_seq(store, key->hash);
+  unsigned int before, tries;
+  bool ref = false;
+  int ret;
+  for (tries = 0; tries < KVFILESTORE_READ_RETRIES; tries++) {
+    before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    /* A compaction is under way, which the lock waits out. */
+    if (before & 1)
+      break;
+    ret = find_entry(store, key, value, &ref, NULL, NULL);
+    if (ret >= 0)
+      return ref ? ERRBLOB : 0;
+    if (ret != ERRNOKEY && ret != ERRCHECKSUM)
+      return ret;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+      return ret;
+  }
+  pthread_rwlock_rdlock(lock);
+  ret = find_entry(store, key, value, &ref, NULL, NULL);
+  pthread_rwlock_unlock(lock);
+  if (ret < 0)
+    return ret;
+  else
+    return ref ? ERRBLOB : 0;
+}
+
+/* Builds the entry for KEY and VALUE, which is a reference to a blob if REF
+ * is set, compressing any other VALUE if STORE compresses values and doing
+ * so saves space, and places the length of VALUE into VALLEN. Returns the
+ * entry, in malloc()d memory which should be free()d later, or NULL if
+ * memory runs out. */
+static kventry_t *entry_new(kvfilestore_t *store, kvkey_t *key, char *value,
+    bool ref, size_t *vallen) {
+  size_t keylen = key->len, header, clen = 0;
+  kvcompress_dict_t *dict;
+  kventry_t *entry;
+  uint32_t rawlen;
+  char *data;
+  *vallen = strlen(value);
+  if ((entry = malloc(sizeof(kventry_t) + keylen + *vallen + 2)) == NULL)
+    return NULL;
+  entry->magic = KVFILESTORE_MAGIC;
+  entry->flags = 0;
+  memcpy(entry->data, key->str, keylen + 1);
+  data = entry->data + keylen + 1;
+  if (!ref && store->compress && *vallen >= KVCOMPRESS_MIN_SIZE) {
+    sample_value(store, value, *vallen);
+    dict = __atomic_load_n(&store->dict, __ATOMIC_ACQUIRE);
+    header = sizeof(uint32_t) + ((dict != NULL) ? sizeof(uint32_t) : 0);
+    /* Room for less than the value itself, so that only a saving fits. */
+    clen = kvcompress(dict, value, *vallen, data + header, *vallen - header);
+    if (clen > 0) {
+      entry->flags = KVENTRY_COMPRESSED | ((dict != NULL) ? KVENTRY_DICT : 0);
+      rawlen = *vallen;
+      memcpy(data, &rawlen, sizeof(uint32_t));
+      if (dict != NULL)
+        memcpy(data + sizeof(uint32_t), &dict->id, sizeof(uint32_t));
+      entry->length = keylen + 1 + header + clen;
+    }
+  }
+  if (entry->flags == 0) {
+    strcpy(data, value);
+    entry->length = keylen + *vallen + 2;
+  }
+  if (ref)
+    entry->flags |= KVENTRY_REF;
+  /* Entries which older builds can read are still written for them. */
+  entry->version = (entry->flags != 0) ? KVFILESTORE_VERSION : 1;
+  entry->checksum = entry_checksum(entry);
+  return entry;
+}
+
+/* Writes ENTRY to STORE as position CHAINPOS of the hash chain of HASHVAL,
+ * whose lock must be held by the caller. ENTRY is written to a temporary
+ * file, synced unless STORE's sync mode is KVSYNC_NONE, then renamed over
+ * the entry file, so that readers and crashes see either the old entry or
+ * the new one. Returns 0 if successful, else ERRFILACCESS. */
+static int entry_write(kvfilestore_t *store, unsigned long hashval,
+    unsigned int chainpos, kventry_t *entry) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  size_t size = sizeof(kventry_t) + entry->length;
+  int fd, ret = 0;
+  snapshot_chain(store, hashval);
+  /* The stripe lock keeps any other writer from using the same name. */
+  if (kvstore_path(filename, "%s/%lu-%u%s", store->dirname, hashval,
+      chainpos, KVFILESTORE_FILETYPE) != 0 ||
+      kvstore_path(tmpname, "%s/%s/%lu-%u%s", store->dirname,
+      KVFILESTORE_TMP_DIRNAME, hashval, chainpos, KVFILESTORE_FILETYPE) != 0)
+    return ERRFILACCESS;
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    return ERRFILACCESS;
+  if (write(fd, entry, size) != (ssize_t) size)
+    ret = ERRFILACCESS;
+  if (ret == 0 && store->sync.mode != KVSYNC_NONE && fdatasync(fd) == -1)
+    ret = ERRFILACCESS;
+  if (close(fd) != 0)
+    ret = ERRFILACCESS;
+  if (ret == 0 && rename(tmpname, filename) == -1)
+    ret = ERRFILACCESS;
+  if (ret != 0)
+    remove(tmpname);
+  return ret;
+}
+
+/* Adds the given KEY, VALUE entry to STORE, where VALUE is a reference to a
+ * blob if REF is set. Returns 0 if successful, else a negative error code.
+ * See kvfilestore.h for a complete description of how entries are stored. */
+int kvfilestore_put(kvfilestore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  unsigned long hashval = key->hash;
+  pthread_rwlock_t *lock = stripe_lock(store, hashval);
+  int counter, hole, ret;
+  unsigned int chainlen, chainpos;
+  uint64_t ticket = 0;
+  size_t vallen;
+  kventry_t *entry;
+  if ((entry = entry_new(store, key, value, ref, &vallen)) == NULL)
+    return ENOMEM;
+  /* Hold the stripe across the lookup and the write, so that two writers of
+   * the same chain cannot both claim the same free chain position. */
+  pthread_rwlock_wrlock(lock);
+  counter = find_entry(store, key, NULL, NULL, &chainlen, &hole);
+  if (counter >= 0) {
+    /* Entry already exists, just update it. */
+    chainpos = counter;
+  } else if (counter != ERRNOKEY && counter != ERRCHECKSUM) {
+    pthread_rwlock_unlock(lock);
+    free(entry);
+    return counter;
+  } else if (hole >= 0) {
+    /* Reuse the first tombstone, which comes no later than any tombstone of
+     * KEY itself. */
+    chainpos = hole;
+  } else {
+    /* Insert at the end of the hash chain, which was found by the search
+     * (past any damaged entry, which is left for the key it held). */
+    chainpos = chainlen;
+  }
+  ret = entry_write(store, hashval, chainpos, entry);
+  if (ret == 0)
+    ticket = kvsync_append(&store->sync, sizeof(kventry_t) + entry->length);
+  pthread_rwlock_unlock(lock);
+  if (ret == 0) {
+    __atomic_fetch_add(&store->raw_bytes, vallen, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&store->stored_bytes,
+        entry->length - key->len - 1 -
+        !(entry->flags & KVENTRY_COMPRESSED), __ATOMIC_RELAXED);
+    if (entry->flags & KVENTRY_COMPRESSED)
+      __atomic_fetch_add(&store->compressed, 1, __ATOMIC_RELAXED);
+  }
+  free(entry);
+  if (ret == 0)
+    ret = kvsync_wait(&store->sync, ticket);
+  return ret;
+}
+
+/* Queues the hash chain of HASHVAL within STORE, which holds a tombstone,
+ * to be compacted by the reclaiming thread. */
+static void reclaim_later(kvfilestore_t *store, unsigned long hashval) {
+  pthread_mutex_lock(&store->reclaim_lock);
+  if (store->num_pending < KVFILESTORE_RECLAIM_QUEUE)
+    store->pending[store->num_pending++] = hashval;
+  else
+    store->rescan = true;
+  pthread_cond_signal(&store->reclaim_cond);
+  pthread_mutex_unlock(&store->reclaim_lock);
+}
+
+/* Removes the given KEY entry from STORE by overwriting it with a
+ * tombstone, leaving its hash chain to be compacted in the background.
+ * Returns 0 if successful, else a negative error code. */
+int kvfilestore_del(kvfilestore_t *store, kvkey_t *key) {
+  int chainpos, ret;
+  unsigned long hashval = key->hash;
+  pthread_rwlock_t *lock = stripe_lock(store, hashval);
+  uint64_t ticket = 0;
+  kventry_t *entry;
+  if ((entry = malloc(sizeof(kventry_t) + key->len + 1)) == NULL)
+    return ENOMEM;
+  entry->magic = KVFILESTORE_MAGIC;
+  entry->version = KVFILESTORE_VERSION;
+  entry->flags = KVENTRY_TOMBSTONE;
+  entry->length = key->len + 1;
+  memcpy(entry->data, key->str, key->len + 1);
+  entry->checksum = entry_checksum(entry);
+  pthread_rwlock_wrlock(lock);
+  chainpos = find_entry(store, key, NULL, NULL, NULL, NULL);
+  if (chainpos < 0) {
+    pthread_rwlock_unlock(lock);
+    free(entry);
+    return chainpos;
+  }
+  ret = entry_write(store, hashval, chainpos, entry);
+  if (ret == 0)
+    ticket = kvsync_append(&store->sync, sizeof(kventry_t) + entry->length);
+  pthread_rwlock_unlock(lock);
+  free(entry);
+  if (ret != 0)
+    return ret;
+  __atomic_fetch_add(&store->tombstones, 1, __ATOMIC_RELAXED);
+  reclaim_later(store, hashval);
+  return kvsync_wait(&store->sync, ticket);
+}
+
+/* Compacts the hash chain of HASHVAL within STORE, whose lock must be held
+ * by the caller, so that it holds no tombstones: trailing tombstones are
+ * removed, and the last entry of the chain is renamed into each remaining
+ * one. The chain is complete after every step, and the sequence number of
+ * its stripe is odd while entries are moved, for the sake of GETs, which
+ * take no lock. Returns 0 if successful, else a negative error code (or
+ * ENOMEM). */
+static int reclaim_chain(kvfilestore_t *store, unsigned long hashval) {
+  char filename[MAX_FILENAME], lastfile[MAX_FILENAME];
+  unsigned int *seq = stripe_seq(store, hashval);
+  unsigned int len = 0, cap = 0, first = 0, removed = 0;
+  bool *dead = NULL, *grown;
+  kventry_t *entry;
+  int ret;
+  snapshot_chain(store, hashval);
+  while (true) {
+    if ((ret = kvstore_path(filename, "%s/%lu-%u%s", store->dirname, hashval,
+        len, KVFILESTORE_FILETYPE)) != 0)
+      goto done;
+    /* Damaged entries are kept, and moved like any other. */
+    ret = entry_load(filename, false, &entry);
+    if (ret == ERRNOKEY)
+      break;
+    if (ret != 0 && ret != ERRCHECKSUM)
+      goto done;
+    if (len == cap) {
+      cap = (cap == 0) ? 8 : cap * 2;
+      if ((grown = realloc(dead, cap * sizeof(bool))) == NULL) {
+        free(entry);
+        ret = ENOMEM;
+        goto done;
+      }
+      dead = grown;
+    }
+    dead[len++] = ret == 0 && (entry->flags & KVENTRY_TOMBSTONE);
+    free(entry);
+  }
+  ret = 0;
+  __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+  while (len > 0) {
+    if (kvstore_path(lastfile, "%s/%lu-%u%s", store->dirname, hashval,
+        len - 1, KVFILESTORE_FILETYPE) != 0) {
+      ret = ERRFILACCESS;
+      break;
+    }
+    if (dead[len - 1]) {
+      if (remove(lastfile) == -1) {
+        ret = ERRFILACCESS;
+        break;
+      }
+    } else {
+      while (first < len - 1 && !dead[first])
+        first++;
+      if (first == len - 1)
+        break;
+      if (kvstore_path(filename, "%s/%lu-%u%s", store->dirname, hashval,
+          first, KVFILESTORE_FILETYPE) != 0 ||
+          rename(lastfile, filename) == -1) {
+        ret = ERRFILACCESS;
+        break;
+      }
+      dead[first] = false;
+    }
+    len--;
+    removed++;
+  }
+  __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+done:
+  free(dead);
+  if (removed > 0) {
+    kvsync_append(&store->sync, 0);
+    __atomic_fetch_add(&store->reclaimed, removed, __ATOMIC_RELAXED);
+  }
+  return ret;
+}
+
+/* Compacts the hash chain of HASHVAL within STORE, taking its lock. */
+static int reclaim(kvfilestore_t *store, unsigned long hashval) {
+  pthread_rwlock_t *lock = stripe_lock(store, hashval);
+  int ret;
+  pthread_rwlock_wrlock(lock);
+  ret = reclaim_chain(store, hashval);
+  pthread_rwlock_unlock(lock);
+  return ret;
+}
+
+/* Scans the directory of STORE for tombstones, compacting every chain which
+ * holds one. Returns 0 if successful, else a negative error code. */
+static int reclaim_all(kvfilestore_t *store) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  size_t len, typelen = strlen(KVFILESTORE_FILETYPE);
+  unsigned long hashval;
+  unsigned int chainpos;
+  kventry_t *entry;
+  DIR *kvstoredir = opendir(store->dirname);
+  int ret = 0;
+  if (kvstoredir == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && !__atomic_load_n(&store->stopping, __ATOMIC_RELAXED) &&
+      (dent = readdir(kvstoredir)) != NULL) {
+    len = strlen(dent->d_name);
+    if (len <= typelen ||
+        strcmp(dent->d_name + len - typelen, KVFILESTORE_FILETYPE) != 0 ||
+        sscanf(dent->d_name, "%lu-%u", &hashval, &chainpos) != 2)
+      continue;
+    if (kvstore_path(filename, "%s/%s", store->dirname, dent->d_name) != 0 ||
+        entry_load(filename, false, &entry) != 0)
+      continue;
+    if (entry->flags & KVENTRY_TOMBSTONE)
+      ret = reclaim(store, hashval);
+    free(entry);
+  }
+  closedir(kvstoredir);
+  return ret < 0 ? ret : 0;
+}
+
+/* The body of the reclaiming thread of STORE, which compacts the chains
+ * queued by DEL, or every chain after a scan is requested, until the store
+ * is cleaned. */
+static void *reclaimer(void *arg) {
+  kvfilestore_t *store = (kvfilestore_t *) arg;
+  unsigned long *batch = malloc(sizeof(store->pending));
+  unsigned int i, count;
+  bool rescan;
+  int ret = 0;
+  pthread_mutex_lock(&store->reclaim_lock);
+  while (!store->stopping) {
+    if (store->num_pending == 0 && !store->rescan) {
+      pthread_cond_wait(&store->reclaim_cond, &store->reclaim_lock);
+      continue;
+    }
+    /* Without a batch, every chain waits for a scan. */
+    rescan = store->rescan || batch == NULL;
+    count = (batch != NULL) ? store->num_pending : 0;
+    if (count > 0)
+      memcpy(batch, store->pending, count * sizeof(unsigned long));
+    store->num_pending = 0;
+    store->rescan = false;
+    pthread_mutex_unlock(&store->reclaim_lock);
+    if (rescan)
+      ret = reclaim_all(store);
+    for (i = 0; ret == 0 && !rescan && i < count; i++)
+      ret = reclaim(store, batch[i]);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to reclaim tombstones in %s: error %d\n",
+          store->dirname, ret);
+      ret = 0;
+      sleep(1);
+    }
+    pthread_mutex_lock(&store->reclaim_lock);
+  }
+  pthread_mutex_unlock(&store->reclaim_lock);
+  free(batch);
+  return NULL;
+}
+
+/* Returns true if DIRNAME holds any entries stored by a KVFileStore. */
+bool kvfilestore_detect(char *dirname) {
+  struct dirent *dent;
+  size_t len, typelen = strlen(KVFILESTORE_FILETYPE);
+  bool found = false;
+  DIR *dir = opendir(dirname);
+  if (dir == NULL)
+    return false;
+  while (!found && (dent = readdir(dir)) != NULL) {
+    len = strlen(dent->d_name);
+    found = len > typelen &&
+        strcmp(dent->d_name + len - typelen, KVFILESTORE_FILETYPE) == 0;
+  }
+  closedir(dir);
+  return found;
+}
+
+/* Makes every write made to STORE so far durable, whatever its sync mode.
+ * Returns 0 if successful, else a negative error code. */
+int kvfilestore_flush(kvfilestore_t *store) {
+  return kvsync_flush(&store->sync);
+}
+
+/* Calls CALLBACK with ARG (and a NULL value) on the key of every entry in
+ * STORE, in no particular order. Entries added or removed during the call
+ * may or may not be seen. Returns 0 if successful, else a negative error
+ * code. */
+int kvfilestore_keys(kvfilestore_t *store, kvscan_cb_t callback, void *arg) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  size_t len, typelen = strlen(KVFILESTORE_FILETYPE);
+  kventry_t *entry;
+  DIR *kvstoredir = opendir(store->dirname);
+  int ret = 0;
+  if (kvstoredir == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && (dent = readdir(kvstoredir)) != NULL) {
+    len = strlen(dent->d_name);
+    if (len <= typelen ||
+        strcmp(dent->d_name + len - typelen, KVFILESTORE_FILETYPE) != 0)
+      continue;
+    if (kvstore_path(filename, "%s/%s", store->dirname, dent->d_name) != 0 ||
+        entry_load(filename, store->verify, &entry) != 0)
+      continue;
+    if (!(entry->flags & KVENTRY_TOMBSTONE))
+      ret = callback(entry->data, NULL, arg);
+    free(entry);
+  }
+  closedir(kvstoredir);
+  return ret < 0 ? ret : 0;
+}
+
+/* Takes a snapshot of STORE into DIRNAME, an empty directory, as described
+ * in kvfilestore.h. Returns 0 if successful, else a negative error code (or
+ * ENOMEM). */
+int kvfilestore_snapshot(kvfilestore_t *store, char *dirname) {
+  char filename[MAX_FILENAME], dstname[MAX_FILENAME];
+  size_t len, typelen = strlen(KVFILESTORE_FILETYPE);
+  kvfilechain_t *chain, *tmp;
+  unsigned long hashval;
+  unsigned int chainpos;
+  struct dirent *dent;
+  pthread_rwlock_t *lock;
+  char *snapshot;
+  DIR *kvstoredir;
+  int i, ret = 0;
+  if ((snapshot = strdup(dirname)) == NULL)
+    return ENOMEM;
+  if ((kvstoredir = opendir(store->dirname)) == NULL) {
+    free(snapshot);
+    return ERRFILACCESS;
+  }
+  for (i = 0; i < KVFILESTORE_STRIPES; i++)
+    pthread_rwlock_wrlock(&store->locks[i]);
+  store->snapshot = snapshot;
+  store->snapshot_error = 0;
+  for (i = KVFILESTORE_STRIPES - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&store->locks[i]);
+
+  /* The dictionary never changes once saved, and entries only use it after
+   * it has been. */
+  pthread_mutex_lock(&store->sample_lock);
+  if ((ret = kvstore_path(filename, "%s/%s", store->dirname,
+      KVFILESTORE_DICT_FILENAME)) == 0 &&
+      (ret = kvstore_path(dstname, "%s/%s", dirname,
+      KVFILESTORE_DICT_FILENAME)) == 0 &&
+      (ret = kvstore_snapshot_link(filename, dstname)) == ERRNOKEY)
+    ret = 0;
+  pthread_mutex_unlock(&store->sample_lock);
+
+  /* Chains created since the moment of the snapshot were linked (empty) by
+   * their first write, so are skipped like any other linked chain. */
+  while (ret == 0 && (dent = readdir(kvstoredir)) != NULL) {
+    len = strlen(dent->d_name);
+    if (len <= typelen ||
+        strcmp(dent->d_name + len - typelen, KVFILESTORE_FILETYPE) != 0 ||
+        sscanf(dent->d_name, "%lu-%u", &hashval, &chainpos) != 2)
+      continue;
+    lock = stripe_lock(store, hashval);
+    pthread_rwlock_rdlock(lock);
+    ret = snapshot_chain(store, hashval);
+    pthread_rwlock_unlock(lock);
+  }
+  closedir(kvstoredir);
+
+  for (i = 0; i < KVFILESTORE_STRIPES; i++)
+    pthread_rwlock_wrlock(&store->locks[i]);
+  store->snapshot = NULL;
+  if (ret == 0)
+    ret = store->snapshot_error;
+  for (i = KVFILESTORE_STRIPES - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&store->locks[i]);
+  HASH_ITER(hh, store->snapshot_chains, chain, tmp) {
+    HASH_DEL(store->snapshot_chains, chain);
+    free(chain);
+  }
+  free(snapshot);
+  return ret;
+}
+
+/* Writes the compression and tombstone statistics of STORE, covering the
+ * writes made since it was initialized, into BUF, which holds SIZE bytes.
+ * Returns what snprintf() does. */
+int kvfilestore_stats(kvfilestore_t *store, char *buf, size_t size) {
+  kvcompress_dict_t *dict = __atomic_load_n(&store->dict, __ATOMIC_ACQUIRE);
+  uint64_t raw = __atomic_load_n(&store->raw_bytes, __ATOMIC_RELAXED);
+  uint64_t stored = __atomic_load_n(&store->stored_bytes, __ATOMIC_RELAXED);
+  return snprintf(buf, size,
+      "compress: %s\n"
+      "compress_dict_bytes: %zu\n"
+      "compress_values: %llu\n"
+      "compress_raw_bytes: %llu\n"
+      "compress_stored_bytes: %llu\n"
+      "compress_ratio: %.2f\n"
+      "tombstones_written: %llu\n"
+      "tombstones_reclaimed: %llu\n",
+      store->compress ? "on" : "off", (dict != NULL) ? dict->size : 0,
+      (unsigned long long) __atomic_load_n(&store->compressed,
+      __ATOMIC_RELAXED), (unsigned long long) raw,
+      (unsigned long long) stored,
+      (stored > 0) ? (double) raw / stored : 1.0,
+      (unsigned long long) __atomic_load_n(&store->tombstones,
+      __ATOMIC_RELAXED),
+      (unsigned long long) __atomic_load_n(&store->reclaimed,
+      __ATOMIC_RELAXED));
+}
+
+/* Stops the reclaiming thread of STORE, then deletes all current entries in
+ * STORE. */
+int kvfilestore_clean(kvfilestore_t *store) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  size_t len, typelen = strlen(KVFILESTORE_FILETYPE);
+  DIR *kvstoredir;
+  int i;
+  pthread_mutex_lock(&store->reclaim_lock);
+  store->stopping = true;
+  pthread_cond_broadcast(&store->reclaim_cond);
+  pthread_mutex_unlock(&store->reclaim_lock);
+  if (store->reclaimer)
+    pthread_join(store->reclaimer, NULL);
+  store->reclaimer = 0;
+  kvsync_stop(&store->sync);
+  if (store->dirfd >= 0) {
+    close(store->dirfd);
+    store->dirfd = -1;
+  }
+  if ((kvstoredir = opendir(store->dirname)) == NULL)
+    return 0;
+  for (i = 0; i < KVFILESTORE_STRIPES; i++)
+    pthread_rwlock_wrlock(&store->locks[i]);
+  while ((dent = readdir(kvstoredir)) != NULL) {
+    len = strlen(dent->d_name);
+    if (len <= typelen ||
+        strcmp(dent->d_name + len - typelen, KVFILESTORE_FILETYPE) != 0)
+      continue;
+    if (kvstore_path(filename, "%s/%s", store->dirname, dent->d_name) == 0)
+      remove(filename);
+  }
+  if (kvstore_path(filename, "%s/%s", store->dirname,
+      KVFILESTORE_DICT_FILENAME) == 0)
+    remove(filename);
+  tmp_clear(store);
+  if (kvstore_path(filename, "%s/%s", store->dirname,
+      KVFILESTORE_TMP_DIRNAME) == 0)
+    rmdir(filename);
+  for (i = KVFILESTORE_STRIPES - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&store->locks[i]);
+  closedir(kvstoredir);
+  for (i = 0; i < (int) store->num_samples; i++)
+    free(store->samples[i]);
+  free(store->samples);
+  free(store->sample_lens);
+  free(store->dict);
+  store->samples = NULL;
+  store->sample_lens = NULL;
+  store->num_samples = 0;
+  store->dict = NULL;
+  return 0;
+}
+
+static int engine_init(kvstore_t *store, char *dirname) {
+  kvfilestore_t *filestore = malloc(sizeof(kvfilestore_t));
+  if (filestore == NULL)
+    return ENOMEM;
+  store->state = filestore;
+  return kvfilestore_init(filestore, dirname, store->sync_mode,
+      store->verify, store->compress);
+}
+
+static int engine_get(kvstore_t *store, kvkey_t *key, char **value) {
+  return kvfilestore_get(store->state, key, value);
+}
+
+static int engine_put(kvstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  return kvfilestore_put(store->state, key, value, ref);
+}
+
+static int engine_del(kvstore_t *store, kvkey_t *key) {
+  return kvfilestore_del(store->state, key);
+}
+
+static bool engine_haskey(kvstore_t *store, kvkey_t *key) {
+  return kvfilestore_haskey(store->state, key);
+}
+
+static int engine_flush(kvstore_t *store) {
+  return kvfilestore_flush(store->state);
+}
+
+static int engine_keys(kvstore_t *store, kvscan_cb_t callback, void *arg) {
+  return kvfilestore_keys(store->state, callback, arg);
+}
+
+static int engine_stats(kvstore_t *store, char *buf, size_t size) {
+  return kvfilestore_stats(store->state, buf, size);
+}
+
+static int engine_snapshot(kvstore_t *store, char *dirname) {
+  return kvfilestore_snapshot(store->state, dirname);
+}
+
+static int engine_clean(kvstore_t *store) {
+  int ret = kvfilestore_clean(store->state);
+  free(store->state);
+  return ret;
+}
+
+/* The file-per-entry engine, as used by KVStore. */
+const kvstore_engine_t kvfilestore_engine = {
+  .name = "file",
+  .persistent = true,
+  .init = engine_init,
+  .get = engine_get,
+  .put = engine_put,
+  .del = engine_del,
+  .haskey = engine_haskey,
+  .keys = engine_keys,
+  .flush = engine_flush,
+  .stats = engine_stats,
+  .snapshot = engine_snapshot,
+  .clean = engine_clean,
+};
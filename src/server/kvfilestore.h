@@ -0,0 +1,223 @@
+#ifndef __KV_FILE_STORE__
+#define __KV_FILE_STORE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "uthash.h"
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "kvsync.h"
+#include "kvcompress.h"
+
+/* KVFileStore is the original file-per-entry storage engine for KVStore,
+ * selected with the name "file".
+ *
+ * Each entry is stored as an individual file, all collected within the
+ * directory name which is passed in upon initialization. If you are running
+ * multiple KVStores, they MUST have unique directory names, else behavior is
+ * undefined.
+ *
+ * The files which store entries are simple binary dumps of a kventry_t
+ * struct.  Note that this means entry files are NOT portable, and results will
+ * vary if an entry created on one machine is accessed on another machine, or
+ * even by a program compiled by a different compiler. The LENGTH field of kventry_t
+ * is used to determine how large an entry and its associated file are.
+ *
+ * Each entry starts with a versioned header carrying a CRC-32C of its length
+ * and data. An entry is read with a single read() of the whole file, and is
+ * rejected with ERRCHECKSUM if its length does not match the size of the
+ * file or its data is not two strings, or (if the store verifies reads, see
+ * kvstore.h) if it fails its checksum. Entries written before the header
+ * existed (which start straight with LENGTH) are still read, without a
+ * checksum to verify, and gain one when next written. A lookup which finds
+ * a damaged entry in its hash chain, and not the key it was after, fails
+ * with ERRCHECKSUM, since the key may have been in the damaged entry; a PUT
+ * of that key appends a fresh entry to the chain instead.
+ *
+ * If the store compresses values (see kvstore.h), a value of at least
+ * KVCOMPRESS_MIN_SIZE bytes is stored compressed (see kvcompress.h) when
+ * that saves space, which is marked by KVENTRY_COMPRESSED in the FLAGS of
+ * its header. The data of such an entry is the key, the uncompressed length
+ * of the value (a uint32_t) and, if KVENTRY_DICT is also set, the ID of the
+ * dictionary it was compressed with, followed by the compressed value. The
+ * first KVCOMPRESS_SAMPLES values which are large enough are sampled to
+ * train the dictionary, which is saved to KVFILESTORE_DICT_FILENAME and
+ * never changes once trained; values written before then are compressed
+ * without one. Compressed entries are written as version 2, which older
+ * builds reject rather than misread, while other entries are still written
+ * as version 1. Only the value of the entry which matches a lookup is ever
+ * decompressed. A value which is a reference to a blob (see kvblob.h) is
+ * marked by KVENTRY_REF, and is never compressed.
+ *
+ * The name of the file that stores an entry is determined by the djb2 string
+ * hash of the entry's key, which can be found using the hash() function. To
+ * resolve collisions, hash chaining is used, thus the file names of entries
+ * within the store directory should have the format:
+ *    hash(key)-chainpos.entry
+ *        OR, more explicitly:
+ *    sprintf(filename, "%lu-%u.entry", hash(key), chainpos);
+ * chainpos represents the entry's position within its hash chain, which should
+ * start from 0.  If a collision is found when storing an entry, the new entry
+ * will have a chainpos of 1, and so on.  Chains should always be complete;
+ * that is, you may never have a chain which has entries with a chainpos of 0
+ * and 2 but not 1.
+ *
+ * A DEL does not remove the entry's file, which would leave a hole in the
+ * chain to be filled by renaming its last entry and churn the directory on
+ * every delete. Instead it overwrites the entry with a tombstone: a version
+ * 2 entry marked by KVENTRY_TOMBSTONE whose data is just the key. A lookup
+ * which meets the tombstone of its key stops there, since a key is never
+ * written past its own tombstone, and a PUT reuses the first tombstone in
+ * the chain (whatever its key) before appending. Chains holding tombstones
+ * are queued for a background thread which compacts them, removing trailing
+ * tombstones and renaming the last entry of the chain into each remaining
+ * one, exactly as DEL used to. Since a tombstone is an ordinary entry, the
+ * chain stays complete throughout and a crash leaves nothing to repair; the
+ * thread scans the whole directory for tombstones left over when the store
+ * is opened, and whenever more than KVFILESTORE_RECLAIM_QUEUE chains were
+ * waiting.
+ *
+ * An entry file is never written in place. A PUT or DEL writes the new
+ * entry to a file of the same name within the KVFILESTORE_TMP_DIRNAME
+ * subdirectory, then renames it over the entry file, so that every entry
+ * file holds either its old entry or all of its new one: to a concurrent
+ * reader, and after a crash, since the new file is synced before it is
+ * renamed unless the sync mode is KVSYNC_NONE. Files left in the
+ * subdirectory by a crash are removed when the store is opened.
+ *
+ * Each hash chain is guarded by one of KVFILESTORE_STRIPES locks, chosen by
+ * hash(key) % KVFILESTORE_STRIPES, so operations on keys in different stripes
+ * never wait for one another. A PUT or DEL holds its stripe for writing from
+ * the chain lookup through the rename, and the reclaiming thread holds it
+ * while it compacts the chain. GETs take no lock: since no reader can see a
+ * partial entry, the only thing which can mislead one is a chain being
+ * compacted under it, moving an entry from the end of the chain to a
+ * position it has already passed. Compaction therefore bumps a sequence
+ * number for the stripe before and after it moves anything, and a GET which
+ * does not find its key accepts that only if the sequence number of the
+ * stripe was even and unchanged throughout. Otherwise it looks again, and
+ * after KVFILESTORE_READ_RETRIES attempts shares the stripe lock instead.
+ *
+ * Renames are made durable (see kvsync.h) by syncing the store directory,
+ * once for each batch of concurrent writes.
+ *
+ * Since an entry file is only ever replaced or removed, never written in
+ * place, a snapshot (see kvstore_snapshot) is a directory of hard links to
+ * the entry files as they were at its moment, which is when it is started
+ * with every stripe lock held. Rather than stop writers while every file is
+ * linked, the first write during the snapshot to a hash chain (a PUT, a DEL,
+ * or the compaction of its tombstones) links the whole chain into the
+ * snapshot before changing it, and records that it has; the snapshot then
+ * links the entry files of every other chain as it comes across them.
+ */
+
+/* The filetype to append to the filenames of entries within the store. */
+#define KVFILESTORE_FILETYPE ".entry"
+
+/* The MAGIC and VERSION of the header of entries. The magic number is larger
+ * than any LENGTH, which is how headerless entries are told apart. */
+#define KVFILESTORE_MAGIC 0x4b564531U
+#define KVFILESTORE_VERSION 2
+
+/* The FLAGS of the header of entries. */
+#define KVENTRY_COMPRESSED 0x1  /* The value is compressed. */
+#define KVENTRY_DICT 0x2        /* The value is compressed with the dictionary. */
+#define KVENTRY_TOMBSTONE 0x4   /* The key has been deleted, and there is no value. */
+#define KVENTRY_REF 0x8         /* The value is a reference to a blob. */
+
+/* The name of the file the compression dictionary is saved to within the
+ * directory. */
+#define KVFILESTORE_DICT_FILENAME "compress.dict"
+
+/* The name of the subdirectory of the directory in which entries are
+ * written before they are renamed into place. */
+#define KVFILESTORE_TMP_DIRNAME "tmp"
+
+/* The number of locks which hash chains are striped across. */
+#define KVFILESTORE_STRIPES 64
+
+/* The number of times a GET looks for a key without a lock before it takes
+ * the lock of its stripe. */
+#define KVFILESTORE_READ_RETRIES 3
+
+/* The number of chains which may wait to have their tombstones reclaimed
+ * before the directory is scanned for them instead. */
+#define KVFILESTORE_RECLAIM_QUEUE 4096
+
+/* A hash chain which has been linked into the snapshot being taken. */
+typedef struct {
+  unsigned long hashval;        /* The hash of the chain. */
+  UT_hash_handle hh;            /* Makes this structure hashable by uthash. */
+} kvfilechain_t;
+
+/* A KVFileStore. */
+typedef struct {
+  char dirname[MAX_FILENAME];  /* The name of the directory used to store its entries. */
+  pthread_rwlock_t locks[KVFILESTORE_STRIPES]; /* The locks guarding the hash chains, by hash(key) % KVFILESTORE_STRIPES. */
+  unsigned int seqs[KVFILESTORE_STRIPES]; /* The sequence numbers of the stripes, which are odd while a chain in the stripe is compacted. */
+  int dirfd;                   /* An open file descriptor for the directory, used to sync it. */
+  bool verify;                 /* true to verify the checksum of every entry read. */
+  bool compress;               /* true to compress values of at least KVCOMPRESS_MIN_SIZE bytes. */
+  kvcompress_dict_t *dict;     /* The dictionary values are compressed with, or NULL until one is trained. */
+  char **samples;              /* The values sampled to train DICT, while it is NULL. */
+  size_t *sample_lens;         /* The lengths of SAMPLES. */
+  unsigned int num_samples;    /* The number of SAMPLES. */
+  pthread_mutex_t sample_lock; /* Protects SAMPLES, and the training of DICT. */
+  uint64_t raw_bytes;          /* The total length of the values written, uncompressed. */
+  uint64_t stored_bytes;       /* The total length of the values written, as stored. */
+  uint64_t compressed;         /* The number of values written compressed. */
+  uint64_t tombstones;         /* The number of tombstones written. */
+  uint64_t reclaimed;          /* The number of entries removed from chains by reclamation. */
+  unsigned long pending[KVFILESTORE_RECLAIM_QUEUE]; /* The hashes of chains waiting for reclamation. */
+  unsigned int num_pending;    /* The number of PENDING chains. */
+  bool rescan;                 /* true if the directory should be scanned for tombstones. */
+  bool stopping;               /* true once the reclaiming thread should exit. */
+  pthread_mutex_t reclaim_lock; /* Protects PENDING, NUM_PENDING, RESCAN and STOPPING. */
+  pthread_cond_t reclaim_cond; /* Signalled whenever there may be tombstones to reclaim, or STOPPING is set. */
+  pthread_t reclaimer;         /* The thread which reclaims tombstones. */
+  char *snapshot;              /* The directory of the snapshot being taken, or NULL. Changed only with every stripe lock held. */
+  kvfilechain_t *snapshot_chains; /* The chains linked into SNAPSHOT ahead of a change. */
+  int snapshot_error;          /* The first error linking a chain into SNAPSHOT, or 0. */
+  pthread_mutex_t snapshot_lock; /* Protects SNAPSHOT_CHAINS and SNAPSHOT_ERROR. */
+  kvsync_t sync;               /* Makes writes to the directory durable. */
+} kvfilestore_t;
+
+/* A single kvstore entry.
+ * data stores both the key and the value, in the form:
+ *   key_string \0 value_string \0
+ * (that is, two concatenated and null terminated strings), unless the value
+ * is compressed or the entry is a tombstone (see above). */
+typedef struct {
+  uint32_t magic;               /* Always KVFILESTORE_MAGIC. */
+  uint16_t version;             /* The version of the entry format, at most KVFILESTORE_VERSION. */
+  uint16_t flags;               /* KVENTRY_* flags, always 0 in version 1. */
+  uint32_t checksum;            /* CRC-32C of LENGTH and DATA. */
+  int length;                   /* Stores the total length of data, including null terminators. */
+  char data[0];                 /* Described above. */
+} kventry_t;
+
+extern const kvstore_engine_t kvfilestore_engine;
+
+int kvfilestore_init(kvfilestore_t *, char *dirname, kvsync_mode_t sync_mode,
+    bool verify, bool compress);
+
+int kvfilestore_get(kvfilestore_t *, kvkey_t *key, char **value);
+int kvfilestore_put(kvfilestore_t *, kvkey_t *key, char *value, bool ref);
+int kvfilestore_del(kvfilestore_t *, kvkey_t *key);
+
+bool kvfilestore_haskey(kvfilestore_t *, kvkey_t *key);
+
+bool kvfilestore_detect(char *dirname);
+
+int kvfilestore_flush(kvfilestore_t *);
+
+int kvfilestore_keys(kvfilestore_t *, kvscan_cb_t callback, void *arg);
+
+int kvfilestore_stats(kvfilestore_t *, char *buf, size_t size);
+
+int kvfilestore_snapshot(kvfilestore_t *, char *dirname);
+
+int kvfilestore_clean(kvfilestore_t *);
+
+#endif
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "kvio.h"
+
+/* The user_data of the request which tells the completion thread to exit. */
+#define STOP_TAG 0
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+    unsigned int min_complete, unsigned int flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+      NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+    unsigned int nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Performs REQ with pread() or pwrite(), returning its result. */
+static ssize_t perform(kvio_req_t *req) {
+  ssize_t ret;
+  if (req->op == KVIO_READ)
+    ret = pread(req->fd, req->buf, req->len, req->offset);
+  else
+    ret = pwrite(req->fd, req->buf, req->len, req->offset);
+  return (ret < 0) ? -errno : ret;
+}
+
+/* Sets the RESULT of REQ and invokes its callback. */
+static void complete(kvio_req_t *req, ssize_t result) {
+  req->result = result;
+  req->callback(req);
+}
+
+/* The body of the completion thread of the kvio_t ARG. Once it has reaped
+ * the request to stop, it carries on until every other request is reaped. */
+static void *reaper(void *arg) {
+  kvio_t *io = arg;
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail, count;
+  bool stopping = false, done = false;
+  while (!done) {
+    if (io_uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;
+    head = *io->cq_head;
+    tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for (count = 0; head != tail; head++, count++) {
+      cqe = &io->cqes[head & *io->cq_mask];
+      if (cqe->user_data == STOP_TAG)
+        stopping = true;
+      else
+        complete((kvio_req_t *) (uintptr_t) cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&io->sq_lock);
+    io->inflight -= count;
+    done = stopping && io->inflight == 0;
+    if (count > 0)
+      pthread_cond_broadcast(&io->sq_space);
+    pthread_mutex_unlock(&io->sq_lock);
+  }
+  return NULL;
+}
+
+/* Fills in the next submission queue entry of IO to perform REQ (or, if REQ
+ * is NULL, to stop the completion thread). Must be called with the
+ * submission lock held, while the submission queue has room. */
+static void queue(kvio_t *io, kvio_req_t *req) {
+  unsigned int tail = *io->sq_tail, index = tail & *io->sq_mask;
+  struct io_uring_sqe *sqe = &io->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  if (req == NULL) {
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = STOP_TAG;
+  } else {
+    if (req->index >= 0) {
+      sqe->opcode = (req->op == KVIO_READ) ? IORING_OP_READ_FIXED :
+          IORING_OP_WRITE_FIXED;
+      sqe->buf_index = req->index;
+    } else {
+      sqe->opcode = (req->op == KVIO_READ) ? IORING_OP_READ :
+          IORING_OP_WRITE;
+    }
+    sqe->fd = req->fd;
+    if (req->fd >= 0 && req->fd < KVIO_MAX_FILES && io->registered[req->fd])
+      sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) req->buf;
+    sqe->len = req->len;
+    sqe->off = req->offset;
+    sqe->user_data = (uintptr_t) req;
+  }
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  io->queued++;
+  io->inflight++;
+}
+
+/* Submits every request queued within IO, unless another thread is already
+ * doing so, in which case it will submit them too. Must be called with the
+ * submission lock held. */
+static void submit_queued(kvio_t *io) {
+  int ret;
+  if (io->submitting)
+    return;
+  io->submitting = true;
+  while (io->queued > 0) {
+    /* Submit without the lock held, so that other threads can keep queueing
+     * requests; they will be picked up by the next pass. */
+    unsigned int count = io->queued;
+    pthread_mutex_unlock(&io->sq_lock);
+    ret = io_uring_enter(io->ring_fd, count, 0, 0);
+    pthread_mutex_lock(&io->sq_lock);
+    if (ret > 0) {
+      io->queued -= ret;
+      pthread_cond_broadcast(&io->sq_space);
+    } else if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+        errno != EBUSY) {
+      /* The kernel would not take the requests, so pull them back off the
+       * ring and perform them here instead. */
+      kvio_req_t *pulled[io->queued];
+      unsigned int tail = *io->sq_tail, num_pulled = io->queued, i;
+      bool stop = false;
+      for (i = 0; i < num_pulled; i++) {
+        tail--;
+        pulled[i] = (kvio_req_t *) (uintptr_t)
+            io->sqes[io->sq_array[tail & *io->sq_mask]].user_data;
+      }
+      __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+      io->queued = 0;
+      io->inflight -= num_pulled;
+      pthread_cond_broadcast(&io->sq_space);
+      pthread_mutex_unlock(&io->sq_lock);
+      for (i = num_pulled; i > 0; i--) {
+        if (pulled[i - 1] != NULL)
+          complete(pulled[i - 1], perform(pulled[i - 1]));
+        else
+          stop = true;
+      }
+      pthread_mutex_lock(&io->sq_lock);
+      /* The request to stop cannot be performed here, and the completion
+       * thread waits for it, so put it back for the next pass. */
+      if (stop)
+        queue(io, NULL);
+    }
+  }
+  io->submitting = false;
+}
+
+/* Places REQ (or, if REQ is NULL, a request to stop the completion thread)
+ * on the submission queue of IO and submits it. */
+static void enqueue(kvio_t *io, kvio_req_t *req) {
+  pthread_mutex_lock(&io->sq_lock);
+  /* Never have more requests outstanding than the completion queue holds,
+   * or completions could be dropped. */
+  while (*io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE)
+      >= io->sq_entries || io->inflight >= io->cq_entries)
+    pthread_cond_wait(&io->sq_space, &io->sq_lock);
+  queue(io, req);
+  submit_queued(io);
+  pthread_mutex_unlock(&io->sq_lock);
+}
+
+/* Maps the rings of the io_uring instance IO->ring_fd set up with PARAMS.
+ * Returns 0 if successful, else -1. */
+static int map_rings(kvio_t *io, struct io_uring_params *params) {
+  char *sq, *cq;
+  io->sq_map_size = params->sq_off.array +
+      params->sq_entries * sizeof(unsigned int);
+  io->cq_map_size = params->cq_off.cqes +
+      params->cq_entries * sizeof(struct io_uring_cqe);
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (io->cq_map_size > io->sq_map_size)
+      io->sq_map_size = io->cq_map_size;
+    io->cq_map_size = 0;
+  }
+  sq = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    return -1;
+  io->sq_map = sq;
+  if (io->cq_map_size == 0) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      return -1;
+    io->cq_map = cq;
+  }
+  io->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED) {
+    io->sqes = NULL;
+    return -1;
+  }
+  io->sq_head = (unsigned *) (sq + params->sq_off.head);
+  io->sq_tail = (unsigned *) (sq + params->sq_off.tail);
+  io->sq_mask = (unsigned *) (sq + params->sq_off.ring_mask);
+  io->sq_array = (unsigned *) (sq + params->sq_off.array);
+  io->cq_head = (unsigned *) (cq + params->cq_off.head);
+  io->cq_tail = (unsigned *) (cq + params->cq_off.tail);
+  io->cq_mask = (unsigned *) (cq + params->cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+  io->sq_entries = params->sq_entries;
+  io->cq_entries = params->cq_entries;
+  return 0;
+}
+
+/* Registers an empty fixed file table and the buffer pool with the ring of
+ * IO. Either may be refused (for instance by RLIMIT_MEMLOCK), in which case
+ * IO simply goes without. */
+static void register_resources(kvio_t *io) {
+  struct iovec iovecs[KVIO_BUFFERS];
+  int fds[KVIO_MAX_FILES], i;
+  for (i = 0; i < KVIO_MAX_FILES; i++)
+    fds[i] = -1;
+  io->files = io_uring_register(io->ring_fd, IORING_REGISTER_FILES, fds,
+      KVIO_MAX_FILES) == 0;
+  io->buffers = mmap(NULL, KVIO_BUFFERS * KVIO_BUFFER_SIZE,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (io->buffers == MAP_FAILED) {
+    io->buffers = NULL;
+    return;
+  }
+  for (i = 0; i < KVIO_BUFFERS; i++) {
+    iovecs[i].iov_base = io->buffers + i * KVIO_BUFFER_SIZE;
+    iovecs[i].iov_len = KVIO_BUFFER_SIZE;
+  }
+  if (io_uring_register(io->ring_fd, IORING_REGISTER_BUFFERS, iovecs,
+      KVIO_BUFFERS) < 0) {
+    munmap(io->buffers, KVIO_BUFFERS * KVIO_BUFFER_SIZE);
+    io->buffers = NULL;
+    return;
+  }
+  for (i = 0; i < KVIO_BUFFERS; i++)
+    io->free_buffers[i] = i;
+  io->num_free = KVIO_BUFFERS;
+}
+
+/* Releases the rings of IO and closes it, leaving IO synchronous. */
+static void unmap_rings(kvio_t *io) {
+  if (io->sqes != NULL)
+    munmap(io->sqes, io->sqes_size);
+  if (io->cq_map != NULL)
+    munmap(io->cq_map, io->cq_map_size);
+  if (io->sq_map != NULL)
+    munmap(io->sq_map, io->sq_map_size);
+  if (io->buffers != NULL)
+    munmap(io->buffers, KVIO_BUFFERS * KVIO_BUFFER_SIZE);
+  io->sqes = io->cq_map = io->sq_map = NULL;
+  io->buffers = NULL;
+  io->num_free = 0;
+  io->files = false;
+  close(io->ring_fd);
+  io->ring_fd = -1;
+}
+
+/* Initializes IO with an io_uring of ENTRIES submission queue entries. If
+ * ENTRIES is 0, or the kernel does not support io_uring, IO performs every
+ * request synchronously instead. Returns 0 if successful, else a negative
+ * error code. */
+int kvio_init(kvio_t *io, unsigned int entries) {
+  struct io_uring_params params;
+  memset(io, 0, sizeof(kvio_t));
+  io->ring_fd = -1;
+  pthread_mutex_init(&io->sq_lock, NULL);
+  pthread_cond_init(&io->sq_space, NULL);
+  pthread_mutex_init(&io->buf_lock, NULL);
+  if (entries == 0)
+    return 0;
+  memset(&params, 0, sizeof(struct io_uring_params));
+  if ((io->ring_fd = io_uring_setup(entries, &params)) < 0) {
+    io->ring_fd = -1;
+    return 0;
+  }
+  if (map_rings(io, &params) < 0) {
+    unmap_rings(io);
+    return 0;
+  }
+  register_resources(io);
+  if (pthread_create(&io->reaper, NULL, reaper, io) != 0) {
+    unmap_rings(io);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+/* Adds FD to the fixed file table of IO, so that requests on it skip the
+ * descriptor lookup. FD must be removed with kvio_unregister before it is
+ * closed. Does nothing if IO has no fixed file table or FD is out of range. */
+void kvio_register(kvio_t *io, int fd) {
+  struct io_uring_files_update update;
+  if (!io->files || fd < 0 || fd >= KVIO_MAX_FILES)
+    return;
+  memset(&update, 0, sizeof(struct io_uring_files_update));
+  update.offset = fd;
+  update.fds = (uintptr_t) &fd;
+  pthread_mutex_lock(&io->sq_lock);
+  if (io_uring_register(io->ring_fd, IORING_REGISTER_FILES_UPDATE, &update,
+      1) == 1)
+    io->registered[fd] = true;
+  pthread_mutex_unlock(&io->sq_lock);
+}
+
+/* Removes FD from the fixed file table of IO, if it is there. Requests
+ * already submitted on FD are unaffected. */
+void kvio_unregister(kvio_t *io, int fd) {
+  struct io_uring_files_update update;
+  int none = -1;
+  if (!io->files || fd < 0 || fd >= KVIO_MAX_FILES)
+    return;
+  memset(&update, 0, sizeof(struct io_uring_files_update));
+  update.offset = fd;
+  update.fds = (uintptr_t) &none;
+  pthread_mutex_lock(&io->sq_lock);
+  if (io->registered[fd]) {
+    io_uring_register(io->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    io->registered[fd] = false;
+  }
+  pthread_mutex_unlock(&io->sq_lock);
+}
+
+/* Returns a buffer of at least SIZE bytes, taken from the registered buffers
+ * of IO if one is free and large enough (with its index placed into INDEX),
+ * else malloc()d (with INDEX set to -1). Returns NULL if out of memory. The
+ * buffer must be released with kvio_free. */
+void *kvio_alloc(kvio_t *io, size_t size, int *index) {
+  *index = -1;
+  if (io->buffers != NULL && size <= KVIO_BUFFER_SIZE) {
+    pthread_mutex_lock(&io->buf_lock);
+    if (io->num_free > 0)
+      *index = io->free_buffers[--io->num_free];
+    pthread_mutex_unlock(&io->buf_lock);
+    if (*index >= 0)
+      return io->buffers + *index * KVIO_BUFFER_SIZE;
+  }
+  return malloc(size);
+}
+
+/* Releases BUF, which was returned by kvio_alloc along with INDEX. */
+void kvio_free(kvio_t *io, void *buf, int index) {
+  if (index < 0) {
+    free(buf);
+    return;
+  }
+  pthread_mutex_lock(&io->buf_lock);
+  io->free_buffers[io->num_free++] = index;
+  pthread_mutex_unlock(&io->buf_lock);
+}
+
+/* Submits REQ to IO. Its callback is invoked from the completion thread once
+ * it has completed, or before this returns if IO is synchronous. Returns 0. */
+int kvio_submit(kvio_t *io, kvio_req_t *req) {
+  if (io->ring_fd < 0)
+    complete(req, perform(req));
+  else
+    enqueue(io, req);
+  return 0;
+}
+
+/* Transfers all LEN bytes between FD at OFFSET and BUF in the direction given
+ * by OP with pread() or pwrite(). A lone request gains nothing from the ring,
+ * whose round trip through the completion thread only adds to its latency.
+ * Returns 0 if successful, else ERRFILACCESS. */
+static int transfer(kvio_op_t op, int fd, void *buf, size_t len,
+    off_t offset) {
+  kvio_req_t req;
+  size_t done = 0;
+  req.op = op;
+  req.fd = fd;
+  while (done < len) {
+    req.buf = (char *) buf + done;
+    req.len = len - done;
+    req.offset = offset + done;
+    req.result = perform(&req);
+    if (req.result == -EINTR || req.result == -EAGAIN)
+      continue;
+    if (req.result <= 0)
+      return ERRFILACCESS;
+    done += req.result;
+  }
+  return 0;
+}
+
+/* Reads exactly LEN bytes at OFFSET within FD into BUF, which has INDEX (see
+ * kvio_alloc). Returns 0 if successful, else ERRFILACCESS (including if the
+ * file ends first). */
+int kvio_read(kvio_t *io, int fd, void *buf, int index, size_t len,
+    off_t offset) {
+  return transfer(KVIO_READ, fd, buf, len, offset);
+}
+
+/* The state of a batch of requests submitted by kvio_read_many. Each batch
+ * has its own lock and condition, so that a completion wakes only the thread
+ * waiting for it. */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  unsigned int pending;
+} batch_t;
+
+/* The callback of requests submitted by kvio_read_many. */
+static void batch_done(kvio_req_t *req) {
+  batch_t *batch = req->arg;
+  pthread_mutex_lock(&batch->lock);
+  if (--batch->pending == 0)
+    pthread_cond_signal(&batch->done);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/* Performs the COUNT reads described by the FD, BUF, INDEX, LEN and OFFSET of
+ * each of REQS, waiting until all of them have completed. The reads are
+ * queued in the order given and submitted together, rather than one
+ * io_uring_enter() apiece. Returns 0 if successful, else ERRFILACCESS
+ * (including if any file ends first). */
+int kvio_read_many(kvio_t *io, kvio_req_t *reqs, unsigned int count) {
+  batch_t batch;
+  unsigned int i;
+  ssize_t got;
+  int ret = 0;
+  batch.pending = count;
+  for (i = 0; i < count; i++) {
+    reqs[i].op = KVIO_READ;
+    reqs[i].callback = batch_done;
+    reqs[i].arg = &batch;
+  }
+  if (io->ring_fd < 0) {
+    for (i = 0; i < count; i++)
+      reqs[i].result = perform(&reqs[i]);
+  } else if (count > 0) {
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    pthread_mutex_lock(&io->sq_lock);
+    for (i = 0; i < count; i++) {
+      /* Submit what has been queued so far before waiting for room, since
+       * the room can only be made by completing it. */
+      while (*io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE)
+          >= io->sq_entries || io->inflight >= io->cq_entries) {
+        submit_queued(io);
+        pthread_cond_wait(&io->sq_space, &io->sq_lock);
+      }
+      queue(io, &reqs[i]);
+    }
+    submit_queued(io);
+    pthread_mutex_unlock(&io->sq_lock);
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+      pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+  }
+  /* Finish any reads which were cut short one at a time. */
+  for (i = 0; i < count && ret == 0; i++) {
+    got = reqs[i].result;
+    if (got == -EINTR || got == -EAGAIN)
+      got = 0;
+    if (got < 0)
+      ret = ERRFILACCESS;
+    else if ((size_t) got < reqs[i].len)
+      ret = transfer(KVIO_READ, reqs[i].fd, (char *) reqs[i].buf + got,
+          reqs[i].len - got, reqs[i].offset + got);
+  }
+  return ret;
+}
+
+/* Writes all LEN bytes of BUF, which has INDEX (see kvio_alloc), at OFFSET
+ * within FD. Returns 0 if successful, else ERRFILACCESS. */
+int kvio_write(kvio_t *io, int fd, const void *buf, int index, size_t len,
+    off_t offset) {
+  return transfer(KVIO_WRITE, fd, (void *) buf, len, offset);
+}
+
+/* Waits for every request submitted to IO to complete, then stops its
+ * completion thread and releases its resources. */
+void kvio_close(kvio_t *io) {
+  if (io->ring_fd >= 0) {
+    enqueue(io, NULL);
+    pthread_join(io->reaper, NULL);
+    unmap_rings(io);
+  }
+  pthread_mutex_destroy(&io->sq_lock);
+  pthread_cond_destroy(&io->sq_space);
+  pthread_mutex_destroy(&io->buf_lock);
+}
@@ -0,0 +1,122 @@
+#ifndef __KV_IO__
+#define __KV_IO__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "kvconstants.h"
+
+/* KVIO performs the file reads and writes of a storage engine through an
+ * io_uring instance, falling back to plain pread()/pwrite() when io_uring is
+ * unavailable (an old kernel, a seccomp filter, or io_uring_disabled).
+ *
+ * A request (a kvio_req_t) is submitted with kvio_submit, which returns as
+ * soon as the request is queued; its CALLBACK is later invoked with the
+ * result from the completion thread. Requests queued by several threads are
+ * batched: whichever thread finds no submission in progress submits every
+ * queued request with a single io_uring_enter(), while the others return
+ * immediately. kvio_read_many queues a whole batch of reads, submits them
+ * together and waits for the batch alone to complete. kvio_read and
+ * kvio_write, which have a single request to wait for, use pread() and
+ * pwrite() directly, since the trip through the ring and the completion
+ * thread would only add to their latency.
+ *
+ * Files used on hot paths can be registered with kvio_register, after which
+ * requests on them use the ring's fixed file table rather than looking up
+ * the descriptor each time. The fixed file table is indexed by descriptor, so
+ * callers keep passing the descriptor itself; a file must be unregistered
+ * before it is closed. Likewise, kvio_alloc hands out buffers from a pool of
+ * KVIO_BUFFERS buffers registered with the ring (which need not be mapped for
+ * every request), falling back to malloc() once the pool is empty.
+ *
+ * In the synchronous fallback, kvio_submit performs the request and invokes
+ * its CALLBACK before returning, so callers need not tell the difference.
+ */
+
+/* The number of submission queue entries of each ring. */
+#define KVIO_ENTRIES 256
+
+/* The size of the fixed file table. Descriptors at least this large are used
+ * without registering them. */
+#define KVIO_MAX_FILES 1024
+
+/* The number of registered buffers, and the size of each. */
+#define KVIO_BUFFERS 32
+#define KVIO_BUFFER_SIZE (64 * 1024)
+
+/* The kinds of request. */
+typedef enum {
+  KVIO_READ,
+  KVIO_WRITE
+} kvio_op_t;
+
+struct kvio_req;
+
+/* Invoked once REQ has completed, with its RESULT set. */
+typedef void (*kvio_cb_t)(struct kvio_req *req);
+
+/* A single read or write. */
+typedef struct kvio_req {
+  kvio_op_t op;                 /* Whether to read or write. */
+  int fd;                       /* The file to read or write. */
+  void *buf;                    /* The buffer to read into or write from. */
+  int index;                    /* The index of BUF if it came from kvio_alloc, else -1. */
+  size_t len;                   /* The number of bytes to transfer. */
+  off_t offset;                 /* The offset within FD at which to start. */
+  ssize_t result;               /* Set to the number of bytes transferred, or -errno. */
+  kvio_cb_t callback;           /* Invoked once the request has completed. */
+  void *arg;                    /* For use by CALLBACK. */
+} kvio_req_t;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* A KVIO. */
+typedef struct {
+  int ring_fd;                  /* The io_uring, or -1 if requests are performed synchronously. */
+  void *sq_map;                 /* The mapping of the submission ring. */
+  size_t sq_map_size;           /* The size of SQ_MAP. */
+  void *cq_map;                 /* The mapping of the completion ring, if separate from SQ_MAP. */
+  size_t cq_map_size;           /* The size of CQ_MAP. */
+  struct io_uring_sqe *sqes;    /* The mapping of the submission queue entries. */
+  size_t sqes_size;             /* The size of SQES. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; /* Within SQ_MAP. */
+  unsigned *cq_head, *cq_tail, *cq_mask;            /* Within CQ_MAP. */
+  struct io_uring_cqe *cqes;    /* Within CQ_MAP. */
+  unsigned sq_entries;          /* The size of the submission queue. */
+  unsigned cq_entries;          /* The size of the completion queue. */
+  unsigned queued;              /* The number of requests queued but not yet submitted. */
+  unsigned inflight;            /* The number of requests queued or submitted but not completed. */
+  bool submitting;              /* true while a thread is submitting queued requests. */
+  pthread_mutex_t sq_lock;      /* Protects the submission ring and the counts above. */
+  pthread_cond_t sq_space;      /* Broadcast whenever room may have been made in the rings. */
+  pthread_t reaper;             /* The completion thread. */
+  bool files;                   /* true if the fixed file table was registered. */
+  bool registered[KVIO_MAX_FILES]; /* Which descriptors are in the fixed file table. */
+  char *buffers;                /* The pool of registered buffers, or NULL. */
+  int free_buffers[KVIO_BUFFERS]; /* The indices of the buffers which are not in use. */
+  int num_free;                 /* The number of entries in FREE_BUFFERS. */
+  pthread_mutex_t buf_lock;     /* Protects FREE_BUFFERS and NUM_FREE. */
+} kvio_t;
+
+int kvio_init(kvio_t *, unsigned int entries);
+
+void kvio_register(kvio_t *, int fd);
+void kvio_unregister(kvio_t *, int fd);
+
+void *kvio_alloc(kvio_t *, size_t size, int *index);
+void kvio_free(kvio_t *, void *buf, int index);
+
+int kvio_submit(kvio_t *, kvio_req_t *req);
+
+int kvio_read(kvio_t *, int fd, void *buf, int index, size_t len,
+    off_t offset);
+int kvio_write(kvio_t *, int fd, const void *buf, int index, size_t len,
+    off_t offset);
+int kvio_read_many(kvio_t *, kvio_req_t *reqs, unsigned int count);
+
+void kvio_close(kvio_t *);
+
+#endif
@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include "kvkey.h"
+
+/* Describes the key STR in KEY (see kvkey.h). */
+void kvkey_init(kvkey_t *key, char *str) {
+  unsigned long djb2 = 5381;
+  uint64_t fnv = 0xcbf29ce484222325ULL;
+  uint64_t ring = 1125899906842597ULL;
+  unsigned char *p;
+  key->str = str;
+  for (p = (unsigned char *) str; *p != '\0'; p++) {
+    djb2 = ((djb2 << 5) + djb2) + (char) *p; /* hash * 33 + c */
+    fnv = (fnv ^ *p) * 0x100000001b3ULL;
+    ring = (31 * ring) + (int64_t) (char) *p;
+  }
+  /* Finish FNV-1a with a mix, so that the high and low halves of the Bloom
+   * hash are both usable. */
+  fnv ^= fnv >> 33;
+  fnv *= 0xff51afd7ed558ccdULL;
+  fnv ^= fnv >> 33;
+  fnv *= 0xc4ceb9fe1a85ec53ULL;
+  fnv ^= fnv >> 33;
+  key->len = (char *) p - str;
+  key->hash = djb2;
+  key->bloom_hash = fnv;
+  /* Computed unsigned, which wraps exactly as hash_64_bit() does in practice
+   * without overflowing. */
+  key->ring_hash = (int64_t) ring;
+}
+
+/* Returns an array describing each of the COUNT keys STRS, using malloc()d
+ * memory which should be free()d later, or NULL if memory runs out. */
+kvkey_t *kvkey_array(char **strs, unsigned int count) {
+  kvkey_t *keys = malloc((count > 0 ? count : 1) * sizeof(kvkey_t));
+  unsigned int i;
+  if (keys == NULL)
+    return NULL;
+  for (i = 0; i < count; i++)
+    kvkey_init(&keys[i], strs[i]);
+  return keys;
+}
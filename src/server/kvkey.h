@@ -0,0 +1,37 @@
+#ifndef __KV_KEY__
+#define __KV_KEY__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVKey describes a key once, as a request is parsed, so that the layers the
+ * request then passes through need not each walk the key again.
+ *
+ * kvkey_init takes a single pass over the key to find its length and every
+ * hash which any layer needs:
+ *    HASH        hash() (djb2, see kvstore.h), which picks the key's set
+ *                within a KVCache and its hash chain within the "file"
+ *                engine.
+ *    BLOOM_HASH  The hash which places the key within a Bloom filter (see
+ *                kvbloom.h).
+ *    RING_HASH   hash_64_bit(), which places the key on a TPCMaster's ring
+ *                of slaves.
+ * Each is computed exactly as its own function would, so filters and file
+ * names saved by older builds stay valid.
+ *
+ * A kvkey_t does not own STR; it is only valid for as long as STR is.
+ */
+
+/* A key, and what is derived from it. */
+typedef struct {
+  char *str;                    /* The key itself, null terminated. */
+  size_t len;                   /* The length of STR. */
+  unsigned long hash;           /* hash(STR). */
+  uint64_t bloom_hash;          /* The Bloom filter hash of STR. */
+  int64_t ring_hash;            /* hash_64_bit(STR). */
+} kvkey_t;
+
+void kvkey_init(kvkey_t *, char *str);
+kvkey_t *kvkey_array(char **strs, unsigned int count);
+
+#endif
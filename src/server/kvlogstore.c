@@ -0,0 +1,1112 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utlist.h"
+#include "kvcrc32c.h"
+#include "kvlogstore.h"
+
+/* The size on disk of a record with the given KEYLEN and VALLEN. */
+#define RECORD_SIZE(keylen, vallen) \
+  (sizeof(kvlogrecord_t) + (keylen) + 1 + ((vallen) < 0 ? 0 : (vallen) + 1))
+
+static void *merger(void *);
+
+/* Places the filename of the segment with id SEGID of STORE into FILENAME.
+ * Returns 0 if successful, else ERRFILACCESS if it does not fit. */
+static int segment_filename(kvlogstore_t *store, unsigned int segid,
+    char *filename) {
+  return kvstore_path(filename, "%s/%u%s", store->dirname, segid,
+      KVLOGSTORE_FILETYPE);
+}
+
+/* Opens, creating it if necessary, the segment with id SEGID and adds it to
+ * the list of segments of STORE, in id order. Returns the segment, or NULL if
+ * it could not be opened. */
+static kvlogsegment_t *segment_open(kvlogstore_t *store, unsigned int segid) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+  kvlogsegment_t *next, *segment;
+  if (segment_filename(store, segid, filename) != 0 ||
+      (segment = calloc(1, sizeof(kvlogsegment_t))) == NULL)
+    return NULL;
+  segment->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (segment->fd < 0 || fstat(segment->fd, &st) < 0) {
+    if (segment->fd >= 0)
+      close(segment->fd);
+    free(segment);
+    return NULL;
+  }
+  segment->id = segid;
+  segment->size = st.st_size;
+  kvio_register(&store->io, segment->fd);
+  DL_FOREACH(store->segments, next) {
+    if (next->id > segid)
+      break;
+  }
+  if (next != NULL)
+    DL_PREPEND_ELEM(store->segments, next, segment);
+  else
+    DL_APPEND(store->segments, segment);
+  return segment;
+}
+
+/* Closes SEGMENT, removes it from STORE and deletes its file. */
+static void segment_remove(kvlogstore_t *store, kvlogsegment_t *segment) {
+  char filename[MAX_FILENAME];
+  kvio_unregister(&store->io, segment->fd);
+  close(segment->fd);
+  if (segment_filename(store, segment->id, filename) == 0)
+    remove(filename);
+  store->dead -= segment->dead;
+  DL_DELETE(store->segments, segment);
+  free(segment);
+}
+
+/* Returns the checksum of RECORD, of SIZE bytes. */
+static uint32_t record_checksum(kvlogrecord_t *record, size_t size) {
+  uint32_t crc = kvcrc32c(0, (char *) record, offsetof(kvlogrecord_t,
+      checksum));
+  return kvcrc32c(crc, record->data, size - sizeof(kvlogrecord_t));
+}
+
+/* Checks the checksum of the whole record of SIZE bytes in BUF, whose key is
+ * KEYLEN bytes long, and then moves its value, null terminated, to the start
+ * of BUF. Returns 0 if successful, else ERRCHECKSUM. */
+static int record_unwrap(char *buf, size_t size, size_t keylen) {
+  kvlogrecord_t *record = (kvlogrecord_t *) buf;
+  size_t vallen = size - sizeof(kvlogrecord_t) - keylen - 2;
+  if (record->checksum != record_checksum(record, size))
+    return ERRCHECKSUM;
+  memmove(buf, record->data + keylen + 1, vallen);
+  buf[vallen] = '\0';
+  return 0;
+}
+
+/* Records in the keydir of STORE that the most recent record for KEY is the
+ * SIZE byte record at OFFSET within SEGMENT, with a value of length VALLEN
+ * which is a reference to a blob if REF is set. The record it supersedes, if
+ * any, becomes dead space. */
+static int keydir_apply(kvlogstore_t *store, char *key,
+    kvlogsegment_t *segment, off_t offset, int32_t vallen, bool ref,
+    size_t size) {
+  kvlogkeydir_t *entry;
+  size_t keylen = strlen(key);
+  HASH_FIND(hh, store->keydir, key, keylen, entry);
+  if (entry != NULL) {
+    size_t oldsize = RECORD_SIZE(keylen, entry->vallen);
+    entry->segment->dead += oldsize;
+    store->live -= oldsize;
+    store->dead += oldsize;
+  }
+  if (vallen == KVLOGSTORE_TOMBSTONE) {
+    /* The tombstone itself is never needed once it has been applied. */
+    segment->dead += size;
+    store->dead += size;
+    if (entry != NULL) {
+      HASH_DELETE(hh, store->keydir, entry);
+      free(entry->key);
+      free(entry);
+    }
+    return 0;
+  }
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(kvlogkeydir_t));
+    if (entry == NULL)
+      return ENOMEM;
+    entry->key = malloc(keylen + 1);
+    if (entry->key == NULL) {
+      free(entry);
+      return ENOMEM;
+    }
+    strcpy(entry->key, key);
+    HASH_ADD_KEYPTR(hh, store->keydir, entry->key, keylen, entry);
+  }
+  entry->segment = segment;
+  entry->offset = offset;
+  entry->vallen = vallen;
+  entry->ref = ref;
+  store->live += size;
+  return 0;
+}
+
+/* Replays every record within SEGMENT from offset START onwards into the
+ * keydir of STORE. A record which is truncated, malformed or fails its
+ * checksum (as left behind by a crash in the middle of an append) ends the
+ * segment, and the segment is truncated to drop it. */
+static int segment_replay(kvlogstore_t *store, kvlogsegment_t *segment,
+    off_t start) {
+  char filename[MAX_FILENAME];
+  char buf[sizeof(kvlogrecord_t) + MAX_KEYLEN + MAX_VALLEN + 2]
+      __attribute__((aligned(8)));
+  kvlogrecord_t *record = (kvlogrecord_t *) buf;
+  off_t offset = start;
+  int32_t keylen;
+  size_t size;
+  FILE *file;
+  bool ref;
+  int ret = 0;
+  if (segment_filename(store, segment->id, filename) != 0 ||
+      (file = fopen(filename, "r")) == NULL)
+    return ERRFILACCESS;
+  if (fseek(file, start, SEEK_SET) < 0) {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  while (fread(record, sizeof(kvlogrecord_t), 1, file) == 1) {
+    ref = (record->keylen & KVLOGSTORE_REF) != 0;
+    keylen = record->keylen & ~KVLOGSTORE_REF;
+    if (keylen < 0 || keylen > MAX_KEYLEN ||
+        record->vallen < KVLOGSTORE_TOMBSTONE || record->vallen > MAX_VALLEN)
+      break;
+    size = RECORD_SIZE(keylen, record->vallen);
+    if (offset + size > segment->size)
+      break;
+    if (fread(record->data, size - sizeof(kvlogrecord_t), 1, file) != 1 ||
+        record->data[keylen] != '\0' || (record->vallen >= 0 &&
+        record->data[size - sizeof(kvlogrecord_t) - 1] != '\0') ||
+        record->checksum != record_checksum(record, size))
+      break;
+    if ((ret = keydir_apply(store, record->data, segment, offset,
+        record->vallen, ref, size)) != 0)
+      break;
+    offset += size;
+  }
+  fclose(file);
+  if (ret == 0 && offset < segment->size) {
+    if (ftruncate(segment->fd, offset) < 0)
+      return ERRFILACCESS;
+    segment->size = offset;
+  }
+  return ret;
+}
+
+/* Removes every entry from the keydir of STORE. */
+static void keydir_free(kvlogstore_t *store) {
+  kvlogkeydir_t *entry, *tmpentry;
+  HASH_ITER(hh, store->keydir, entry, tmpentry) {
+    HASH_DELETE(hh, store->keydir, entry);
+    free(entry->key);
+    free(entry);
+  }
+  store->live = 0;
+}
+
+/* Writes SIZE bytes of DATA to FILE, adding them to the checksum CRC.
+ * Returns 0 if successful, else -1. */
+static int index_write(FILE *file, const void *data, size_t size,
+    uint32_t *crc) {
+  *crc = kvcrc32c(*crc, data, size);
+  return (fwrite(data, size, 1, file) == 1) ? 0 : -1;
+}
+
+/* Writes a snapshot of the keydir of STORE to KVLOGSTORE_INDEX, replacing any
+ * previous one. The snapshot covers every record within COVER and the
+ * segments before it, which must all be durable, and must not mention any
+ * record after them. Must be called with the write lock held. Returns 0 if
+ * successful, else a negative error code. */
+static int index_save(kvlogstore_t *store, kvlogsegment_t *cover) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  kvlogindex_header_t header;
+  kvlogindex_segment_t seg;
+  kvlogindex_entry_t rec;
+  kvlogsegment_t *segment;
+  kvlogkeydir_t *entry, *tmpentry;
+  uint32_t crc = 0;
+  size_t keylen;
+  FILE *file;
+  if (kvstore_path(filename, "%s/%s", store->dirname, KVLOGSTORE_INDEX) != 0 ||
+      kvstore_path(tmpname, "%s.tmp", filename) != 0 ||
+      (file = fopen(tmpname, "w")) == NULL)
+    return ERRFILCRT;
+  memset(&header, 0, sizeof(kvlogindex_header_t));
+  header.magic = KVLOGSTORE_INDEX_MAGIC;
+  header.count = HASH_COUNT(store->keydir);
+  DL_FOREACH(store->segments, segment) {
+    if (segment->id <= cover->id)
+      header.num_segments++;
+  }
+  /* The header is written again once the checksum is known. */
+  if (fwrite(&header, sizeof(kvlogindex_header_t), 1, file) != 1)
+    goto error;
+  crc = kvcrc32c(crc, (char *) &header + 2 * sizeof(uint32_t),
+      sizeof(kvlogindex_header_t) - 2 * sizeof(uint32_t));
+  DL_FOREACH(store->segments, segment) {
+    if (segment->id > cover->id)
+      continue;
+    memset(&seg, 0, sizeof(kvlogindex_segment_t));
+    seg.id = segment->id;
+    seg.size = segment->size;
+    seg.dead = segment->dead;
+    if (index_write(file, &seg, sizeof(kvlogindex_segment_t), &crc) < 0)
+      goto error;
+  }
+  HASH_ITER(hh, store->keydir, entry, tmpentry) {
+    memset(&rec, 0, sizeof(kvlogindex_entry_t));
+    rec.segid = entry->segment->id;
+    keylen = strlen(entry->key);
+    rec.keylen = keylen | (entry->ref ? KVLOGSTORE_REF : 0);
+    rec.vallen = entry->vallen;
+    rec.offset = entry->offset;
+    if (index_write(file, &rec, sizeof(kvlogindex_entry_t), &crc) < 0 ||
+        index_write(file, entry->key, keylen, &crc) < 0)
+      goto error;
+  }
+  header.checksum = crc;
+  if (fseek(file, 0, SEEK_SET) < 0 ||
+      fwrite(&header, sizeof(kvlogindex_header_t), 1, file) != 1 ||
+      fflush(file) != 0 || fsync(fileno(file)) < 0)
+    goto error;
+  fclose(file);
+  if (rename(tmpname, filename) < 0) {
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  store->unindexed = 0;
+  return 0;
+
+error:
+  fclose(file);
+  remove(tmpname);
+  return ERRFILACCESS;
+}
+
+/* Syncs COVER, then snapshots the keydir of STORE up to the end of it (see
+ * index_save). A failure only costs replay time on the next initialization,
+ * so it is not reported. Must be called with the write lock held. */
+static void checkpoint(kvlogstore_t *store, kvlogsegment_t *cover) {
+  if (fdatasync(cover->fd) == 0)
+    index_save(store, cover);
+}
+
+/* Returns the segment of STORE with id SEGID, or NULL. */
+static kvlogsegment_t *segment_find(kvlogstore_t *store, unsigned int segid) {
+  kvlogsegment_t *segment;
+  DL_FOREACH(store->segments, segment) {
+    if (segment->id == segid)
+      return segment;
+  }
+  return NULL;
+}
+
+/* Checks the entry REC of a snapshot against the segments it covers, which
+ * are listed in COVERED by id from FIRST to LAST. Returns the segment which
+ * holds it, or NULL if it does not fit within them. */
+static kvlogsegment_t *index_segment(kvlogsegment_t **covered,
+    unsigned int first, unsigned int last, kvlogindex_entry_t *rec) {
+  kvlogsegment_t *segment;
+  if (rec->keylen < 0 || rec->keylen > MAX_KEYLEN || rec->vallen < 0 ||
+      rec->vallen > MAX_VALLEN || rec->segid < first || rec->segid > last ||
+      (segment = covered[rec->segid - first]) == NULL || rec->offset < 0 ||
+      rec->offset + RECORD_SIZE(rec->keylen, rec->vallen) >
+      segment->size)
+    return NULL;
+  return segment;
+}
+
+/* Fills the keydir of STORE from the snapshot in MAP, of SIZE bytes, whose
+ * checksum has been verified. Places the last segment covered by the
+ * snapshot into COVER and the size of it covered into OFFSET. Returns 0 if
+ * successful, else a negative error code (ERRFILACCESS if the snapshot does
+ * not describe the segments now on disk). */
+static int index_apply(kvlogstore_t *store, char *map, size_t size,
+    kvlogsegment_t **cover, off_t *offset) {
+  kvlogindex_header_t header;
+  kvlogindex_segment_t seg;
+  kvlogindex_entry_t rec;
+  kvlogsegment_t *segment, **covered;
+  char key[MAX_KEYLEN + 1];
+  size_t pos = sizeof(kvlogindex_header_t);
+  unsigned int first = store->segments->id, num_covered = 0;
+  uint64_t i;
+  bool ref;
+  int ret = ERRFILACCESS;
+  memcpy(&header, map, sizeof(kvlogindex_header_t));
+  if (header.num_segments == 0 || header.num_segments >
+      (size - pos) / sizeof(kvlogindex_segment_t))
+    return ERRFILACCESS;
+  /* Every segment covered must be unchanged since the snapshot, except that
+   * the last may have grown; merges remove segments, which invalidates it. */
+  for (i = 0; i < header.num_segments; i++) {
+    memcpy(&seg, map + pos, sizeof(kvlogindex_segment_t));
+    pos += sizeof(kvlogindex_segment_t);
+    segment = segment_find(store, seg.id);
+    if (segment == NULL || segment->size < seg.size ||
+        (i + 1 < header.num_segments && segment->size != seg.size))
+      return ERRFILACCESS;
+    segment->dead = seg.dead;
+    store->dead += seg.dead;
+    *cover = segment;
+    *offset = seg.size;
+  }
+  if ((covered = calloc((*cover)->id - first + 1, sizeof(kvlogsegment_t *)))
+      == NULL)
+    return ENOMEM;
+  DL_FOREACH(store->segments, segment) {
+    if (segment->id <= (*cover)->id) {
+      covered[segment->id - first] = segment;
+      num_covered++;
+    }
+  }
+  if (num_covered != header.num_segments)
+    goto done;
+  for (i = 0; i < header.count; i++) {
+    if (pos + sizeof(kvlogindex_entry_t) > size)
+      goto done;
+    memcpy(&rec, map + pos, sizeof(kvlogindex_entry_t));
+    pos += sizeof(kvlogindex_entry_t);
+    ref = (rec.keylen & KVLOGSTORE_REF) != 0;
+    rec.keylen &= ~KVLOGSTORE_REF;
+    if ((segment = index_segment(covered, first, (*cover)->id, &rec)) == NULL
+        || pos + rec.keylen > size)
+      goto done;
+    memcpy(key, map + pos, rec.keylen);
+    key[rec.keylen] = '\0';
+    pos += rec.keylen;
+    if ((ret = keydir_apply(store, key, segment, rec.offset, rec.vallen,
+        ref, RECORD_SIZE(rec.keylen, rec.vallen))) != 0)
+      goto done;
+    ret = ERRFILACCESS;
+  }
+  ret = (pos == size) ? 0 : ERRFILACCESS;
+
+done:
+  free(covered);
+  return ret;
+}
+
+/* Fills the keydir of STORE, whose segments have been opened but not
+ * replayed, from the snapshot written by index_save, if there is a valid
+ * one. Places the last segment covered by the snapshot into COVER and the
+ * size of it covered into OFFSET; only the records after that need to be
+ * replayed. Returns 0 if successful, else a negative error code, in which
+ * case the keydir is left empty. */
+static int index_load(kvlogstore_t *store, kvlogsegment_t **cover,
+    off_t *offset) {
+  char filename[MAX_FILENAME];
+  kvlogindex_header_t header;
+  kvlogsegment_t *segment;
+  struct stat st;
+  char *map;
+  int fd, ret = ERRFILACCESS;
+  if (kvstore_path(filename, "%s/%s", store->dirname, KVLOGSTORE_INDEX) != 0)
+    return ERRFILACCESS;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return ERRNOKEY;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(kvlogindex_header_t)) {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return ERRFILACCESS;
+  memcpy(&header, map, sizeof(kvlogindex_header_t));
+  if (header.magic == KVLOGSTORE_INDEX_MAGIC && header.checksum ==
+      kvcrc32c(0, map + 2 * sizeof(uint32_t),
+      st.st_size - 2 * sizeof(uint32_t)))
+    ret = index_apply(store, map, st.st_size, cover, offset);
+  munmap(map, st.st_size);
+  if (ret != 0) {
+    keydir_free(store);
+    DL_FOREACH(store->segments, segment)
+      segment->dead = 0;
+    store->dead = 0;
+  }
+  return ret;
+}
+
+/* Comparator used to sort segment ids in ascending order. */
+static int segid_cmp(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/* Initializes kvlogstore STORE. Uses DIRNAME as the directory in which to
+ * store segments, which must already exist. Any segments already present in
+ * DIRNAME are replayed to rebuild the keydir. Appends are made durable
+ * according to SYNC_MODE, and the checksum of every record read is verified
+ * if VERIFY is set. Returns 0 if successful, else a negative error code. */
+int kvlogstore_init(kvlogstore_t *store, char *dirname,
+    kvsync_mode_t sync_mode, bool verify) {
+  struct dirent *dent;
+  unsigned int *segids = NULL, *tmp, segid;
+  kvlogsegment_t *segment, *cover = NULL;
+  size_t count = 0, capacity = 0, i;
+  char suffix[MAX_FILENAME], filename[MAX_FILENAME];
+  off_t offset = 0;
+  DIR *dir;
+  int ret = 0;
+  strcpy(store->dirname, dirname);
+  store->segments = NULL;
+  store->keydir = NULL;
+  store->live = 0;
+  store->dead = 0;
+  store->unindexed = 0;
+  store->verify = verify;
+  store->sync.mode = KVSYNC_NONE;
+  store->merge_wanted = false;
+  store->merging = false;
+  store->stopping = false;
+  store->merge_thread = 0;
+  pthread_rwlock_init(&store->lock, NULL);
+  pthread_mutex_init(&store->merge_lock, NULL);
+  pthread_cond_init(&store->merge_cond, NULL);
+  if ((ret = kvio_init(&store->io, KVIO_ENTRIES)) != 0)
+    return ret;
+  /* A copy left behind by a merge which did not finish is incomplete. */
+  if (kvstore_path(filename, "%s/%s", dirname, KVLOGSTORE_MERGE_TMP) != 0)
+    return ERRFILACCESS;
+  remove(filename);
+
+  if ((dir = opendir(dirname)) == NULL)
+    return ERRFILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%u%s", &segid, suffix) != 2 ||
+        strcmp(suffix, KVLOGSTORE_FILETYPE) != 0)
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      tmp = realloc(segids, capacity * sizeof(unsigned int));
+      if (tmp == NULL) {
+        free(segids);
+        closedir(dir);
+        return ENOMEM;
+      }
+      segids = tmp;
+    }
+    segids[count++] = segid;
+  }
+  closedir(dir);
+
+  if (count > 1)
+    qsort(segids, count, sizeof(unsigned int), segid_cmp);
+  for (i = 0; i < count && ret == 0; i++) {
+    if (segment_open(store, segids[i]) == NULL)
+      ret = ERRFILACCESS;
+  }
+  free(segids);
+  /* Replay only what the snapshot does not cover, if there is one. */
+  if (ret == 0 && store->segments != NULL &&
+      index_load(store, &cover, &offset) == 0)
+    segment = cover;
+  else
+    segment = store->segments;
+  for (; segment != NULL && ret == 0; segment = segment->next)
+    ret = segment_replay(store, segment, (segment == cover) ? offset : 0);
+  if (ret == 0 && store->segments == NULL)
+    ret = (segment_open(store, 0) == NULL) ? ERRFILACCESS : 0;
+  if (ret == 0)
+    ret = kvsync_init(&store->sync, sync_mode, store->segments->prev->fd,
+        false);
+  if (ret == 0)
+    ret = pthread_create(&store->merge_thread, NULL, merger, store);
+  return ret;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE.
+ * Returns 0 if successful, ERRBLOB if its value is a reference to a blob,
+ * ERRCHECKSUM if its record is corrupt, else a negative error code. If VALUE
+ * is not NULL, the entry's value will be placed into VALUE using malloc()d
+ * memory which should be free()d later. */
+int kvlogstore_get(kvlogstore_t *store, kvkey_t *key, char **value) {
+  kvlogkeydir_t *entry;
+  int32_t vallen;
+  off_t offset;
+  size_t size;
+  char *buf;
+  bool ref;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND(hh, store->keydir, key->str, key->len, entry);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRNOKEY;
+  }
+  ref = entry->ref;
+  if (value == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ref ? ERRBLOB : 0;
+  }
+  /* The whole record is read if its checksum is to be verified. */
+  vallen = entry->vallen;
+  size = store->verify ? RECORD_SIZE(key->len, vallen) : vallen + 1;
+  offset = entry->offset;
+  if (!store->verify)
+    offset += sizeof(kvlogrecord_t) + key->len + 1;
+  if ((buf = malloc(size)) == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ENOMEM;
+  }
+  if (kvio_read(&store->io, entry->segment->fd, buf, -1, size, offset) != 0) {
+    pthread_rwlock_unlock(&store->lock);
+    free(buf);
+    return ERRFILACCESS;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  if (store->verify && record_unwrap(buf, size, key->len) != 0) {
+    free(buf);
+    return ERRCHECKSUM;
+  }
+  buf[vallen] = '\0';
+  *value = buf;
+  return ref ? ERRBLOB : 0;
+}
+
+/* A read of a value by kvlogstore_mget. */
+typedef struct {
+  unsigned int segid;           /* The id of the segment holding the value. */
+  unsigned int pos;             /* The position of its key within the batch. */
+  kvio_req_t req;               /* The read itself. */
+} mget_read_t;
+
+/* Compares two mget_read_t by where their values are stored, for qsort. */
+static int mget_read_cmp(const void *a, const void *b) {
+  const mget_read_t *x = a, *y = b;
+  if (x->segid != y->segid)
+    return (x->segid < y->segid) ? -1 : 1;
+  return (x->req.offset < y->req.offset) ? -1 : (x->req.offset > y->req.offset);
+}
+
+/* Attempts to retrieve the COUNT entries denoted by KEYS from STORE, placing
+ * the value of each into the corresponding entry of VALUES using malloc()d
+ * memory (or NULL if the key is absent, or its value is a reference to a
+ * blob). Every value is read with a single
+ * batch of reads, issued in segment and offset order, along with the rest of
+ * its record if checksums are verified. Returns 0 if successful, else a
+ * negative error code (or ENOMEM), such as ERRCHECKSUM if any record is
+ * corrupt, in which case every entry of VALUES is NULL. */
+int kvlogstore_mget(kvlogstore_t *store, kvkey_t *keys, unsigned int count,
+    char **values) {
+  kvlogkeydir_t *entry;
+  mget_read_t *reads;
+  kvio_req_t *reqs;
+  unsigned int num_reads = 0, i;
+  size_t size;
+  int ret = 0;
+  reads = malloc(count * sizeof(mget_read_t));
+  reqs = malloc(count * sizeof(kvio_req_t));
+  if (reads == NULL || reqs == NULL) {
+    free(reads);
+    free(reqs);
+    return ENOMEM;
+  }
+  for (i = 0; i < count; i++)
+    values[i] = NULL;
+  pthread_rwlock_rdlock(&store->lock);
+  for (i = 0; i < count; i++) {
+    HASH_FIND(hh, store->keydir, keys[i].str, keys[i].len, entry);
+    if (entry == NULL || entry->ref)
+      continue;
+    size = store->verify ? RECORD_SIZE(keys[i].len, entry->vallen) :
+        entry->vallen + 1;
+    if ((values[i] = malloc(size)) == NULL) {
+      ret = ENOMEM;
+      goto out;
+    }
+    reads[num_reads].segid = entry->segment->id;
+    reads[num_reads].pos = i;
+    reads[num_reads].req.fd = entry->segment->fd;
+    reads[num_reads].req.buf = values[i];
+    reads[num_reads].req.index = -1;
+    reads[num_reads].req.len = size;
+    reads[num_reads].req.offset = entry->offset;
+    if (!store->verify)
+      reads[num_reads].req.offset += sizeof(kvlogrecord_t) + keys[i].len + 1;
+    num_reads++;
+  }
+  qsort(reads, num_reads, sizeof(mget_read_t), mget_read_cmp);
+  for (i = 0; i < num_reads; i++)
+    reqs[i] = reads[i].req;
+  ret = kvio_read_many(&store->io, reqs, num_reads);
+out:
+  pthread_rwlock_unlock(&store->lock);
+  for (i = 0; i < num_reads && ret == 0; i++) {
+    if (store->verify)
+      ret = record_unwrap(values[reads[i].pos], reqs[i].len,
+          keys[reads[i].pos].len);
+    else
+      values[reads[i].pos][reqs[i].len - 1] = '\0';
+  }
+  if (ret != 0) {
+    for (i = 0; i < count; i++) {
+      free(values[i]);
+      values[i] = NULL;
+    }
+  }
+  free(reads);
+  free(reqs);
+  return ret;
+}
+
+/* Finds where the value of the entry denoted by KEY is stored within STORE,
+ * placing a duplicate of its segment's file descriptor (which stays valid
+ * even if the segment is merged away) into LOC. A value sent from its
+ * segment is never verified, so if STORE verifies checksums this returns
+ * ERRNOTIMPL instead, and the value must be read with kvlogstore_get.
+ * Returns 0 if successful, ERRBLOB if the value is a reference to a blob,
+ * else a negative error code. */
+int kvlogstore_locate(kvlogstore_t *store, kvkey_t *key, kvstore_loc_t *loc) {
+  kvlogkeydir_t *entry;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND(hh, store->keydir, key->str, key->len, entry);
+  if (entry == NULL || entry->ref || store->verify) {
+    pthread_rwlock_unlock(&store->lock);
+    return (entry == NULL) ? ERRNOKEY : entry->ref ? ERRBLOB : ERRNOTIMPL;
+  }
+  if ((loc->fd = dup(entry->segment->fd)) < 0) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRFILACCESS;
+  }
+  loc->offset = entry->offset + sizeof(kvlogrecord_t) + key->len + 1;
+  loc->length = entry->vallen;
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+/* Returns true if STORE contains KEY, else false. */
+bool kvlogstore_haskey(kvlogstore_t *store, kvkey_t *key) {
+  int ret = kvlogstore_get(store, key, NULL);
+  return ret == 0 || ret == ERRBLOB;
+}
+
+/* Builds a record for KEY and VALUE (a tombstone if VALUE is NULL), which is
+ * a reference to a blob if REF is set, in a buffer from kvio_alloc, storing
+ * its size into SIZE and the index of the buffer into INDEX. */
+static kvlogrecord_t *record_new(kvlogstore_t *store, kvkey_t *key,
+    char *value, bool ref, size_t *size, int *index) {
+  size_t keylen = key->len;
+  int32_t vallen = (value == NULL) ? KVLOGSTORE_TOMBSTONE : strlen(value);
+  kvlogrecord_t *record;
+  *size = RECORD_SIZE(keylen, vallen);
+  if ((record = kvio_alloc(&store->io, *size, index)) == NULL)
+    return NULL;
+  record->keylen = keylen | (ref ? KVLOGSTORE_REF : 0);
+  record->vallen = vallen;
+  memcpy(record->data, key->str, keylen + 1);
+  if (value != NULL)
+    strcpy(record->data + keylen + 1, value);
+  record->checksum = record_checksum(record, *size);
+  return record;
+}
+
+/* Makes the active segment of STORE immutable, starting a new one, whose id
+ * leaves room for a merge below it (see kvlogstore.h). Must be called with
+ * the write lock held. Returns 0 if successful, else a negative error
+ * code. */
+static int seal(kvlogstore_t *store) {
+  kvlogsegment_t *active;
+  if ((active = segment_open(store, store->segments->prev->id + 2)) == NULL)
+    return ERRFILACCESS;
+  return kvsync_switch(&store->sync, active->fd);
+}
+
+/* Asks the merge thread of STORE to merge it. */
+static void merge_request(kvlogstore_t *store) {
+  pthread_mutex_lock(&store->merge_lock);
+  store->merge_wanted = true;
+  pthread_cond_broadcast(&store->merge_cond);
+  pthread_mutex_unlock(&store->merge_lock);
+}
+
+/* Appends RECORD, of SIZE bytes and with buffer INDEX (see kvio_alloc), to
+ * the active segment of STORE and applies it to the keydir, sealing the
+ * active segment first if RECORD would not fit. If sealing leaves the store
+ * mostly dead, asks for it to be merged. Places the ticket to wait on for
+ * the record to be durable (see kvsync_wait) into TICKET. Must be called
+ * with the write lock held. */
+static int append_record(kvlogstore_t *store, kvlogrecord_t *record,
+    size_t size, int index, uint64_t *ticket) {
+  kvlogsegment_t *active = store->segments->prev;
+  int ret;
+  if (active->size > 0 && active->size + size > KVLOGSTORE_SEGMENT_SIZE) {
+    if ((ret = seal(store)) != 0)
+      return ret;
+    active = store->segments->prev;
+    if (store->unindexed >= KVLOGSTORE_CHECKPOINT_SIZE)
+      checkpoint(store, active->prev);
+    if (store->dead > store->live && store->dead > KVLOGSTORE_SEGMENT_SIZE)
+      merge_request(store);
+  }
+  if (kvio_write(&store->io, active->fd, record, index, size, active->size)
+      != 0) {
+    /* Drop any partially written record so the segment stays replayable. */
+    ftruncate(active->fd, active->size);
+    return ERRFILACCESS;
+  }
+  active->size += size;
+  store->unindexed += size;
+  *ticket = kvsync_append(&store->sync, size);
+  return keydir_apply(store, record->data, active, active->size - size,
+      record->vallen, (record->keylen & KVLOGSTORE_REF) != 0, size);
+}
+
+/* Adds the given KEY, VALUE entry to STORE, where VALUE is a reference to a
+ * blob if REF is set. Returns 0 if successful, else a negative error code. */
+int kvlogstore_put(kvlogstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  kvlogrecord_t *record;
+  uint64_t ticket;
+  size_t size;
+  int index, ret;
+  if ((record = record_new(store, key, value, ref, &size, &index)) == NULL)
+    return ENOMEM;
+  pthread_rwlock_wrlock(&store->lock);
+  ret = append_record(store, record, size, index, &ticket);
+  pthread_rwlock_unlock(&store->lock);
+  kvio_free(&store->io, record, index);
+  if (ret == 0)
+    ret = kvsync_wait(&store->sync, ticket);
+  return ret;
+}
+
+/* Removes the given KEY entry from STORE by appending a tombstone. Returns 0
+ * if successful, else a negative error code. */
+int kvlogstore_del(kvlogstore_t *store, kvkey_t *key) {
+  kvlogrecord_t *record;
+  kvlogkeydir_t *entry;
+  uint64_t ticket;
+  size_t size;
+  int index, ret;
+  if ((record = record_new(store, key, NULL, false, &size, &index)) == NULL)
+    return ENOMEM;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND(hh, store->keydir, key->str, key->len, entry);
+  ret = (entry == NULL) ? ERRNOKEY :
+      append_record(store, record, size, index, &ticket);
+  pthread_rwlock_unlock(&store->lock);
+  kvio_free(&store->io, record, index);
+  if (ret == 0)
+    ret = kvsync_wait(&store->sync, ticket);
+  return ret;
+}
+
+/* A live record to be copied by a merge. */
+typedef struct {
+  char *key;                    /* The key of the record. */
+  kvlogsegment_t *segment;      /* The segment holding the record. */
+  off_t offset;                 /* The offset of the record within SEGMENT. */
+  off_t copy;                   /* The offset of its copy. */
+  size_t size;                  /* The size of the record. */
+} merge_entry_t;
+
+/* Lists into ENTRIES, using malloc()d memory, the COUNT live records of
+ * STORE held by segments with ids below FIRST_KEPT. Must be called with the
+ * write lock held. Returns 0 if successful, else ENOMEM. */
+static int merge_list(kvlogstore_t *store, unsigned int first_kept,
+    merge_entry_t **entries, size_t *count) {
+  kvlogkeydir_t *entry, *tmpentry;
+  merge_entry_t *list;
+  size_t n = 0;
+  list = malloc((HASH_COUNT(store->keydir) + 1) * sizeof(merge_entry_t));
+  if (list == NULL)
+    return ENOMEM;
+  HASH_ITER(hh, store->keydir, entry, tmpentry) {
+    if (entry->segment->id >= first_kept)
+      continue;
+    if ((list[n].key = strdup(entry->key)) == NULL) {
+      while (n > 0)
+        free(list[--n].key);
+      free(list);
+      return ENOMEM;
+    }
+    list[n].segment = entry->segment;
+    list[n].offset = entry->offset;
+    list[n].size = RECORD_SIZE(strlen(entry->key), entry->vallen);
+    n++;
+  }
+  *entries = list;
+  *count = n;
+  return 0;
+}
+
+/* Copies the COUNT records listed in ENTRIES, in that order, into the file
+ * FILENAME, making it durable, and stores the offset of each copy. Must be
+ * called without the lock held; the segments listed are never removed
+ * while a merge runs. Returns 0 if successful, else a negative error
+ * code. */
+static int merge_copy(merge_entry_t *entries, size_t count,
+    char *filename) {
+  char buf[sizeof(kvlogrecord_t) + MAX_KEYLEN + MAX_VALLEN + 2];
+  off_t offset = 0;
+  size_t i;
+  FILE *file;
+  if ((file = fopen(filename, "w")) == NULL)
+    return ERRFILCRT;
+  for (i = 0; i < count; i++) {
+    if (pread(entries[i].segment->fd, buf, entries[i].size,
+        entries[i].offset) != (ssize_t) entries[i].size ||
+        fwrite(buf, entries[i].size, 1, file) != 1)
+      break;
+    entries[i].copy = offset;
+    offset += entries[i].size;
+  }
+  if (i < count || fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    remove(filename);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  return 0;
+}
+
+/* Copies the live records of every immutable segment of STORE into a new
+ * segment just below the active one, then removes the immutable segments
+ * (see kvlogstore.h). The write lock is taken only while the records are
+ * listed and while the copy replaces them. Must be called by one thread at a
+ * time. Returns 0 if successful, else a negative error code. */
+static int merge(kvlogstore_t *store) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  kvlogsegment_t *active, *output, *segment, *tmp;
+  merge_entry_t *entries = NULL;
+  kvlogkeydir_t *entry;
+  unsigned int first_kept;
+  size_t count = 0, i;
+  struct stat st;
+  int ret = 0;
+
+  pthread_rwlock_wrlock(&store->lock);
+  active = store->segments->prev;
+  /* The id below the active segment is taken if this segment was already
+   * merged into; a new one then makes room. */
+  if (active->id > 0 && segment_filename(store, active->id - 1, filename) == 0
+      && stat(filename, &st) == 0)
+    ret = seal(store);
+  active = store->segments->prev;
+  first_kept = active->id;
+  if (ret == 0 && store->segments != active)
+    ret = merge_list(store, first_kept, &entries, &count);
+  pthread_rwlock_unlock(&store->lock);
+  if (ret != 0 || entries == NULL)
+    return ret;
+
+  /* Once renamed, the copy replays after the records it copies, so a crash
+   * before they are removed leaves the same entries. */
+  if ((ret = segment_filename(store, first_kept - 1, filename)) == 0 &&
+      (ret = kvstore_path(tmpname, "%s/%s", store->dirname,
+      KVLOGSTORE_MERGE_TMP)) == 0 &&
+      (ret = merge_copy(entries, count, tmpname)) == 0 &&
+      rename(tmpname, filename) < 0) {
+    remove(tmpname);
+    ret = ERRFILACCESS;
+  }
+
+  if (ret == 0) {
+    pthread_rwlock_wrlock(&store->lock);
+    if ((output = segment_open(store, first_kept - 1)) == NULL) {
+      remove(filename);
+      ret = ERRFILACCESS;
+    } else {
+      /* Entries written since they were listed now live elsewhere, which
+       * leaves their copies dead. */
+      for (i = 0; i < count; i++) {
+        HASH_FIND(hh, store->keydir, entries[i].key, strlen(entries[i].key),
+            entry);
+        if (entry != NULL && entry->segment == entries[i].segment &&
+            entry->offset == entries[i].offset) {
+          entry->segment = output;
+          entry->offset = entries[i].copy;
+        } else {
+          output->dead += entries[i].size;
+          store->dead += entries[i].size;
+        }
+      }
+      DL_FOREACH_SAFE(store->segments, segment, tmp) {
+        if (segment->id < first_kept - 1)
+          segment_remove(store, segment);
+      }
+      /* The previous snapshot names the removed segments, so it is now
+       * useless. */
+      checkpoint(store, store->segments->prev);
+    }
+    pthread_rwlock_unlock(&store->lock);
+  }
+  for (i = 0; i < count; i++)
+    free(entries[i].key);
+  free(entries);
+  return ret;
+}
+
+/* The body of the merge thread of STORE, which merges it whenever asked to,
+ * until the store is cleaned. */
+static void *merger(void *arg) {
+  kvlogstore_t *store = arg;
+  int ret;
+  pthread_mutex_lock(&store->merge_lock);
+  while (!store->stopping) {
+    if (store->merge_wanted && !store->merging) {
+      store->merge_wanted = false;
+      store->merging = true;
+      pthread_mutex_unlock(&store->merge_lock);
+      if ((ret = merge(store)) != 0)
+        fprintf(stderr, "Failed to merge %s: error %d\n", store->dirname,
+            ret);
+      pthread_mutex_lock(&store->merge_lock);
+      store->merging = false;
+      pthread_cond_broadcast(&store->merge_cond);
+      continue;
+    }
+    pthread_cond_wait(&store->merge_cond, &store->merge_lock);
+  }
+  pthread_mutex_unlock(&store->merge_lock);
+  return NULL;
+}
+
+/* Reclaims the space held by dead records in STORE, waiting for any merge
+ * already running. Returns 0 if successful, else a negative error code. */
+int kvlogstore_merge(kvlogstore_t *store) {
+  int ret;
+  pthread_mutex_lock(&store->merge_lock);
+  while (store->merging)
+    pthread_cond_wait(&store->merge_cond, &store->merge_lock);
+  store->merging = true;
+  pthread_mutex_unlock(&store->merge_lock);
+  ret = merge(store);
+  pthread_mutex_lock(&store->merge_lock);
+  store->merging = false;
+  pthread_cond_broadcast(&store->merge_cond);
+  pthread_mutex_unlock(&store->merge_lock);
+  return ret;
+}
+
+/* Makes every write made to STORE so far durable, whatever its sync mode,
+ * and snapshots the keydir so that the next initialization need not replay
+ * any segment. Returns 0 if successful, else a negative error code. */
+int kvlogstore_flush(kvlogstore_t *store) {
+  int ret;
+  pthread_rwlock_wrlock(&store->lock);
+  if ((ret = kvsync_flush(&store->sync)) == 0)
+    ret = index_save(store, store->segments->prev);
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Takes a snapshot of STORE into DIRNAME, an empty directory (see
+ * kvlogstore.h). Returns 0 if successful, else a negative error code. */
+int kvlogstore_snapshot(kvlogstore_t *store, char *dirname) {
+  char filename[MAX_FILENAME], dstname[MAX_FILENAME];
+  kvlogsegment_t *segment;
+  int fd, ret = 0;
+  pthread_rwlock_wrlock(&store->lock);
+  if (store->segments->prev->size > 0)
+    ret = seal(store);
+  DL_FOREACH(store->segments, segment) {
+    if (ret != 0 || segment == store->segments->prev)
+      break;
+    if ((ret = segment_filename(store, segment->id, filename)) == 0 &&
+        (ret = kvstore_path(dstname, "%s/%u%s", dirname, segment->id,
+        KVLOGSTORE_FILETYPE)) == 0)
+      ret = kvstore_snapshot_link(filename, dstname);
+  }
+  /* The snapshot gets an active segment of its own, so that a store opened
+   * on it never appends to a segment it shares with this one. */
+  if (ret == 0) {
+    if (kvstore_path(dstname, "%s/%u%s", dirname, store->segments->prev->id,
+        KVLOGSTORE_FILETYPE) != 0 ||
+        (fd = open(dstname, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0)
+      ret = ERRFILCRT;
+    else
+      close(fd);
+  }
+  if (ret == 0) {
+    if ((ret = kvstore_path(filename, "%s/%s", store->dirname,
+        KVLOGSTORE_INDEX)) == 0 &&
+        (ret = kvstore_path(dstname, "%s/%s", dirname, KVLOGSTORE_INDEX)) == 0
+        && (ret = kvstore_snapshot_link(filename, dstname)) == ERRNOKEY)
+      ret = 0;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Deletes all current entries in STORE and removes its segment files. */
+int kvlogstore_clean(kvlogstore_t *store) {
+  char filename[MAX_FILENAME];
+  kvlogsegment_t *segment, *tmp;
+  pthread_mutex_lock(&store->merge_lock);
+  store->stopping = true;
+  pthread_cond_broadcast(&store->merge_cond);
+  pthread_mutex_unlock(&store->merge_lock);
+  if (store->merge_thread)
+    pthread_join(store->merge_thread, NULL);
+  kvsync_stop(&store->sync);
+  pthread_rwlock_wrlock(&store->lock);
+  keydir_free(store);
+  DL_FOREACH_SAFE(store->segments, segment, tmp)
+    segment_remove(store, segment);
+  if (kvstore_path(filename, "%s/%s", store->dirname, KVLOGSTORE_INDEX) == 0)
+    remove(filename);
+  store->dead = 0;
+  pthread_rwlock_unlock(&store->lock);
+  kvio_close(&store->io);
+  return 0;
+}
+
+static int engine_init(kvstore_t *store, char *dirname) {
+  kvlogstore_t *logstore = malloc(sizeof(kvlogstore_t));
+  if (logstore == NULL)
+    return ENOMEM;
+  store->state = logstore;
+  return kvlogstore_init(logstore, dirname, store->sync_mode, store->verify);
+}
+
+static int engine_get(kvstore_t *store, kvkey_t *key, char **value) {
+  return kvlogstore_get(store->state, key, value);
+}
+
+static int engine_mget(kvstore_t *store, kvkey_t *keys, unsigned int count,
+    char **values) {
+  return kvlogstore_mget(store->state, keys, count, values);
+}
+
+static int engine_put(kvstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  return kvlogstore_put(store->state, key, value, ref);
+}
+
+static int engine_del(kvstore_t *store, kvkey_t *key) {
+  return kvlogstore_del(store->state, key);
+}
+
+static bool engine_haskey(kvstore_t *store, kvkey_t *key) {
+  return kvlogstore_haskey(store->state, key);
+}
+
+static int engine_flush(kvstore_t *store) {
+  return kvlogstore_flush(store->state);
+}
+
+static int engine_locate(kvstore_t *store, kvkey_t *key, kvstore_loc_t *loc) {
+  return kvlogstore_locate(store->state, key, loc);
+}
+
+static int engine_snapshot(kvstore_t *store, char *dirname) {
+  return kvlogstore_snapshot(store->state, dirname);
+}
+
+static int engine_clean(kvstore_t *store) {
+  int ret = kvlogstore_clean(store->state);
+  free(store->state);
+  return ret;
+}
+
+/* The log-structured engine, as used by KVStore. */
+const kvstore_engine_t kvlogstore_engine = {
+  .name = "log",
+  .persistent = true,
+  .init = engine_init,
+  .get = engine_get,
+  .mget = engine_mget,
+  .put = engine_put,
+  .del = engine_del,
+  .haskey = engine_haskey,
+  .flush = engine_flush,
+  .locate = engine_locate,
+  .snapshot = engine_snapshot,
+  .clean = engine_clean,
+};
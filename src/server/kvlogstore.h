@@ -0,0 +1,208 @@
+#ifndef __KV_LOG_STORE__
+#define __KV_LOG_STORE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "uthash.h"
+#include "kvconstants.h"
+#include "kvio.h"
+#include "kvstore.h"
+#include "kvsync.h"
+
+/* KVLogStore is a log-structured (Bitcask-style) storage engine for KVStore,
+ * selected with the name "log".
+ *
+ * Instead of one file per entry, entries are appended to a small number of
+ * large segment files within the store directory. Segment files are named by
+ * a monotonically increasing id:
+ *    sprintf(filename, "%s/%u%s", dirname, segid, KVLOGSTORE_FILETYPE);
+ * Only the newest segment (the active segment) is ever written to. Once it
+ * grows past KVLOGSTORE_SEGMENT_SIZE, a new active segment is started and the
+ * old one becomes immutable.
+ *
+ * Every record in a segment is a kvlogrecord_t header followed by the key and
+ * the value, each null terminated. A DEL appends a record with a VALLEN of
+ * KVLOGSTORE_TOMBSTONE and no value, so that replaying the segments in order
+ * always yields the current contents of the store. A value which is a
+ * reference to a blob (see kvblob.h) is marked by KVLOGSTORE_REF in the
+ * KEYLEN of its record, and of its entry in the keydir snapshot.
+ *
+ * Every record carries a CRC-32C of the rest of it. Replay stops at the first
+ * record whose checksum does not match, as it does at a truncated one. If
+ * the store verifies checksums (see kvstore_init), a GET or MGET reads the
+ * whole record rather than just its value and fails with ERRCHECKSUM if it
+ * does not match, and values are not sent straight from their segments.
+ *
+ * An in-memory keydir maps every live key to the segment, offset and length
+ * of its most recent value, so a GET costs a single pread(). The keydir is
+ * rebuilt on initialization by replaying the segments from oldest to newest.
+ * Records are never modified once written, so a large value can also be sent
+ * straight from its segment (see kvlogstore_locate).
+ *
+ * Records which have been overwritten or deleted are dead space. When a
+ * segment is sealed and more than half of the store is dead, a background
+ * thread merges the store: the live records of all immutable segments are
+ * copied into a new segment, and the immutable segments are removed. The
+ * write lock is held only to list the records to copy and, once the copy is
+ * durable, to point the keydir at it and drop the old segments, so reads and
+ * writes carry on while the records are copied. Active segments are numbered
+ * by twos, so the id just below the active segment is always free for the
+ * copy, which must replay after the segments it replaces and before any
+ * record written since.
+ *
+ * So that initialization need not replay every segment, the keydir is
+ * snapshotted into an index file (KVLOGSTORE_INDEX) by kvlogstore_flush (and
+ * so on clean shutdown), after a merge, and whenever a segment is sealed once
+ * KVLOGSTORE_CHECKPOINT_SIZE bytes have been appended since the last
+ * snapshot. The index lists the segments it covers, with their sizes, and
+ * the location of every live record within them, and is checksummed with
+ * CRC-32C. Initialization maps it, checks that the segments it covers are
+ * unchanged (the last may have grown), loads it into the keydir, and replays
+ * only the records written after it. An index which fails any check is
+ * ignored, and every segment is replayed as before.
+ *
+ * Appends to the active segment are made durable according to the store's
+ * sync mode (see kvsync.h). A PUT or DEL in KVSYNC_ALWAYS mode waits for its
+ * record to be synced after releasing the store lock, so concurrent writers
+ * share one fdatasync(). The active segment is synced before it is sealed.
+ *
+ * Values are read, and records appended, through the store's KVIO (see
+ * kvio.h), with every segment in its fixed file table and records built in
+ * its registered buffers, so concurrent GETs are batched into one submission
+ * on hosts with io_uring. An MGET looks every key up first, then submits all
+ * of the reads at once, sorted by segment and offset.
+ *
+ * A snapshot (see kvstore_snapshot) seals the active segment, unless it is
+ * empty, and then hard-links every immutable segment, and the keydir
+ * snapshot, into the snapshot directory, all with the write lock held, so
+ * writers wait for no more than a link per segment. Nothing is copied
+ * unless the snapshot is on another filesystem.
+ */
+
+/* The filetype to append to the filenames of segments within the store. */
+#define KVLOGSTORE_FILETYPE ".seg"
+
+/* The size past which the active segment is sealed and a new one started. */
+#define KVLOGSTORE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* The VALLEN of a record which marks its key as deleted. */
+#define KVLOGSTORE_TOMBSTONE -1
+
+/* Set in the KEYLEN of a record whose value is a reference to a blob. */
+#define KVLOGSTORE_REF 0x40000000
+
+/* The name under which a merge writes its copy until it is durable. */
+#define KVLOGSTORE_MERGE_TMP "merge.tmp"
+
+/* The name of the keydir snapshot within the store directory. */
+#define KVLOGSTORE_INDEX "keydir.idx"
+
+/* The number of bytes appended since the last snapshot which makes sealing a
+ * segment take a new one. */
+#define KVLOGSTORE_CHECKPOINT_SIZE (4 * KVLOGSTORE_SEGMENT_SIZE)
+
+/* Identifies a valid keydir snapshot. */
+#define KVLOGSTORE_INDEX_MAGIC 0x4b564c49U
+
+/* The header of a single record within a segment.
+ * data stores the key and (unless this is a tombstone) the value, in the form:
+ *   key_string \0 value_string \0 */
+typedef struct {
+  int32_t keylen;               /* The length of the key, excluding its null terminator, and KVLOGSTORE_REF. */
+  int32_t vallen;               /* The length of the value, or KVLOGSTORE_TOMBSTONE. */
+  uint32_t checksum;            /* CRC-32C of KEYLEN, VALLEN and DATA. */
+  char data[0];                 /* Described above. */
+} kvlogrecord_t;
+
+/* The header of a keydir snapshot, which is followed by a
+ * kvlogindex_segment_t for each segment covered, in increasing id order, and
+ * then a kvlogindex_entry_t for each live key. */
+typedef struct {
+  uint32_t magic;               /* Always KVLOGSTORE_INDEX_MAGIC. */
+  uint32_t checksum;            /* CRC-32C of the rest of the snapshot. */
+  uint32_t num_segments;        /* The number of segments covered. */
+  uint32_t pad;
+  uint64_t count;               /* The number of keys. */
+} kvlogindex_header_t;
+
+/* A segment covered by a keydir snapshot. */
+typedef struct {
+  uint32_t id;                  /* The id of the segment. */
+  uint32_t pad;
+  int64_t size;                 /* The number of bytes of the segment covered. */
+  int64_t dead;                 /* The number of those bytes held by dead records. */
+} kvlogindex_segment_t;
+
+/* A key within a keydir snapshot, which is followed by the KEYLEN bytes of
+ * the key itself, not null terminated. */
+typedef struct {
+  uint32_t segid;               /* The id of the segment holding the record for the key. */
+  int32_t keylen;               /* The length of the key, and KVLOGSTORE_REF. */
+  int32_t vallen;               /* The length of the value. */
+  uint32_t pad;
+  int64_t offset;               /* The offset of the record within the segment. */
+} kvlogindex_entry_t;
+
+/* A single segment file. */
+typedef struct kvlogsegment {
+  unsigned int id;              /* The id of this segment, which determines its filename. */
+  int fd;                       /* An open file descriptor for this segment. */
+  off_t size;                   /* The number of bytes written to this segment. */
+  off_t dead;                   /* The number of bytes in this segment held by dead records. */
+  struct kvlogsegment *next;    /* The next (newer) segment. */
+  struct kvlogsegment *prev;    /* The previous (older) segment. */
+} kvlogsegment_t;
+
+/* An entry in the keydir, describing where the live value of KEY is stored. */
+typedef struct {
+  char *key;                    /* The entry's key. */
+  kvlogsegment_t *segment;      /* The segment holding the most recent record for KEY. */
+  off_t offset;                 /* The offset of the record within SEGMENT. */
+  int32_t vallen;               /* The length of the value, excluding its null terminator. */
+  bool ref;                     /* Whether the value is a reference to a blob. */
+  UT_hash_handle hh;            /* Makes this structure hashable by uthash. */
+} kvlogkeydir_t;
+
+/* A KVLogStore. */
+typedef struct {
+  char dirname[MAX_FILENAME];   /* The name of the directory used to store segments. */
+  kvlogsegment_t *segments;     /* All segments, from oldest to newest. The last is active. */
+  kvlogkeydir_t *keydir;        /* The keydir, a uthash table keyed on the entry's key. */
+  off_t live;                   /* The total number of bytes held by live records. */
+  off_t dead;                   /* The total number of bytes held by dead records. */
+  off_t unindexed;              /* The number of bytes appended since the last keydir snapshot. */
+  bool verify;                  /* true to verify the checksum of every record read. */
+  pthread_rwlock_t lock;        /* The lock used to make KVLogStore's functions thread-safe. */
+  kvsync_t sync;                /* Makes appends to the active segment durable. */
+  kvio_t io;                    /* Performs reads of records and appends to the active segment. */
+  pthread_mutex_t merge_lock;   /* Protects the scheduling state of merges. */
+  pthread_cond_t merge_cond;    /* Signalled whenever a merge is wanted, or one finishes. */
+  bool merge_wanted;            /* true if the merge thread should merge the store. */
+  bool merging;                 /* true while a merge is running. */
+  bool stopping;                /* true once the merge thread has been asked to exit. */
+  pthread_t merge_thread;       /* Merges the store in the background. */
+} kvlogstore_t;
+
+extern const kvstore_engine_t kvlogstore_engine;
+
+int kvlogstore_init(kvlogstore_t *, char *dirname, kvsync_mode_t sync_mode,
+    bool verify);
+
+int kvlogstore_get(kvlogstore_t *, kvkey_t *key, char **value);
+int kvlogstore_mget(kvlogstore_t *, kvkey_t *keys, unsigned int count,
+    char **values);
+int kvlogstore_locate(kvlogstore_t *, kvkey_t *key, kvstore_loc_t *loc);
+int kvlogstore_put(kvlogstore_t *, kvkey_t *key, char *value, bool ref);
+int kvlogstore_del(kvlogstore_t *, kvkey_t *key);
+
+bool kvlogstore_haskey(kvlogstore_t *, kvkey_t *key);
+
+int kvlogstore_merge(kvlogstore_t *);
+int kvlogstore_flush(kvlogstore_t *);
+int kvlogstore_snapshot(kvlogstore_t *, char *dirname);
+
+int kvlogstore_clean(kvlogstore_t *);
+
+#endif
@@ -0,0 +1,1299 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "kvlsmstore.h"
+
+static void *background(void *);
+
+/* Returns the target size of LEVEL, which must be at least 1. */
+static off_t level_target(int level) {
+  off_t target = KVLSMSTORE_L1_SIZE;
+  while (--level > 0)
+    target *= 10;
+  return target;
+}
+
+/* Returns a fresh id for a table or log of STORE. */
+static unsigned int new_id(kvlsmstore_t *store) {
+  return __atomic_fetch_add(&store->next_id, 1, __ATOMIC_RELAXED);
+}
+
+/* Appends TABLE to LEVEL. Returns 0 if successful, else a negative error
+ * code. */
+static int level_add(kvlsmlevel_t *level, kvsstable_t *table) {
+  kvsstable_t **tables = realloc(level->tables,
+      (level->count + 1) * sizeof(kvsstable_t *));
+  if (tables == NULL)
+    return ENOMEM;
+  level->tables = tables;
+  level->tables[level->count++] = table;
+  level->size += table->size;
+  return 0;
+}
+
+/* Removes TABLE from LEVEL, if it is there. */
+static void level_remove(kvlsmlevel_t *level, kvsstable_t *table) {
+  int i;
+  for (i = 0; i < level->count; i++) {
+    if (level->tables[i] == table) {
+      memmove(&level->tables[i], &level->tables[i + 1],
+          (level->count - i - 1) * sizeof(kvsstable_t *));
+      level->count--;
+      level->size -= table->size;
+      return;
+    }
+  }
+}
+
+/* Comparator used to sort the tables of a level by their smallest key. */
+static int table_cmp(const void *a, const void *b) {
+  return strcmp((*(kvsstable_t **) a)->smallest,
+      (*(kvsstable_t **) b)->smallest);
+}
+
+/* Sorts the tables of LEVEL by their smallest key. */
+static void level_sort(kvlsmlevel_t *level) {
+  if (level->count > 1)
+    qsort(level->tables, level->count, sizeof(kvsstable_t *), table_cmp);
+}
+
+/* Returns true if TABLE holds any keys between SMALLEST and LARGEST. */
+static bool table_overlaps(kvsstable_t *table, char *smallest, char *largest) {
+  return strcmp(table->largest, smallest) >= 0 &&
+      strcmp(table->smallest, largest) <= 0;
+}
+
+/* Returns true if any level of STORE already holds the table with id ID. */
+static bool has_table(kvlsmstore_t *store, unsigned int id) {
+  int i, j;
+  for (i = 0; i < KVLSMSTORE_LEVELS; i++) {
+    for (j = 0; j < store->levels[i].count; j++) {
+      if (store->levels[i].tables[j]->id == id)
+        return true;
+    }
+  }
+  return false;
+}
+
+/* Atomically replaces the manifest within DIRNAME with one describing the
+ * current levels of STORE. Must be called with the lock held, or before the
+ * background threads are started. */
+static int manifest_save(kvlsmstore_t *store, char *dirname) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  FILE *file;
+  int i, j, fd;
+  if (kvstore_path(filename, "%s/%s", dirname, KVLSMSTORE_MANIFEST) != 0 ||
+      kvstore_path(tmpname, "%s/%s.tmp", dirname, KVLSMSTORE_MANIFEST) != 0 ||
+      (file = fopen(tmpname, "w")) == NULL)
+    return ERRFILCRT;
+  fprintf(file, "next %u\n", __atomic_load_n(&store->next_id,
+      __ATOMIC_RELAXED));
+  for (i = 0; i < KVLSMSTORE_LEVELS; i++) {
+    for (j = 0; j < store->levels[i].count; j++)
+      fprintf(file, "%d %u\n", i, store->levels[i].tables[j]->id);
+  }
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  if (rename(tmpname, filename) < 0)
+    return ERRFILACCESS;
+  if ((fd = open(dirname, O_RDONLY)) >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  return 0;
+}
+
+/* Atomically replaces the manifest of STORE with one describing its current
+ * levels. Must be called with the write lock held, or before the background
+ * threads are started. */
+static int manifest_write(kvlsmstore_t *store) {
+  return manifest_save(store, store->dirname);
+}
+
+/* Opens every table named by the manifest of STORE, if there is one. Returns
+ * 0 if successful, else a negative error code. */
+static int manifest_read(kvlsmstore_t *store) {
+  char filename[MAX_FILENAME];
+  kvsstable_t *table;
+  unsigned int id, next;
+  int level, i, ret = 0;
+  FILE *file;
+  if (kvstore_path(filename, "%s/%s", store->dirname, KVLSMSTORE_MANIFEST)
+      != 0)
+    return ERRFILACCESS;
+  if ((file = fopen(filename, "r")) == NULL)
+    return 0;
+  if (fscanf(file, "next %u\n", &next) == 1)
+    store->next_id = next;
+  while (ret == 0 && fscanf(file, "%d %u\n", &level, &id) == 2) {
+    if (level < 0 || level >= KVLSMSTORE_LEVELS) {
+      ret = ERRFILACCESS;
+      break;
+    }
+    if ((ret = kvsstable_open(&table, &store->io, store->dirname,
+        id)) == 0)
+      ret = level_add(&store->levels[level], table);
+    if (id >= store->next_id)
+      store->next_id = id + 1;
+  }
+  fclose(file);
+  for (i = 1; i < KVLSMSTORE_LEVELS; i++)
+    level_sort(&store->levels[i]);
+  return ret;
+}
+
+/* Builds a record for KEY and VALUE (a tombstone if VALUE is NULL), which is
+ * a reference to a blob if REF is set, using malloc()d memory, storing its
+ * size into SIZE. */
+static kvsstable_record_t *record_new(char *key, char *value, bool ref,
+    size_t *size) {
+  size_t keylen = strlen(key);
+  int32_t vallen = (value == NULL) ? KVSSTABLE_TOMBSTONE : strlen(value);
+  kvsstable_record_t *record;
+  *size = sizeof(kvsstable_record_t) + keylen + 1 +
+      ((value == NULL) ? 0 : vallen + 1);
+  if ((record = malloc(*size)) == NULL)
+    return NULL;
+  record->keylen = keylen | (ref ? KVSSTABLE_REF : 0);
+  record->vallen = vallen;
+  strcpy(record->data, key);
+  if (value != NULL)
+    strcpy(record->data + keylen + 1, value);
+  return record;
+}
+
+/* Places the filename of the write-ahead log with id ID into FILENAME.
+ * Returns 0 if successful, else ERRFILACCESS if it does not fit. */
+static int wal_filename(kvlsmstore_t *store, unsigned int id,
+    char *filename) {
+  return kvstore_path(filename, "%s/%u%s", store->dirname, id,
+      KVLSMSTORE_WAL_FILETYPE);
+}
+
+/* Creates a new, empty write-ahead log with id ID and returns a file
+ * descriptor for appending to it, or -1 if it could not be created. */
+static int wal_open(kvlsmstore_t *store, unsigned int id) {
+  char filename[MAX_FILENAME];
+  if (wal_filename(store, id, filename) != 0)
+    return -1;
+  return open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+}
+
+/* Deletes the write-ahead log with id ID. */
+static void wal_remove(kvlsmstore_t *store, unsigned int id) {
+  char filename[MAX_FILENAME];
+  if (wal_filename(store, id, filename) == 0)
+    remove(filename);
+}
+
+/* Inserts every record of the write-ahead log with id ID into MEM. A record
+ * which is truncated or malformed (as left behind by a crash in the middle of
+ * an append) ends the log. Returns 0 if successful, else a negative error
+ * code. */
+static int wal_replay(kvlsmstore_t *store, unsigned int id,
+    kvskiplist_t *mem) {
+  char filename[MAX_FILENAME];
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  kvsstable_record_t header;
+  FILE *file;
+  bool ref;
+  int ret = 0;
+  if (wal_filename(store, id, filename) != 0 ||
+      (file = fopen(filename, "r")) == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && fread(&header, sizeof(kvsstable_record_t), 1, file) == 1) {
+    ref = (header.keylen & KVSSTABLE_REF) != 0;
+    header.keylen &= ~KVSSTABLE_REF;
+    if (header.keylen < 0 || header.keylen > MAX_KEYLEN ||
+        header.vallen < KVSSTABLE_TOMBSTONE || header.vallen > MAX_VALLEN)
+      break;
+    if (fread(key, header.keylen + 1, 1, file) != 1 ||
+        key[header.keylen] != '\0')
+      break;
+    if (header.vallen >= 0 && (fread(value, header.vallen + 1, 1, file) != 1 ||
+        value[header.vallen] != '\0'))
+      break;
+    ret = kvskiplist_put(mem, key, (header.vallen < 0) ? NULL : value, ref);
+  }
+  fclose(file);
+  return ret;
+}
+
+/* Writes every entry of MEM out as a new table of STORE, storing it into
+ * TABLE (NULL if MEM was empty). Returns 0 if successful, else a negative
+ * error code. */
+static int write_table(kvlsmstore_t *store, kvskiplist_t *mem,
+    kvsstable_t **table) {
+  kvsstable_builder_t builder;
+  kvskipnode_t *node;
+  char *value;
+  bool ref = false;
+  int ret;
+  if ((ret = kvsstable_builder_init(&builder, &store->io, store->dirname,
+      new_id(store))) < 0)
+    return ret;
+  for (node = kvskiplist_first(mem); node != NULL;
+      node = kvskiplist_next(node)) {
+    value = kvskiplist_value(node, &ref);
+    if ((ret = kvsstable_builder_add(&builder, node->key, value, ref)) < 0) {
+      kvsstable_builder_abandon(&builder);
+      return ret;
+    }
+  }
+  return kvsstable_builder_finish(&builder, table);
+}
+
+/* Writes the immutable memtable of STORE out to a new level 0 table, then
+ * discards the memtable and its write-ahead log. Returns 0 if successful,
+ * else a negative error code. */
+static int flush(kvlsmstore_t *store) {
+  kvskiplist_t *imm = store->imm;
+  unsigned int wal_id = store->imm_wal_id;
+  kvsstable_t *table;
+  int ret;
+  if ((ret = write_table(store, imm, &table)) < 0)
+    return ret;
+  pthread_rwlock_wrlock(&store->lock);
+  if (table != NULL && (ret = level_add(&store->levels[0], table)) < 0) {
+    pthread_rwlock_unlock(&store->lock);
+    kvsstable_close(table, true);
+    return ret;
+  }
+  store->imm = NULL;
+  ret = manifest_write(store);
+  pthread_rwlock_unlock(&store->lock);
+  /* Keep the log around for recovery if the manifest could not be written. */
+  if (ret == 0)
+    wal_remove(store, wal_id);
+  kvskiplist_free(imm);
+  free(imm);
+  return ret;
+}
+
+/* Returns the level of STORE which most needs compacting, or -1 if none
+ * does. Levels which are already being compacted are skipped. Must be called
+ * with the background lock held. */
+static int pick_compaction(kvlsmstore_t *store) {
+  double score, best_score = 1.0;
+  int i, best = -1;
+  pthread_rwlock_rdlock(&store->lock);
+  for (i = 0; i < KVLSMSTORE_LEVELS - 1; i++) {
+    if (store->levels[i].busy || store->levels[i + 1].busy)
+      continue;
+    if (i == 0)
+      score = (double) store->levels[0].count / KVLSMSTORE_L0_TRIGGER;
+    else
+      score = (double) store->levels[i].size / level_target(i);
+    if (score >= best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return best;
+}
+
+/* Merges INPUTS, NUM_INPUTS tables ordered from newest to oldest, into new
+ * tables of at most about KVLSMSTORE_TABLE_SIZE bytes each. Only the newest
+ * record of each key is kept, and deleted keys are dropped entirely if BOTTOM
+ * is set. The new tables are stored into OUTPUTS, which must have room for
+ * them, and their number into NUM_OUTPUTS. Returns 0 if successful, else a
+ * negative error code. */
+static int merge_tables(kvlsmstore_t *store, kvsstable_t **inputs,
+    int num_inputs, bool bottom, kvsstable_t ***outputs, int *num_outputs) {
+  kvsstable_iter_t *iters = calloc(num_inputs, sizeof(kvsstable_iter_t));
+  kvsstable_builder_t builder;
+  kvsstable_t *table, **tmp;
+  char key[MAX_KEYLEN + 1], *smallest, *value;
+  bool building = false;
+  int i, winner, ret = 0;
+  *outputs = NULL;
+  *num_outputs = 0;
+  if (iters == NULL)
+    return ENOMEM;
+  for (i = 0; i < num_inputs && ret == 0; i++)
+    ret = kvsstable_iter_init(&iters[i], inputs[i]);
+
+  while (ret == 0) {
+    /* On ties, the earliest (newest) input wins. */
+    smallest = NULL;
+    winner = -1;
+    for (i = 0; i < num_inputs; i++) {
+      if (iters[i].valid &&
+          (smallest == NULL || strcmp(iters[i].key, smallest) < 0)) {
+        smallest = iters[i].key;
+        winner = i;
+      }
+    }
+    if (winner < 0)
+      break;
+    strcpy(key, smallest);
+    value = iters[winner].value;
+    if (value != NULL || !bottom) {
+      if (!building) {
+        if ((ret = kvsstable_builder_init(&builder, &store->io,
+            store->dirname, new_id(store))) < 0)
+          break;
+        building = true;
+      }
+      if ((ret = kvsstable_builder_add(&builder, key, value,
+          iters[winner].ref)) < 0)
+        break;
+      if (kvsstable_builder_size(&builder) >= KVLSMSTORE_TABLE_SIZE) {
+        building = false;
+        if ((ret = kvsstable_builder_finish(&builder, &table)) < 0)
+          break;
+        if ((tmp = realloc(*outputs, (*num_outputs + 1) *
+            sizeof(kvsstable_t *))) == NULL) {
+          kvsstable_close(table, true);
+          ret = ENOMEM;
+          break;
+        }
+        *outputs = tmp;
+        (*outputs)[(*num_outputs)++] = table;
+      }
+    }
+    for (i = 0; i < num_inputs && ret == 0; i++) {
+      while (iters[i].valid && strcmp(iters[i].key, key) == 0 && ret == 0)
+        ret = kvsstable_iter_next(&iters[i]);
+    }
+  }
+
+  if (building) {
+    if (ret != 0) {
+      kvsstable_builder_abandon(&builder);
+    } else if ((ret = kvsstable_builder_finish(&builder, &table)) == 0 &&
+        table != NULL) {
+      if ((tmp = realloc(*outputs, (*num_outputs + 1) *
+          sizeof(kvsstable_t *))) == NULL) {
+        kvsstable_close(table, true);
+        ret = ENOMEM;
+      } else {
+        *outputs = tmp;
+        (*outputs)[(*num_outputs)++] = table;
+      }
+    }
+  }
+  for (i = 0; i < num_inputs; i++)
+    kvsstable_iter_free(&iters[i]);
+  free(iters);
+  if (ret != 0) {
+    for (i = 0; i < *num_outputs; i++)
+      kvsstable_close((*outputs)[i], true);
+    free(*outputs);
+    *outputs = NULL;
+    *num_outputs = 0;
+  }
+  return ret;
+}
+
+/* Compacts LEVEL of STORE into the next level. Both levels must have been
+ * marked busy by the caller. Returns 0 if successful, else a negative error
+ * code. */
+static int compact(kvlsmstore_t *store, int level) {
+  kvlsmlevel_t *upper = &store->levels[level], *lower = &store->levels[level + 1];
+  kvsstable_t **inputs, **outputs = NULL;
+  char *smallest, *largest, *next = NULL;
+  int i, num_upper = 0, num_inputs = 0, num_outputs = 0, ret = 0;
+  bool bottom = true;
+
+  pthread_rwlock_rdlock(&store->lock);
+  inputs = malloc((upper->count + lower->count) * sizeof(kvsstable_t *));
+  if (inputs == NULL || upper->count == 0) {
+    pthread_rwlock_unlock(&store->lock);
+    free(inputs);
+    return (inputs == NULL) ? ENOMEM : 0;
+  }
+  if (level == 0) {
+    /* Level 0 tables overlap, so all of them are compacted at once. */
+    for (i = upper->count - 1; i >= 0; i--)
+      inputs[num_inputs++] = upper->tables[i];
+  } else {
+    /* Compact one table, cycling through the key space. */
+    for (i = 0; i < upper->count; i++) {
+      if (upper->next_compaction == NULL ||
+          strcmp(upper->tables[i]->smallest, upper->next_compaction) > 0)
+        break;
+    }
+    inputs[num_inputs++] = upper->tables[(i == upper->count) ? 0 : i];
+  }
+  num_upper = num_inputs;
+  smallest = inputs[0]->smallest;
+  largest = inputs[0]->largest;
+  for (i = 1; i < num_upper; i++) {
+    if (strcmp(inputs[i]->smallest, smallest) < 0)
+      smallest = inputs[i]->smallest;
+    if (strcmp(inputs[i]->largest, largest) > 0)
+      largest = inputs[i]->largest;
+  }
+  for (i = 0; i < lower->count; i++) {
+    if (table_overlaps(lower->tables[i], smallest, largest))
+      inputs[num_inputs++] = lower->tables[i];
+  }
+  for (i = level + 2; i < KVLSMSTORE_LEVELS; i++) {
+    if (store->levels[i].count > 0)
+      bottom = false;
+  }
+  if (level > 0 && (next = malloc(strlen(largest) + 1)) != NULL)
+    strcpy(next, largest);
+  pthread_rwlock_unlock(&store->lock);
+
+  if (level > 0 && num_inputs == 1) {
+    /* Nothing to merge with, so the table simply moves down a level. */
+    outputs = malloc(sizeof(kvsstable_t *));
+    if (outputs == NULL) {
+      ret = ENOMEM;
+    } else {
+      outputs[0] = inputs[0];
+      num_outputs = 1;
+    }
+  } else {
+    ret = merge_tables(store, inputs, num_inputs, bottom, &outputs,
+        &num_outputs);
+  }
+  if (ret != 0) {
+    free(inputs);
+    free(next);
+    return ret;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  for (i = 0; i < num_inputs; i++)
+    level_remove((i < num_upper) ? upper : lower, inputs[i]);
+  for (i = 0; i < num_outputs && ret == 0; i++)
+    ret = level_add(lower, outputs[i]);
+  level_sort(lower);
+  if (level > 0) {
+    free(upper->next_compaction);
+    upper->next_compaction = next;
+  }
+  if (ret == 0)
+    ret = manifest_write(store);
+  pthread_rwlock_unlock(&store->lock);
+
+  /* Inputs which were moved rather than merged are still in use. */
+  if (num_outputs != 1 || outputs[0] != inputs[0]) {
+    for (i = 0; i < num_inputs; i++)
+      kvsstable_close(inputs[i], true);
+  }
+  free(inputs);
+  free(outputs);
+  return ret;
+}
+
+/* The body of each background thread of STORE, which flushes immutable
+ * memtables and compacts levels until the store is cleaned. */
+static void *background(void *arg) {
+  kvlsmstore_t *store = (kvlsmstore_t *) arg;
+  bool need_flush;
+  int level, ret;
+  pthread_mutex_lock(&store->bg_lock);
+  while (!store->stopping) {
+    pthread_rwlock_rdlock(&store->lock);
+    need_flush = store->imm != NULL && !store->flushing;
+    pthread_rwlock_unlock(&store->lock);
+    if (need_flush) {
+      store->flushing = true;
+      pthread_mutex_unlock(&store->bg_lock);
+      if ((ret = flush(store)) != 0) {
+        fprintf(stderr, "Failed to flush memtable in %s: error %d\n",
+            store->dirname, ret);
+        sleep(1);
+      }
+      pthread_mutex_lock(&store->bg_lock);
+      store->flushing = false;
+      pthread_cond_broadcast(&store->bg_cond);
+      continue;
+    }
+    if ((level = pick_compaction(store)) >= 0) {
+      store->levels[level].busy = store->levels[level + 1].busy = true;
+      pthread_mutex_unlock(&store->bg_lock);
+      if ((ret = compact(store, level)) != 0) {
+        fprintf(stderr, "Failed to compact level %d in %s: error %d\n",
+            level, store->dirname, ret);
+        sleep(1);
+      }
+      pthread_mutex_lock(&store->bg_lock);
+      store->levels[level].busy = store->levels[level + 1].busy = false;
+      pthread_cond_broadcast(&store->bg_cond);
+      continue;
+    }
+    pthread_cond_wait(&store->bg_cond, &store->bg_lock);
+  }
+  pthread_mutex_unlock(&store->bg_lock);
+  return NULL;
+}
+
+/* Comparator used to sort log ids in ascending order. */
+static int id_cmp(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/* Deletes any table within the directory of STORE which is not named by the
+ * manifest, and recovers the contents of any write-ahead logs into a new
+ * level 0 table. Must be called before the background threads are started.
+ * Returns 0 if successful, else a negative error code. */
+static int recover(kvlsmstore_t *store) {
+  char filename[MAX_FILENAME], suffix[MAX_FILENAME];
+  unsigned int *wal_ids = NULL, *tmp, id;
+  size_t count = 0, i;
+  struct dirent *dent;
+  kvskiplist_t mem;
+  kvsstable_t *table = NULL;
+  DIR *dir;
+  int ret = 0;
+  if ((dir = opendir(store->dirname)) == NULL)
+    return ERRFILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%u%s", &id, suffix) != 2)
+      continue;
+    if (id >= store->next_id)
+      store->next_id = id + 1;
+    if (strcmp(suffix, KVSSTABLE_FILETYPE) == 0 && !has_table(store, id)) {
+      if (kvstore_path(filename, "%s/%s", store->dirname, dent->d_name) == 0)
+        remove(filename);
+    } else if (strcmp(suffix, KVLSMSTORE_WAL_FILETYPE) == 0) {
+      if ((tmp = realloc(wal_ids, (count + 1) * sizeof(unsigned int)))
+          == NULL) {
+        ret = ENOMEM;
+        break;
+      }
+      wal_ids = tmp;
+      wal_ids[count++] = id;
+    }
+  }
+  closedir(dir);
+  if (ret != 0 || count == 0) {
+    free(wal_ids);
+    return ret;
+  }
+
+  qsort(wal_ids, count, sizeof(unsigned int), id_cmp);
+  if ((ret = kvskiplist_init(&mem)) != 0) {
+    free(wal_ids);
+    return ret;
+  }
+  for (i = 0; i < count && ret == 0; i++)
+    ret = wal_replay(store, wal_ids[i], &mem);
+  if (ret == 0)
+    ret = write_table(store, &mem, &table);
+  if (ret == 0 && table != NULL)
+    ret = level_add(&store->levels[0], table);
+  if (ret == 0)
+    ret = manifest_write(store);
+  if (ret == 0) {
+    for (i = 0; i < count; i++)
+      wal_remove(store, wal_ids[i]);
+  }
+  kvskiplist_free(&mem);
+  free(wal_ids);
+  return ret;
+}
+
+/* Initializes kvlsmstore STORE. Uses DIRNAME as the directory in which to
+ * store tables and logs, which must already exist. Any tables and logs
+ * already present in DIRNAME are recovered. Appends to the write-ahead log
+ * are made durable according to SYNC_MODE. Returns 0 if successful, else a
+ * negative error code. */
+int kvlsmstore_init(kvlsmstore_t *store, char *dirname,
+    kvsync_mode_t sync_mode) {
+  int i, ret;
+  memset(store, 0, sizeof(kvlsmstore_t));
+  strcpy(store->dirname, dirname);
+  store->wal_fd = -1;
+  pthread_rwlock_init(&store->lock, NULL);
+  pthread_mutex_init(&store->write_lock, NULL);
+  pthread_mutex_init(&store->bg_lock, NULL);
+  pthread_cond_init(&store->bg_cond, NULL);
+  if ((ret = kvio_init(&store->io, KVIO_ENTRIES)) != 0)
+    return ret;
+  if ((ret = manifest_read(store)) != 0 || (ret = recover(store)) != 0)
+    return ret;
+  if ((store->mem = malloc(sizeof(kvskiplist_t))) == NULL)
+    return ENOMEM;
+  if ((ret = kvskiplist_init(store->mem)) != 0)
+    return ret;
+  store->wal_id = new_id(store);
+  if ((store->wal_fd = wal_open(store, store->wal_id)) < 0)
+    return ERRFILCRT;
+  if ((ret = kvsync_init(&store->sync, sync_mode, store->wal_fd, false)) != 0)
+    return ret;
+  for (i = 0; i < KVLSMSTORE_BG_THREADS; i++) {
+    if ((ret = pthread_create(&store->bg_threads[i], NULL, background,
+        store)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Looks up KEY within LIST. Returns 0 if LIST holds a value for KEY, which is
+ * placed into VALUE (if not NULL) using malloc()d memory, or ERRBLOB if that
+ * value is a reference to a blob. Returns KVSSTABLE_DELETED if LIST records
+ * KEY as deleted, else ERRNOKEY. */
+static int memtable_get(kvskiplist_t *list, char *key, char **value) {
+  kvskipnode_t *node = kvskiplist_find(list, key);
+  bool ref = false;
+  char *found;
+  if (node == NULL)
+    return ERRNOKEY;
+  if ((found = kvskiplist_value(node, &ref)) == NULL)
+    return KVSSTABLE_DELETED;
+  if (value != NULL) {
+    if ((*value = malloc(strlen(found) + 1)) == NULL)
+      return ENOMEM;
+    strcpy(*value, found);
+  }
+  return ref ? ERRBLOB : 0;
+}
+
+/* Returns the table within the sorted LEVEL which may hold KEY, or NULL. */
+static kvsstable_t *level_find(kvlsmlevel_t *level, char *key) {
+  int lo = 0, hi = level->count, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(level->tables[mid]->largest, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == level->count || strcmp(level->tables[lo]->smallest, key) > 0)
+    return NULL;
+  return level->tables[lo];
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE.
+ * Returns 0 if successful, ERRBLOB if its value is a reference to a blob,
+ * else a negative error code. If VALUE is not NULL, the entry's value will
+ * be placed into VALUE using malloc()d memory which should be free()d later. */
+int kvlsmstore_get(kvlsmstore_t *store, char *key, char **value) {
+  kvsstable_t *table;
+  int i, ret;
+  pthread_rwlock_rdlock(&store->lock);
+  ret = memtable_get(store->mem, key, value);
+  if (ret == ERRNOKEY && store->imm != NULL)
+    ret = memtable_get(store->imm, key, value);
+  for (i = store->levels[0].count - 1; i >= 0 && ret == ERRNOKEY; i--)
+    ret = kvsstable_get(store->levels[0].tables[i], key, value);
+  for (i = 1; i < KVLSMSTORE_LEVELS && ret == ERRNOKEY; i++) {
+    if ((table = level_find(&store->levels[i], key)) != NULL)
+      ret = kvsstable_get(table, key, value);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return (ret == KVSSTABLE_DELETED) ? ERRNOKEY : ret;
+}
+
+/* Finds where the value of the entry denoted by KEY is stored within STORE,
+ * placing a duplicate of its table's file descriptor (which stays valid even
+ * if the table is compacted away) into LOC. Returns 0 if successful,
+ * ERRNOTIMPL if the value is still in a memtable, ERRBLOB if it is a
+ * reference to a blob, else a negative error code. */
+int kvlsmstore_locate(kvlsmstore_t *store, char *key, kvstore_loc_t *loc) {
+  kvsstable_t *table = NULL;
+  int i, ret;
+  pthread_rwlock_rdlock(&store->lock);
+  ret = memtable_get(store->mem, key, NULL);
+  if (ret == ERRNOKEY && store->imm != NULL)
+    ret = memtable_get(store->imm, key, NULL);
+  if (ret == 0)
+    ret = ERRNOTIMPL;
+  for (i = store->levels[0].count - 1; i >= 0 && ret == ERRNOKEY; i--) {
+    table = store->levels[0].tables[i];
+    ret = kvsstable_locate(table, key, &loc->offset, &loc->length);
+  }
+  for (i = 1; i < KVLSMSTORE_LEVELS && ret == ERRNOKEY; i++) {
+    if ((table = level_find(&store->levels[i], key)) != NULL)
+      ret = kvsstable_locate(table, key, &loc->offset, &loc->length);
+  }
+  if (ret == 0 && (loc->fd = dup(table->fd)) < 0)
+    ret = ERRFILACCESS;
+  pthread_rwlock_unlock(&store->lock);
+  return (ret == KVSSTABLE_DELETED) ? ERRNOKEY : ret;
+}
+
+/* Returns true if STORE contains KEY, else false. */
+bool kvlsmstore_haskey(kvlsmstore_t *store, char *key) {
+  int ret = kvlsmstore_get(store, key, NULL);
+  return ret == 0 || ret == ERRBLOB;
+}
+
+/* Makes the memtable of STORE immutable and starts a new one and its log.
+ * There must be no immutable memtable already. Must be called with the
+ * writer lock held. Returns 0 if successful, else a negative error code. */
+static int rotate(kvlsmstore_t *store) {
+  kvskiplist_t *mem;
+  unsigned int wal_id;
+  int wal_fd, old_fd, ret;
+  if ((mem = malloc(sizeof(kvskiplist_t))) == NULL)
+    return ENOMEM;
+  if ((ret = kvskiplist_init(mem)) != 0) {
+    free(mem);
+    return ret;
+  }
+  wal_id = new_id(store);
+  if ((wal_fd = wal_open(store, wal_id)) < 0) {
+    kvskiplist_free(mem);
+    free(mem);
+    return ERRFILCRT;
+  }
+  /* The old log must be durable before it stops receiving writes. */
+  if ((ret = kvsync_switch(&store->sync, wal_fd)) != 0) {
+    close(wal_fd);
+    wal_remove(store, wal_id);
+    kvskiplist_free(mem);
+    free(mem);
+    return ret;
+  }
+  pthread_rwlock_wrlock(&store->lock);
+  store->imm = store->mem;
+  store->imm_wal_id = store->wal_id;
+  store->mem = mem;
+  old_fd = store->wal_fd;
+  store->wal_fd = wal_fd;
+  store->wal_id = wal_id;
+  pthread_rwlock_unlock(&store->lock);
+  close(old_fd);
+
+  pthread_mutex_lock(&store->bg_lock);
+  pthread_cond_broadcast(&store->bg_cond);
+  pthread_mutex_unlock(&store->bg_lock);
+  return 0;
+}
+
+/* Makes sure the memtable of STORE has room for another write, making it
+ * immutable and starting a new one if it is full. Stalls while the previous
+ * immutable memtable is still being flushed or level 0 is overfull. Must be
+ * called with the writer lock held. Returns 0 if successful, else a negative
+ * error code. */
+static int make_room(kvlsmstore_t *store) {
+  bool stall;
+  int ret;
+  while (store->mem->size >= KVLSMSTORE_MEMTABLE_SIZE) {
+    pthread_mutex_lock(&store->bg_lock);
+    pthread_rwlock_rdlock(&store->lock);
+    stall = store->imm != NULL ||
+        store->levels[0].count >= KVLSMSTORE_L0_STALL;
+    pthread_rwlock_unlock(&store->lock);
+    if (stall) {
+      if (store->stopping) {
+        pthread_mutex_unlock(&store->bg_lock);
+        return ERRFILACCESS;
+      }
+      pthread_cond_wait(&store->bg_cond, &store->bg_lock);
+      pthread_mutex_unlock(&store->bg_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&store->bg_lock);
+    if ((ret = rotate(store)) != 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Logs and applies a write of KEY and VALUE (a delete if VALUE is NULL),
+ * which is a reference to a blob if REF is set, to STORE, placing the ticket
+ * to wait on for the log record to be durable (see kvsync_wait) into TICKET.
+ * Must be called with the writer lock held. */
+static int write_entry(kvlsmstore_t *store, char *key, char *value, bool ref,
+    uint64_t *ticket) {
+  kvsstable_record_t *record;
+  size_t size;
+  int ret;
+  if ((record = record_new(key, value, ref, &size)) == NULL)
+    return ENOMEM;
+  if ((ret = make_room(store)) == 0) {
+    if (write(store->wal_fd, record, size) != size) {
+      ret = ERRFILACCESS;
+    } else {
+      *ticket = kvsync_append(&store->sync, size);
+      ret = kvskiplist_put(store->mem, key, value, ref);
+    }
+  }
+  free(record);
+  return ret;
+}
+
+/* Adds the given KEY, VALUE entry to STORE, where VALUE is a reference to a
+ * blob if REF is set. Returns 0 if successful, else a negative error code. */
+int kvlsmstore_put(kvlsmstore_t *store, char *key, char *value, bool ref) {
+  uint64_t ticket;
+  int ret;
+  pthread_mutex_lock(&store->write_lock);
+  ret = write_entry(store, key, value, ref, &ticket);
+  pthread_mutex_unlock(&store->write_lock);
+  if (ret == 0)
+    ret = kvsync_wait(&store->sync, ticket);
+  return ret;
+}
+
+/* Removes the given KEY entry from STORE by writing a tombstone. Returns 0
+ * if successful, else a negative error code. */
+int kvlsmstore_del(kvlsmstore_t *store, char *key) {
+  uint64_t ticket;
+  int ret;
+  /* The lookup may reach the tables on disk, so it is made before taking the
+   * write lock; KVStore serializes the writes of each key (see kvstore.h). */
+  ret = kvlsmstore_get(store, key, NULL);
+  if (ret != 0 && ret != ERRBLOB)
+    return ret;
+  pthread_mutex_lock(&store->write_lock);
+  ret = write_entry(store, key, NULL, false, &ticket);
+  pthread_mutex_unlock(&store->write_lock);
+  if (ret == 0)
+    ret = kvsync_wait(&store->sync, ticket);
+  return ret;
+}
+
+/* Makes every write made to STORE so far durable, whatever its sync mode.
+ * Returns 0 if successful, else a negative error code. */
+int kvlsmstore_flush(kvlsmstore_t *store) {
+  return kvsync_flush(&store->sync);
+}
+
+/* Returns true if any of the COUNT tables TABLES, which are sorted by key and
+ * disjoint, holds keys between SMALLEST and LARGEST. */
+static bool tables_overlap(kvsstable_t **tables, int count, char *smallest,
+    char *largest) {
+  int lo = 0, hi = count, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(tables[mid]->largest, smallest) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < count && strcmp(tables[lo]->smallest, largest) <= 0;
+}
+
+/* Returns true if any table of LEVEL overlaps any of the COUNT sorted,
+ * disjoint TABLES. */
+static bool level_overlaps(kvlsmlevel_t *level, kvsstable_t **tables,
+    int count) {
+  int i;
+  for (i = 0; i < level->count; i++) {
+    if (tables_overlap(tables, count, level->tables[i]->smallest,
+        level->tables[i]->largest))
+      return true;
+  }
+  return false;
+}
+
+/* Returns true if LIST holds any key within the COUNT sorted, disjoint
+ * TABLES. */
+static bool memtable_overlaps(kvskiplist_t *list, kvsstable_t **tables,
+    int count) {
+  kvskipnode_t *node;
+  for (node = kvskiplist_first(list); node != NULL;
+      node = kvskiplist_next(node)) {
+    if (tables_overlap(tables, count, node->key, node->key))
+      return true;
+  }
+  return false;
+}
+
+/* Waits until the immutable memtable of STORE, if there is one, has been
+ * flushed. Must be called with the writer lock held. Returns 0 if
+ * successful, else a negative error code. */
+static int wait_flushed(kvlsmstore_t *store) {
+  bool pending;
+  pthread_mutex_lock(&store->bg_lock);
+  for (;;) {
+    pthread_rwlock_rdlock(&store->lock);
+    pending = store->imm != NULL;
+    pthread_rwlock_unlock(&store->lock);
+    if (!pending || store->stopping)
+      break;
+    pthread_cond_wait(&store->bg_cond, &store->bg_lock);
+  }
+  pthread_mutex_unlock(&store->bg_lock);
+  return pending ? ERRFILACCESS : 0;
+}
+
+/* Links the table file SRCNAME into the directory of STORE as the table with
+ * id ID, or copies it there if it is on another filesystem. Returns 0 if
+ * successful, else a negative error code. */
+static int table_adopt(kvlsmstore_t *store, char *srcname, unsigned int id) {
+  char filename[MAX_FILENAME], *buf;
+  int src, dst, ret = 0;
+  ssize_t len;
+  if (kvstore_path(filename, "%s/%u%s", store->dirname, id,
+      KVSSTABLE_FILETYPE) != 0)
+    return ERRFILACCESS;
+  if (link(srcname, filename) == 0)
+    return 0;
+  if (errno != EXDEV)
+    return ERRFILACCESS;
+  if ((buf = malloc(KVLSMSTORE_TABLE_SIZE)) == NULL)
+    return ENOMEM;
+  if ((src = open(srcname, O_RDONLY)) < 0) {
+    free(buf);
+    return ERRFILACCESS;
+  }
+  if ((dst = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0) {
+    close(src);
+    free(buf);
+    return ERRFILCRT;
+  }
+  while (ret == 0 && (len = read(src, buf, KVLSMSTORE_TABLE_SIZE)) != 0) {
+    if (len < 0 || write(dst, buf, len) != len)
+      ret = ERRFILACCESS;
+  }
+  if (ret == 0 && fsync(dst) < 0)
+    ret = ERRFILACCESS;
+  close(src);
+  close(dst);
+  free(buf);
+  if (ret != 0)
+    remove(filename);
+  return ret;
+}
+
+/* Publishes the COUNT TABLES, which are sorted by key and disjoint, as the
+ * newest entries of STORE (see kvlsmstore.h). Returns 0 if successful, else
+ * a negative error code. */
+static int ingest_publish(kvlsmstore_t *store, kvsstable_t **tables,
+    int count) {
+  bool flush_mem, flush_imm;
+  int i, level, best = 0, ret = 0;
+  pthread_mutex_lock(&store->write_lock);
+  /* Entries still in a memtable would shadow the tables, so any memtable
+   * holding keys within them is flushed first. */
+  pthread_rwlock_rdlock(&store->lock);
+  flush_mem = memtable_overlaps(store->mem, tables, count);
+  flush_imm = store->imm != NULL &&
+      memtable_overlaps(store->imm, tables, count);
+  pthread_rwlock_unlock(&store->lock);
+  if (flush_mem || flush_imm)
+    ret = wait_flushed(store);
+  if (ret == 0 && flush_mem && (ret = rotate(store)) == 0)
+    ret = wait_flushed(store);
+  if (ret != 0) {
+    pthread_mutex_unlock(&store->write_lock);
+    return ret;
+  }
+
+  pthread_mutex_lock(&store->bg_lock);
+  pthread_rwlock_wrlock(&store->lock);
+  /* Levels being compacted into are skipped, since the compaction's output
+   * could overlap the tables. Level 0 tables may overlap anyway. */
+  for (level = 0; level < KVLSMSTORE_LEVELS; level++) {
+    if (level_overlaps(&store->levels[level], tables, count))
+      break;
+    if (level > 0 && !store->levels[level].busy)
+      best = level;
+  }
+  for (i = 0; i < count && ret == 0; i++)
+    ret = level_add(&store->levels[best], tables[i]);
+  if (best > 0)
+    level_sort(&store->levels[best]);
+  if (ret == 0)
+    ret = manifest_write(store);
+  if (ret != 0) {
+    for (i = 0; i < count; i++)
+      level_remove(&store->levels[best], tables[i]);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  pthread_cond_broadcast(&store->bg_cond);
+  pthread_mutex_unlock(&store->bg_lock);
+  pthread_mutex_unlock(&store->write_lock);
+  return ret;
+}
+
+/* Adopts the tables built for ingestion in DIRNAME (see kvlsmstore.h) into
+ * STORE, calling CALLBACK with ARG (and a NULL value) on each of their keys
+ * before any of them can be read. The tables and their list are removed
+ * from DIRNAME once they have been adopted. Returns 0 if successful,
+ * ERRCHECKSUM if the tables overlap one another, else a negative error
+ * code. */
+int kvlsmstore_ingest(kvlsmstore_t *store, char *dirname,
+    kvscan_cb_t callback, void *arg) {
+  char filename[MAX_FILENAME];
+  kvsstable_t **tables = NULL, **tmp;
+  unsigned int id, *srcids = NULL, *tmpids;
+  kvsstable_iter_t iter;
+  int i, count = 0, ret = 0;
+  FILE *file;
+  if (kvstore_path(filename, "%s/%s", dirname, KVLSMSTORE_INGEST_LIST) != 0 ||
+      (file = fopen(filename, "r")) == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && fscanf(file, "%u\n", &id) == 1) {
+    if ((tmp = realloc(tables, (count + 1) * sizeof(kvsstable_t *))) == NULL) {
+      ret = ENOMEM;
+      break;
+    }
+    tables = tmp;
+    if ((tmpids = realloc(srcids, (count + 1) * sizeof(unsigned int)))
+        == NULL) {
+      ret = ENOMEM;
+      break;
+    }
+    srcids = tmpids;
+    srcids[count] = id;
+    if ((ret = kvstore_path(filename, "%s/%u%s", dirname, id,
+        KVSSTABLE_FILETYPE)) != 0)
+      break;
+    id = new_id(store);
+    if ((ret = table_adopt(store, filename, id)) != 0)
+      break;
+    if ((ret = kvsstable_open(&tables[count], &store->io, store->dirname,
+        id)) != 0) {
+      /* table_adopt has already checked that this name fits. */
+      kvstore_path(filename, "%s/%u%s", store->dirname, id,
+          KVSSTABLE_FILETYPE);
+      remove(filename);
+      break;
+    }
+    count++;
+  }
+  fclose(file);
+
+  if (ret == 0 && count > 1)
+    qsort(tables, count, sizeof(kvsstable_t *), table_cmp);
+  for (i = 1; i < count && ret == 0; i++) {
+    if (strcmp(tables[i - 1]->largest, tables[i]->smallest) >= 0)
+      ret = ERRCHECKSUM;
+  }
+  /* Tables built offline never refer to blobs, which only the store writes;
+   * one which claims to could take over the blob of another key. */
+  for (i = 0; i < count && ret == 0; i++) {
+    ret = kvsstable_iter_init(&iter, tables[i]);
+    while (iter.valid && ret == 0) {
+      if (iter.ref)
+        ret = ERRCHECKSUM;
+      else if (iter.value != NULL && callback != NULL)
+        ret = callback(iter.key, NULL, arg);
+      if (ret == 0)
+        ret = kvsstable_iter_next(&iter);
+    }
+    kvsstable_iter_free(&iter);
+  }
+  if (ret == 0 && count > 0)
+    ret = ingest_publish(store, tables, count);
+
+  if (ret != 0) {
+    for (i = 0; i < count; i++)
+      kvsstable_close(tables[i], true);
+  } else {
+    /* Every one of these names was built before. */
+    for (i = 0; i < count; i++) {
+      kvstore_path(filename, "%s/%u%s", dirname, srcids[i],
+          KVSSTABLE_FILETYPE);
+      remove(filename);
+    }
+    kvstore_path(filename, "%s/%s", dirname, KVLSMSTORE_INGEST_LIST);
+    remove(filename);
+  }
+  free(tables);
+  free(srcids);
+  return ret;
+}
+
+/* Takes a snapshot of STORE into DIRNAME, an empty directory (see
+ * kvlsmstore.h). Returns 0 if successful, else a negative error code (or
+ * ENOMEM). */
+int kvlsmstore_snapshot(kvlsmstore_t *store, char *dirname) {
+  char filename[MAX_FILENAME], dstname[MAX_FILENAME];
+  unsigned int wal_id;
+  struct stat st;
+  int i, j, wal_fd = -1, ret = 0;
+  pthread_mutex_lock(&store->write_lock);
+  pthread_rwlock_rdlock(&store->lock);
+  /* The moment of the snapshot: no write is under way, and the memtables
+   * and levels cannot be swapped while the lock is held. */
+  wal_id = store->wal_id;
+  if (wal_filename(store, wal_id, filename) != 0 ||
+      (wal_fd = open(filename, O_RDONLY)) < 0 ||
+      fstat(store->wal_fd, &st) < 0)
+    ret = ERRFILACCESS;
+  pthread_mutex_unlock(&store->write_lock);
+  if (ret == 0 && store->imm != NULL) {
+    if ((ret = wal_filename(store, store->imm_wal_id, filename)) == 0 &&
+        (ret = kvstore_path(dstname, "%s/%u%s", dirname, store->imm_wal_id,
+        KVLSMSTORE_WAL_FILETYPE)) == 0)
+      ret = kvstore_snapshot_link(filename, dstname);
+  }
+  for (i = 0; i < KVLSMSTORE_LEVELS && ret == 0; i++) {
+    for (j = 0; j < store->levels[i].count && ret == 0; j++) {
+      if ((ret = kvstore_path(dstname, "%s/%u%s", dirname,
+          store->levels[i].tables[j]->id, KVSSTABLE_FILETYPE)) == 0)
+        ret = kvstore_snapshot_link(store->levels[i].tables[j]->filename,
+            dstname);
+    }
+  }
+  if (ret == 0)
+    ret = manifest_save(store, dirname);
+  pthread_rwlock_unlock(&store->lock);
+
+  /* The log of the memtable is still being appended to, so only what it
+   * held at the moment of the snapshot is copied. */
+  if (ret == 0) {
+    if ((ret = kvstore_path(dstname, "%s/%u%s", dirname, wal_id,
+        KVLSMSTORE_WAL_FILETYPE)) == 0)
+      ret = kvstore_snapshot_copy(wal_fd, st.st_size, dstname);
+  }
+  if (wal_fd >= 0)
+    close(wal_fd);
+  return ret;
+}
+
+/* Calls CALLBACK with ARG on every key of LIST which is not a tombstone. */
+static int memtable_keys(kvskiplist_t *list, kvscan_cb_t callback, void *arg) {
+  kvskipnode_t *node;
+  int ret = 0;
+  for (node = kvskiplist_first(list); node != NULL && ret == 0;
+      node = kvskiplist_next(node)) {
+    if (kvskiplist_value(node, NULL) != NULL)
+      ret = callback(node->key, NULL, arg);
+  }
+  return ret;
+}
+
+/* Calls CALLBACK with ARG (and a NULL value) on every key held by the
+ * memtables or tables of STORE, in no particular order. A key with values in
+ * several places may be seen more than once, and keys which have been
+ * deleted may also be seen. Returns 0 if successful, else a negative error
+ * code. */
+int kvlsmstore_keys(kvlsmstore_t *store, kvscan_cb_t callback, void *arg) {
+  kvsstable_iter_t iter;
+  int i, j, ret;
+  pthread_rwlock_rdlock(&store->lock);
+  ret = memtable_keys(store->mem, callback, arg);
+  if (ret == 0 && store->imm != NULL)
+    ret = memtable_keys(store->imm, callback, arg);
+  for (i = 0; i < KVLSMSTORE_LEVELS && ret == 0; i++) {
+    for (j = 0; j < store->levels[i].count && ret == 0; j++) {
+      ret = kvsstable_iter_init(&iter, store->levels[i].tables[j]);
+      while (iter.valid && ret == 0) {
+        if (iter.value != NULL)
+          ret = callback(iter.key, NULL, arg);
+        if (ret == 0)
+          ret = kvsstable_iter_next(&iter);
+      }
+      kvsstable_iter_free(&iter);
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret < 0 ? ret : 0;
+}
+
+/* Stops the background threads of STORE, then deletes all of its entries,
+ * tables and logs. */
+int kvlsmstore_clean(kvlsmstore_t *store) {
+  char filename[MAX_FILENAME];
+  int i, j;
+  pthread_mutex_lock(&store->bg_lock);
+  store->stopping = true;
+  pthread_cond_broadcast(&store->bg_cond);
+  pthread_mutex_unlock(&store->bg_lock);
+  for (i = 0; i < KVLSMSTORE_BG_THREADS; i++) {
+    if (store->bg_threads[i])
+      pthread_join(store->bg_threads[i], NULL);
+  }
+  kvsync_stop(&store->sync);
+
+  pthread_mutex_lock(&store->write_lock);
+  pthread_rwlock_wrlock(&store->lock);
+  if (store->wal_fd >= 0) {
+    close(store->wal_fd);
+    wal_remove(store, store->wal_id);
+  }
+  if (store->mem != NULL) {
+    kvskiplist_free(store->mem);
+    free(store->mem);
+  }
+  if (store->imm != NULL) {
+    wal_remove(store, store->imm_wal_id);
+    kvskiplist_free(store->imm);
+    free(store->imm);
+  }
+  for (i = 0; i < KVLSMSTORE_LEVELS; i++) {
+    for (j = 0; j < store->levels[i].count; j++)
+      kvsstable_close(store->levels[i].tables[j], true);
+    free(store->levels[i].tables);
+    free(store->levels[i].next_compaction);
+  }
+  if (kvstore_path(filename, "%s/%s", store->dirname, KVLSMSTORE_MANIFEST)
+      == 0)
+    remove(filename);
+  pthread_rwlock_unlock(&store->lock);
+  pthread_mutex_unlock(&store->write_lock);
+  kvio_close(&store->io);
+  return 0;
+}
+
+static int engine_init(kvstore_t *store, char *dirname) {
+  kvlsmstore_t *lsmstore = malloc(sizeof(kvlsmstore_t));
+  if (lsmstore == NULL)
+    return ENOMEM;
+  store->state = lsmstore;
+  return kvlsmstore_init(lsmstore, dirname, store->sync_mode);
+}
+
+static int engine_get(kvstore_t *store, kvkey_t *key, char **value) {
+  return kvlsmstore_get(store->state, key->str, value);
+}
+
+static int engine_put(kvstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  return kvlsmstore_put(store->state, key->str, value, ref);
+}
+
+static int engine_del(kvstore_t *store, kvkey_t *key) {
+  return kvlsmstore_del(store->state, key->str);
+}
+
+static bool engine_haskey(kvstore_t *store, kvkey_t *key) {
+  return kvlsmstore_haskey(store->state, key->str);
+}
+
+static int engine_flush(kvstore_t *store) {
+  return kvlsmstore_flush(store->state);
+}
+
+static int engine_locate(kvstore_t *store, kvkey_t *key, kvstore_loc_t *loc) {
+  return kvlsmstore_locate(store->state, key->str, loc);
+}
+
+static int engine_keys(kvstore_t *store, kvscan_cb_t callback, void *arg) {
+  return kvlsmstore_keys(store->state, callback, arg);
+}
+
+static int engine_ingest(kvstore_t *store, char *dirname,
+    kvscan_cb_t callback, void *arg) {
+  return kvlsmstore_ingest(store->state, dirname, callback, arg);
+}
+
+static int engine_snapshot(kvstore_t *store, char *dirname) {
+  return kvlsmstore_snapshot(store->state, dirname);
+}
+
+static int engine_clean(kvstore_t *store) {
+  int ret = kvlsmstore_clean(store->state);
+  free(store->state);
+  return ret;
+}
+
+/* The log-structured merge-tree engine, as used by KVStore. */
+const kvstore_engine_t kvlsmstore_engine = {
+  .name = "lsm",
+  .persistent = true,
+  .init = engine_init,
+  .get = engine_get,
+  .put = engine_put,
+  .del = engine_del,
+  .haskey = engine_haskey,
+  .keys = engine_keys,
+  .flush = engine_flush,
+  .locate = engine_locate,
+  .ingest = engine_ingest,
+  .snapshot = engine_snapshot,
+  .clean = engine_clean,
+};
@@ -0,0 +1,159 @@
+#ifndef __KV_LSM_STORE__
+#define __KV_LSM_STORE__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "kvio.h"
+#include "kvskiplist.h"
+#include "kvsstable.h"
+#include "kvstore.h"
+#include "kvsync.h"
+
+/* KVLSMStore is a log-structured merge-tree storage engine for KVStore,
+ * selected with the name "lsm". It is meant for write-heavy workloads.
+ *
+ * Writes are appended to a write-ahead log and inserted into an in-memory
+ * skiplist (the memtable, see kvskiplist.h). Once the memtable grows past
+ * KVLSMSTORE_MEMTABLE_SIZE it becomes immutable, a fresh memtable and log are
+ * started, and a background thread writes the immutable memtable out as a
+ * sorted table (see kvsstable.h) in level 0. Every write is therefore a
+ * sequential append, and tables are only ever written in bulk.
+ *
+ * Tables are organized into KVLSMSTORE_LEVELS levels. Tables within level 0
+ * may overlap one another; tables within any deeper level cover disjoint key
+ * ranges. When level 0 holds KVLSMSTORE_L0_TRIGGER tables, or a deeper level
+ * grows past its size target (KVLSMSTORE_L1_SIZE, growing tenfold per level),
+ * a background thread merges tables from that level with the overlapping
+ * tables of the next level, dropping overwritten values (and, at the bottom,
+ * deleted keys). Up to KVLSMSTORE_BG_THREADS flushes and compactions touching
+ * different levels run at once. Writers stall while an immutable memtable is
+ * still waiting to be flushed, or level 0 holds KVLSMSTORE_L0_STALL tables.
+ *
+ * A GET checks the memtable, the immutable memtable, every level 0 table
+ * from newest to oldest, and then at most one table per deeper level, and
+ * stops at the first table which mentions the key.
+ *
+ * The set of live tables and the level of each is recorded in a manifest file
+ * (KVLSMSTORE_MANIFEST) within the store directory, which is atomically
+ * replaced whenever it changes. On initialization, the tables named by the
+ * manifest are opened, any other tables (left behind by an interrupted flush
+ * or compaction) are deleted, and any write-ahead logs are replayed and
+ * flushed to level 0.
+ *
+ * Appends to the write-ahead log are made durable according to the store's
+ * sync mode (see kvsync.h), with writers waiting for the sync after releasing
+ * the writer lock so that concurrent writers share it. A log is synced before
+ * a new one replaces it.
+ *
+ * Table blocks are read through the store's KVIO (see kvio.h), so on hosts
+ * with io_uring the block reads of concurrent GETs share submissions.
+ *
+ * Tables built elsewhere (by kvingest, see main/kvingest.c) are adopted with
+ * kvlsmstore_ingest. The directory they were built in holds the tables,
+ * which must cover disjoint key ranges, and a list of their ids
+ * (KVLSMSTORE_INGEST_LIST), written once they are complete. Each table is
+ * linked (or, across filesystems, copied) into the store directory under a
+ * fresh id, and read through, failing with ERRCHECKSUM if any record in
+ * them claims to refer to a blob (see kvblob.h), which only the store itself
+ * writes. All of them are then published with one manifest write, so a
+ * crash leaves either none of them in the store or all of them. Their
+ * entries are newer than any already in the store: a memtable holding keys
+ * within their ranges is flushed first, and the tables go to the deepest
+ * level which, like every level above it, holds no table overlapping them,
+ * or else to level 0 as its newest tables. Writers wait while the tables are
+ * published, but not while they are linked or copied.
+ *
+ * A snapshot (see kvstore_snapshot) is taken with the writer lock held just
+ * long enough to note the length of the write-ahead log of the memtable,
+ * and with the lock held for reading (which holds off flushes and
+ * compactions, but not writers) while the live tables and the log of the
+ * immutable memtable, if there is one, are hard-linked into the snapshot
+ * directory and a manifest naming the tables is written there. The prefix
+ * of the memtable's log which was noted is then copied, with writers
+ * appending to the log all the while. A store opened on the snapshot
+ * replays both logs, as after a crash.
+ */
+
+/* The filetype to append to the filenames of write-ahead logs. */
+#define KVLSMSTORE_WAL_FILETYPE ".wal"
+
+/* The name of the manifest file within the store directory. */
+#define KVLSMSTORE_MANIFEST "MANIFEST"
+
+/* The name of the list of tables within a directory built for ingestion. */
+#define KVLSMSTORE_INGEST_LIST "INGEST"
+
+/* The number of levels of tables. */
+#define KVLSMSTORE_LEVELS 5
+
+/* The size past which the memtable is made immutable and flushed. */
+#define KVLSMSTORE_MEMTABLE_SIZE (4 * 1024 * 1024)
+
+/* The size past which compaction output is split into a new table. */
+#define KVLSMSTORE_TABLE_SIZE (2 * 1024 * 1024)
+
+/* The number of level 0 tables which triggers a compaction into level 1. */
+#define KVLSMSTORE_L0_TRIGGER 4
+
+/* The number of level 0 tables at which writers stall for compaction. */
+#define KVLSMSTORE_L0_STALL 12
+
+/* The target size of level 1. Each deeper level is ten times larger. */
+#define KVLSMSTORE_L1_SIZE (10 * 1024 * 1024)
+
+/* The number of background threads which flush and compact tables. */
+#define KVLSMSTORE_BG_THREADS 2
+
+/* A single level of tables. */
+typedef struct {
+  kvsstable_t **tables;         /* The tables in this level. Sorted by key below level 0, else oldest first. */
+  int count;                    /* The number of tables in this level. */
+  off_t size;                   /* The total size of the tables in this level. */
+  bool busy;                    /* true while a compaction is reading or writing this level. */
+  char *next_compaction;        /* The key after which the next compaction of this level starts. */
+} kvlsmlevel_t;
+
+/* A KVLSMStore. */
+typedef struct {
+  char dirname[MAX_FILENAME];   /* The name of the directory used to store tables and logs. */
+  kvskiplist_t *mem;            /* The memtable which receives writes. */
+  kvskiplist_t *imm;            /* The memtable being flushed, or NULL. */
+  int wal_fd;                   /* An open file descriptor for the write-ahead log of MEM. */
+  unsigned int wal_id;          /* The id of the write-ahead log of MEM. */
+  unsigned int imm_wal_id;      /* The id of the write-ahead log of IMM. */
+  unsigned int next_id;         /* The id to give the next table or log. */
+  kvlsmlevel_t levels[KVLSMSTORE_LEVELS]; /* The levels of tables. */
+  pthread_rwlock_t lock;        /* Protects MEM, IMM and LEVELS. Held for writing only to swap them. */
+  pthread_mutex_t write_lock;   /* Serializes writers. */
+  kvsync_t sync;                /* Makes appends to the write-ahead log of MEM durable. */
+  kvio_t io;                    /* Performs reads of table blocks. */
+  pthread_mutex_t bg_lock;      /* Protects the scheduling state of the background threads. */
+  pthread_cond_t bg_cond;       /* Signalled whenever there may be background work, or it finishes. */
+  bool flushing;                /* true while IMM is being written out. */
+  bool stopping;                /* true once the background threads have been asked to exit. */
+  pthread_t bg_threads[KVLSMSTORE_BG_THREADS]; /* The background threads. */
+} kvlsmstore_t;
+
+extern const kvstore_engine_t kvlsmstore_engine;
+
+int kvlsmstore_init(kvlsmstore_t *, char *dirname, kvsync_mode_t sync_mode);
+
+int kvlsmstore_get(kvlsmstore_t *, char *key, char **value);
+int kvlsmstore_locate(kvlsmstore_t *, char *key, kvstore_loc_t *loc);
+int kvlsmstore_put(kvlsmstore_t *, char *key, char *value, bool ref);
+int kvlsmstore_del(kvlsmstore_t *, char *key);
+
+bool kvlsmstore_haskey(kvlsmstore_t *, char *key);
+
+int kvlsmstore_flush(kvlsmstore_t *);
+
+int kvlsmstore_ingest(kvlsmstore_t *, char *dirname, kvscan_cb_t callback,
+    void *arg);
+int kvlsmstore_snapshot(kvlsmstore_t *, char *dirname);
+
+int kvlsmstore_keys(kvlsmstore_t *, kvscan_cb_t callback, void *arg);
+
+int kvlsmstore_clean(kvlsmstore_t *);
+
+#endif
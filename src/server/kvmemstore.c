@@ -0,0 +1,152 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "kvmemstore.h"
+
+/* Initializes kvmemstore STORE to be empty. Returns 0 if successful, else a
+ * negative error code. */
+int kvmemstore_init(kvmemstore_t *store) {
+  store->entries = NULL;
+  return pthread_rwlock_init(&store->lock, NULL);
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE.
+ * Returns 0 if successful, ERRBLOB if its value is a reference to a blob,
+ * else a negative error code. If VALUE is not NULL,
+ * the entry's value will be placed into VALUE using malloc()d memory which
+ * should be free()d later. */
+int kvmemstore_get(kvmemstore_t *store, char *key, char **value) {
+  kvmementry_t *entry;
+  bool ref;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRNOKEY;
+  }
+  if (value != NULL) {
+    *value = malloc(strlen(entry->value) + 1);
+    if (*value == NULL) {
+      pthread_rwlock_unlock(&store->lock);
+      return ENOMEM;
+    }
+    strcpy(*value, entry->value);
+  }
+  ref = entry->ref;
+  pthread_rwlock_unlock(&store->lock);
+  return ref ? ERRBLOB : 0;
+}
+
+/* Returns true if STORE contains KEY, else false. */
+bool kvmemstore_haskey(kvmemstore_t *store, char *key) {
+  int ret = kvmemstore_get(store, key, NULL);
+  return ret == 0 || ret == ERRBLOB;
+}
+
+/* Adds the given KEY, VALUE entry to STORE, replacing any existing value.
+ * VALUE is a reference to a blob if REF is set. Returns 0 if successful, else
+ * a negative error code. */
+int kvmemstore_put(kvmemstore_t *store, char *key, char *value, bool ref) {
+  kvmementry_t *entry;
+  char *copy = malloc(strlen(value) + 1);
+  if (copy == NULL)
+    return ENOMEM;
+  strcpy(copy, value);
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry != NULL) {
+    free(entry->value);
+    entry->value = copy;
+    entry->ref = ref;
+    pthread_rwlock_unlock(&store->lock);
+    return 0;
+  }
+  entry = calloc(1, sizeof(kvmementry_t));
+  if (entry == NULL || (entry->key = malloc(strlen(key) + 1)) == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    free(entry);
+    free(copy);
+    return ENOMEM;
+  }
+  strcpy(entry->key, key);
+  entry->value = copy;
+  entry->ref = ref;
+  HASH_ADD_KEYPTR(hh, store->entries, entry->key, strlen(entry->key), entry);
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+/* Removes the given KEY entry from STORE. Returns 0 if successful, else a
+ * negative error code. */
+int kvmemstore_del(kvmemstore_t *store, char *key) {
+  kvmementry_t *entry;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRNOKEY;
+  }
+  HASH_DELETE(hh, store->entries, entry);
+  pthread_rwlock_unlock(&store->lock);
+  free(entry->key);
+  free(entry->value);
+  free(entry);
+  return 0;
+}
+
+/* Deletes all current entries in STORE. */
+int kvmemstore_clean(kvmemstore_t *store) {
+  kvmementry_t *entry, *tmp;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_ITER(hh, store->entries, entry, tmp) {
+    HASH_DELETE(hh, store->entries, entry);
+    free(entry->key);
+    free(entry->value);
+    free(entry);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+static int engine_init(kvstore_t *store, char *dirname) {
+  kvmemstore_t *memstore = malloc(sizeof(kvmemstore_t));
+  if (memstore == NULL)
+    return ENOMEM;
+  store->state = memstore;
+  return kvmemstore_init(memstore);
+}
+
+static int engine_get(kvstore_t *store, kvkey_t *key, char **value) {
+  return kvmemstore_get(store->state, key->str, value);
+}
+
+static int engine_put(kvstore_t *store, kvkey_t *key, char *value,
+    bool ref) {
+  return kvmemstore_put(store->state, key->str, value, ref);
+}
+
+static int engine_del(kvstore_t *store, kvkey_t *key) {
+  return kvmemstore_del(store->state, key->str);
+}
+
+static bool engine_haskey(kvstore_t *store, kvkey_t *key) {
+  return kvmemstore_haskey(store->state, key->str);
+}
+
+static int engine_clean(kvstore_t *store) {
+  int ret = kvmemstore_clean(store->state);
+  free(store->state);
+  return ret;
+}
+
+/* The in-memory engine, as used by KVStore. */
+const kvstore_engine_t kvmemstore_engine = {
+  .name = "mem",
+  .persistent = false,
+  .init = engine_init,
+  .get = engine_get,
+  .put = engine_put,
+  .del = engine_del,
+  .haskey = engine_haskey,
+  .clean = engine_clean,
+};
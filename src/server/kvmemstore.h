@@ -0,0 +1,44 @@
+#ifndef __KV_MEM_STORE__
+#define __KV_MEM_STORE__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "uthash.h"
+#include "kvconstants.h"
+#include "kvstore.h"
+
+/* KVMemStore is an in-memory storage engine for KVStore, selected with the
+ * name "mem".
+ *
+ * Entries are kept in a hash table and never touch disk, so they are lost
+ * when the server exits. This is meant for cache-tier servers, whose data can
+ * always be refetched, and as a baseline when comparing the other engines.
+ */
+
+/* A single entry within a KVMemStore. */
+typedef struct {
+  char *key;                    /* The entry's key. */
+  char *value;                  /* The entry's value. */
+  bool ref;                     /* Whether VALUE is a reference to a blob. */
+  UT_hash_handle hh;            /* Makes this structure hashable by uthash. */
+} kvmementry_t;
+
+/* A KVMemStore. */
+typedef struct {
+  kvmementry_t *entries;        /* All entries, a uthash table keyed on the entry's key. */
+  pthread_rwlock_t lock;        /* The lock used to make KVMemStore's functions thread-safe. */
+} kvmemstore_t;
+
+extern const kvstore_engine_t kvmemstore_engine;
+
+int kvmemstore_init(kvmemstore_t *);
+
+int kvmemstore_get(kvmemstore_t *, char *key, char **value);
+int kvmemstore_put(kvmemstore_t *, char *key, char *value, bool ref);
+int kvmemstore_del(kvmemstore_t *, char *key);
+
+bool kvmemstore_haskey(kvmemstore_t *, char *key);
+
+int kvmemstore_clean(kvmemstore_t *);
+
+#endif
@@ -1,31 +1,118 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <json-c/json.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <stdio.h>
 #include <string.h>
 #include "kvmessage.h"
 
+/* Reads exactly SIZE bytes from SOCKFD into BUF. Returns 0 if successful,
+ * else -1. */
+static int read_all(int sockfd, void *buf, size_t size) {
+  ssize_t n;
+  while (size > 0) {
+    if ((n = read(sockfd, buf, size)) <= 0)
+      return -1;
+    buf = (char *) buf + n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Reads up to SIZE bytes of the value of MESSAGE, which was left on the
+ * socket by kvmessage_parse (see kvmessage.h), into BUF. Returns the number
+ * of bytes read, which is 0 only once the whole value has been read, or -1
+ * if the value cannot be read or its frames are malformed. */
+ssize_t kvmessage_read_value(kvmessage_t *message, char *buf, size_t size) {
+  size_t done = 0, want;
+  uint32_t frame;
+  while (done < size && (size_t) message->value_offset < message->value_len) {
+    if (message->frame_left == 0) {
+      if (read_all(message->value_fd, &frame, 4) < 0)
+        return -1;
+      frame = ntohl(frame);
+      if (frame == 0 || frame > KVMESSAGE_FRAME_SIZE ||
+          frame > message->value_len - message->value_offset)
+        return -1;
+      message->frame_left = frame;
+    }
+    want = size - done;
+    if (want > message->frame_left)
+      want = message->frame_left;
+    if (read_all(message->value_fd, buf + done, want) < 0)
+      return -1;
+    done += want;
+    message->frame_left -= want;
+    message->value_offset += want;
+  }
+  /* The empty frame which ends the value is read with its last byte. */
+  if (done > 0 && (size_t) message->value_offset == message->value_len) {
+    if (read_all(message->value_fd, &frame, 4) < 0 || frame != 0)
+      return -1;
+  }
+  return done;
+}
+
+/* Reads the whole of the value of MESSAGE, which was left on the socket by
+ * kvmessage_parse, into BUF, which must hold VALUE_LEN bytes. Returns 0 if
+ * successful, else -1. */
+static int read_value_all(kvmessage_t *message, char *buf) {
+  size_t done = 0;
+  ssize_t n;
+  while (done < message->value_len) {
+    if ((n = kvmessage_read_value(message, buf + done,
+        message->value_len - done)) <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+/* Reads and discards whatever remains of the value of MESSAGE, which was
+ * left on the socket by kvmessage_parse, so that a reply can be sent.
+ * Returns 0 if successful, else -1. */
+int kvmessage_skip_value(kvmessage_t *message) {
+  char buf[4096];
+  ssize_t n;
+  while ((n = kvmessage_read_value(message, buf, sizeof(buf))) > 0)
+    ;
+  return (int) n;
+}
+
 /* Receives and returns a message from socket SOCKFD.
  * Returns NULL if there is an error. */
 kvmessage_t *kvmessage_parse(int sockfd) {
   json_object *new_obj;
-  kvmessage_t *msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
-  int size;
+  kvmessage_t *msg;
+  uint32_t size;
+  char *buffer;
 
   /* First read the size of the incoming message */
-  if (read(sockfd, &size, 4) < 4) {
+  if (read_all(sockfd, &size, 4) < 0) {
     return NULL;
   }
   /* Then create the buffer and read in the data */
   size = ntohl(size);
-  char buffer[size];
-  if (read(sockfd, buffer, size) < size) {
+  if (size > KVMESSAGE_MAX_SIZE || (buffer = malloc(size + 1)) == NULL) {
+    return NULL;
+  }
+  if (read_all(sockfd, buffer, size) < 0) {
+    free(buffer);
+    return NULL;
+  }
+  buffer[size] = '\0';
+  if ((msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t))) == NULL) {
+    free(buffer);
     return NULL;
   }
 
   struct json_object *value_obj;
   new_obj = json_tokener_parse(buffer);
+  free(buffer);
   if (json_object_object_get_ex(new_obj, "type", &value_obj)) {
     int type = json_object_get_int(value_obj);
     msg->type = type;
@@ -36,6 +123,7 @@ kvmessage_t *kvmessage_parse(int sockfd) {
     char *key_buf = calloc(1, strlen(key) + 1);
     memcpy(key_buf, key, strlen(key) + 1);
     msg->key = key_buf;
+    kvkey_init(&msg->key_desc, msg->key);
   }
   if (json_object_object_get_ex(new_obj, "value", &value_obj)) {
     const char *value = json_object_get_string(value_obj);
@@ -43,14 +131,105 @@ kvmessage_t *kvmessage_parse(int sockfd) {
     memcpy(value_buf, value, strlen(value) + 1);
     msg->value = value_buf;
   }
+  if (json_object_object_get_ex(new_obj, "vallen", &value_obj)) {
+    /* The value follows the JSON in frames; see kvmessage.h. */
+    int64_t vallen = json_object_get_int64(value_obj);
+    free(msg->value);
+    msg->value = NULL;
+    msg->value_fd = sockfd;
+    msg->value_len = vallen;
+    if (vallen <= 0 || vallen > MAX_BLOB_VALLEN || (vallen <= MAX_VALLEN &&
+        ((msg->value = malloc(vallen + 1)) == NULL ||
+        read_value_all(msg, msg->value) < 0 ||
+        memchr(msg->value, '\0', vallen) != NULL))) {
+      json_object_put(new_obj);
+      kvmessage_free(msg);
+      return NULL;
+    }
+    if (msg->value != NULL) {
+      /* The whole value has been read. */
+      msg->value[vallen] = '\0';
+      msg->value_len = 0;
+    }
+  }
   if (json_object_object_get_ex(new_obj, "message", &value_obj)) {
     const char *message = json_object_get_string(value_obj);
     char *message_buf = calloc(1, strlen(message) + 1);
     memcpy(message_buf, message, strlen(message) + 1);
     msg->message = message_buf;
   }
+  if (json_object_object_get_ex(new_obj, "limit", &value_obj)) {
+    msg->limit = json_object_get_int(value_obj);
+  }
+  struct json_object *keys_obj, *values_obj = NULL, *entry_obj;
+  if (json_object_object_get_ex(new_obj, "keys", &keys_obj)) {
+    unsigned int i, n;
+    bool has_values = json_object_object_get_ex(new_obj, "values",
+        &values_obj);
+    /* The entries come from the client, so their types and number are
+     * checked before anything is allocated for them. Every key must have a
+     * value (or null) if any does, so that none is silently dropped. */
+    if (!json_object_is_type(keys_obj, json_type_array) ||
+        (has_values && !json_object_is_type(values_obj, json_type_array)) ||
+        (n = json_object_array_length(keys_obj)) > MAX_BATCH_ENTRIES ||
+        (has_values && json_object_array_length(values_obj) != n))
+      goto invalid;
+    msg->keys = calloc(n + 1, sizeof(char *));
+    if (has_values)
+      msg->values = calloc(n + 1, sizeof(char *));
+    if (msg->keys == NULL || (has_values && msg->values == NULL))
+      goto invalid;
+    for (i = 0; i < n; i++) {
+      entry_obj = json_object_array_get_idx(keys_obj, i);
+      if (!json_object_is_type(entry_obj, json_type_string) ||
+          (msg->keys[i] = strdup(json_object_get_string(entry_obj))) == NULL)
+        goto invalid;
+      msg->num_entries = i + 1;
+      if (!has_values)
+        continue;
+      /* A null value denotes a key without one. */
+      entry_obj = json_object_array_get_idx(values_obj, i);
+      if (entry_obj == NULL)
+        continue;
+      if (!json_object_is_type(entry_obj, json_type_string) ||
+          (msg->values[i] = strdup(json_object_get_string(entry_obj))) == NULL)
+        goto invalid;
+    }
+    msg->key_descs = kvkey_array(msg->keys, msg->num_entries);
+  }
   json_object_put(new_obj);
   return msg;
+
+invalid:
+  json_object_put(new_obj);
+  kvmessage_free(msg);
+  return NULL;
+}
+
+/* Sends the LEN bytes at OFFSET within FD on socket SOCKFD in frames (see
+ * kvmessage.h), without copying them through user space. Returns the number
+ * of bytes which were sent, including the headers of the frames. */
+static int send_file(int sockfd, int fd, off_t offset, size_t len) {
+  size_t sent = 0, frame_sent, frame;
+  uint32_t header;
+  ssize_t n;
+  while (len > 0) {
+    frame = (len > KVMESSAGE_FRAME_SIZE) ? KVMESSAGE_FRAME_SIZE : len;
+    header = htonl(frame);
+    if (send(sockfd, &header, 4, MSG_MORE) != 4)
+      return sent;
+    sent += 4;
+    for (frame_sent = 0; frame_sent < frame; frame_sent += n) {
+      if ((n = sendfile(sockfd, fd, &offset, frame - frame_sent)) <= 0)
+        return sent + frame_sent;
+    }
+    sent += frame;
+    len -= frame;
+  }
+  header = 0;
+  if (send(sockfd, &header, 4, 0) == 4)
+    sent += 4;
+  return sent;
 }
 
 /* Sends MESSAGE on socket SOCKFD. Includes whichever fields are
@@ -62,7 +241,10 @@ int kvmessage_send(kvmessage_t *message, int sockfd) {
   if (message->key) {
     json_object_object_add(json, "key", json_object_new_string(message->key));
   }
-  if (message->value) {
+  if (message->value_len) {
+    json_object_object_add(json, "vallen",
+        json_object_new_int64(message->value_len));
+  } else if (message->value) {
     json_object_object_add(json, "value",
         json_object_new_string(message->value));
   }
@@ -70,23 +252,77 @@ int kvmessage_send(kvmessage_t *message, int sockfd) {
     json_object_object_add(json, "message",
         json_object_new_string(message->message));
   }
+  if (message->limit) {
+    json_object_object_add(json, "limit", json_object_new_int(message->limit));
+  }
+  if (message->keys) {
+    json_object *keys = json_object_new_array();
+    json_object *values = message->values ? json_object_new_array() : NULL;
+    unsigned int i;
+    for (i = 0; i < message->num_entries; i++) {
+      json_object_array_add(keys, json_object_new_string(message->keys[i]));
+      if (values != NULL)
+        json_object_array_add(values, message->values[i] == NULL ? NULL :
+            json_object_new_string(message->values[i]));
+    }
+    json_object_object_add(json, "keys", keys);
+    if (values != NULL)
+      json_object_object_add(json, "values", values);
+  }
   const char *json_string = json_object_to_json_string(json);
   int size = htonl(strlen(json_string));
-  sent += write(sockfd, &size, 4);
-  sent += write(sockfd, json_string, strlen(json_string));
+  /* Hold back a partial packet if the value is still to follow. */
+  int flags = message->value_len ? MSG_MORE : 0;
+  sent += send(sockfd, &size, 4, MSG_MORE);
+  sent += send(sockfd, json_string, strlen(json_string), flags);
   json_object_put(json);
+  if (message->value_len) {
+    sent += send_file(sockfd, message->value_fd, message->value_offset,
+        message->value_len);
+  }
   return sent;
 }
 
+/* Frees the KEYS and VALUES of MESSAGE, every entry within them, and the
+ * descriptors of KEYS. Either array may already have been taken (and set to
+ * NULL). */
+void kvmessage_free_entries(kvmessage_t *message) {
+  unsigned int i;
+  for (i = 0; i < message->num_entries; i++) {
+    if (message->keys)
+      free(message->keys[i]);
+    if (message->values)
+      free(message->values[i]);
+  }
+  free(message->keys);
+  free(message->values);
+  free(message->key_descs);
+  message->keys = NULL;
+  message->values = NULL;
+  message->key_descs = NULL;
+  message->num_entries = 0;
+}
+
+/* Frees the VALUE of MESSAGE, or drops the reference to it if it is held in
+ * VALUE_BUF. */
+void kvmessage_free_value(kvmessage_t *message) {
+  if (message->value_buf != NULL)
+    kvbuf_unref(message->value_buf);
+  else
+    free(message->value);
+  message->value = NULL;
+  message->value_buf = NULL;
+}
+
 /* Frees the memory for MESSAGE. Assumes that the message itself and all
  * fields were allocated using malloc/calloc (which will be the case for a
  * message created using kvmessage_parse). */
 void kvmessage_free(kvmessage_t *message) {
   if (message->key)
     free(message->key);
-  if (message->value)
-    free(message->value);
+  kvmessage_free_value(message);
   if (message->message)
     free(message->message);
+  kvmessage_free_entries(message);
   free(message);
 }
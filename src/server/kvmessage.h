@@ -1,7 +1,11 @@
 #ifndef __KV_MESSAGE__
 #define __KV_MESSAGE__
 
+#include <stddef.h>
+#include <sys/types.h>
+#include "kvbuf.h"
 #include "kvconstants.h"
+#include "kvkey.h"
 
 /* KVMessage is used to send messages across sockets.
  *
@@ -12,19 +16,80 @@
  * kvmessage_parse reads the first four bytes of the message, uses this to determine
  * the size of the remainder of the message, then parses the remainder of the message
  * as JSON and populates whichever fields of the message are present in the incoming JSON.
+ * A size larger than KVMESSAGE_MAX_SIZE is rejected before anything is allocated
+ * for it, since it comes from the peer.
+ *
+ * Messages which carry several entries (such as SCANRESP) hold them in KEYS and
+ * VALUES, which are sent as two JSON arrays of NUM_ENTRIES strings each.
+ * VALUES may be NULL for messages which carry only keys (MGETREQ and MDELREQ),
+ * and an entry of VALUES may be NULL (sent as a JSON null) for a key which
+ * has no value, as in an MGETRESP.
+ *
+ * kvmessage_parse also describes every key it receives (see kvkey.h), in
+ * KEY_DESC for KEY and in KEY_DESCS for KEYS, so that the layers which then
+ * handle the request can use the key's length and hashes without computing
+ * them again. The descriptors point into KEY and KEYS, and are not sent.
+ *
+ * A message may also carry its value after the JSON rather than within it.
+ * The JSON then holds a "vallen" field instead of "value", and is followed by
+ * the value in frames (which are not counted in the size in the first four
+ * bytes): each frame is a four-byte length of at most KVMESSAGE_FRAME_SIZE,
+ * followed by that many bytes of the value, and an empty frame ends it.
+ * kvmessage_send does this whenever VALUE_LEN is set, sending each frame
+ * straight from VALUE_FD to the socket with sendfile() so that the value is
+ * never copied through user space.
+ *
+ * kvmessage_parse reads a value of at most MAX_VALLEN bytes sent this way
+ * back into VALUE, so receivers need not know how it was sent; like any
+ * value held in VALUE it is a string, so one holding a NUL byte is
+ * rejected. Only a longer value is binary-safe. A longer
+ * value, of at most MAX_BLOB_VALLEN bytes, is left on the socket: VALUE is
+ * NULL, VALUE_LEN is its length and VALUE_FD the socket, and the receiver
+ * reads it a piece at a time with kvmessage_read_value (or discards it with
+ * kvmessage_skip_value, which must be done before replying), so that the
+ * memory a request takes does not grow with its value.
+ *
+ * A message may hold its VALUE by reference rather than own it, when VALUE
+ * is the DATA of the buffer VALUE_BUF (see kvbuf.h), such as a value shared
+ * with the cache. kvmessage_free then drops the reference instead of freeing
+ * VALUE.
  */
 
+/* The largest JSON accepted by kvmessage_parse, which comfortably holds
+ * MAX_BATCH_ENTRIES (or MAX_SCAN_ENTRIES) entries of the longest key and
+ * value even with every byte of them escaped. */
+#define KVMESSAGE_MAX_SIZE (16 * 1024 * 1024)
+
+/* The largest frame of a value sent after the JSON of a message. */
+#define KVMESSAGE_FRAME_SIZE (64 * 1024)
+
 typedef struct {
   msgtype_t type;    /* The type of this message. */
   char *key;         /* The key this message stores. May be NULL, depending on type. */
   char *value;       /* The value this message stores. May be NULL, depending on type. */
+  kvbuf_t *value_buf; /* If not NULL, a reference to the buffer which holds VALUE. */
   char *message;     /* The message this message stores. May be NULL, depending on type. */
+  char **keys;       /* The keys of the entries this message stores. May be NULL, depending on type. */
+  char **values;     /* The values of the entries this message stores, parallel to KEYS. */
+  unsigned int num_entries; /* The number of entries in KEYS and VALUES. */
+  unsigned int limit; /* The maximum number of entries requested, or 0 for no limit. */
+  int value_fd;      /* If VALUE_LEN is not 0, the file from which the value is sent instead of VALUE, or the socket it is still to be read from. */
+  off_t value_offset; /* The offset of the value within VALUE_FD, or the number of bytes of it read from the socket. */
+  size_t value_len;  /* The length of the value within VALUE_FD, or 0 to send VALUE. */
+  size_t frame_left; /* The number of bytes of the current frame still to be read from the socket. */
+  kvkey_t key_desc;  /* Describes KEY, if it was received by kvmessage_parse. */
+  kvkey_t *key_descs; /* Describes each of KEYS, if they were received by kvmessage_parse. */
 } kvmessage_t;
 
 kvmessage_t *kvmessage_parse(int sockfd);
 
 int kvmessage_send(kvmessage_t *, int sockfd);
 
+ssize_t kvmessage_read_value(kvmessage_t *, char *buf, size_t size);
+int kvmessage_skip_value(kvmessage_t *);
+
+void kvmessage_free_value(kvmessage_t *);
+void kvmessage_free_entries(kvmessage_t *);
 void kvmessage_free(kvmessage_t *);
 
 #endif
@@ -2,7 +2,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "kvconstants.h"
 #include "kvcache.h"
 #include "kvstore.h"
@@ -11,22 +14,73 @@
 #include "tpclog.h"
 #include "socket_server.h"
 
+/* Checks that the directory of STORE was last used as store INDEX of COUNT,
+ * recording that it is if it has not been used as any. Returns 0 if
+ * successful, ERRSHARD if it was used as another, else ERRFILACCESS. */
+static int shard_check(kvstore_t *store, unsigned int index,
+    unsigned int count) {
+  char filename[MAX_FILENAME];
+  unsigned int old_index, old_count;
+  FILE *file;
+  int ret = 0;
+  sprintf(filename, "%s/%s", store->dirname, KVSERVER_SHARD_FILENAME);
+  if ((file = fopen(filename, "r")) != NULL) {
+    if (fscanf(file, "%u/%u", &old_index, &old_count) != 2)
+      ret = ERRFILACCESS;
+    else if (old_index != index || old_count != count)
+      ret = ERRSHARD;
+    fclose(file);
+    return ret;
+  }
+  if (errno != ENOENT || (file = fopen(filename, "w")) == NULL)
+    return ERRFILACCESS;
+  if (fprintf(file, "%u/%u\n", index, count) < 0)
+    ret = ERRFILACCESS;
+  if (fclose(file) != 0)
+    ret = ERRFILACCESS;
+  return ret;
+}
+
 /* Initializes a kvserver. Will return 0 if successful, or a negative error
- * code if not. DIRNAME is the directory which should be used to store entries
- * for this server.  The server's cache will have NUM_SETS cache sets, each
- * with ELEM_PER_SET elements.  HOSTNAME and PORT indicate where SERVER will be
- * made available for requests.  USE_TPC indicates whether this server should
- * use TPC logic (for PUTs and DELs) or not. */
-int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
-    unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
-    int port, bool use_tpc) {
+ * code if not. DIRNAMES are the NUM_DIRS directories, at most
+ * KVSERVER_MAX_STORES, which should be used to store entries for this
+ * server, each holding a store of its own; they must be given in the same
+ * order every time, or initialization fails with ERRSHARD. ENGINE names the
+ * storage engine which should store them (NULL for the default; see
+ * kvstore.h), which makes writes durable according to SYNC_MODE (see
+ * kvsync.h), verifying the checksums of what it reads if VERIFY is set and
+ * compressing values if COMPRESS is set.  The server's cache will have
+ * NUM_SETS cache sets, which share a budget of CACHE_BYTES bytes and keep
+ * entries according to CACHE_POLICY (see kvcache.h).  HOSTNAME and PORT
+ * indicate where SERVER will be made available for requests.  USE_TPC
+ * indicates whether this server should use TPC logic (for PUTs and DELs) or
+ * not, and keeps its log in the first directory. */
+int kvserver_init(kvserver_t *server, char **dirnames, unsigned int num_dirs,
+    const char *engine, kvsync_mode_t sync_mode, bool verify, bool compress,
+    unsigned int num_sets, size_t cache_bytes, kvcache_policy_t cache_policy,
+    unsigned int max_threads, const char *hostname, int port, bool use_tpc) {
+  unsigned int i;
   int ret;
-  ret = kvcache_init(&server->cache, num_sets, elem_per_set);
-  if (ret < 0) return ret;
-  ret = kvstore_init(&server->store, dirname);
+  server->num_stores = 0;
+  server->ingest_root = NULL;
+  server->snapshot_root = NULL;
+  if (num_dirs == 0 || num_dirs > KVSERVER_MAX_STORES)
+    return ERRSHARD;
+  ret = kvcache_init(&server->cache, num_sets, cache_bytes, cache_policy);
   if (ret < 0) return ret;
+  for (i = 0; i < num_dirs; i++) {
+    ret = kvstore_init(&server->stores[i], dirnames[i], engine, sync_mode,
+        verify, compress);
+    if (ret < 0) return ret;
+    server->num_stores++;
+    /* Entries which do not outlive the process cannot be misplaced. */
+    if (server->stores[i].engine->persistent) {
+      ret = shard_check(&server->stores[i], i, num_dirs);
+      if (ret < 0) return ret;
+    }
+  }
   if (use_tpc) {
-      ret = tpclog_init(&server->log, dirname);
+      ret = tpclog_init(&server->log, dirnames[0]);
       if (ret < 0) return ret;
   }
   server->hostname = (char *)malloc(strlen(hostname) + 1);
@@ -61,14 +115,79 @@ int kvserver_register_master(kvserver_t *server, int sockfd) {
   return 0;
 }
 
+/* Returns the index of the store which holds KEY on a server with
+ * NUM_STORES stores. The high bits of a multiplicative hash of hash(key) pick
+ * it, since the low bits of hash(key) pick the key's cache set and its hash
+ * chain within the "file" engine. */
+unsigned int kvserver_store_index(kvkey_t *key, unsigned int num_stores) {
+  return (unsigned int) (((uint64_t) key->hash * 0x9e3779b97f4a7c15ULL) >> 32)
+      % num_stores;
+}
+
+/* Returns the index of the store of SERVER which holds KEY. */
+static unsigned int store_index(kvserver_t *server, kvkey_t *key) {
+  return kvserver_store_index(key, server->num_stores);
+}
+
+/* Returns the store of SERVER which holds KEY. */
+static kvstore_t *key_store(kvserver_t *server, kvkey_t *key) {
+  return &server->stores[store_index(server, key)];
+}
+
+/* A batch of keys grouped by the store which holds each. */
+typedef struct {
+  kvkey_t *keys;            /* The keys, store by store. */
+  char **values;            /* The value of each of KEYS, or NULL. */
+  unsigned int *order;      /* The position within the batch of each of KEYS. */
+  unsigned int first[KVSERVER_MAX_STORES + 1]; /* The keys of store I are KEYS[FIRST[I]] up to KEYS[FIRST[I + 1]]. */
+} store_batch_t;
+
+/* Groups the COUNT KEYS by the store of SERVER which holds each into BATCH,
+ * along with VALUES if it is not NULL (otherwise the values of BATCH are
+ * NULL, for lookups to fill in). BATCH should later be freed with
+ * batch_free, whatever this returns. Returns 0 if successful, else ENOMEM. */
+static int batch_group(kvserver_t *server, kvkey_t *keys, char **values,
+    unsigned int count, store_batch_t *batch) {
+  unsigned int next[KVSERVER_MAX_STORES], i, s;
+  memset(batch, 0, sizeof(store_batch_t));
+  batch->keys = malloc(count * sizeof(kvkey_t));
+  batch->values = calloc(count, sizeof(char *));
+  batch->order = malloc(count * sizeof(unsigned int));
+  if (count > 0 && (batch->keys == NULL || batch->values == NULL ||
+      batch->order == NULL))
+    return ENOMEM;
+  for (i = 0; i < count; i++)
+    batch->first[store_index(server, &keys[i]) + 1]++;
+  for (s = 0; s < server->num_stores; s++) {
+    batch->first[s + 1] += batch->first[s];
+    next[s] = batch->first[s];
+  }
+  for (i = 0; i < count; i++) {
+    s = store_index(server, &keys[i]);
+    batch->order[next[s]] = i;
+    batch->keys[next[s]] = keys[i];
+    if (values != NULL)
+      batch->values[next[s]] = values[i];
+    next[s]++;
+  }
+  return 0;
+}
+
+/* Frees the arrays of BATCH, but not the values in them. */
+static void batch_free(store_batch_t *batch) {
+  free(batch->keys);
+  free(batch->values);
+  free(batch->order);
+}
+
 /* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
  * error code.  If successful, VALUE will point to a string which should later
  * be free()d.  If the KEY is in cache, take the value from there. Otherwise,
  * go to the store and update the value in the cache. */
-int kvserver_get(kvserver_t *server, char *key, char **value) {
+int kvserver_get(kvserver_t *server, kvkey_t *key, char **value) {
   int ret = kvcache_get(&(server->cache), key, value);
   if(ret < 0){
-	ret = kvstore_get(&(server->store), key, value);
+	ret = kvstore_get(key_store(server, key), key, value);
 	if(ret < 0){
 	  return ret;
 	}
@@ -79,55 +198,529 @@ int kvserver_get(kvserver_t *server, char *key, char **value) {
   return ret;
 }
 
+/* Attempts to get the COUNT KEYS from SERVER. The value of each key is placed
+ * into the corresponding entry of VALUES, as a string which should later be
+ * free()d, or NULL if the key is not present. Keys are taken from the cache
+ * where possible; the rest are looked up in their stores, as a single batch
+ * per store (see kvstore_mget), and then cached. Returns 0 if successful,
+ * else a negative error code (or ENOMEM), in which case every entry of
+ * VALUES is NULL. */
+int kvserver_mget(kvserver_t *server, kvkey_t *keys, unsigned int count,
+    char **values) {
+  kvkey_t *miss_keys;
+  store_batch_t batch = {0};
+  unsigned int *miss_pos, num_miss = 0, found, first, i, s;
+  int ret;
+  found = kvcache_mget(&(server->cache), keys, count, values);
+  if (found == count)
+    return 0;
+  miss_keys = malloc((count - found) * sizeof(kvkey_t));
+  miss_pos = malloc((count - found) * sizeof(unsigned int));
+  if (miss_keys == NULL || miss_pos == NULL) {
+    ret = ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < count; i++) {
+    if (values[i] == NULL) {
+      miss_keys[num_miss] = keys[i];
+      miss_pos[num_miss++] = i;
+    }
+  }
+  if ((ret = batch_group(server, miss_keys, NULL, num_miss, &batch)) != 0)
+    goto out;
+  for (s = 0; s < server->num_stores; s++) {
+    first = batch.first[s];
+    if (batch.first[s + 1] > first && (ret = kvstore_mget(&server->stores[s],
+        batch.keys + first, batch.first[s + 1] - first,
+        batch.values + first)) != 0)
+      goto out;
+  }
+  for (i = 0; i < num_miss; i++) {
+    if ((values[miss_pos[batch.order[i]]] = batch.values[i]) != NULL)
+      kvcache_put(&(server->cache), &batch.keys[i], batch.values[i]);
+  }
+out:
+  if (ret != 0) {
+    for (i = 0; i < count; i++) {
+      free(values[i]);
+      values[i] = NULL;
+    }
+    /* Stores looked up before the failure have values not yet handed out. */
+    for (i = 0; batch.values != NULL && i < num_miss; i++)
+      free(batch.values[i]);
+  }
+  batch_free(&batch);
+  free(miss_keys);
+  free(miss_pos);
+  return ret;
+}
+
+/* Attempts to get KEY from SERVER like kvserver_get, except that VALUE is
+ * set to a reference to the value (see kvbuf.h), which should later be
+ * dropped with kvbuf_unref(); a value taken from the cache is shared with it
+ * rather than copied. A value which is not cached and is at least
+ * KVSERVER_SENDFILE_MIN bytes long, or is stored out of line, is not read at
+ * all: VALUE is set to NULL and its location is placed into LOC, so that it
+ * can be sent straight from the store's file, whose descriptor the caller
+ * must close(). Returns 0 if successful, else a negative error code. */
+int kvserver_get_located(kvserver_t *server, kvkey_t *key, kvbuf_t **value,
+    kvstore_loc_t *loc) {
+  int ret = kvcache_get_buf(&(server->cache), key, value);
+  char *str = NULL;
+  if (ret == 0)
+    return 0;
+  *value = NULL;
+  ret = kvstore_locate(key_store(server, key), key, loc);
+  if (ret == ERRNOTIMPL) {
+    ret = kvstore_get_located(key_store(server, key), key, &str, loc);
+    /* Values stored out of line are never cached. Running out of memory
+     * (a positive code) is a failure too, and leaves STR unset. */
+    if (ret != 0 || str == NULL)
+      return ret;
+    if ((*value = kvbuf_wrap(str)) == NULL) {
+      free(str);
+      return ENOMEM;
+    }
+    return kvcache_put(&(server->cache), key, str);
+  }
+  if (ret < 0)
+    return ret;
+  if (loc->length >= KVSERVER_SENDFILE_MIN)
+    return 0;
+  /* Small values are cheap to copy, and worth caching. */
+  if ((*value = kvbuf_alloc(loc->length)) == NULL) {
+    close(loc->fd);
+    return ENOMEM;
+  }
+  if (pread(loc->fd, (*value)->data, loc->length, loc->offset) != loc->length) {
+    close(loc->fd);
+    kvbuf_unref(*value);
+    *value = NULL;
+    return ERRFILACCESS;
+  }
+  close(loc->fd);
+  return kvcache_put(&(server->cache), key, (*value)->data);
+}
+
 /* Checks if the given KEY, VALUE pair can be inserted into this server's
  * store. Returns 0 if it can, else a negative error code. */
-int kvserver_put_check(kvserver_t *server, char *key, char *value) {
-  return kvstore_put_check(&(server->store), key, value);
+int kvserver_put_check(kvserver_t *server, kvkey_t *key, char *value) {
+  return kvstore_put_check(key_store(server, key), key, value);
 }
 
 /* Inserts the given KEY, VALUE pair into this server's store and cache. Access
  * to the cache should be concurrent if the keys are in different cache sets.
  * Returns 0 if successful, else a negative error code. */
-int kvserver_put(kvserver_t *server, char *key, char *value) {
+int kvserver_put(kvserver_t *server, kvkey_t *key, char *value) {
   int ret;
   ret = kvserver_put_check(server, key, value);
   if(ret < 0) return ret;
   ret = kvcache_put(&(server->cache), key, value);
   if(ret < 0) return ret;
-  ret = kvstore_put(&(server->store), key, value);
+  ret = kvstore_put(key_store(server, key), key, value);
   if(ret < 0) return ret;
   return 0;
 }
 
+/* Passes a piece of the value of the request ARG to the store. */
+static ssize_t read_request_value(void *arg, char *buf, size_t size) {
+  return kvmessage_read_value(arg, buf, size);
+}
+
+/* Inserts a value of LENGTH bytes for KEY into this server's store, reading
+ * it from the socket of REQMSG (see kvmessage_read_value) a piece at a time
+ * and storing it out of line (see kvstore_put_stream). Such values bypass the
+ * cache, which only drops whatever it held for KEY. Returns 0 if successful,
+ * else a negative error code. */
+int kvserver_put_stream(kvserver_t *server, kvkey_t *key, size_t length,
+    kvmessage_t *reqmsg) {
+  kvcache_del(&(server->cache), key);
+  return kvstore_put_stream(key_store(server, key), key, length,
+      read_request_value, reqmsg);
+}
+
 /* Checks if the given KEY can be deleted from this server's store.
  * Returns 0 if it can, else a negative error code. */
-int kvserver_del_check(kvserver_t *server, char *key) {
-  return kvstore_del_check(&(server->store), key);
+int kvserver_del_check(kvserver_t *server, kvkey_t *key) {
+  return kvstore_del_check(key_store(server, key), key);
 }
 
 /* Removes the given KEY from this server's store and cache. Access to the
  * cache should be concurrent if the keys are in different cache sets. Returns
  * 0 if successful, else a negative error code. */
-int kvserver_del(kvserver_t *server, char *key) {
+int kvserver_del(kvserver_t *server, kvkey_t *key) {
   int ret;
   ret = kvserver_del_check(server, key);
   if(ret < 0) return ret;
   kvcache_del(&(server->cache), key);
-  ret = kvstore_del(&(server->store), key);
+  ret = kvstore_del(key_store(server, key), key);
   if(ret < 0) return ret;
   return 0;
 }
 
-/* Returns an info string about SERVER including its hostname and port. */
+/* Inserts the COUNT entries given by KEYS and VALUES into this server's stores
+ * and cache, after checking that every one of them can be inserted. Only the
+ * entries of a store which took all of its share are cached; the cache drops
+ * whatever it held for the entries of a store which failed, some of which may
+ * have been written. Returns 0 if successful, else a negative error code. */
+int kvserver_mput(kvserver_t *server, kvkey_t *keys, char **values,
+    unsigned int count) {
+  store_batch_t batch;
+  unsigned int first, i, s;
+  int ret;
+  for (i = 0; i < count; i++) {
+    ret = kvserver_put_check(server, &keys[i], values[i]);
+    if(ret < 0) return ret;
+  }
+  ret = batch_group(server, keys, values, count, &batch);
+  for (s = 0; ret == 0 && s < server->num_stores; s++) {
+    first = batch.first[s];
+    if (batch.first[s + 1] == first)
+      continue;
+    ret = kvstore_mput(&server->stores[s], batch.keys + first,
+        batch.values + first, batch.first[s + 1] - first);
+    for (i = first; i < batch.first[s + 1]; i++) {
+      if (ret != 0 || kvcache_put(&(server->cache), &batch.keys[i],
+          batch.values[i]) != 0)
+        kvcache_del(&(server->cache), &batch.keys[i]);
+    }
+  }
+  batch_free(&batch);
+  return ret;
+}
+
+/* Removes the COUNT KEYS from this server's stores and cache. Keys which are
+ * not present are skipped. Returns 0 if successful, else the first negative
+ * error code, after attempting every key. */
+int kvserver_mdel(kvserver_t *server, kvkey_t *keys, unsigned int count) {
+  store_batch_t batch;
+  unsigned int first, i, s;
+  int ret, err;
+  for (i = 0; i < count; i++)
+    kvcache_del(&(server->cache), &keys[i]);
+  if ((ret = batch_group(server, keys, NULL, count, &batch)) == 0) {
+    for (s = 0; s < server->num_stores; s++) {
+      first = batch.first[s];
+      if (batch.first[s + 1] == first)
+        continue;
+      err = kvstore_mdel(&server->stores[s], batch.keys + first,
+          batch.first[s + 1] - first);
+      if (err != 0 && ret == 0)
+        ret = err;
+    }
+  }
+  batch_free(&batch);
+  return ret;
+}
+
+/* The entries collected by a scan. */
+typedef struct {
+  char **keys;
+  char **values;
+  unsigned int count;
+  unsigned int cap;
+  int error;
+} scan_result_t;
+
+/* Appends copies of KEY and VALUE to the scan_result_t ARG. Returns nonzero
+ * to end the scan if memory runs out. */
+static int scan_collect(char *key, char *value, void *arg) {
+  scan_result_t *result = arg;
+  char **keys, **values;
+  if (result->count == result->cap) {
+    result->cap = (result->cap == 0) ? 16 : result->cap * 2;
+    if ((keys = realloc(result->keys, result->cap * sizeof(char *))) != NULL)
+      result->keys = keys;
+    if ((values = realloc(result->values, result->cap * sizeof(char *)))
+        != NULL)
+      result->values = values;
+    if (keys == NULL || values == NULL)
+      goto nomem;
+  }
+  if ((result->keys[result->count] = strdup(key)) == NULL)
+    goto nomem;
+  if ((result->values[result->count] = strdup(value)) == NULL) {
+    free(result->keys[result->count]);
+    goto nomem;
+  }
+  result->count++;
+  return 0;
+nomem:
+  result->error = ENOMEM;
+  return 1;
+}
+
+/* A single entry collected by a scan. */
+typedef struct {
+  char *key;
+  char *value;
+} scan_entry_t;
+
+/* Orders the scan_entry_t A and B by key. */
+static int scan_entry_cmp(const void *a, const void *b) {
+  return strcmp(((const scan_entry_t *) a)->key,
+      ((const scan_entry_t *) b)->key);
+}
+
+/* Sorts the entries of RESULT, collected from several stores in turn, into
+ * key order, and frees all but the first LIMIT. Returns 0 if successful,
+ * else ENOMEM. */
+static int scan_merge(scan_result_t *result, unsigned int limit) {
+  scan_entry_t *entries;
+  unsigned int i;
+  if (result->count == 0)
+    return 0;
+  if ((entries = malloc(result->count * sizeof(scan_entry_t))) == NULL)
+    return ENOMEM;
+  for (i = 0; i < result->count; i++) {
+    entries[i].key = result->keys[i];
+    entries[i].value = result->values[i];
+  }
+  qsort(entries, result->count, sizeof(scan_entry_t), scan_entry_cmp);
+  for (i = 0; i < result->count; i++) {
+    if (i < limit) {
+      result->keys[i] = entries[i].key;
+      result->values[i] = entries[i].value;
+    } else {
+      free(entries[i].key);
+      free(entries[i].value);
+    }
+  }
+  if (result->count > limit)
+    result->count = limit;
+  free(entries);
+  return 0;
+}
+
+/* Retrieves the entries of SERVER's stores whose keys are at least START and
+ * less than END, in key order (see kvstore_scan). At most LIMIT entries are
+ * returned, or MAX_SCAN_ENTRIES if LIMIT is 0 or larger; each store is asked
+ * for that many, and what they return is merged. If successful, KEYS and
+ * VALUES will point to arrays of COUNT strings which should later be
+ * free()d, along with every string in them. Entries are read straight from
+ * the stores, which the cache writes through to. Returns 0 if successful,
+ * else an error code. */
+int kvserver_scan(kvserver_t *server, char *start, char *end,
+    unsigned int limit, char ***keys, char ***values, unsigned int *count) {
+  scan_result_t result = {0};
+  unsigned int i, s;
+  int ret = 0;
+  if (limit == 0 || limit > MAX_SCAN_ENTRIES)
+    limit = MAX_SCAN_ENTRIES;
+  for (s = 0; ret >= 0 && result.error == 0 && s < server->num_stores; s++)
+    ret = kvstore_scan(&server->stores[s], start, end, limit, scan_collect,
+        &result);
+  if (ret >= 0)
+    ret = result.error;
+  if (ret == 0 && server->num_stores > 1)
+    ret = scan_merge(&result, limit);
+  if (ret != 0) {
+    for (i = 0; i < result.count; i++) {
+      free(result.keys[i]);
+      free(result.values[i]);
+    }
+    free(result.keys);
+    free(result.values);
+    return ret;
+  }
+  *keys = result.keys;
+  *values = result.values;
+  *count = result.count;
+  return 0;
+}
+
+/* Places the path of NAME within ROOT into DIRNAME, which holds
+ * MAX_FILENAME bytes, leaving room for the names of the files within it.
+ * NAME comes from a client, so it must be a single component of a path (see
+ * kvserver.h). Returns 0 if successful, ERRINVLDMSG if ROOT is NULL or NAME
+ * is not such a component, else ERRFILLEN. */
+static int root_path(char *root, char *name, char *dirname) {
+  if (root == NULL || name[0] == '\0' || strchr(name, '/') != NULL ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    return ERRINVLDMSG;
+  if (strlen(root) + strlen(name) + 1 + 32 > MAX_FILENAME)
+    return ERRFILLEN;
+  sprintf(dirname, "%s/%s", root, name);
+  return 0;
+}
+
+/* Adopts the entries which kvingest built in the directory NAME within the
+ * INGEST_ROOT of SERVER into its stores (see kvserver.h), then clears the
+ * cache. Subdirectories which have already been adopted are skipped.
+ * Returns 0 if successful, ERRINVLDMSG if NAME may not be used, ERRSHARD if
+ * the entries were built for a different number of stores, ERRFILACCESS if
+ * there are none, else a negative error code. */
+int kvserver_ingest(kvserver_t *server, char *name) {
+  char dirname[MAX_FILENAME], filename[MAX_FILENAME];
+  bool present[KVSERVER_MAX_STORES];
+  unsigned int i, index, count, found = 0;
+  FILE *file;
+  int ret;
+  if ((ret = root_path(server->ingest_root, name, dirname)) != 0)
+    return ret;
+  for (i = 0; i < server->num_stores && ret == 0; i++) {
+    present[i] = false;
+    sprintf(filename, "%s/%u/%s", dirname, i, KVSERVER_SHARD_FILENAME);
+    if ((file = fopen(filename, "r")) == NULL) {
+      if (errno != ENOENT)
+        ret = ERRFILACCESS;
+      continue;
+    }
+    if (fscanf(file, "%u/%u", &index, &count) != 2) {
+      ret = ERRFILACCESS;
+    } else if (index != i || count != server->num_stores) {
+      ret = ERRSHARD;
+    } else {
+      present[i] = true;
+      found++;
+    }
+    fclose(file);
+  }
+  if (ret == 0 && found == 0)
+    ret = ERRFILACCESS;
+  for (i = 0; i < server->num_stores && ret == 0; i++) {
+    if (!present[i])
+      continue;
+    sprintf(filename, "%s/%u", dirname, i);
+    if ((ret = kvstore_ingest(&server->stores[i], filename)) == 0) {
+      sprintf(filename, "%s/%u/%s", dirname, i, KVSERVER_SHARD_FILENAME);
+      remove(filename);
+      sprintf(filename, "%s/%u", dirname, i);
+      rmdir(filename);
+    }
+  }
+  if (ret == 0)
+    rmdir(dirname);
+  /* Even a partial ingestion may have replaced cached values. */
+  if (found > 0)
+    kvcache_clear(&server->cache);
+  return ret;
+}
+
+/* Takes a snapshot of the stores of SERVER into the directory NAME within
+ * its SNAPSHOT_ROOT, which must not exist yet (see kvserver.h). Nothing is
+ * left behind if the snapshot fails. Returns 0 if successful, ERRINVLDMSG
+ * if NAME may not be used, else a negative error code. */
+int kvserver_snapshot(kvserver_t *server, char *name) {
+  char dirname[MAX_FILENAME], filename[MAX_FILENAME];
+  unsigned int i;
+  FILE *file;
+  int ret;
+  if ((ret = root_path(server->snapshot_root, name, dirname)) != 0)
+    return ret;
+  if (mkdir(dirname, 0700) < 0)
+    return ERRFILCRT;
+  for (i = 0; i < server->num_stores && ret == 0; i++) {
+    sprintf(filename, "%s/%u", dirname, i);
+    if ((ret = kvstore_snapshot(&server->stores[i], filename)) != 0)
+      break;
+    sprintf(filename, "%s/%u/%s", dirname, i, KVSERVER_SHARD_FILENAME);
+    if ((file = fopen(filename, "w")) == NULL) {
+      ret = ERRFILACCESS;
+      break;
+    }
+    if (fprintf(file, "%u/%u\n", i, server->num_stores) < 0)
+      ret = ERRFILACCESS;
+    if (fclose(file) != 0)
+      ret = ERRFILACCESS;
+  }
+  if (ret != 0)
+    kvstore_remove_tree(dirname);
+  return ret;
+}
+
+/* Returns an info string about SERVER including its hostname and port,
+ * followed by the statistics of its store (see kvstore_stats), or of each
+ * of its stores in turn, headed by its directory. */
 char *kvserver_get_info_message(kvserver_t *server) {
-  char info[1024], buf[256];
+  size_t size = 4096 * server->num_stores, len;
+  char *info = malloc(size), buf[256];
   time_t ltime = time(NULL);
+  unsigned int s;
+  if (info == NULL)
+    return NULL;
   strcpy(info, asctime(localtime(&ltime)));
-  sprintf(buf, "{%s, %d}", server->hostname, server->port);
+  sprintf(buf, "{%s, %d}\n", server->hostname, server->port);
   strcat(info, buf);
-  char *msg = malloc(strlen(info));
-  strcpy(msg, info);
-  return msg;
+  len = strlen(info);
+  len += kvcache_stats(&server->cache, info + len, size - len);
+  for (s = 0; s < server->num_stores && len < size - 1; s++) {
+    if (server->num_stores > 1)
+      len += snprintf(info + len, size - len, "store %u: %s\n", s,
+          server->stores[s].dirname);
+    if (len < size - 1)
+      len += kvstore_stats(&server->stores[s], info + len, size - len);
+  }
+  return info;
+}
+
+/* Handles the GETREQ REQMSG, populating RESPMSG as a response. Large values
+ * are left in the store, for kvmessage_send to stream from there, and others
+ * are held by reference (see kvbuf.h), so that a cached value is not copied. */
+static void handle_get(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  kvstore_loc_t loc;
+  int ret = kvserver_get_located(server, &reqmsg->key_desc,
+      &(respmsg->value_buf), &loc);
+  if (respmsg->value_buf != NULL)
+    respmsg->value = respmsg->value_buf->data;
+  respmsg->message = (ret != 0) ? GETMSG(ret) : MSG_SUCCESS;
+  if (ret == 0) {
+    respmsg->type = GETRESP;
+    respmsg->key = strdup(reqmsg->key);
+    if (respmsg->value == NULL) {
+      respmsg->value_fd = loc.fd;
+      respmsg->value_offset = loc.offset;
+      respmsg->value_len = loc.length;
+    }
+  }
+}
+
+/* Returns true if the batch request REQMSG carries between 1 and
+ * MAX_BATCH_ENTRIES keys, along with a value for each if WITH_VALUES. */
+static bool batch_valid(kvmessage_t *reqmsg, bool with_values) {
+  unsigned int i;
+  if (reqmsg->key_descs == NULL || reqmsg->num_entries == 0 ||
+      reqmsg->num_entries > MAX_BATCH_ENTRIES)
+    return false;
+  if (!with_values)
+    return true;
+  if (reqmsg->values == NULL)
+    return false;
+  for (i = 0; i < reqmsg->num_entries; i++) {
+    if (reqmsg->values[i] == NULL)
+      return false;
+  }
+  return true;
+}
+
+/* Handles the MGETREQ REQMSG, populating RESPMSG as a response. The response
+ * takes over the keys of the request, and carries a value (or null) for
+ * each. */
+static void handle_mget(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  char **values;
+  int ret;
+  if (!batch_valid(reqmsg, false)) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if ((values = calloc(reqmsg->num_entries, sizeof(char *))) == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  ret = kvserver_mget(server, reqmsg->key_descs, reqmsg->num_entries, values);
+  if (ret != 0) {
+    free(values);
+    respmsg->message = GETMSG(ret);
+    return;
+  }
+  respmsg->type = MGETRESP;
+  respmsg->message = MSG_SUCCESS;
+  respmsg->keys = reqmsg->keys;
+  respmsg->values = values;
+  respmsg->num_entries = reqmsg->num_entries;
+  reqmsg->keys = NULL;
 }
 
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
@@ -141,29 +734,33 @@ char *kvserver_get_info_message(kvserver_t *server) {
 void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
   if(reqmsg->type == GETREQ){
-	  int ret = kvserver_get(server, reqmsg->key, &(respmsg->value));
-	  respmsg->message = ret < 0 ? GETMSG(ret): MSG_SUCCESS;
-	  if(ret == 0){
-		  respmsg->type = GETRESP;
-		  int length_key = strlen(reqmsg->key) + 1;
-		  respmsg->key = (char *)malloc(length_key);
-		  strncpy(respmsg->key, reqmsg->key, length_key);
-	  }
+	  handle_get(server, reqmsg, respmsg);
+	  return;
+  }
+  if(reqmsg->type == MGETREQ){
+	  handle_mget(server, reqmsg, respmsg);
 	  return;
   }
   if(reqmsg->type == PUTREQ){
-      int ret = kvstore_put_check(&(server->store), reqmsg->key, reqmsg->value);
+      /* Values stored out of line are not supported by TPC. */
+      int ret = reqmsg->value == NULL ? ERRVALLEN :
+          kvstore_put_check(key_store(server, &reqmsg->key_desc),
+          &reqmsg->key_desc,
+          reqmsg->value);
       if(ret < 0){
            respmsg->type = VOTE_ABORT;
            return;
       }
       tpclog_log(&(server->log), PUTREQ, reqmsg->key, reqmsg->value);
-      kvstore_put(&(server->store), reqmsg->key, reqmsg->value);
+      kvstore_put(key_store(server, &reqmsg->key_desc), &reqmsg->key_desc,
+          reqmsg->value);
       respmsg->type = VOTE_COMMIT;
       return;
   }
   if(reqmsg->type == DELREQ){
-      int ret = kvstore_put_check(&(server->store), resmsg->key, reqmsg->value);
+      int ret = kvstore_put_check(key_store(server, &resmsg->key_desc),
+          &resmsg->key_desc,
+          reqmsg->value);
       if(ret < 0){
            respmsg->type = VOTE_ABORT;
            return;
@@ -176,9 +773,11 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg,
       char logname[MAX_FILENAME];
       sprintf(logname, "%s/%lu%s", server->log.dirname, server->log.nextid-1, TPCLOG_FILETYPE);
       logentry* entry;
+      kvkey_t key;
       tpclog_load_entry(&entry, logname);
+      kvkey_init(&key, entry->data);
       if(entry->type == DELREQ){
-           kvstore_del(server, entry->data);
+           kvstore_del(server, &key);
       }
       return;
   }
@@ -186,9 +785,11 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg,
       char logname[MAX_FILENAME];
       sprintf(logname, "%s/%lu%s", server->log.dirname, server->log.nextid-1, TPCLOG_FILETYPE);
       logentry* entry;
+      kvkey_t key;
       tpclog_load_entry(&entry, logname);
+      kvkey_init(&key, entry->data);
       if(entry->type == PUTREQ){
-           kvserver_del(server, entry->data);
+           kvserver_del(server, &key);
       }
       return;
   }
@@ -206,26 +807,64 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg,
      return;
   }
   if(reqmsg->type == GETREQ){
-	  int ret = kvserver_get(server, reqmsg->key, &(respmsg->value));
-	  respmsg->message = ret < 0 ? GETMSG(ret) : MSG_SUCCESS;
-      if(ret == 0){
-          respmsg->type = GETRESP;
-          int length_key = strlen(reqmsg->key) + 1;
-          respmsg->key = (char *)malloc(length_key);
-          strncpy(respmsg->key, reqmsg->key, length_key);
-      }
+	  handle_get(server, reqmsg, respmsg);
+	  return;
+  }
+  if(reqmsg->type == MGETREQ){
+	  handle_mget(server, reqmsg, respmsg);
+	  return;
+  }
+  if(reqmsg->type == SCANREQ){
+	  int ret = kvserver_scan(server, reqmsg->key, reqmsg->value, reqmsg->limit,
+	      &(respmsg->keys), &(respmsg->values), &(respmsg->num_entries));
+	  respmsg->message = ret != 0 ? GETMSG(ret) : MSG_SUCCESS;
+	  if(ret == 0){
+	      respmsg->type = SCANRESP;
+	  }
 	  return;
   }
   if(reqmsg->type == PUTREQ){
-	  int ret = kvserver_put(server, reqmsg->key, reqmsg->value);
+	  int ret = reqmsg->value == NULL && reqmsg->value_len > 0 ?
+	      kvserver_put_stream(server, &reqmsg->key_desc, reqmsg->value_len,
+	      reqmsg) :
+	      kvserver_put(server, &reqmsg->key_desc, reqmsg->value);
 	  respmsg->message = ret < 0 ? GETMSG(ret) : MSG_SUCCESS;
 	  return;
   }
   if(reqmsg->type == DELREQ){
-	  int ret = kvserver_del(server, reqmsg->key);
+	  int ret = kvserver_del(server, &reqmsg->key_desc);
 	  respmsg->message = ret < 0 ? GETMSG(ret) : MSG_SUCCESS;
 	  return;
   }
+  if(reqmsg->type == MPUTREQ){
+	  int ret = !batch_valid(reqmsg, true) ? ERRINVLDMSG :
+	      kvserver_mput(server, reqmsg->key_descs, reqmsg->values,
+	      reqmsg->num_entries);
+	  respmsg->message = ret == ERRINVLDMSG ? ERRMSG_INVALID_REQUEST :
+	      ret < 0 ? GETMSG(ret) : MSG_SUCCESS;
+	  return;
+  }
+  if(reqmsg->type == MDELREQ){
+	  int ret = !batch_valid(reqmsg, false) ? ERRINVLDMSG :
+	      kvserver_mdel(server, reqmsg->key_descs, reqmsg->num_entries);
+	  respmsg->message = ret == ERRINVLDMSG ? ERRMSG_INVALID_REQUEST :
+	      ret < 0 ? GETMSG(ret) : MSG_SUCCESS;
+	  return;
+  }
+  if(reqmsg->type == INGESTREQ){
+	  int ret = reqmsg->key == NULL ? ERRINVLDMSG :
+	      kvserver_ingest(server, reqmsg->key);
+	  respmsg->message = ret == ERRINVLDMSG ? ERRMSG_INVALID_REQUEST :
+	      ret != 0 ? GETMSG(ret) : MSG_SUCCESS;
+	  return;
+  }
+  if(reqmsg->type == SNAPSHOTREQ){
+	  int ret = reqmsg->key == NULL ? ERRINVLDMSG :
+	      kvserver_snapshot(server, reqmsg->key);
+	  respmsg->message = ret == ERRINVLDMSG ? ERRMSG_INVALID_REQUEST :
+	      ret != 0 ? GETMSG(ret) : MSG_SUCCESS;
+	  return;
+  }
 }
 
 /* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
@@ -245,8 +884,18 @@ void kvserver_handle(kvserver_t *server, int sockfd, void *extra) {
     respmsg->message = ERRMSG_INVALID_REQUEST;
   } else {
     server_handler(server, reqmsg, respmsg);
+    /* Whatever of a streamed value was not stored must still be read. */
+    if (reqmsg->value == NULL &&
+        (size_t) reqmsg->value_offset < reqmsg->value_len)
+      kvmessage_skip_value(reqmsg);
   }
   kvmessage_send(respmsg, sockfd);
+  if (respmsg->value_len)
+    close(respmsg->value_fd);
+  kvmessage_free_entries(respmsg);
+  free(respmsg->key);
+  kvmessage_free_value(respmsg);
+  free(respmsg);
   if (reqmsg != NULL)
     kvmessage_free(reqmsg);
 }
@@ -267,8 +916,25 @@ int kvserver_rebuild_state(kvserver_t *server) {
   return -1;
 }
 
-/* Deletes all current entries in SERVER's store and removes the store
- * directory.  Also cleans the associated log. */
+/* Prepares SERVER for the process to exit; see kvstore_close. Writes to its
+ * stores fail afterwards. Returns 0 if successful, else the first negative
+ * error code, after closing every store. */
+int kvserver_close(kvserver_t *server) {
+  unsigned int s;
+  int ret = 0, err;
+  for (s = 0; s < server->num_stores; s++) {
+    err = kvstore_close(&server->stores[s]);
+    if (err != 0 && ret == 0)
+      ret = err;
+  }
+  return ret;
+}
+
+/* Deletes all current entries in SERVER's stores and removes the store
+ * directories.  Also cleans the associated log. */
 int kvserver_clean(kvserver_t *server) {
-  return kvstore_clean(&server->store);
+  unsigned int s;
+  for (s = 0; s < server->num_stores; s++)
+    kvstore_clean(&server->stores[s]);
+  return 0;
 }
@@ -28,23 +28,95 @@
  * PUT and DEL requests go immediately to the cache/store. In TPC mode, 2-Phase
  * Commit logic is used, described further in the spec.
  *
- * Because the KVStore stores all data in persistent file storage, a non-TPC
- * KVServer can be reinitialized using a DIRNAME which contains a previous
- * KVServer and all old entries will be available, enabling easy crash
- * recovery.
+ * The storage engine behind the KVStore is chosen when the server is
+ * initialized (see kvstore.h). Because the persistent engines store all data
+ * in file storage, a non-TPC KVServer using one of them can be reinitialized
+ * using the DIRNAMES which contain a previous KVServer and all old entries
+ * will be available, enabling easy crash recovery.
+ *
+ * On a cache miss, a GET for a value at least KVSERVER_SENDFILE_MIN bytes
+ * long which the store can locate within a file (see kvstore_locate) is not
+ * read into memory at all: the response streams it straight from the file to
+ * the socket (see kvmessage.h), and it is not cached. Smaller values are read
+ * and cached as usual. A GET which hits the cache sends the cached value
+ * itself, holding a reference to it (see kvbuf.h) until the response has
+ * been sent, rather than a copy; the value read on a miss is held the same
+ * way.
+ *
+ * A PUT may carry a value longer than MAX_VALLEN, of up to MAX_BLOB_VALLEN
+ * bytes, in frames after its JSON (see kvmessage.h). Such a value is read
+ * from the socket a piece at a time straight into a blob (see
+ * kvstore_put_stream), so a request takes the same memory whatever the size
+ * of its value, and bypasses the cache; a GET streams it back from the blob
+ * the same way as any other located value.
+ *
+ * A KVServer may keep its entries in several data directories, typically
+ * one per disk, each holding a KVStore of its own. Keys are spread across
+ * the stores by hash(key) (mixed, so that the choice does not follow the
+ * cache set or the hash chain of the key), and since each store has its own
+ * engine, with its own locks and its own sync flusher, requests for keys in
+ * different stores proceed in parallel on different devices. Batches are
+ * split by store, a SCAN merges the entries of every store in key order, and
+ * INFO reports the statistics of each store. A key is always found in the
+ * store it was written to only if the directories are given in the same
+ * order every time, so each records its position and the number of stores
+ * in KVSERVER_SHARD_FILENAME, and initialization fails with ERRSHARD if they
+ * do not match.
+ *
+ * An INGEST request, whose key names a directory within the server's
+ * INGEST_ROOT, adopts the entries which kvingest built there (see
+ * main/kvingest.c) into the stores, as their newest entries (see
+ * kvstore_ingest). kvingest builds one subdirectory per store, named by the
+ * index of the store and recording it in its own KVSERVER_SHARD_FILENAME;
+ * every subdirectory is checked before any is adopted, and each is removed
+ * once it has been, so a request which fails part way may simply be
+ * repeated. The cache is cleared afterwards. INGEST is only handled in
+ * non-TPC mode, and is refused unless INGEST_ROOT is set.
+ *
+ * A SNAPSHOT request, whose key names a directory which does not exist yet
+ * within the server's SNAPSHOT_ROOT, takes a snapshot of every store (see
+ * kvstore_snapshot) into a subdirectory named by its index, recording the
+ * index in its own KVSERVER_SHARD_FILENAME, while requests carry on. A
+ * snapshot is a consistent copy of each store, though not of all stores at
+ * one moment, and is opened by another server with the same engine by
+ * giving it the subdirectories in order, as in `kvslave -d DIR/0 -d DIR/1`.
+ * A snapshot which fails part way is removed, so that it may be retried
+ * under the same name. SNAPSHOT is only handled in non-TPC mode, and is
+ * refused unless SNAPSHOT_ROOT is set.
+ *
+ * Since clients may not choose where on the server's host files are
+ * written, the name a SNAPSHOT (or INGEST) request carries must be a single
+ * component of a path: neither empty, "." nor "..", and without a '/'.
+ *
+ * MGET, MPUT and MDEL requests carry up to MAX_BATCH_ENTRIES keys at once.
+ * An MGET takes what it can from the cache and looks the rest up in the
+ * store as one batch (see kvstore_mget); its response lists a value, or null,
+ * for each key requested, in order.
  *
  * A TPC KVServer maintains state beyond the current KVStore entries, so a
  * TPCLog is used to log incoming requests and can be used to recreate the
  * state of the server upon crash recovery.
  */
+
+/* The length from which uncached values are sent straight from the store. */
+#define KVSERVER_SENDFILE_MIN 512
+
+/* The largest number of data directories, and so of stores, a server may
+ * use. */
+#define KVSERVER_MAX_STORES 16
+
+/* The name of the file recording which shard a data directory holds. */
+#define KVSERVER_SHARD_FILENAME "shard"
+
 struct kvserver;
 typedef void (*kvhandle_t)(struct kvserver *, int sockfd, void *extra);
 
-/* A KVServer. Stores the associated KVCache and KVStore, as well as whether or
- * not this is a TPC-enabled server. */
+/* A KVServer. Stores the associated KVCache and KVStores, as well as whether
+ * or not this is a TPC-enabled server. */
 typedef struct kvserver {
   kvcache_t cache;          /* The cache this server will use. */
-  kvstore_t store;          /* The store this server will use. */
+  kvstore_t stores[KVSERVER_MAX_STORES]; /* The stores this server will use, one per data directory. */
+  unsigned int num_stores;  /* The number of STORES in use. */
   tpclog_t log;             /* The log this server will use (checkpoint 2 only). */
   bool use_tpc;             /* 1 if this server should expect TPC operations, else 0. */
   int max_threads;          /* The max threads this server will run on. */
@@ -53,11 +125,14 @@ typedef struct kvserver {
   int sockfd;               /* The socket fd this server is currently listening on (if any). */
   int port;                 /* The port this server should listen on. */
   char *hostname;           /* The host this server should listen on. */
+  char *ingest_root;        /* The directory within which INGEST requests name directories, or NULL to refuse them. */
+  char *snapshot_root;      /* The directory within which SNAPSHOT requests create directories, or NULL to refuse them. */
 } kvserver_t;
 
-int kvserver_init(kvserver_t *, char *dirname, unsigned int num_sets,
-    unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
-    int port, bool use_tpc);
+int kvserver_init(kvserver_t *, char **dirnames, unsigned int num_dirs,
+    const char *engine, kvsync_mode_t sync_mode, bool verify, bool compress,
+    unsigned int num_sets, size_t cache_bytes, kvcache_policy_t cache_policy,
+    unsigned int max_threads, const char *hostname, int port, bool use_tpc);
 
 int kvserver_register_master(kvserver_t *, int sockfd);
 
@@ -68,12 +143,28 @@ void kvserver_handle_tpc(kvserver_t *, kvmessage_t *reqmsg,
 void kvserver_handle_no_tpc(kvserver_t *, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
 
-int kvserver_get(kvserver_t *, char *key, char **value);
-int kvserver_put(kvserver_t *, char *key, char *value);
-int kvserver_del(kvserver_t *, char *key);
+int kvserver_get(kvserver_t *, kvkey_t *key, char **value);
+int kvserver_get_located(kvserver_t *, kvkey_t *key, kvbuf_t **value,
+    kvstore_loc_t *loc);
+int kvserver_mget(kvserver_t *, kvkey_t *keys, unsigned int count,
+    char **values);
+int kvserver_put(kvserver_t *, kvkey_t *key, char *value);
+int kvserver_put_stream(kvserver_t *, kvkey_t *key, size_t length,
+    kvmessage_t *reqmsg);
+int kvserver_del(kvserver_t *, kvkey_t *key);
+int kvserver_mput(kvserver_t *, kvkey_t *keys, char **values,
+    unsigned int count);
+int kvserver_mdel(kvserver_t *, kvkey_t *keys, unsigned int count);
+int kvserver_scan(kvserver_t *, char *start, char *end, unsigned int limit,
+    char ***keys, char ***values, unsigned int *count);
+int kvserver_ingest(kvserver_t *, char *name);
+int kvserver_snapshot(kvserver_t *, char *name);
+
+unsigned int kvserver_store_index(kvkey_t *key, unsigned int num_stores);
 
 int kvserver_rebuild_state(kvserver_t *);
 
+int kvserver_close(kvserver_t *);
 int kvserver_clean(kvserver_t *);
 
 #endif
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "utlist.h"
+#include "kvskiplist.h"
+
+/* Allocates a node of height HEIGHT for KEY and VALUE. VALUE is taken over by
+ * the node, KEY is copied. */
+static kvskipnode_t *node_new(char *key, char *value, int height) {
+  kvskipnode_t *node = calloc(1, sizeof(kvskipnode_t) +
+      height * sizeof(kvskipnode_t *));
+  if (node == NULL)
+    return NULL;
+  if (key != NULL) {
+    if ((node->key = malloc(strlen(key) + 1)) == NULL) {
+      free(node);
+      return NULL;
+    }
+    strcpy(node->key, key);
+  }
+  node->value = value;
+  node->height = height;
+  return node;
+}
+
+/* Returns a copy of VALUE using malloc()d memory, behind a byte which is set
+ * if REF is, or NULL if VALUE is NULL. */
+static char *value_copy(char *value, bool ref, int *error) {
+  char *copy;
+  *error = 0;
+  if (value == NULL)
+    return NULL;
+  if ((copy = malloc(strlen(value) + 2)) == NULL) {
+    *error = ENOMEM;
+    return NULL;
+  }
+  copy[0] = ref;
+  strcpy(copy + 1, value);
+  return copy;
+}
+
+/* Picks a random height for a new node, where each level is a quarter as
+ * likely as the one below it. */
+static int random_height(kvskiplist_t *list) {
+  int height = 1;
+  while (height < KVSKIPLIST_MAX_HEIGHT && rand_r(&list->seed) % 4 == 0)
+    height++;
+  return height;
+}
+
+/* Returns the first node in LIST whose key is not less than KEY, or NULL if
+ * there is none. If PREV is not NULL, it is filled with the last node before
+ * that point at each level. */
+static kvskipnode_t *find_greater_or_equal(kvskiplist_t *list, char *key,
+    kvskipnode_t **prev) {
+  kvskipnode_t *node = list->head, *next;
+  int level = __atomic_load_n(&list->height, __ATOMIC_ACQUIRE) - 1;
+  while (1) {
+    next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+    if (next != NULL && strcmp(next->key, key) < 0) {
+      node = next;
+    } else {
+      if (prev != NULL)
+        prev[level] = node;
+      if (level == 0)
+        return next;
+      level--;
+    }
+  }
+}
+
+/* Initializes LIST to be empty. Returns 0 if successful, else a negative
+ * error code. */
+int kvskiplist_init(kvskiplist_t *list) {
+  list->head = node_new(NULL, NULL, KVSKIPLIST_MAX_HEIGHT);
+  if (list->head == NULL)
+    return ENOMEM;
+  list->height = 1;
+  list->size = 0;
+  list->seed = (unsigned int) (size_t) list;
+  list->garbage = NULL;
+  return 0;
+}
+
+/* Sets the value of KEY in LIST to VALUE, which is a reference to a blob if
+ * REF is set, or marks KEY as deleted if VALUE is NULL. Calls to
+ * kvskiplist_put on the same list must not run concurrently. Returns 0 if
+ * successful, else a negative error code. */
+int kvskiplist_put(kvskiplist_t *list, char *key, char *value, bool ref) {
+  kvskipnode_t *prev[KVSKIPLIST_MAX_HEIGHT], *node;
+  kvskipgarbage_t *garbage;
+  int height, level, error;
+  char *copy = value_copy(value, ref, &error), *old;
+  if (error)
+    return error;
+  node = find_greater_or_equal(list, key, prev);
+  if (node != NULL && strcmp(node->key, key) == 0) {
+    old = __atomic_exchange_n(&node->value, copy, __ATOMIC_ACQ_REL);
+    if (old != NULL) {
+      if ((garbage = malloc(sizeof(kvskipgarbage_t))) == NULL) {
+        /* Leak the old value rather than free it under a reader. */
+        return 0;
+      }
+      garbage->value = old;
+      LL_PREPEND(list->garbage, garbage);
+    }
+    list->size += (value == NULL) ? 0 : strlen(value) + 2;
+    return 0;
+  }
+
+  height = random_height(list);
+  if (height > list->height) {
+    for (level = list->height; level < height; level++)
+      prev[level] = list->head;
+    __atomic_store_n(&list->height, height, __ATOMIC_RELEASE);
+  }
+  if ((node = node_new(key, copy, height)) == NULL) {
+    free(copy);
+    return ENOMEM;
+  }
+  for (level = 0; level < height; level++) {
+    node->next[level] = __atomic_load_n(&prev[level]->next[level],
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&prev[level]->next[level], node, __ATOMIC_RELEASE);
+  }
+  list->size += sizeof(kvskipnode_t) + height * sizeof(kvskipnode_t *) +
+      strlen(key) + 1 + ((value == NULL) ? 0 : strlen(value) + 2);
+  return 0;
+}
+
+/* Returns the node for KEY within LIST, or NULL if KEY has never been put.
+ * Use kvskiplist_value to read the node's value. */
+kvskipnode_t *kvskiplist_find(kvskiplist_t *list, char *key) {
+  kvskipnode_t *node = find_greater_or_equal(list, key, NULL);
+  if (node != NULL && strcmp(node->key, key) == 0)
+    return node;
+  return NULL;
+}
+
+/* Returns the node with the smallest key in LIST, or NULL if LIST is empty. */
+kvskipnode_t *kvskiplist_first(kvskiplist_t *list) {
+  return __atomic_load_n(&list->head->next[0], __ATOMIC_ACQUIRE);
+}
+
+/* Returns the node following NODE in key order, or NULL if there is none. */
+kvskipnode_t *kvskiplist_next(kvskipnode_t *node) {
+  return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+/* Returns the current value of NODE, or NULL if its key is deleted. If REF is
+ * not NULL, whether the value is a reference to a blob is placed into it. The
+ * value remains valid until the list is freed. */
+char *kvskiplist_value(kvskipnode_t *node, bool *ref) {
+  char *value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+  if (value == NULL)
+    return NULL;
+  if (ref != NULL)
+    *ref = value[0];
+  return value + 1;
+}
+
+/* Frees all memory used by LIST. No other thread may be using LIST. */
+void kvskiplist_free(kvskiplist_t *list) {
+  kvskipnode_t *node = list->head, *next;
+  kvskipgarbage_t *garbage, *tmp;
+  while (node != NULL) {
+    next = node->next[0];
+    free(node->key);
+    free(node->value);
+    free(node);
+    node = next;
+  }
+  LL_FOREACH_SAFE(list->garbage, garbage, tmp) {
+    free(garbage->value);
+    free(garbage);
+  }
+  list->head = NULL;
+  list->garbage = NULL;
+}
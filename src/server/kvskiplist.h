@@ -0,0 +1,60 @@
+#ifndef __KV_SKIPLIST__
+#define __KV_SKIPLIST__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* KVSkiplist is the sorted in-memory table used by KVLSMStore to buffer
+ * recent writes (the memtable).
+ *
+ * Writers must be serialized by the caller, but any number of readers may
+ * search the list concurrently with a writer and without taking any lock:
+ * a node is fully built before it is linked in with a release store, and
+ * readers follow links with acquire loads.
+ *
+ * Nodes are never removed. Overwriting a key swaps the value pointer of its
+ * node, and deleting a key swaps it for NULL, which marks the key as deleted
+ * (a tombstone) rather than absent. Replaced values are kept until the whole
+ * list is freed, so a reader may still be copying one when it is replaced.
+ * Each value is stored behind a byte which marks whether it is a reference to
+ * a blob (see kvblob.h), so that the mark is swapped along with the value.
+ */
+
+/* The maximum number of levels in a skiplist. */
+#define KVSKIPLIST_MAX_HEIGHT 12
+
+/* A node within a KVSkiplist. */
+typedef struct kvskipnode {
+  char *key;                    /* The node's key. */
+  char *value;                  /* The node's marked value, or NULL if KEY is deleted. */
+  int height;                   /* The number of levels this node is linked into. */
+  struct kvskipnode *next[0];   /* The next node at each level. */
+} kvskipnode_t;
+
+/* A value which has been replaced but may still be in use by a reader. */
+typedef struct kvskipgarbage {
+  char *value;                  /* The replaced value. */
+  struct kvskipgarbage *next;   /* The next replaced value. */
+} kvskipgarbage_t;
+
+/* A KVSkiplist. */
+typedef struct {
+  kvskipnode_t *head;           /* A sentinel node which precedes every key. */
+  int height;                   /* The current height of the tallest node. */
+  size_t size;                  /* The approximate memory used by this list, in bytes. */
+  unsigned int seed;            /* The seed used to pick random node heights. */
+  kvskipgarbage_t *garbage;     /* Replaced values which are freed with the list. */
+} kvskiplist_t;
+
+int kvskiplist_init(kvskiplist_t *);
+
+int kvskiplist_put(kvskiplist_t *, char *key, char *value, bool ref);
+kvskipnode_t *kvskiplist_find(kvskiplist_t *, char *key);
+
+kvskipnode_t *kvskiplist_first(kvskiplist_t *);
+kvskipnode_t *kvskiplist_next(kvskipnode_t *);
+char *kvskiplist_value(kvskipnode_t *, bool *ref);
+
+void kvskiplist_free(kvskiplist_t *);
+
+#endif
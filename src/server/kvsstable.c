@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "kvcrc32c.h"
+#include "kvsstable.h"
+
+/* Appends SIZE bytes of DATA to the growable buffer BUF, which currently
+ * holds LEN bytes within CAP bytes of space. Returns 0 if successful, else a
+ * negative error code. */
+static int buf_append(char **buf, size_t *len, size_t *cap, const void *data,
+    size_t size) {
+  char *tmp;
+  size_t newcap = (*cap == 0) ? KVSSTABLE_BLOCK_SIZE * 2 : *cap;
+  while (*len + size > newcap)
+    newcap *= 2;
+  if (newcap != *cap) {
+    if ((tmp = realloc(*buf, newcap)) == NULL)
+      return ENOMEM;
+    *buf = tmp;
+    *cap = newcap;
+  }
+  memcpy(*buf + *len, data, size);
+  *len += size;
+  return 0;
+}
+
+/* Writes all SIZE bytes of BUF to FD. Returns 0 if successful, else a
+ * negative error code. */
+static int write_all(int fd, const char *buf, size_t size) {
+  ssize_t written;
+  while (size > 0) {
+    if ((written = write(fd, buf, size)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return ERRFILACCESS;
+    }
+    buf += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/* Parses the record at offset POS of the LEN byte block BUF, storing its key
+ * and value (NULL for a tombstone) into KEY and VALUE, whether the value is a
+ * reference to a blob into REF and its total size into SIZE. Returns 0 if
+ * successful, else a negative error code if the record is malformed. */
+static int record_parse(char *buf, size_t len, size_t pos, char **key,
+    char **value, bool *ref, size_t *size) {
+  kvsstable_record_t record;
+  if (pos + sizeof(kvsstable_record_t) > len)
+    return ERRFILACCESS;
+  /* Records are packed, so copy the header out rather than read it in place. */
+  memcpy(&record, buf + pos, sizeof(kvsstable_record_t));
+  *ref = (record.keylen & KVSSTABLE_REF) != 0;
+  record.keylen &= ~KVSSTABLE_REF;
+  if (record.keylen < 0 || record.keylen > MAX_KEYLEN ||
+      record.vallen < KVSSTABLE_TOMBSTONE || record.vallen > MAX_VALLEN)
+    return ERRFILACCESS;
+  *size = sizeof(kvsstable_record_t) + record.keylen + 1 +
+      ((record.vallen < 0) ? 0 : record.vallen + 1);
+  if (pos + *size > len)
+    return ERRFILACCESS;
+  *key = buf + pos + sizeof(kvsstable_record_t);
+  *value = (record.vallen < 0) ? NULL : *key + record.keylen + 1;
+  if ((*key)[record.keylen] != '\0' ||
+      (*value != NULL && (*value)[record.vallen] != '\0'))
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Prepares BUILDER to write the table with id ID within DIRNAME, which will
+ * be read through IO once finished. Returns 0 if successful, else a negative
+ * error code. */
+int kvsstable_builder_init(kvsstable_builder_t *builder, kvio_t *io,
+    char *dirname, unsigned int id) {
+  memset(builder, 0, sizeof(kvsstable_builder_t));
+  builder->io = io;
+  builder->id = id;
+  sprintf(builder->filename, "%s/%u%s", dirname, id, KVSSTABLE_FILETYPE);
+  builder->fd = open(builder->filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (builder->fd < 0)
+    return ERRFILCRT;
+  return 0;
+}
+
+/* Writes out the data block currently being filled by BUILDER, and records
+ * it in the index. */
+static int builder_flush_block(kvsstable_builder_t *builder) {
+  kvsstable_handle_t handle;
+  uint32_t crc;
+  int ret;
+  if (builder->blocklen == 0)
+    return 0;
+  if ((ret = write_all(builder->fd, builder->block, builder->blocklen)) < 0)
+    return ret;
+  handle.offset = builder->offset;
+  handle.size = builder->blocklen;
+  handle.keylen = strlen(builder->lastkey);
+  if ((ret = buf_append(&builder->index, &builder->indexlen,
+      &builder->indexcap, &handle, sizeof(kvsstable_handle_t))) != 0 ||
+      (ret = buf_append(&builder->index, &builder->indexlen,
+      &builder->indexcap, builder->lastkey, handle.keylen + 1)) != 0)
+    return ret;
+  crc = kvcrc32c(0, builder->block, builder->blocklen);
+  if ((ret = buf_append(&builder->index, &builder->indexlen,
+      &builder->indexcap, &crc, sizeof(uint32_t))) != 0)
+    return ret;
+  builder->offset += builder->blocklen;
+  builder->num_blocks++;
+  builder->blocklen = 0;
+  return 0;
+}
+
+/* Adds KEY and VALUE (a tombstone if VALUE is NULL), which is a reference to
+ * a blob if REF is set, to the table being built by BUILDER. KEY must be
+ * greater than every key previously added. Returns 0 if successful, else a
+ * negative error code. */
+int kvsstable_builder_add(kvsstable_builder_t *builder, char *key,
+    char *value, bool ref) {
+  kvsstable_record_t record;
+  size_t keylen = strlen(key);
+  int ret;
+  record.keylen = keylen | (ref ? KVSSTABLE_REF : 0);
+  record.vallen = (value == NULL) ? KVSSTABLE_TOMBSTONE : strlen(value);
+  if ((ret = buf_append(&builder->block, &builder->blocklen,
+      &builder->blockcap, &record, sizeof(kvsstable_record_t))) != 0 ||
+      (ret = buf_append(&builder->block, &builder->blocklen,
+      &builder->blockcap, key, keylen + 1)) != 0)
+    return ret;
+  if (value != NULL && (ret = buf_append(&builder->block, &builder->blocklen,
+      &builder->blockcap, value, record.vallen + 1)) != 0)
+    return ret;
+  strcpy(builder->lastkey, key);
+  builder->count++;
+  if (builder->blocklen >= KVSSTABLE_BLOCK_SIZE)
+    return builder_flush_block(builder);
+  return 0;
+}
+
+/* Returns the approximate size of the table being built by BUILDER. */
+size_t kvsstable_builder_size(kvsstable_builder_t *builder) {
+  return builder->offset + builder->blocklen + builder->indexlen;
+}
+
+/* Discards the table being built by BUILDER and frees its resources. */
+void kvsstable_builder_abandon(kvsstable_builder_t *builder) {
+  close(builder->fd);
+  remove(builder->filename);
+  free(builder->block);
+  free(builder->index);
+}
+
+/* Opens the table stored in FILENAME for reading through IO, storing it into
+ * TABLE using malloc()d memory which should be released with
+ * kvsstable_close. The file is checked before anything in it is used (see
+ * kvsstable.h). Returns 0 if successful, ERRCHECKSUM if its index block is
+ * damaged, else a negative error code. */
+static int table_open(kvsstable_t **table, kvio_t *io, char *filename,
+    unsigned int id) {
+  kvsstable_footer_t footer;
+  kvsstable_handle_t handle;
+  kvsstable_record_t *record;
+  kvsstable_t *t;
+  struct stat st;
+  char *index = NULL, *first = NULL, *key;
+  size_t pos = 0, firstlen, footer_size = sizeof(kvsstable_footer_t);
+  size_t entry_size;
+  int32_t keylen;
+  int i, ret = ERRFILACCESS;
+
+  if ((t = calloc(1, sizeof(kvsstable_t))) == NULL)
+    return ENOMEM;
+  t->id = id;
+  t->io = io;
+  strcpy(t->filename, filename);
+  if ((t->fd = open(filename, O_RDONLY)) < 0) {
+    free(t);
+    return ERRFILACCESS;
+  }
+  kvio_register(io, t->fd);
+  if (fstat(t->fd, &st) < 0 || st.st_size < footer_size)
+    goto error;
+  t->size = st.st_size;
+  if (pread(t->fd, &footer, footer_size, t->size - footer_size) !=
+      footer_size || footer.magic != KVSSTABLE_MAGIC)
+    goto error;
+  /* The index block lies between the data blocks and the footer, and holds
+   * at least a handle, a null terminator and a checksum for every block. */
+  entry_size = sizeof(kvsstable_handle_t) + 1 + sizeof(uint32_t);
+  if (footer.index_size <= 0 ||
+      footer.index_size > t->size - (off_t) footer_size ||
+      footer.index_offset != t->size - (off_t) footer_size -
+      footer.index_size || footer.num_blocks <= 0 ||
+      footer.num_blocks > footer.index_size / entry_size)
+    goto error;
+  t->count = footer.count;
+
+  if ((index = malloc(footer.index_size)) == NULL ||
+      (t->blocks = calloc(footer.num_blocks, sizeof(kvsstable_block_t)))
+      == NULL) {
+    ret = ENOMEM;
+    goto error;
+  }
+  if (pread(t->fd, index, footer.index_size, footer.index_offset)
+      != footer.index_size)
+    goto error;
+  if (kvcrc32c(0, index, footer.index_size) != footer.index_crc) {
+    ret = ERRCHECKSUM;
+    goto error;
+  }
+  for (i = 0; i < footer.num_blocks; i++) {
+    if (pos + sizeof(kvsstable_handle_t) > footer.index_size)
+      goto error;
+    memcpy(&handle, index + pos, sizeof(kvsstable_handle_t));
+    if (handle.keylen < 0 || handle.keylen > MAX_KEYLEN ||
+        pos + entry_size + handle.keylen > footer.index_size ||
+        handle.offset < 0 || handle.size <= 0 ||
+        handle.size > KVSSTABLE_MAX_BLOCK ||
+        handle.offset > footer.index_offset - handle.size)
+      goto error;
+    t->blocks[i].offset = handle.offset;
+    t->blocks[i].size = handle.size;
+    memcpy(&t->blocks[i].crc, index + pos + sizeof(kvsstable_handle_t) +
+        handle.keylen + 1, sizeof(uint32_t));
+    if ((t->blocks[i].lastkey = malloc(handle.keylen + 1)) == NULL) {
+      ret = ENOMEM;
+      goto error;
+    }
+    memcpy(t->blocks[i].lastkey, index + pos + sizeof(kvsstable_handle_t),
+        handle.keylen);
+    t->blocks[i].lastkey[handle.keylen] = '\0';
+    t->num_blocks++;
+    pos += entry_size + handle.keylen;
+  }
+
+  /* The smallest key is the first key of the first block. */
+  firstlen = t->blocks[0].size;
+  if (firstlen > sizeof(kvsstable_record_t) + MAX_KEYLEN + 1)
+    firstlen = sizeof(kvsstable_record_t) + MAX_KEYLEN + 1;
+  if ((first = malloc(firstlen)) == NULL) {
+    ret = ENOMEM;
+    goto error;
+  }
+  if (pread(t->fd, first, firstlen, t->blocks[0].offset) != firstlen)
+    goto error;
+  record = (kvsstable_record_t *) first;
+  keylen = record->keylen & ~KVSSTABLE_REF;
+  if (keylen < 0 || keylen > MAX_KEYLEN ||
+      sizeof(kvsstable_record_t) + keylen + 1 > firstlen ||
+      record->data[keylen] != '\0')
+    goto error;
+  key = record->data;
+  if ((t->smallest = malloc(strlen(key) + 1)) == NULL) {
+    ret = ENOMEM;
+    goto error;
+  }
+  strcpy(t->smallest, key);
+  t->largest = t->blocks[t->num_blocks - 1].lastkey;
+  free(first);
+  free(index);
+  *table = t;
+  return 0;
+
+error:
+  free(first);
+  free(index);
+  kvsstable_close(t, false);
+  return ret;
+}
+
+/* Writes out the remainder of the table being built by BUILDER and opens it,
+ * storing it into TABLE. If no records were added, the table is discarded and
+ * TABLE is set to NULL. The builder's resources are freed either way. Returns
+ * 0 if successful, else a negative error code. */
+int kvsstable_builder_finish(kvsstable_builder_t *builder,
+    kvsstable_t **table) {
+  kvsstable_footer_t footer;
+  int ret;
+  *table = NULL;
+  if (builder->count == 0) {
+    kvsstable_builder_abandon(builder);
+    return 0;
+  }
+  if ((ret = builder_flush_block(builder)) < 0)
+    goto error;
+  footer.index_crc = kvcrc32c(0, builder->index, builder->indexlen);
+  footer.reserved = 0;
+  footer.index_offset = builder->offset;
+  footer.index_size = builder->indexlen;
+  footer.num_blocks = builder->num_blocks;
+  footer.count = builder->count;
+  footer.magic = KVSSTABLE_MAGIC;
+  if ((ret = write_all(builder->fd, builder->index, builder->indexlen)) < 0 ||
+      (ret = write_all(builder->fd, (char *) &footer,
+      sizeof(kvsstable_footer_t))) < 0)
+    goto error;
+  if (fsync(builder->fd) < 0) {
+    ret = ERRFILACCESS;
+    goto error;
+  }
+  close(builder->fd);
+  free(builder->block);
+  free(builder->index);
+  return table_open(table, builder->io, builder->filename, builder->id);
+
+error:
+  kvsstable_builder_abandon(builder);
+  return ret;
+}
+
+/* Opens the table with id ID within DIRNAME for reading through IO, storing
+ * it into TABLE using malloc()d memory which should be released with
+ * kvsstable_close. Returns 0 if successful, else a negative error code. */
+int kvsstable_open(kvsstable_t **table, kvio_t *io, char *dirname,
+    unsigned int id) {
+  char filename[MAX_FILENAME];
+  sprintf(filename, "%s/%u%s", dirname, id, KVSSTABLE_FILETYPE);
+  return table_open(table, io, filename, id);
+}
+
+/* Reads BLOCK of TABLE into BUF, which has INDEX (see kvio_alloc), checking
+ * it against its checksum. Returns 0 if successful, ERRCHECKSUM if the block
+ * is damaged, else ERRFILACCESS. */
+static int block_read(kvsstable_t *table, kvsstable_block_t *block, char *buf,
+    int index) {
+  if (kvio_read(table->io, table->fd, buf, index, block->size,
+      block->offset) != 0)
+    return ERRFILACCESS;
+  if (kvcrc32c(0, buf, block->size) != block->crc)
+    return ERRCHECKSUM;
+  return 0;
+}
+
+/* Looks up KEY within TABLE. Returns 0 if TABLE holds a value for KEY, which
+ * is placed into VALUE (if not NULL) using malloc()d memory, and whose
+ * location within the table file is placed into OFFSET and LENGTH (if not
+ * NULL), or ERRBLOB if that value is a reference to a blob. Returns
+ * KVSSTABLE_DELETED if TABLE records KEY as deleted, ERRNOKEY if TABLE does
+ * not mention KEY, else a negative error code. */
+static int find_record(kvsstable_t *table, char *key, char **value,
+    off_t *offset, size_t *length) {
+  int lo = 0, hi = table->num_blocks, mid, cmp, index, ret = ERRNOKEY;
+  char *buf, *reckey, *recvalue;
+  size_t pos = 0, size;
+  kvsstable_block_t *block;
+  bool ref;
+  if (strcmp(key, table->smallest) < 0 || strcmp(key, table->largest) > 0)
+    return ERRNOKEY;
+  /* Find the first block whose last key is not less than KEY. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(table->blocks[mid].lastkey, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == table->num_blocks)
+    return ERRNOKEY;
+  block = &table->blocks[lo];
+  if ((buf = kvio_alloc(table->io, block->size, &index)) == NULL)
+    return ENOMEM;
+  if ((ret = block_read(table, block, buf, index)) != 0) {
+    kvio_free(table->io, buf, index);
+    return ret;
+  }
+  while (pos < block->size) {
+    if ((ret = record_parse(buf, block->size, pos, &reckey, &recvalue, &ref,
+        &size)) < 0)
+      break;
+    if ((cmp = strcmp(reckey, key)) >= 0) {
+      if (cmp > 0) {
+        ret = ERRNOKEY;
+      } else if (recvalue == NULL) {
+        ret = KVSSTABLE_DELETED;
+      } else {
+        if (offset != NULL) {
+          *offset = block->offset + (recvalue - buf);
+          *length = strlen(recvalue);
+        }
+        if (value != NULL) {
+          if ((*value = malloc(strlen(recvalue) + 1)) == NULL)
+            ret = ENOMEM;
+          else
+            strcpy(*value, recvalue);
+        }
+        if (ref && ret == 0)
+          ret = ERRBLOB;
+      }
+      break;
+    }
+    pos += size;
+    ret = ERRNOKEY;
+  }
+  kvio_free(table->io, buf, index);
+  return ret;
+}
+
+/* Looks up KEY within TABLE. Returns 0 if TABLE holds a value for KEY, which
+ * is placed into VALUE (if not NULL) using malloc()d memory which should be
+ * free()d later, or ERRBLOB if that value is a reference to a blob. Returns
+ * KVSSTABLE_DELETED if TABLE records KEY as deleted, ERRNOKEY if TABLE does
+ * not mention KEY, else a negative error code. */
+int kvsstable_get(kvsstable_t *table, char *key, char **value) {
+  return find_record(table, key, value, NULL, NULL);
+}
+
+/* Looks up KEY within TABLE like kvsstable_get, but rather than reading the
+ * value, places the offset of the value within the table file into OFFSET
+ * and its length into LENGTH. */
+int kvsstable_locate(kvsstable_t *table, char *key, off_t *offset,
+    size_t *length) {
+  return find_record(table, key, NULL, offset, length);
+}
+
+/* Closes TABLE and frees its memory. If REMOVE_FILE is set, its file is
+ * deleted. */
+void kvsstable_close(kvsstable_t *table, bool remove_file) {
+  int i;
+  if (table->fd >= 0) {
+    kvio_unregister(table->io, table->fd);
+    close(table->fd);
+  }
+  if (remove_file)
+    remove(table->filename);
+  for (i = 0; i < table->num_blocks; i++)
+    free(table->blocks[i].lastkey);
+  free(table->blocks);
+  free(table->smallest);
+  free(table);
+}
+
+/* Loads block number BLOCK of the table being walked by ITER. */
+static int iter_load(kvsstable_iter_t *iter, int block) {
+  kvsstable_block_t *b = &iter->table->blocks[block];
+  int ret;
+  free(iter->buf);
+  iter->len = iter->pos = 0;
+  if ((iter->buf = malloc(b->size)) == NULL)
+    return ENOMEM;
+  if ((ret = block_read(iter->table, b, iter->buf, -1)) != 0)
+    return ret;
+  iter->block = block;
+  iter->len = b->size;
+  return 0;
+}
+
+/* Advances ITER to the next record of its table, setting its VALID field to
+ * false if there are no more. Returns 0 if successful, else a negative error
+ * code. */
+int kvsstable_iter_next(kvsstable_iter_t *iter) {
+  size_t size;
+  int ret;
+  while (iter->pos >= iter->len) {
+    if (iter->block + 1 >= iter->table->num_blocks) {
+      iter->valid = false;
+      return 0;
+    }
+    if ((ret = iter_load(iter, iter->block + 1)) < 0) {
+      iter->valid = false;
+      return ret;
+    }
+  }
+  if ((ret = record_parse(iter->buf, iter->len, iter->pos, &iter->key,
+      &iter->value, &iter->ref, &size)) < 0) {
+    iter->valid = false;
+    return ret;
+  }
+  iter->pos += size;
+  iter->valid = true;
+  return 0;
+}
+
+/* Positions ITER at the first record of TABLE. Returns 0 if successful, else
+ * a negative error code. */
+int kvsstable_iter_init(kvsstable_iter_t *iter, kvsstable_t *table) {
+  memset(iter, 0, sizeof(kvsstable_iter_t));
+  iter->table = table;
+  iter->block = -1;
+  return kvsstable_iter_next(iter);
+}
+
+/* Frees the resources held by ITER. */
+void kvsstable_iter_free(kvsstable_iter_t *iter) {
+  free(iter->buf);
+  iter->buf = NULL;
+  iter->valid = false;
+}
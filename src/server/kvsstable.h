@@ -0,0 +1,166 @@
+#ifndef __KV_SSTABLE__
+#define __KV_SSTABLE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "kvconstants.h"
+#include "kvio.h"
+
+/* KVSSTable is an immutable, sorted table of entries stored in a single file,
+ * as used by KVLSMStore.
+ *
+ * A table file is a sequence of data blocks, followed by an index block and
+ * a fixed-size footer:
+ *    [data block 0] ... [data block N-1] [index block] [kvsstable_footer_t]
+ *
+ * A data block holds roughly KVSSTABLE_BLOCK_SIZE bytes of kvsstable_record_t
+ * records, in increasing key order across the whole file. The index block
+ * holds one kvsstable_handle_t per data block, each followed by the last key
+ * of that block (null terminated) and the CRC-32C of the block (see
+ * kvcrc32c.h), so a lookup needs the in-memory index plus a single block
+ * read. The footer holds the CRC-32C of the index block. Every block is
+ * checked against its checksum as it is read, and the index block when the
+ * table is opened, failing with ERRCHECKSUM.
+ *
+ * Since tables may be adopted from outside the store (see kvstore_ingest),
+ * opening one trusts nothing in the file: the index block and every block it
+ * lists must lie within the file before the footer, and no block may be
+ * larger than KVSSTABLE_MAX_BLOCK.
+ *
+ * Deleted keys are stored as records with a VALLEN of KVSSTABLE_TOMBSTONE so
+ * that they hide older values of the same key in other tables. A value which
+ * is a reference to a blob (see kvblob.h) is marked by KVSSTABLE_REF in the
+ * KEYLEN of its record.
+ *
+ * Table files are named by a unique id:
+ *    sprintf(filename, "%s/%u%s", dirname, id, KVSSTABLE_FILETYPE);
+ *
+ * Blocks are read through the KVIO of the owning store (see kvio.h), which
+ * holds every open table in its fixed file table.
+ */
+
+/* The filetype to append to the filenames of tables. */
+#define KVSSTABLE_FILETYPE ".sst"
+
+/* The size past which a data block is ended and a new one started. */
+#define KVSSTABLE_BLOCK_SIZE 4096
+
+/* The VALLEN of a record which marks its key as deleted. */
+#define KVSSTABLE_TOMBSTONE -1
+
+/* Set in the KEYLEN of a record whose value is a reference to a blob. */
+#define KVSSTABLE_REF 0x40000000
+
+/* Returned by kvsstable_get if the table records KEY as deleted. */
+#define KVSSTABLE_DELETED 1
+
+/* The largest data block, holding KVSSTABLE_BLOCK_SIZE bytes and then the
+ * largest record. */
+#define KVSSTABLE_MAX_BLOCK \
+    (KVSSTABLE_BLOCK_SIZE + sizeof(kvsstable_record_t) + MAX_KEYLEN + \
+    MAX_VALLEN + 2)
+
+/* Identifies a valid table file. */
+#define KVSSTABLE_MAGIC 0x5353544cU
+
+/* A single entry.
+ * data stores the key and (unless this is a tombstone) the value, in the form:
+ *   key_string \0 value_string \0 */
+typedef struct {
+  int32_t keylen;               /* The length of the key, excluding its null terminator, and KVSSTABLE_REF. */
+  int32_t vallen;               /* The length of the value, or KVSSTABLE_TOMBSTONE. */
+  char data[0];                 /* Described above. */
+} kvsstable_record_t;
+
+/* The location of a block, as stored in the index block. */
+typedef struct {
+  int64_t offset;               /* The offset of the block within the file. */
+  int32_t size;                 /* The size of the block in bytes. */
+  int32_t keylen;               /* The length of the key which follows this handle. */
+} kvsstable_handle_t;
+
+/* The footer at the end of every table file. */
+typedef struct {
+  uint32_t index_crc;           /* The CRC-32C of the index block. */
+  uint32_t reserved;            /* Always 0. */
+  int64_t index_offset;         /* The offset of the index block. */
+  int32_t index_size;           /* The size of the index block in bytes. */
+  int32_t num_blocks;           /* The number of data blocks. */
+  uint32_t count;               /* The number of records in the table. */
+  uint32_t magic;               /* Always KVSSTABLE_MAGIC. */
+} kvsstable_footer_t;
+
+/* A block of a table, as held in memory. */
+typedef struct {
+  int64_t offset;               /* The offset of the block within the file. */
+  int32_t size;                 /* The size of the block in bytes. */
+  uint32_t crc;                 /* The CRC-32C of the block. */
+  char *lastkey;                /* The last key stored within the block. */
+} kvsstable_block_t;
+
+/* An open table. */
+typedef struct {
+  unsigned int id;              /* The id of this table, which determines its filename. */
+  char filename[MAX_FILENAME];  /* The name of the file holding this table. */
+  int fd;                       /* An open file descriptor for the table. */
+  kvio_t *io;                   /* Used to read blocks of the table. */
+  off_t size;                   /* The size of the table file in bytes. */
+  uint32_t count;               /* The number of records in the table. */
+  int num_blocks;               /* The number of data blocks. */
+  kvsstable_block_t *blocks;    /* The index of data blocks. */
+  char *smallest;               /* The smallest key within the table. */
+  char *largest;                /* The largest key within the table. */
+} kvsstable_t;
+
+/* Used to write a new table, one record at a time in increasing key order. */
+typedef struct {
+  kvio_t *io;                   /* Passed on to the table once it is finished. */
+  unsigned int id;              /* The id of the table being written. */
+  char filename[MAX_FILENAME];  /* The name of the file being written. */
+  int fd;                       /* An open file descriptor for the file. */
+  int64_t offset;               /* The number of bytes written to the file so far. */
+  uint32_t count;               /* The number of records added so far. */
+  int num_blocks;               /* The number of data blocks written so far. */
+  char *block;                  /* The data block currently being filled. */
+  size_t blocklen;              /* The number of bytes in BLOCK. */
+  size_t blockcap;              /* The capacity of BLOCK. */
+  char *index;                  /* The index block being built. */
+  size_t indexlen;              /* The number of bytes in INDEX. */
+  size_t indexcap;              /* The capacity of INDEX. */
+  char lastkey[MAX_KEYLEN + 1]; /* The last key added. */
+} kvsstable_builder_t;
+
+/* Used to walk every record of a table in key order. */
+typedef struct {
+  kvsstable_t *table;           /* The table being walked. */
+  int block;                    /* The index of the block held in BUF. */
+  char *buf;                    /* The contents of the current block. */
+  size_t len;                   /* The number of bytes in BUF. */
+  size_t pos;                   /* The offset of the next record within BUF. */
+  bool valid;                   /* false once the iterator has passed the last record. */
+  char *key;                    /* The key of the current record. */
+  char *value;                  /* The value of the current record, or NULL if deleted. */
+  bool ref;                     /* Whether VALUE is a reference to a blob. */
+} kvsstable_iter_t;
+
+int kvsstable_builder_init(kvsstable_builder_t *, kvio_t *io, char *dirname,
+    unsigned int id);
+int kvsstable_builder_add(kvsstable_builder_t *, char *key, char *value,
+    bool ref);
+size_t kvsstable_builder_size(kvsstable_builder_t *);
+int kvsstable_builder_finish(kvsstable_builder_t *, kvsstable_t **table);
+void kvsstable_builder_abandon(kvsstable_builder_t *);
+
+int kvsstable_open(kvsstable_t **table, kvio_t *io, char *dirname,
+    unsigned int id);
+int kvsstable_get(kvsstable_t *, char *key, char **value);
+int kvsstable_locate(kvsstable_t *, char *key, off_t *offset, size_t *length);
+void kvsstable_close(kvsstable_t *, bool remove_file);
+
+int kvsstable_iter_init(kvsstable_iter_t *, kvsstable_t *);
+int kvsstable_iter_next(kvsstable_iter_t *);
+void kvsstable_iter_free(kvsstable_iter_t *);
+
+#endif
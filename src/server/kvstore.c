@@ -1,11 +1,30 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include "kvstore.h"
+#include "kvfilestore.h"
+#include "kvlogstore.h"
+#include "kvmemstore.h"
+#include "kvlsmstore.h"
+#include "kvbtree.h"
+#include "kvcrc32c.h"
+#include "kvblob.h"
+
+/* All engines which can be selected by name, terminated by NULL. */
+static const kvstore_engine_t *engines[] = {
+  &kvlogstore_engine,
+  &kvfilestore_engine,
+  &kvmemstore_engine,
+  &kvlsmstore_engine,
+  &kvbtree_engine,
+  NULL
+};
 
 /* The djb2 string hash algorithm
  * Do NOT change this function. 
@@ -18,218 +37,887 @@ unsigned long hash(char *str) {
   return hash;
 }
 
-/* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
- * the entries of this store, creating the directory if necessary. Returns 0 if
- * successful, else a negative error code. */
-int kvstore_init(kvstore_t *store, char *dirname) {
-  struct stat st;
-  if (stat(dirname, &st) == -1) {
-    if (mkdir(dirname, 0700) == -1)
-      return errno;
+/* Returns the engine called NAME, or NULL if there is no such engine. */
+const kvstore_engine_t *kvstore_engine_lookup(const char *name) {
+  int i;
+  for (i = 0; engines[i] != NULL; i++) {
+    if (strcmp(engines[i]->name, name) == 0)
+      return engines[i];
   }
-  strcpy(store->dirname, dirname);
-  pthread_rwlock_init(&store->lock, NULL);
+  return NULL;
+}
+
+/* Adds KEY to the Bloom filter ARG. */
+static int bloom_add_key(char *key, char *value, void *arg) {
+  kvkey_t desc;
+  kvkey_init(&desc, key);
+  kvbloom_add(arg, &desc);
   return 0;
 }
 
-/* Attempts to find an entry matching KEY within the store.
- *
- * Returns a nonnegative integer representing the location of the entry within
- * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
- *
- * Returns a negative error code if the entry is not found or an error
- * occurred.
- *
- * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
-int find_entry(kvstore_t *store, char *key, char **value) {
-  unsigned long hashval;
-  unsigned int counter = 0;
-  char currfile[MAX_FILENAME];
-  size_t keylen = strlen(key);
-  struct stat st;
-  FILE *file;
-  kventry_t *entry, header;
-  if (keylen > MAX_KEYLEN)
-    return ERRKEYLEN;
-  if (stat(store->dirname, &st) == -1)
+/* Builds a Bloom filter holding every key of STORE, with room for at least
+ * CAPACITY keys, and places it into BLOOM. Returns 0 if successful, else a
+ * negative error code. */
+static int bloom_build(kvstore_t *store, uint64_t capacity,
+    kvbloom_t **bloom) {
+  kvbloom_t *fresh = malloc(sizeof(kvbloom_t));
+  int ret;
+  if (fresh == NULL)
+    return ENOMEM;
+  if ((ret = kvbloom_init(fresh, capacity)) == 0)
+    ret = store->engine->keys(store, bloom_add_key, fresh);
+  if (ret >= 0 && fresh->count > kvbloom_capacity(fresh)) {
+    /* More keys than expected; size the filter for them instead. */
+    capacity = fresh->count * 2;
+    kvbloom_free(fresh);
+    free(fresh);
+    return bloom_build(store, capacity, bloom);
+  }
+  if (ret < 0) {
+    kvbloom_free(fresh);
+    free(fresh);
+    return ret;
+  }
+  *bloom = fresh;
+  return 0;
+}
+
+/* Sets up the Bloom filter of STORE, loading the copy saved by kvstore_close
+ * if there is one, else building it from the engine's keys. */
+static int bloom_open(kvstore_t *store) {
+  char filename[MAX_FILENAME];
+  kvbloom_t *bloom;
+  if (store->engine->keys == NULL)
+    return 0;
+  pthread_rwlock_init(&store->bloom_lock, NULL);
+  if (kvstore_path(filename, "%s/%s", store->dirname,
+      KVSTORE_BLOOM_FILENAME) != 0)
     return ERRFILACCESS;
-  hashval = hash(key);
-  pthread_rwlock_rdlock(&store->lock);
-  sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-      KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    if ((file = fopen(currfile, "r")) == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ERRFILACCESS;
-    }
-    fread(&header, sizeof(kventry_t), 1, file);
-    fseek(file, 0L, SEEK_SET);
-    entry = malloc(sizeof(kventry_t) + header.length);
-    if (entry == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ENOMEM;
+  if ((bloom = malloc(sizeof(kvbloom_t))) == NULL)
+    return ENOMEM;
+  if (kvbloom_load(bloom, filename) == 0) {
+    /* Only trust the saved filter once; see the comment in kvstore.h. */
+    if (remove(filename) == 0) {
+      store->bloom = bloom;
+      return 0;
     }
-    fread(entry, sizeof(kventry_t) + header.length, 1, file);
-    fclose(file);
-    if (strcmp(key, entry->data) == 0) {
-      if (value != NULL) {
-        *value = malloc(entry->length - strlen(entry->data) - 1);
-        if (*value == NULL) {
-          pthread_rwlock_unlock(&store->lock);
-          return ENOMEM;
-        }
-        strcpy(*value, entry->data + strlen(entry->data) + 1);
-        free(entry);
-      }
-      pthread_rwlock_unlock(&store->lock);
-      return counter - 1;
-    }
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-        KVSTORE_FILETYPE);
+    kvbloom_free(bloom);
+  }
+  free(bloom);
+  remove(filename);
+  return bloom_build(store, 0, &store->bloom);
+}
+
+/* Holds the Bloom filter of STORE for reading and returns it, or returns NULL
+ * without holding anything if STORE has no filter, or no longer has one since
+ * being closed. */
+static kvbloom_t *bloom_hold(kvstore_t *store) {
+  if (store->engine->keys == NULL)
+    return NULL;
+  pthread_rwlock_rdlock(&store->bloom_lock);
+  if (store->bloom == NULL) {
+    pthread_rwlock_unlock(&store->bloom_lock);
+    return NULL;
+  }
+  return store->bloom;
+}
+
+/* Rebuilds the Bloom filter of STORE if it holds more keys than it was sized
+ * for, or if too many of its keys have been deleted. If the rebuild fails,
+ * the old filter (which still holds every key) stays in use. */
+static void bloom_maintain(kvstore_t *store) {
+  kvbloom_t *bloom;
+  uint64_t capacity, count, stale;
+  bool stale_filter;
+  if ((bloom = bloom_hold(store)) == NULL)
+    return;
+  capacity = kvbloom_capacity(bloom);
+  count = __atomic_load_n(&bloom->count, __ATOMIC_RELAXED);
+  stale = __atomic_load_n(&bloom->stale, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&store->bloom_lock);
+  if (count <= capacity && stale <= capacity / 2)
+    return;
+  pthread_rwlock_wrlock(&store->bloom_lock);
+  if (store->bloom == NULL) {
+    pthread_rwlock_unlock(&store->bloom_lock);
+    return;
+  }
+  capacity = kvbloom_capacity(store->bloom);
+  stale_filter = store->bloom->count > capacity ||
+      store->bloom->stale > capacity / 2;
+  if (stale_filter && bloom_build(store,
+      (store->bloom->count - store->bloom->stale) * 2, &bloom) == 0) {
+    kvbloom_free(store->bloom);
+    free(store->bloom);
+    store->bloom = bloom;
+  }
+  pthread_rwlock_unlock(&store->bloom_lock);
+}
+
+/* Returns the stripe of STORE which KEY falls within. */
+static kvstore_stripe_t *stripe_of(kvstore_t *store, kvkey_t *key) {
+  return &store->stripes[key->hash % KVSTORE_STRIPES];
+}
+
+/* Returns a new entry recording that KEY holds a reference to a blob, using
+ * malloc()d memory which should be released with blobref_free, or NULL if
+ * memory runs out. */
+static kvstore_blobref_t *blobref_new(kvkey_t *key) {
+  kvstore_blobref_t *entry = calloc(1, sizeof(kvstore_blobref_t));
+  if (entry != NULL && (entry->key = strdup(key->str)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+/* Frees ENTRY, which may be NULL. */
+static void blobref_free(kvstore_blobref_t *entry) {
+  if (entry != NULL)
+    free(entry->key);
+  free(entry);
+}
+
+/* Keeps the blob REF, written for KEY, within the kvstore_t ARG if the
+ * engine holds it as the reference of KEY, recording it in the stripe of
+ * KEY, else removes it; see kvblob.h. */
+static int sweep_blob(char *key, char *ref, void *arg) {
+  kvstore_t *store = arg;
+  kvstore_stripe_t *stripe;
+  kvstore_blobref_t *entry;
+  kvkey_t desc;
+  char *value = NULL;
+  bool keep;
+  int ret = 0;
+  kvkey_init(&desc, key);
+  stripe = stripe_of(store, &desc);
+  pthread_mutex_lock(&stripe->lock);
+  keep = store->engine->get(store, &desc, &value) == ERRBLOB &&
+      strcmp(value, ref) == 0;
+  HASH_FIND(hh, stripe->refs, key, desc.len, entry);
+  if (keep && entry == NULL) {
+    if ((entry = blobref_new(&desc)) == NULL)
+      ret = ENOMEM;
+    else
+      HASH_ADD_KEYPTR(hh, stripe->refs, entry->key, desc.len, entry);
+  } else if (!keep && entry != NULL && strcmp(entry->ref, ref) == 0) {
+    HASH_DELETE(hh, stripe->refs, entry);
+    blobref_free(entry);
+    entry = NULL;
+  }
+  if (keep && entry != NULL)
+    strcpy(entry->ref, ref);
+  pthread_mutex_unlock(&stripe->lock);
+  if (!keep)
+    kvblob_remove(&store->blobs, ref);
+  free(value);
+  return ret;
+}
+
+/* Initializes kvstore STORE to use the engine called ENGINE. If ENGINE is
+ * NULL, the file-per-entry engine is used if DIRNAME already holds entries in
+ * that layout, else the default engine. Persistent engines use DIRNAME as the
+ * directory in which to store the entries of this store, creating the
+ * directory if necessary, and make their writes durable according to
+ * SYNC_MODE. Engines which checksum what they store verify the checksum of
+ * everything they read if VERIFY is set, and engines which can compress
+ * values do so if COMPRESS is set. Returns 0 if successful, ERRENGINE if
+ * there is no engine called ENGINE, else a negative error code. */
+int kvstore_init(kvstore_t *store, char *dirname, const char *engine,
+    kvsync_mode_t sync_mode, bool verify, bool compress) {
+  struct stat st;
+  int i, ret;
+  if (engine == NULL)
+    engine = kvfilestore_detect(dirname) ? "file" : KVSTORE_DEFAULT_ENGINE;
+  if ((store->engine = kvstore_engine_lookup(engine)) == NULL)
+    return ERRENGINE;
+  if (strlen(dirname) >= MAX_FILENAME)
+    return ERRFILACCESS;
+  if (store->engine->persistent && stat(dirname, &st) == -1) {
+    if (mkdir(dirname, 0700) == -1)
+      return errno;
   }
-  pthread_rwlock_unlock(&store->lock);
-  return ERRNOKEY;
+  strcpy(store->dirname, dirname);
+  if ((ret = kvblob_init(&store->blobs, dirname, sync_mode)) != 0)
+    return ret;
+  store->state = NULL;
+  store->sync_mode = sync_mode;
+  store->verify = verify;
+  store->compress = compress;
+  store->bloom = NULL;
+  store->closed = false;
+  pthread_mutex_init(&store->snapshot_lock, NULL);
+  for (i = 0; i < KVSTORE_STRIPES; i++) {
+    store->stripes[i].refs = NULL;
+    pthread_mutex_init(&store->stripes[i].lock, NULL);
+  }
+  if ((ret = store->engine->init(store, dirname)) != 0)
+    return ret;
+  if ((ret = bloom_open(store)) != 0)
+    return ret;
+  return kvblob_list(&store->blobs, sweep_blob, store);
 }
 
 /* Returns true if STORE contains KEY, else false. */
-bool kvstore_haskey(kvstore_t *store, char *key) {
-  return find_entry(store, key, NULL) >= 0;
+bool kvstore_haskey(kvstore_t *store, kvkey_t *key) {
+  kvbloom_t *bloom;
+  bool ret;
+  if (key->len > MAX_KEYLEN)
+    return false;
+  if ((bloom = bloom_hold(store)) == NULL)
+    return store->engine->haskey(store, key);
+  if (!kvbloom_may_contain(bloom, key)) {
+    ret = false;
+  } else if (!(ret = store->engine->haskey(store, key))) {
+    kvbloom_false_positive(bloom);
+  }
+  pthread_rwlock_unlock(&store->bloom_lock);
+  return ret;
+}
+
+/* Retrieves the value of KEY from STORE as the engine holds it, which may
+ * be a reference to a blob, like kvstore_get. */
+static int get_value(kvstore_t *store, kvkey_t *key, char **value) {
+  kvbloom_t *bloom;
+  int ret;
+  if (key->len > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if ((bloom = bloom_hold(store)) == NULL)
+    return store->engine->get(store, key, value);
+  if (!kvbloom_may_contain(bloom, key)) {
+    ret = ERRNOKEY;
+  } else if ((ret = store->engine->get(store, key, value)) == ERRNOKEY) {
+    kvbloom_false_positive(bloom);
+  }
+  pthread_rwlock_unlock(&store->bloom_lock);
+  return ret;
 }
 
 /* Attempts to retrieve the entry denoted by KEY from STORE.
- * Returns 0 if successful, else a negative error code. The entry's value will
+ * Returns 0 if successful, ERRBLOB if its value is stored out of line (see
+ * kvstore_get_located), else a negative error code. The entry's value will
  * be placed into VALUE using malloc()d memory which should be free()d later. */
-int kvstore_get(kvstore_t *store, char *key, char **value) {
-  int ret = find_entry(store, key, value);
-  if (ret < 0)
-    return ret;
-  else
-    return 0;
+int kvstore_get(kvstore_t *store, kvkey_t *key, char **value) {
+  int ret = get_value(store, key, value);
+  if (ret == ERRBLOB && value != NULL) {
+    free(*value);
+    *value = NULL;
+  }
+  return ret;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE like kvstore_get,
+ * except that a value stored out of line is not read: VALUE is set to NULL
+ * and the location of the value within its blob is placed into LOC instead,
+ * as kvstore_locate does. Returns 0 if successful, else a negative error
+ * code. */
+int kvstore_get_located(kvstore_t *store, kvkey_t *key, char **value,
+    kvstore_loc_t *loc) {
+  int ret, tries;
+  for (tries = 0; tries < 2; tries++) {
+    if ((ret = get_value(store, key, value)) != ERRBLOB)
+      return ret;
+    ret = kvblob_open(&store->blobs, *value, store->verify, &loc->fd,
+        &loc->offset, &loc->length);
+    free(*value);
+    *value = NULL;
+    /* The key may have been written again, and its blob removed, since the
+     * reference was read. */
+    if (ret != ERRNOKEY)
+      break;
+  }
+  return ret;
+}
+
+/* Compares the keys pointed to by A and B, for qsort. */
+static int key_ptr_cmp(const void *a, const void *b) {
+  return strcmp((*(kvkey_t * const *) a)->str, (*(kvkey_t * const *) b)->str);
+}
+
+/* Looks up the COUNT keys at KEYS within the engine of STORE, as the MGET
+ * hook of the engine would (see kvstore_engine_t), doing so one key at a time
+ * if the engine has no such hook. */
+static int engine_mget(kvstore_t *store, kvkey_t *keys, unsigned int count,
+    char **values) {
+  kvkey_t **order;
+  unsigned int i, pos;
+  int ret = 0;
+  if (store->engine->mget != NULL)
+    return store->engine->mget(store, keys, count, values);
+  /* Engines which keep entries in key order find neighbouring keys close
+   * together, so visit the keys in that order. */
+  if ((order = malloc(count * sizeof(kvkey_t *))) == NULL)
+    return ENOMEM;
+  for (i = 0; i < count; i++)
+    order[i] = &keys[i];
+  if (store->engine->scan != NULL)
+    qsort(order, count, sizeof(kvkey_t *), key_ptr_cmp);
+  for (i = 0; i < count && ret == 0; i++) {
+    pos = order[i] - keys;
+    values[pos] = NULL;
+    ret = store->engine->get(store, &keys[pos], &values[pos]);
+    /* Values stored out of line are not read into memory. */
+    if (ret == ERRBLOB)
+      free(values[pos]);
+    if (ret != 0)
+      values[pos] = NULL;
+    if (ret == ERRNOKEY || ret == ERRBLOB)
+      ret = 0;
+  }
+  free(order);
+  if (ret != 0) {
+    for (i = 0; i < count; i++) {
+      free(values[i]);
+      values[i] = NULL;
+    }
+  }
+  return ret;
+}
+
+/* Attempts to retrieve the COUNT entries denoted by KEYS from STORE. The value
+ * of each key is placed into the corresponding entry of VALUES using
+ * malloc()d memory which should be free()d later, or NULL if the key is not
+ * present or its value is stored out of line. Returns 0 if successful, else a
+ * negative error code (or ENOMEM), in which case every entry of VALUES is
+ * NULL. */
+int kvstore_mget(kvstore_t *store, kvkey_t *keys, unsigned int count,
+    char **values) {
+  kvbloom_t *bloom;
+  kvkey_t *cand_keys;
+  char **cand_values;
+  unsigned int *cand_pos, num_cand = 0, i;
+  int ret;
+  for (i = 0; i < count; i++) {
+    values[i] = NULL;
+    if (keys[i].len > MAX_KEYLEN)
+      return ERRKEYLEN;
+  }
+  if ((bloom = bloom_hold(store)) == NULL)
+    return engine_mget(store, keys, count, values);
+  cand_keys = malloc(count * sizeof(kvkey_t));
+  cand_values = calloc(count, sizeof(char *));
+  cand_pos = malloc(count * sizeof(unsigned int));
+  if (cand_keys == NULL || cand_values == NULL || cand_pos == NULL) {
+    ret = ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < count; i++) {
+    if (kvbloom_may_contain(bloom, &keys[i])) {
+      cand_keys[num_cand] = keys[i];
+      cand_pos[num_cand++] = i;
+    }
+  }
+  ret = (num_cand == 0) ? 0 :
+      engine_mget(store, cand_keys, num_cand, cand_values);
+  if (ret == 0) {
+    for (i = 0; i < num_cand; i++) {
+      if ((values[cand_pos[i]] = cand_values[i]) == NULL)
+        kvbloom_false_positive(bloom);
+    }
+  }
+out:
+  pthread_rwlock_unlock(&store->bloom_lock);
+  free(cand_keys);
+  free(cand_values);
+  free(cand_pos);
+  return ret;
+}
+
+/* Finds where the value of the entry denoted by KEY is stored within STORE,
+ * so that it can be sent straight from the file (see kvstore_loc_t); for a
+ * value stored out of line, that is its blob. Returns 0 if successful,
+ * ERRNOTIMPL if the value must be read with kvstore_get_located instead,
+ * else a negative error code. */
+int kvstore_locate(kvstore_t *store, kvkey_t *key, kvstore_loc_t *loc) {
+  kvbloom_t *bloom;
+  char *value;
+  int ret;
+  if (key->len > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (store->engine->locate == NULL)
+    return ERRNOTIMPL;
+  if ((bloom = bloom_hold(store)) == NULL) {
+    ret = store->engine->locate(store, key, loc);
+  } else {
+    if (!kvbloom_may_contain(bloom, key)) {
+      ret = ERRNOKEY;
+    } else if ((ret = store->engine->locate(store, key, loc)) == ERRNOKEY) {
+      kvbloom_false_positive(bloom);
+    }
+    pthread_rwlock_unlock(&store->bloom_lock);
+  }
+  if (ret == ERRBLOB) {
+    /* The engine holds a reference, which leads to the blob. */
+    ret = kvstore_get_located(store, key, &value, loc);
+    if (ret == 0 && value != NULL) {
+      free(value);
+      ret = ERRNOTIMPL;
+    }
+  }
+  return ret;
 }
 
 /* Checks if STORE can successfully add the given KEY, VALUE pair.
  * Returns 0 if it can, else a negative error code indicating why it cannot. */
-int kvstore_put_check(kvstore_t *store, char *key, char *value) {
+int kvstore_put_check(kvstore_t *store, kvkey_t *key, char *value) {
   struct stat st;
-  if (strlen(key) > MAX_KEYLEN)
+  if (key->len > MAX_KEYLEN)
     return ERRKEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERRVALLEN;
-  if (stat(store->dirname, &st) == -1)
+  if (store->engine->persistent && stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
   return 0;
 }
 
+/* Adds KEY to STORE with VALUE, which has been checked and is a reference
+ * to a blob if REF is set, removing any blob the key held before. Returns 0
+ * if successful, else a negative error code. */
+static int put_value(kvstore_t *store, kvkey_t *key, char *value, bool ref) {
+  kvstore_stripe_t *stripe = stripe_of(store, key);
+  kvstore_blobref_t *entry, *fresh = NULL;
+  char old[KVBLOB_REF_SIZE] = "";
+  kvbloom_t *bloom;
+  int ret;
+  /* Allocate up front, so that nothing can fail once the engine has the
+   * reference. */
+  if (ref && (fresh = blobref_new(key)) == NULL)
+    return ENOMEM;
+  pthread_mutex_lock(&stripe->lock);
+  if (store->closed) {
+    ret = ERRFILACCESS;
+  } else if ((bloom = bloom_hold(store)) == NULL) {
+    ret = store->engine->put(store, key, value, ref);
+  } else {
+    /* The key is added first so that a concurrent GET can never miss it. */
+    kvbloom_add(bloom, key);
+    ret = store->engine->put(store, key, value, ref);
+    pthread_rwlock_unlock(&store->bloom_lock);
+  }
+  if (ret == 0) {
+    HASH_FIND(hh, stripe->refs, key->str, key->len, entry);
+    if (entry != NULL) {
+      strcpy(old, entry->ref);
+      HASH_DELETE(hh, stripe->refs, entry);
+      blobref_free(entry);
+    }
+    if (ref) {
+      strcpy(fresh->ref, value);
+      HASH_ADD_KEYPTR(hh, stripe->refs, fresh->key, key->len, fresh);
+      fresh = NULL;
+    }
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  blobref_free(fresh);
+  if (old[0] != '\0')
+    kvblob_remove(&store->blobs, old);
+  if (ret == 0)
+    bloom_maintain(store);
+  return ret;
+}
+
 /* Adds the given KEY, VALUE entry to STORE. Returns 0 if successful, else a
- * negative error code. See kvserver.h for a complete description of how
- * entries are stored. */
-int kvstore_put(kvstore_t *store, char *key, char *value) {
-  unsigned long hashval;
-  int counter, check;
-  size_t keylen = strlen(key), vallen = strlen(value);
-  char filename[MAX_FILENAME];
-  struct stat st;
-  FILE *file;
-  kventry_t *entry;
+ * negative error code. See the header of the store's engine for a complete
+ * description of how entries are stored. */
+int kvstore_put(kvstore_t *store, kvkey_t *key, char *value) {
+  int check;
   if ((check = kvstore_put_check(store, key, value)) < 0)
     return check;
-  hashval = hash(key);
-  counter = find_entry(store, key, NULL);
-  pthread_rwlock_wrlock(&store->lock);
-  if (counter >= 0) {
-    /* Entry already exists, just update it. */
-    sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter,
-        KVSTORE_FILETYPE);
-  } else {
-    /* Search for the end of the hash chain to insert. */
-    counter = 0;
-    sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-        KVSTORE_FILETYPE);
-    while (stat(filename, &st) != -1)
-      sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-          KVSTORE_FILETYPE);
-  }
-  if ((file = fopen(filename, "w")) == NULL) {
-    pthread_rwlock_unlock(&store->lock);
+  return put_value(store, key, value, false);
+}
+
+/* Adds a value of LENGTH bytes for KEY to STORE, storing it out of line (see
+ * kvblob.h) as it is read with READER (passed ARG) a piece at a time, so
+ * that it is never held in memory whole. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_put_stream(kvstore_t *store, kvkey_t *key, size_t length,
+    kvblob_read_t reader, void *arg) {
+  char ref[KVBLOB_REF_SIZE];
+  struct stat st;
+  int ret;
+  if (key->len > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (length > MAX_BLOB_VALLEN)
+    return ERRVALLEN;
+  if (store->engine->persistent && stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
-  }
-  entry = malloc(sizeof(kventry_t) + keylen + vallen + 2);
-  entry->length = keylen + vallen + 2;
-  strcpy(entry->data, key);
-  strcpy(entry->data + keylen + 1, value);
-  fwrite(entry, sizeof(kventry_t) + entry->length, 1, file);
-  fclose(file);
-  pthread_rwlock_unlock(&store->lock);
-  free(entry);
-  return 0;
+  if ((ret = kvblob_write(&store->blobs, key, length, reader, arg, ref)) != 0)
+    return ret;
+  if ((ret = put_value(store, key, ref, true)) != 0)
+    kvblob_remove(&store->blobs, ref);
+  return ret;
 }
 
 /* Checks if STORE can successfully remove the given KEY.
  * Returns 0 if it can, else a negative error code indicating why it cannot. */
-int kvstore_del_check(kvstore_t *store, char *key) {
+int kvstore_del_check(kvstore_t *store, kvkey_t *key) {
   struct stat st;
-  if (strlen(key) > MAX_KEYLEN)
+  if (key->len > MAX_KEYLEN)
     return ERRKEYLEN;
-  if (stat(store->dirname, &st) == -1)
+  if (store->engine->persistent && stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
   if (!kvstore_haskey(store, key))
     return ERRNOKEY;
   return 0;
 }
 
-/* Removes the given KEY entry from STORE. Returns 0 if successful, else a
- * negative error code. Any hash chains which are disrupted by the deletion of
- * KEY will be reconnected within this function. */
-int kvstore_del(kvstore_t *store, char *key) {
-  char delfile[MAX_FILENAME];
-  int chainpos;
-  unsigned long hashval;
-  unsigned int counter;
-  char currfile[MAX_FILENAME];
-  struct stat st;
-  chainpos = find_entry(store, key, NULL);
-  if (chainpos < 0)
-    return chainpos;
-  counter = chainpos;
-  hashval = hash(key);
-  pthread_rwlock_wrlock(&store->lock);
-  sprintf(delfile, "%s/%lu-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
-  sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  }
-  if (counter == chainpos + 1) {
-    /* There were no elements in the chain after the element to be deleted. */
-    if (remove(delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
-      return errno;
-    }
+/* Removes the given KEY entry from STORE, along with its blob if its value
+ * is stored out of line. Returns 0 if successful, else a negative error
+ * code. */
+int kvstore_del(kvstore_t *store, kvkey_t *key) {
+  kvstore_blobref_t *entry = NULL;
+  kvstore_stripe_t *stripe;
+  kvbloom_t *bloom;
+  int ret;
+  if (key->len > MAX_KEYLEN)
+    return ERRKEYLEN;
+  stripe = stripe_of(store, key);
+  pthread_mutex_lock(&stripe->lock);
+  if (store->closed) {
+    ret = ERRFILACCESS;
+  } else if ((bloom = bloom_hold(store)) == NULL) {
+    ret = store->engine->del(store, key);
   } else {
-    /* There were elements in the chain after the element to be deleted.
-       Take the last element in the chain and swap it into the deletion
-       location. */
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter - 1,
-        KVSTORE_FILETYPE);
-    if (rename(currfile, delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
-      return errno;
+    if (!kvbloom_may_contain(bloom, key)) {
+      ret = ERRNOKEY;
+    } else if ((ret = store->engine->del(store, key)) == 0) {
+      kvbloom_remove(bloom);
     }
+    pthread_rwlock_unlock(&store->bloom_lock);
+  }
+  if (ret == 0) {
+    HASH_FIND(hh, stripe->refs, key->str, key->len, entry);
+    if (entry != NULL)
+      HASH_DELETE(hh, stripe->refs, entry);
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  if (ret == 0)
+    bloom_maintain(store);
+  if (entry != NULL)
+    kvblob_remove(&store->blobs, entry->ref);
+  blobref_free(entry);
+  return ret;
+}
+
+/* Adds the COUNT entries given by KEYS and VALUES to STORE, after checking
+ * that every one of them can be added. Returns 0 if successful, else a
+ * negative error code, in which case none of the entries were added if the
+ * error was found by the checks, and only those before the failing entry
+ * otherwise. */
+int kvstore_mput(kvstore_t *store, kvkey_t *keys, char **values,
+    unsigned int count) {
+  unsigned int i;
+  int ret;
+  for (i = 0; i < count; i++) {
+    if ((ret = kvstore_put_check(store, &keys[i], values[i])) < 0)
+      return ret;
+  }
+  for (i = 0; i < count; i++) {
+    if ((ret = kvstore_put(store, &keys[i], values[i])) < 0)
+      return ret;
   }
-  pthread_rwlock_unlock(&store->lock);
   return 0;
 }
 
+/* Removes the COUNT entries denoted by KEYS from STORE. Keys which are not
+ * present are skipped. Returns 0 if successful, else the first negative error
+ * code other than ERRNOKEY, after attempting every key. */
+int kvstore_mdel(kvstore_t *store, kvkey_t *keys, unsigned int count) {
+  unsigned int i;
+  int ret, first = 0;
+  for (i = 0; i < count; i++) {
+    ret = kvstore_del(store, &keys[i]);
+    if (ret < 0 && ret != ERRNOKEY && first == 0)
+      first = ret;
+  }
+  return first;
+}
+
+/* The callback of a scan, which sees only values stored inline. */
+typedef struct {
+  kvscan_cb_t callback;
+  void *arg;
+  unsigned int skipped;         /* The number of entries skipped so far. */
+} scan_filter_t;
+
+/* Passes KEY and VALUE to the callback of the scan_filter_t ARG, unless
+ * VALUE is NULL, which the engine passes for a reference to a blob. */
+static int scan_inline(char *key, char *value, void *arg) {
+  scan_filter_t *filter = arg;
+  if (value == NULL) {
+    filter->skipped++;
+    return 0;
+  }
+  return filter->callback(key, value, filter->arg);
+}
+
+/* Calls CALLBACK with ARG on every entry of STORE whose key is at least START
+ * and less than END, in key order. A NULL START or END leaves that end of the
+ * range open, so a prefix scan passes the prefix as START and the prefix with
+ * its last character incremented as END. Stops after LIMIT entries if LIMIT
+ * is not 0, or as soon as CALLBACK returns nonzero. Entries whose values are
+ * stored out of line are skipped, though they count towards LIMIT. CALLBACK
+ * must not modify STORE. Returns the number of entries passed to CALLBACK if
+ * successful, else a negative error code (ERRNOTIMPL if the engine cannot
+ * scan). */
+int kvstore_scan(kvstore_t *store, char *start, char *end, unsigned int limit,
+    kvscan_cb_t callback, void *arg) {
+  scan_filter_t filter = { callback, arg, 0 };
+  int ret;
+  if ((start != NULL && strlen(start) > MAX_KEYLEN) ||
+      (end != NULL && strlen(end) > MAX_KEYLEN))
+    return ERRKEYLEN;
+  if (store->engine->scan == NULL)
+    return ERRNOTIMPL;
+  ret = store->engine->scan(store, start, end, limit, scan_inline, &filter);
+  return (ret < 0) ? ret : ret - (int) filter.skipped;
+}
+
+/* Adopts the entries built offline for STORE in DIRNAME (see
+ * main/kvingest.c) as its newest entries, removing any blobs of keys they
+ * overwrite. Returns 0 if successful, ERRNOTIMPL if the engine of STORE
+ * cannot ingest entries, else a negative error code. */
+int kvstore_ingest(kvstore_t *store, char *dirname) {
+  kvbloom_t *bloom;
+  int ret;
+  if (store->engine->ingest == NULL)
+    return ERRNOTIMPL;
+  /* The filter is held throughout so that it cannot be rebuilt from the
+   * engine's keys between the new keys being added and published. */
+  if ((bloom = bloom_hold(store)) == NULL) {
+    if (store->closed)
+      return ERRFILACCESS;
+    ret = store->engine->ingest(store, dirname, NULL, NULL);
+  } else {
+    ret = store->engine->ingest(store, dirname, bloom_add_key, bloom);
+    pthread_rwlock_unlock(&store->bloom_lock);
+    bloom_maintain(store);
+  }
+  /* Blobs of keys which were overwritten are no longer referred to. */
+  if (ret == 0 && __atomic_load_n(&store->blobs.count, __ATOMIC_RELAXED) > 0)
+    ret = kvblob_list(&store->blobs, sweep_blob, store);
+  return ret;
+}
+
+/* Places the path given by FORMAT and the arguments after it, as for
+ * printf(), into FILENAME, which holds MAX_FILENAME bytes. Returns 0 if
+ * successful, else ERRFILACCESS if the path does not fit. */
+int kvstore_path(char *filename, const char *format, ...) {
+  va_list args;
+  int len;
+  va_start(args, format);
+  len = vsnprintf(filename, MAX_FILENAME, format, args);
+  va_end(args);
+  return (len < 0 || len >= MAX_FILENAME) ? ERRFILACCESS : 0;
+}
+
+/* Removes DIRNAME and everything within it. */
+void kvstore_remove_tree(char *dirname) {
+  char filename[MAX_FILENAME];
+  struct dirent *dent;
+  DIR *dir;
+  if ((dir = opendir(dirname)) == NULL)
+    return;
+  while ((dent = readdir(dir)) != NULL) {
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+    if (kvstore_path(filename, "%s/%s", dirname, dent->d_name) != 0)
+      continue;
+    if (remove(filename) == -1 && errno == ENOTEMPTY)
+      kvstore_remove_tree(filename);
+  }
+  closedir(dir);
+  rmdir(dirname);
+}
+
+/* Takes a snapshot of STORE into DIRNAME, which must not exist yet (see
+ * kvstore.h). DIRNAME can then be opened as a store with the same engine.
+ * Nothing is left in DIRNAME if the snapshot fails. Returns 0 if successful,
+ * ERRNOTIMPL if the engine cannot take snapshots, ERRFILCRT if DIRNAME
+ * cannot be created, else a negative error code. */
+int kvstore_snapshot(kvstore_t *store, char *dirname) {
+  int fd, ret;
+  if (store->engine->snapshot == NULL)
+    return ERRNOTIMPL;
+  if (strlen(dirname) + 64 > MAX_FILENAME)
+    return ERRFILLEN;
+  pthread_mutex_lock(&store->snapshot_lock);
+  if (mkdir(dirname, 0700) == -1) {
+    pthread_mutex_unlock(&store->snapshot_lock);
+    return ERRFILCRT;
+  }
+  /* Blobs are protected from before the moment of the snapshot until all of
+   * them have been linked, so none which its entries refer to is missed. */
+  if ((ret = kvblob_snapshot_begin(&store->blobs, dirname)) == 0) {
+    ret = store->engine->snapshot(store, dirname);
+    if (kvblob_snapshot_end(&store->blobs) != 0 && ret == 0)
+      ret = ERRFILACCESS;
+  }
+  if (ret == 0) {
+    if ((fd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) < 0)
+      ret = ERRFILACCESS;
+    if (fd >= 0)
+      close(fd);
+  }
+  if (ret != 0)
+    kvstore_remove_tree(dirname);
+  pthread_mutex_unlock(&store->snapshot_lock);
+  return ret;
+}
+
+/* Copies the first LENGTH bytes of the file open as FD into the new file
+ * DSTNAME, for a snapshot, and syncs it. Returns 0 if successful, ERRFILCRT
+ * if DSTNAME exists or cannot be created, else a negative error code (or
+ * ENOMEM). */
+int kvstore_snapshot_copy(int fd, off_t length, char *dstname) {
+  char *buf;
+  off_t offset = 0;
+  ssize_t len;
+  int dst, ret = 0;
+  if ((buf = malloc(KVBLOB_CHUNK_SIZE)) == NULL)
+    return ENOMEM;
+  if ((dst = open(dstname, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+    free(buf);
+    return ERRFILCRT;
+  }
+  while (ret == 0 && offset < length) {
+    len = pread(fd, buf, (length - offset < KVBLOB_CHUNK_SIZE) ?
+        length - offset : KVBLOB_CHUNK_SIZE, offset);
+    if (len <= 0 || write(dst, buf, len) != len)
+      ret = ERRFILACCESS;
+    offset += len;
+  }
+  if (ret == 0 && fsync(dst) < 0)
+    ret = ERRFILACCESS;
+  close(dst);
+  free(buf);
+  if (ret != 0)
+    remove(dstname);
+  return ret;
+}
+
+/* Places the file SRCNAME, which is never modified once written, at
+ * DSTNAME for a snapshot: as a hard link, or as a copy if DSTNAME is on
+ * another filesystem. Returns 0 if successful, ERRNOKEY if SRCNAME does not
+ * exist, ERRFILCRT if DSTNAME exists or cannot be created, else a negative
+ * error code (or ENOMEM). */
+int kvstore_snapshot_link(char *srcname, char *dstname) {
+  struct stat st;
+  int fd, ret;
+  if (link(srcname, dstname) == 0)
+    return 0;
+  if (errno == ENOENT)
+    return ERRNOKEY;
+  if (errno == EEXIST)
+    return ERRFILCRT;
+  if (errno != EXDEV)
+    return ERRFILACCESS;
+  if ((fd = open(srcname, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  ret = (fstat(fd, &st) < 0) ? ERRFILACCESS :
+      kvstore_snapshot_copy(fd, st.st_size, dstname);
+  close(fd);
+  return ret;
+}
+
+/* Writes a description of the state of STORE into BUF, which holds SIZE
+ * bytes, as a series of "name: value" lines. Returns the number of bytes
+ * written, excluding the null terminator. */
+int kvstore_stats(kvstore_t *store, char *buf, size_t size) {
+  kvbloom_t *bloom;
+  int len;
+  len = snprintf(buf, size, "engine: %s\nsync_mode: %s\n"
+      "verify: %s\ncrc32c: %s\nblobs: %llu\n",
+      store->engine->name, kvsync_mode_name(store->sync_mode),
+      store->verify ? "on" : "off", kvcrc32c_impl(),
+      (unsigned long long) __atomic_load_n(&store->blobs.count,
+      __ATOMIC_RELAXED));
+  if (len < 0 || (size_t) len >= size)
+    return len < 0 ? 0 : (int) size - 1;
+  if ((bloom = bloom_hold(store)) == NULL) {
+    len += snprintf(buf + len, size - len, "bloom: disabled\n");
+  } else {
+    len += snprintf(buf + len, size - len,
+        "bloom_keys: %llu\n"
+        "bloom_stale_keys: %llu\n"
+        "bloom_capacity: %llu\n"
+        "bloom_fpr_expected: %.6f\n"
+        "bloom_fpr_observed: %.6f\n",
+        (unsigned long long) bloom->count,
+        (unsigned long long) bloom->stale,
+        (unsigned long long) kvbloom_capacity(bloom),
+        kvbloom_fpr(bloom), kvbloom_observed_fpr(bloom));
+    pthread_rwlock_unlock(&store->bloom_lock);
+  }
+  if ((size_t) len < size && store->engine->stats != NULL)
+    len += store->engine->stats(store, buf + len, size - len);
+  return ((size_t) len >= size) ? (int) size - 1 : len;
+}
+
+/* Prepares STORE for the process to exit, making every write durable and
+ * saving anything which would be slow to rebuild (the Bloom filter, and
+ * whatever the engine saves when flushed) into the store directory. Writes
+ * in progress are waited for, and later writes to STORE fail with
+ * ERRFILACCESS, so that the saved filter holds every key; reads are still
+ * served, without the filter. Returns 0 if successful, else a negative error
+ * code. */
+int kvstore_close(kvstore_t *store) {
+  char filename[MAX_FILENAME];
+  int i, ret = 0;
+  /* Stripes first, then the filter, in the order writes take them. */
+  for (i = 0; i < KVSTORE_STRIPES; i++)
+    pthread_mutex_lock(&store->stripes[i].lock);
+  if (store->engine->keys != NULL)
+    pthread_rwlock_wrlock(&store->bloom_lock);
+  store->closed = true;
+  if (store->engine->flush != NULL)
+    ret = store->engine->flush(store);
+  if (store->bloom != NULL) {
+    if (ret == 0)
+      ret = kvstore_path(filename, "%s/%s", store->dirname,
+          KVSTORE_BLOOM_FILENAME);
+    if (ret == 0)
+      ret = kvbloom_save(store->bloom, filename);
+    kvbloom_free(store->bloom);
+    free(store->bloom);
+    store->bloom = NULL;
+  }
+  if (store->engine->keys != NULL)
+    pthread_rwlock_unlock(&store->bloom_lock);
+  for (i = KVSTORE_STRIPES - 1; i >= 0; i--)
+    pthread_mutex_unlock(&store->stripes[i].lock);
+  return ret;
+}
+
 /* Deletes all current entries in STORE and removes the store directory. */
 int kvstore_clean(kvstore_t *store) {
+  kvstore_blobref_t *entry, *tmp;
   struct dirent *dent;
   char filename[MAX_FILENAME];
-  DIR *kvstoredir = opendir(store->dirname);
+  DIR *kvstoredir;
+  int i;
+  if (store->state != NULL) {
+    store->engine->clean(store);
+    store->state = NULL;
+  }
+  if (store->bloom != NULL) {
+    kvbloom_free(store->bloom);
+    free(store->bloom);
+    store->bloom = NULL;
+  }
+  for (i = 0; i < KVSTORE_STRIPES; i++) {
+    HASH_ITER(hh, store->stripes[i].refs, entry, tmp) {
+      HASH_DELETE(hh, store->stripes[i].refs, entry);
+      blobref_free(entry);
+    }
+  }
+  kvblob_clean(&store->blobs);
+  kvstoredir = opendir(store->dirname);
   if (kvstoredir == NULL)
     return 0;
   while ((dent = readdir(kvstoredir)) != NULL) {
-    sprintf(filename, "%s/%s", store->dirname, dent->d_name);
-    remove(filename);
+    if (kvstore_path(filename, "%s/%s", store->dirname, dent->d_name) == 0)
+      remove(filename);
   }
   closedir(kvstoredir);
   remove(store->dirname);
@@ -2,72 +2,270 @@
 #define __KV_STORE__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include "uthash.h"
 #include "kvconstants.h"
+#include "kvbloom.h"
+#include "kvkey.h"
+#include "kvsync.h"
+#include "kvblob.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value> entries.
  *
- * Each entry is stored as an individual file, all collected within the
- * directory name which is passed in upon initialization. If you are running
- * multiple KVStores, they MUST have unique directory names, else behavior is
- * undefined.
- *
- * The files which store entries are simple binary dumps of a kventry_t
- * struct.  Note that this means entry files are NOT portable, and results will
- * vary if an entry created on one machine is accessed on another machine, or
- * even by a program compiled by a different compiler. The LENGTH field of kventry_t
- * is used to determine how large an entry and its associated file are.
- *
- * The name of the file that stores an entry is determined by the djb2 string
- * hash of the entry's key, which can be found using the hash() function. To
- * resolve collisions, hash chaining is used, thus the file names of entries
- * within the store directory should have the format:
- *    hash(key)-chainpos.entry
- *        OR, more explicitly:
- *    sprintf(filename, "%lu-%u.entry", hash(key), chainpos);
- * chainpos represents the entry's position within its hash chain, which should
- * start from 0.  If a collision is found when storing an entry, the new entry
- * will have a chainpos of 1, and so on.  Chains should always be complete;
- * that is, you may never have a chain which has entries with a chainpos of 0
- * and 2 but not 1.
- *
- * All state is stored in persistent file storage, so it is valid to initialize
- * a KVStore using a directory name which was previously used for a KVStore,
- * and the new store will be an exact clone of the old store.
+ * A KVStore validates requests and hands them to a storage engine, which
+ * decides how entries are laid out. The engine is chosen by name when the
+ * store is initialized:
+ *    "log"   Entries are appended to a few large segment files, with an
+ *            in-memory index of where each value lives. See kvlogstore.h.
+ *    "file"  Each entry is stored in its own file. See kvfilestore.h.
+ *    "mem"   Entries are kept in memory only and are lost when the server
+ *            exits. See kvmemstore.h.
+ *    "lsm"   Writes go to a memtable and log, and are flushed to sorted
+ *            tables which are compacted in the background. See kvlsmstore.h.
+ *    "btree" Entries are kept in key order in a copy-on-write B+tree within
+ *            a single memory-mapped file. See kvbtree.h.
+ * If no engine is named, a directory which already holds a file-per-entry
+ * store keeps using the "file" engine, and any other directory uses "log".
+ *
+ * Persistent engines store all of their entries within the directory name
+ * which is passed in upon initialization. If you are running multiple
+ * KVStores, they MUST have unique directory names, else behavior is
+ * undefined. All state is stored in persistent file storage, so it is valid to
+ * initialize a KVStore using a directory name which was previously used for a
+ * KVStore with the same engine, and the new store will be an exact clone of
+ * the old store.
+ *
+ * For engines which must go to disk to look a key up, the store keeps a Bloom
+ * filter of every key (see kvbloom.h), so that GETs, DELs and checks for keys
+ * which are definitely absent fail with ERRNOKEY without reaching the engine.
+ * The filter is built from the engine's keys in kvstore_init, updated by
+ * every PUT and DEL, and rebuilt once it outgrows its capacity or holds too
+ * many deleted keys. kvstore_close saves it to KVSTORE_BLOOM_FILENAME; the
+ * saved copy is deleted as soon as it is loaded again, so a store which was
+ * not closed cleanly always rebuilds its filter rather than trust a stale one.
+ *
+ * kvstore_mget looks a batch of keys up together. Keys which the Bloom filter
+ * rules out are dropped first, and the rest are handed to the engine in one
+ * go so that it can read them in the order they are laid out in storage
+ * (engines which keep entries in key order simply have them sorted).
+ *
+ * Engines which checksum what they store (CRC-32C, see kvcrc32c.h) check
+ * every read against it unless verification is turned off in kvstore_init,
+ * which saves the checksum on hot read paths; the layout of what is read is
+ * still checked, so damaged data fails with ERRCHECKSUM rather than being
+ * trusted either way.
+ *
+ * Engines which can compress values (so far only "file", see kvfilestore.h)
+ * do so if compression is turned on in kvstore_init, and report how well it
+ * is working through kvstore_stats.
+ *
+ * Values longer than MAX_VALLEN, up to MAX_BLOB_VALLEN bytes, are stored out
+ * of line with kvstore_put_stream, which writes them into a blob a piece at
+ * a time (see kvblob.h) and stores a reference to the blob in the engine.
+ * The engine records that the entry holds a reference rather than a value,
+ * so any value can be stored inline. Such a value is never read into memory:
+ * kvstore_get fails with ERRBLOB, kvstore_get_located and kvstore_locate
+ * return where it lies within its blob instead, kvstore_mget returns NULL
+ * for it and kvstore_scan skips it. Overwriting or deleting the key removes
+ * the blob. The store keeps the reference held by each such key in memory,
+ * in one of KVSTORE_STRIPES tables chosen by the hash of the key, and every
+ * write holds the lock of that stripe from looking the old reference up to
+ * recording the new one, so writes need not read the entry first and racing
+ * writes of a key never lose track of a blob.
+ *
+ * Entries built offline by kvingest are adopted in bulk with kvstore_ingest,
+ * by engines which support it (so far only "lsm"), rather than being written
+ * one at a time. Their keys are added to the Bloom filter before they can be
+ * read, and blobs of keys they overwrite are removed once they have been
+ * adopted.
+ *
+ * kvstore_snapshot copies the entries of the store, as they were at a single
+ * moment, into a new directory while writes carry on, so that the copy can
+ * be backed up, or opened as a store of its own by another process, without
+ * stopping the server. Engines which support it (every persistent one) link
+ * the files they never modify again into the snapshot rather than copying
+ * them, so a snapshot on the same filesystem as the store costs little more
+ * than a directory of hard links (see each engine for what it copies).
+ * Blobs are linked along with the entries; the Bloom filter is rebuilt when
+ * the snapshot is opened. One snapshot of a store is taken at a time.
+ *
+ * The sync mode passed to kvstore_init decides when engines which write
+ * through the page cache make their writes durable; see kvsync.h for the
+ * modes. The "btree" engine syncs every write regardless, since its crash
+ * safety depends on the order in which pages reach the disk.
  */
 
-/* The filetype to append to the filenames of entries within the log. */
-#define KVSTORE_FILETYPE ".entry"
+/* The engine used when none is named and the directory holds no entries. */
+#define KVSTORE_DEFAULT_ENGINE "log"
 
-/* A KVStore. */
+/* The name of the file the Bloom filter is saved to within the directory. */
+#define KVSTORE_BLOOM_FILENAME "bloom.filter"
+
+/* The number of stripes which the references to blobs held by keys are
+ * spread across. */
+#define KVSTORE_STRIPES 64
+
+struct kvstore;
+
+/* Called by kvstore_scan with each entry in the range, in key order. KEY and
+ * VALUE are only valid for the duration of the call. Returning nonzero ends
+ * the scan. */
+typedef int (*kvscan_cb_t)(char *key, char *value, void *arg);
+
+/* Where the value of an entry is stored, as found by kvstore_locate. */
 typedef struct {
-  char dirname[MAX_FILENAME];  /* The name of the directory used to store its entries. */
-  pthread_rwlock_t lock;       /* The lock used to make KVStore's functions thread-safe. */
-} kvstore_t;
+  int fd;                       /* An open file descriptor for the file holding the value, to be close()d by the caller. */
+  off_t offset;                 /* The offset of the value within the file. */
+  size_t length;                /* The length of the value, excluding its null terminator. */
+} kvstore_loc_t;
+
+/* A storage engine. Each function receives the KVStore being operated on,
+ * whose STATE field holds whatever the engine allocated in INIT. Keys and
+ * values have already been validated by the time an engine sees them, and
+ * keys arrive as descriptors (see kvkey.h) whose length and hash the engine
+ * may use rather than compute again. SCAN
+ * is NULL for engines which do not keep entries in key order.
+ *
+ * PUT is passed REF set if VALUE is a reference to a blob (see kvblob.h)
+ * rather than a value, which the engine must record alongside the entry.
+ * GET then fails with ERRBLOB for the entry, placing the reference into
+ * VALUE (if not NULL) as it would a value; HASKEY is true for it, MGET
+ * leaves it NULL, SCAN and KEYS pass it to CALLBACK with a NULL value and
+ * LOCATE fails with ERRBLOB.
+ *
+ * KEYS calls CALLBACK (with a NULL value) on every key in the store, in no
+ * particular order, and possibly also on keys which have since been deleted.
+ * It is used to build the store's Bloom filter, and is NULL for engines
+ * whose lookups never leave memory, which do not need one.
+ *
+ * FLUSH makes every write made so far durable, whatever the sync mode. It is
+ * NULL for engines whose writes are always durable, or never are.
+ *
+ * MGET looks up COUNT keys at once, placing the value of each key into the
+ * corresponding entry of VALUES (NULL for keys which are absent) using
+ * malloc()d memory. It should issue its reads in the order in which the
+ * values are laid out in storage. If it fails, it leaves every entry of
+ * VALUES NULL. It is NULL for engines which gain nothing from batching
+ * lookups, which are then looked up one at a time.
+ *
+ * LOCATE finds the file, offset and length of the value of a key, so that it
+ * can be sent without being copied through memory. The file descriptor it
+ * returns must stay valid and its contents unchanged even if the entry is
+ * then overwritten or moved. It returns ERRNOTIMPL if the value is not held
+ * in a file in that form (for instance, if it is still in memory), and is
+ * NULL for engines which cannot locate any value.
+ *
+ * STATS writes statistics particular to the engine into BUF, which holds
+ * SIZE bytes, returning what snprintf() does. It is NULL for engines which
+ * have none.
+ *
+ * INGEST atomically adopts entries which were built offline in DIRNAME in
+ * the engine's own format (see main/kvingest.c), as the newest entries of
+ * the store, calling CALLBACK (with a NULL value) on each of their keys
+ * before any of them can be read. It is NULL for engines which cannot.
+ *
+ * SNAPSHOT fills DIRNAME, an empty directory, with the entries of the store
+ * as they were at a single moment during the call, laid out so that DIRNAME
+ * can be opened as a store with the same engine, without keeping writers
+ * waiting for longer than a few links. Anything the snapshot shares with the
+ * store (see kvstore_snapshot_link) must never be modified again by either.
+ * It is NULL for engines which cannot. */
+typedef struct {
+  const char *name;             /* The name used to select this engine. */
+  bool persistent;              /* true if this engine stores entries within DIRNAME. */
+  int (*init)(struct kvstore *, char *dirname);
+  int (*get)(struct kvstore *, kvkey_t *key, char **value);
+  int (*mget)(struct kvstore *, kvkey_t *keys, unsigned int count,
+      char **values);
+  int (*put)(struct kvstore *, kvkey_t *key, char *value, bool ref);
+  int (*del)(struct kvstore *, kvkey_t *key);
+  bool (*haskey)(struct kvstore *, kvkey_t *key);
+  int (*scan)(struct kvstore *, char *start, char *end, unsigned int limit,
+      kvscan_cb_t callback, void *arg);
+  int (*keys)(struct kvstore *, kvscan_cb_t callback, void *arg);
+  int (*flush)(struct kvstore *);
+  int (*locate)(struct kvstore *, kvkey_t *key, kvstore_loc_t *loc);
+  int (*stats)(struct kvstore *, char *buf, size_t size);
+  int (*ingest)(struct kvstore *, char *dirname, kvscan_cb_t callback,
+      void *arg);
+  int (*snapshot)(struct kvstore *, char *dirname);
+  int (*clean)(struct kvstore *);
+} kvstore_engine_t;
+
+/* A key whose value is stored out of line. */
+typedef struct {
+  char *key;                    /* The key. */
+  char ref[KVBLOB_REF_SIZE];    /* The reference to its blob which the engine holds. */
+  UT_hash_handle hh;            /* Makes this structure hashable by uthash. */
+} kvstore_blobref_t;
 
-/* A single kvstore entry.
- * data stores both the key and the value, in the form:
- *   key_string \0 value_string \0
- * (that is, two concatenated and null terminated strings) */
+/* The keys of a store which fall within one stripe. */
 typedef struct {
-  int length;                   /* Stores the total length of data, including null terminators. */
-  char data[0];                 /* Described above. */
-} kventry_t;
+  kvstore_blobref_t *refs;      /* The keys whose values are stored out of line, a uthash table. */
+  pthread_mutex_t lock;         /* Protects REFS, and is held by each write of a key across its engine write. */
+} kvstore_stripe_t;
+
+/* A KVStore. */
+typedef struct kvstore {
+  char dirname[MAX_FILENAME];       /* The name of the directory used to store its entries. */
+  const kvstore_engine_t *engine;   /* The engine which stores this store's entries. */
+  void *state;                      /* The engine's private state. */
+  kvsync_mode_t sync_mode;          /* When the engine makes writes durable. */
+  bool verify;                      /* true if the engine verifies the checksums of what it reads. */
+  bool compress;                    /* true if the engine compresses the values it stores. */
+  kvbloom_t *bloom;                 /* Filters out lookups of absent keys, or NULL if the engine has no KEYS. */
+  pthread_rwlock_t bloom_lock;      /* Held for reading around each use of BLOOM, and for writing to replace it. */
+  bool closed;                      /* true once kvstore_close has run; set under every stripe lock and BLOOM_LOCK. */
+  kvblob_t blobs;                   /* The values stored out of line. */
+  kvstore_stripe_t stripes[KVSTORE_STRIPES]; /* The references held by keys, by hash(key) % KVSTORE_STRIPES. */
+  pthread_mutex_t snapshot_lock;    /* Held while a snapshot of the store is taken. */
+} kvstore_t;
 
 unsigned long hash(char *str);
 
-int kvstore_init(kvstore_t *, char *dirname);
+const kvstore_engine_t *kvstore_engine_lookup(const char *name);
+
+int kvstore_init(kvstore_t *, char *dirname, const char *engine,
+    kvsync_mode_t sync_mode, bool verify, bool compress);
+
+int kvstore_get(kvstore_t *, kvkey_t *key, char **value);
+int kvstore_mget(kvstore_t *, kvkey_t *keys, unsigned int count,
+    char **values);
+int kvstore_get_located(kvstore_t *, kvkey_t *key, char **value,
+    kvstore_loc_t *loc);
+int kvstore_locate(kvstore_t *, kvkey_t *key, kvstore_loc_t *loc);
+
+int kvstore_put(kvstore_t *, kvkey_t *key, char *value);
+int kvstore_put_check(kvstore_t *, kvkey_t *key, char *value);
+int kvstore_put_stream(kvstore_t *, kvkey_t *key, size_t length,
+    kvblob_read_t reader, void *arg);
+
+int kvstore_del(kvstore_t *, kvkey_t *key);
+int kvstore_del_check(kvstore_t *, kvkey_t *key);
+
+int kvstore_mput(kvstore_t *, kvkey_t *keys, char **values,
+    unsigned int count);
+int kvstore_mdel(kvstore_t *, kvkey_t *keys, unsigned int count);
+
+bool kvstore_haskey(kvstore_t *, kvkey_t *key);
 
-int kvstore_get(kvstore_t *, char *key, char **value);
+int kvstore_scan(kvstore_t *, char *start, char *end, unsigned int limit,
+    kvscan_cb_t callback, void *arg);
 
-int kvstore_put(kvstore_t *, char *key, char *value);
-int kvstore_put_check(kvstore_t *, char *key, char *value);
+int kvstore_ingest(kvstore_t *, char *dirname);
 
-int kvstore_del(kvstore_t *, char *key);
-int kvstore_del_check(kvstore_t *, char *key);
+int kvstore_snapshot(kvstore_t *, char *dirname);
+int kvstore_snapshot_link(char *srcname, char *dstname);
+int kvstore_snapshot_copy(int fd, off_t length, char *dstname);
+void kvstore_remove_tree(char *dirname);
+int kvstore_path(char *filename, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 
-bool kvstore_haskey(kvstore_t *, char *key);
+int kvstore_stats(kvstore_t *, char *buf, size_t size);
 
+int kvstore_close(kvstore_t *);
 int kvstore_clean(kvstore_t *);
 
 #endif
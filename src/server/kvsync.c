@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "kvsync.h"
+
+/* The names of the modes, indexed by mode. */
+static const char *mode_names[] = { "none", "batch", "always" };
+
+/* Returns the mode called NAME, or -1 if there is none. */
+int kvsync_mode_lookup(const char *name) {
+  int i;
+  for (i = 0; i < (int) (sizeof(mode_names) / sizeof(mode_names[0])); i++) {
+    if (strcmp(mode_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Returns the name of MODE. */
+const char *kvsync_mode_name(kvsync_mode_t mode) {
+  return mode_names[mode];
+}
+
+/* Makes everything written to the file of SYNC durable. Returns 0 if
+ * successful, else ERRFILACCESS. */
+static int do_sync(kvsync_t *sync, int fd) {
+  int ret = sync->syncfs ? syncfs(fd) : fdatasync(fd);
+  return (ret < 0) ? ERRFILACCESS : 0;
+}
+
+/* Records that a sync begun when WRITTEN bytes had been reported finished
+ * with result RET, and wakes everybody waiting on it. Must be called with the
+ * lock of SYNC held. */
+static void sync_done(kvsync_t *sync, uint64_t written, int ret) {
+  sync->syncs++;
+  if (ret != 0)
+    sync->error = ret;
+  else if (written > sync->synced)
+    sync->synced = written;
+  if (sync->written > sync->synced)
+    clock_gettime(CLOCK_MONOTONIC, &sync->oldest);
+  pthread_cond_broadcast(&sync->done);
+}
+
+/* Returns true if the flusher of SYNC should sync now, else places the time
+ * at which it should next check into WAKE. Must be called with the lock of
+ * SYNC held, while there are unsynced writes. */
+static bool sync_due(kvsync_t *sync, struct timespec *wake) {
+  struct timespec now;
+  if (sync->mode == KVSYNC_ALWAYS ||
+      sync->written - sync->synced >= KVSYNC_BATCH_BYTES)
+    return true;
+  *wake = sync->oldest;
+  wake->tv_nsec += KVSYNC_BATCH_DELAY_MS * 1000000L;
+  if (wake->tv_nsec >= 1000000000L) {
+    wake->tv_sec += wake->tv_nsec / 1000000000L;
+    wake->tv_nsec %= 1000000000L;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > wake->tv_sec ||
+      (now.tv_sec == wake->tv_sec && now.tv_nsec >= wake->tv_nsec);
+}
+
+/* The body of the flusher thread of the kvsync_t ARG. */
+static void *flusher(void *arg) {
+  kvsync_t *sync = arg;
+  struct timespec wake;
+  uint64_t written;
+  int fd, ret;
+  pthread_mutex_lock(&sync->lock);
+  while (!sync->stopping) {
+    if (sync->written == sync->synced || sync->error != 0) {
+      pthread_cond_wait(&sync->work, &sync->lock);
+      continue;
+    }
+    if (!sync_due(sync, &wake)) {
+      pthread_cond_timedwait(&sync->work, &sync->lock, &wake);
+      continue;
+    }
+    /* Sync without the lock held, so that writers can keep appending; they
+     * will be covered by the next sync. */
+    written = sync->written;
+    fd = sync->fd;
+    sync->syncing = true;
+    pthread_mutex_unlock(&sync->lock);
+    ret = do_sync(sync, fd);
+    pthread_mutex_lock(&sync->lock);
+    sync->syncing = false;
+    sync_done(sync, written, ret);
+  }
+  pthread_mutex_unlock(&sync->lock);
+  return NULL;
+}
+
+/* Initializes SYNC to make writes to FD durable according to MODE, syncing
+ * the whole filesystem holding FD if SYNCFS is set. Starts the flusher
+ * thread unless MODE is KVSYNC_NONE. Returns 0 if successful, else a
+ * negative error code. */
+int kvsync_init(kvsync_t *sync, kvsync_mode_t mode, int fd, bool syncfs) {
+  pthread_condattr_t attr;
+  memset(sync, 0, sizeof(kvsync_t));
+  sync->mode = mode;
+  sync->fd = fd;
+  sync->syncfs = syncfs;
+  pthread_mutex_init(&sync->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sync->work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&sync->done, NULL);
+  if (mode != KVSYNC_NONE &&
+      pthread_create(&sync->thread, NULL, flusher, sync) != 0) {
+    sync->mode = KVSYNC_NONE;
+    return ENOMEM;
+  }
+  return 0;
+}
+
+/* Reports that BYTES more bytes have been written to the file of SYNC. Must
+ * be called once the write has completed, since any sync begun afterwards
+ * covers it. A change which writes no bytes (such as removing a file) is
+ * counted as one byte. Returns a ticket to be passed to kvsync_wait. */
+uint64_t kvsync_append(kvsync_t *sync, size_t bytes) {
+  uint64_t ticket;
+  if (sync->mode == KVSYNC_NONE)
+    return 0;
+  if (bytes == 0)
+    bytes = 1;
+  pthread_mutex_lock(&sync->lock);
+  if (sync->written == sync->synced)
+    clock_gettime(CLOCK_MONOTONIC, &sync->oldest);
+  ticket = sync->written += bytes;
+  if (sync->mode == KVSYNC_ALWAYS ||
+      sync->written - sync->synced >= KVSYNC_BATCH_BYTES ||
+      sync->written - bytes == sync->synced)
+    pthread_cond_signal(&sync->work);
+  pthread_mutex_unlock(&sync->lock);
+  return ticket;
+}
+
+/* Waits, if the mode of SYNC requires it, until the write which returned
+ * TICKET is durable. Must not be called with any lock held which other
+ * writers need, or they cannot join the batch. Returns 0 if successful, else
+ * a negative error code. */
+int kvsync_wait(kvsync_t *sync, uint64_t ticket) {
+  int ret;
+  if (sync->mode != KVSYNC_ALWAYS)
+    return 0;
+  pthread_mutex_lock(&sync->lock);
+  while (sync->synced < ticket && sync->error == 0)
+    pthread_cond_wait(&sync->done, &sync->lock);
+  ret = (sync->synced >= ticket) ? 0 : sync->error;
+  pthread_mutex_unlock(&sync->lock);
+  return ret;
+}
+
+/* Makes every write reported to SYNC durable, from the calling thread. Must
+ * be called with the lock of SYNC held. Returns 0 if successful, else a
+ * negative error code. */
+static int flush_locked(kvsync_t *sync) {
+  int ret;
+  while (sync->syncing)
+    pthread_cond_wait(&sync->done, &sync->lock);
+  if (sync->error != 0)
+    return sync->error;
+  if (sync->written == sync->synced)
+    return 0;
+  ret = do_sync(sync, sync->fd);
+  sync_done(sync, sync->written, ret);
+  return ret;
+}
+
+/* Makes every write reported to SYNC durable, then has it sync FD from now
+ * on. Used when an engine moves on to a new file, before the old one may be
+ * closed. Returns 0 if successful, else a negative error code. */
+int kvsync_switch(kvsync_t *sync, int fd) {
+  int ret;
+  if (sync->mode == KVSYNC_NONE) {
+    sync->fd = fd;
+    return 0;
+  }
+  pthread_mutex_lock(&sync->lock);
+  ret = flush_locked(sync);
+  sync->fd = fd;
+  pthread_mutex_unlock(&sync->lock);
+  return ret;
+}
+
+/* Makes every write reported to SYNC durable, even in KVSYNC_NONE mode.
+ * Returns 0 if successful, else a negative error code. */
+int kvsync_flush(kvsync_t *sync) {
+  int ret;
+  if (sync->mode == KVSYNC_NONE)
+    return do_sync(sync, sync->fd);
+  pthread_mutex_lock(&sync->lock);
+  ret = flush_locked(sync);
+  pthread_mutex_unlock(&sync->lock);
+  return ret;
+}
+
+/* Makes every write reported to SYNC durable, then stops its flusher. */
+void kvsync_stop(kvsync_t *sync) {
+  if (sync->mode == KVSYNC_NONE)
+    return;
+  kvsync_flush(sync);
+  pthread_mutex_lock(&sync->lock);
+  sync->stopping = true;
+  pthread_cond_signal(&sync->work);
+  pthread_mutex_unlock(&sync->lock);
+  pthread_join(sync->thread, NULL);
+  sync->mode = KVSYNC_NONE;
+}
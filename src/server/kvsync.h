@@ -0,0 +1,90 @@
+#ifndef __KV_SYNC__
+#define __KV_SYNC__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "kvconstants.h"
+
+/* KVSync group-commits the writes of a storage engine, so that making writes
+ * durable costs one fdatasync() per batch of writes rather than one per
+ * write.
+ *
+ * An engine writes to its file as usual (so the data sits in the page cache,
+ * which acts as the shared buffer of every concurrent writer), then reports
+ * the write with kvsync_append, which returns a ticket. Once it has released
+ * its own locks, the writer passes the ticket to kvsync_wait. A single
+ * flusher thread syncs the file on behalf of every write made up to that
+ * point, and then wakes all of the writers which were waiting on it; writers
+ * which arrive while a sync is in progress are covered by the next one.
+ *
+ * How long a write may stay unsynced is set by the mode:
+ *    KVSYNC_NONE    The file is never synced; the operating system writes it
+ *                   back whenever it likes. This is the fastest mode, and an
+ *                   acknowledged write may be lost on power failure.
+ *    KVSYNC_BATCH   Writers do not wait. The flusher syncs once
+ *                   KVSYNC_BATCH_BYTES are unsynced, or the oldest unsynced
+ *                   write is KVSYNC_BATCH_DELAY_MS old, whichever comes
+ *                   first, which bounds how much can be lost.
+ *    KVSYNC_ALWAYS  Every write is durable before kvsync_wait returns.
+ *                   The flusher syncs as soon as there is anything to sync.
+ *
+ * An engine which writes many files (rather than appending to one) can sync
+ * the whole filesystem with syncfs() instead, by passing a descriptor for
+ * its directory and setting SYNCFS.
+ *
+ * A failed sync leaves it unknown which writes reached the disk, so once one
+ * fails every later kvsync_wait (in KVSYNC_ALWAYS mode), kvsync_switch and
+ * kvsync_flush fails with ERRFILACCESS.
+ */
+
+/* The number of unsynced bytes which triggers a sync in KVSYNC_BATCH mode. */
+#define KVSYNC_BATCH_BYTES (1024 * 1024)
+
+/* The longest a write stays unsynced in KVSYNC_BATCH mode. */
+#define KVSYNC_BATCH_DELAY_MS 5
+
+/* The mode used if none is chosen. */
+#define KVSYNC_DEFAULT_MODE KVSYNC_BATCH
+
+/* When writes are made durable. Described above. */
+typedef enum {
+  KVSYNC_NONE,
+  KVSYNC_BATCH,
+  KVSYNC_ALWAYS
+} kvsync_mode_t;
+
+/* A KVSync. */
+typedef struct {
+  kvsync_mode_t mode;           /* When writes are made durable. */
+  int fd;                       /* The file to sync, or any file within the filesystem if SYNCFS. */
+  bool syncfs;                  /* true to sync the whole filesystem of FD rather than just FD. */
+  uint64_t written;             /* The number of bytes reported by kvsync_append. */
+  uint64_t synced;              /* The number of those bytes known to be durable. */
+  uint64_t syncs;               /* The number of syncs issued. */
+  struct timespec oldest;       /* When the oldest unsynced write was reported. */
+  int error;                    /* ERRFILACCESS once a sync has failed, else 0. */
+  bool syncing;                 /* true while the flusher is syncing without LOCK held. */
+  bool stopping;                /* true once the flusher has been asked to exit. */
+  pthread_mutex_t lock;         /* Protects all of the above. */
+  pthread_cond_t work;          /* Signalled when the flusher may have something to do. */
+  pthread_cond_t done;          /* Broadcast after every sync. */
+  pthread_t thread;             /* The flusher, if MODE is not KVSYNC_NONE. */
+} kvsync_t;
+
+int kvsync_mode_lookup(const char *name);
+const char *kvsync_mode_name(kvsync_mode_t);
+
+int kvsync_init(kvsync_t *, kvsync_mode_t mode, int fd, bool syncfs);
+
+uint64_t kvsync_append(kvsync_t *, size_t bytes);
+int kvsync_wait(kvsync_t *, uint64_t ticket);
+
+int kvsync_switch(kvsync_t *, int fd);
+int kvsync_flush(kvsync_t *);
+
+void kvsync_stop(kvsync_t *);
+
+#endif
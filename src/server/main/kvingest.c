@@ -0,0 +1,966 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "socket_server.h"
+#include "kvserver.h"
+#include "kvlsmstore.h"
+#include "kvsstable.h"
+
+/* kvingest builds the entries of a bulk load offline, as tables in the
+ * format of the "lsm" engine (see kvlsmstore.h), so that a running slave
+ * can adopt all of them at once with an INGEST request (see kvserver.h)
+ * rather than taking them one PUT at a time.
+ *
+ * The input is either tab-separated text, one "key<TAB>value" entry per
+ * line, or (with -b) binary records, each a uint32_t key length and a
+ * uint32_t value length in host byte order followed by the key and then the
+ * value. It need not be sorted; where a key appears more than once, its last
+ * entry wins. Entries are checked as a PUT would check them, and one which a
+ * PUT would reject (including a value longer than MAX_VALLEN, since values
+ * stored out of line cannot be ingested) stops the load.
+ *
+ * Entries are read into memory until the memory budget (-m, in megabytes)
+ * is used, then sorted by the store which will hold them, for a slave with
+ * the given number of data directories (-n, see kvserver_store_index), and
+ * by key, by all of the threads (-j) at once. Each batch but the last is
+ * then written out to a run file within the output directory. The key space
+ * of each store is split at keys sampled from the batches into ranges of
+ * about equal size, and the threads merge the batches range by range, each
+ * writing tables of about KVLSMSTORE_TABLE_SIZE bytes, so the output is
+ * written by all of the threads in parallel.
+ *
+ * The output directory holds a subdirectory for each store, named by its
+ * index, holding its tables, their list (KVLSMSTORE_INGEST_LIST) and,
+ * written last, its KVSERVER_SHARD_FILENAME. A slave only ingests
+ * directories within its ingest root (kvslave -I), named by their last
+ * component alone, so the output directory should be made there. With -a,
+ * the slave listening on that port of this host is then asked to ingest it;
+ * otherwise, an INGEST request naming the output directory may be sent
+ * later. The ingest root should be on the same filesystem as the slave's
+ * data directories, so that the tables are linked into them rather than
+ * copied.
+ */
+
+const char *USAGE = "Usage: kvingest "
+    "[-b] [--binary] "
+    "[-n stores] [--stores=n (default=1)] "
+    "[-j threads] [--threads=n] "
+    "[-m megabytes] [--memory=megabytes (default=1024)] "
+    "[-a port] [--attach=port] "
+    "input|- output_dir";
+
+/* The number of entries of a sorted batch between samples of its keys. */
+#define SAMPLE_INTERVAL 256
+
+/* The size of each block of memory which entries are read into. */
+#define ARENA_BLOCK (16 * 1024 * 1024)
+
+/* The size of the buffer each thread reads a run file through. */
+#define RUN_BUFFER (256 * 1024)
+
+/* The number of ranges each store's keys are split into per thread. */
+#define RANGES_PER_THREAD 4
+
+/* An entry read from the input. */
+typedef struct {
+  char *key;                    /* The key, null terminated. */
+  char *value;                  /* The value, null terminated. */
+  uint64_t seq;                 /* The position of the entry within the input. */
+  unsigned int store;           /* The index of the store which holds KEY. */
+} entry_t;
+
+/* The header of each entry written to a run file, which is followed by the
+ * key and then the value, without null terminators. */
+typedef struct {
+  uint64_t seq;                 /* The SEQ of the entry. */
+  uint32_t store;               /* The STORE of the entry. */
+  uint32_t keylen;              /* The length of the key. */
+  uint32_t vallen;              /* The length of the value. */
+  uint32_t pad;                 /* Always 0. */
+} run_record_t;
+
+/* A key sampled from a sorted batch. */
+typedef struct {
+  unsigned int store;           /* The store of the sampled entry. */
+  char *key;                    /* The key of the sampled entry. */
+  uint64_t pos;                 /* The index of the entry, or its offset within the run file. */
+} sample_t;
+
+/* A sorted batch of entries, held in memory or in a run file. */
+typedef struct {
+  entry_t *entries;             /* The entries, if the run is held in memory. */
+  size_t count;                 /* The number of ENTRIES. */
+  int fd;                       /* The (already unlinked) run file, or -1. */
+  off_t size;                   /* The size of the run file. */
+  sample_t *samples;            /* Every SAMPLE_INTERVAL-th entry of the run, in order. */
+  size_t num_samples;           /* The number of SAMPLES. */
+} run_t;
+
+/* The entries being read, and the memory holding them. */
+typedef struct {
+  entry_t *entries;             /* The entries read so far. */
+  size_t count;                 /* The number of ENTRIES. */
+  size_t cap;                   /* The capacity of ENTRIES. */
+  char **blocks;                /* The blocks of memory holding their keys and values. */
+  unsigned int num_blocks;      /* The number of BLOCKS. */
+  size_t used;                  /* The number of bytes used in the last block. */
+  size_t bytes;                 /* The memory used by the batch. */
+} batch_t;
+
+/* The entries of one store whose keys are at least LO and less than HI,
+ * either of which may be NULL to leave the range open. */
+typedef struct {
+  unsigned int store;
+  char *lo;
+  char *hi;
+} range_t;
+
+/* The state of an ingestion. */
+typedef struct {
+  char *outdir;                 /* The directory the output is written to. */
+  unsigned int num_stores;      /* The number of stores to build tables for. */
+  unsigned int num_threads;     /* The number of threads to sort and write with. */
+  run_t *runs;                  /* The sorted batches. */
+  unsigned int num_runs;        /* The number of RUNS. */
+  range_t *ranges;              /* The ranges which the tables are written in. */
+  unsigned int num_ranges;      /* The number of RANGES. */
+  unsigned int next_range;      /* The index of the next range to be written. */
+  unsigned int next_id[KVSERVER_MAX_STORES]; /* The id of the next table of each store. */
+  unsigned int *ids[KVSERVER_MAX_STORES]; /* The ids of the tables written for each store. */
+  unsigned int num_ids[KVSERVER_MAX_STORES]; /* The number of IDS of each store. */
+  uint64_t written;             /* The number of entries written to tables. */
+  pthread_mutex_t lock;         /* Protects IDS and NUM_IDS. */
+  kvio_t io;                    /* Used to open the tables once written. */
+  int error;                    /* The first error met while writing, or 0. */
+} ingest_t;
+
+/* Orders entries by store, then key, then position within the input. */
+static int entry_cmp(const entry_t *a, const entry_t *b) {
+  int cmp;
+  if (a->store != b->store)
+    return (a->store < b->store) ? -1 : 1;
+  if ((cmp = strcmp(a->key, b->key)) != 0)
+    return cmp;
+  return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+/* Comparator used to sort entries with qsort. */
+static int entry_qsort_cmp(const void *a, const void *b) {
+  return entry_cmp(a, b);
+}
+
+/* Comparator used to sort keys with qsort. */
+static int key_cmp(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Reads the next entry of IN into the malloc()d buffer BUF, which holds CAP
+ * bytes and is grown as needed, pointing KEY and VALUE into it and placing
+ * their lengths into KEYLEN and VALLEN. The entry is tab-separated text
+ * unless BINARY is set. Returns 1 if an entry was read, 0 at the end of the
+ * input, or -1 if the input is malformed. */
+static int read_entry(FILE *in, bool binary, char **buf, size_t *cap,
+    char **key, size_t *keylen, char **value, size_t *vallen) {
+  uint32_t lens[2];
+  ssize_t len;
+  char *tab;
+  size_t n;
+  if (!binary) {
+    do {
+      if ((len = getline(buf, cap, in)) < 0)
+        return 0;
+      if (len > 0 && (*buf)[len - 1] == '\n')
+        (*buf)[--len] = '\0';
+    } while (len == 0);
+    if ((tab = memchr(*buf, '\t', len)) == NULL)
+      return -1;
+    *tab = '\0';
+    *key = *buf;
+    *keylen = tab - *buf;
+    *value = tab + 1;
+    *vallen = len - *keylen - 1;
+    return 1;
+  }
+  if ((n = fread(lens, 1, sizeof(lens), in)) == 0)
+    return 0;
+  if (n != sizeof(lens) || lens[0] > MAX_KEYLEN || lens[1] > MAX_VALLEN)
+    return -1;
+  if (*cap < (size_t) lens[0] + lens[1] + 2) {
+    free(*buf);
+    *cap = MAX_KEYLEN + MAX_VALLEN + 2;
+    if ((*buf = malloc(*cap)) == NULL)
+      return -1;
+  }
+  if (fread(*buf, 1, lens[0] + lens[1], in) != lens[0] + lens[1])
+    return -1;
+  *key = *buf;
+  *keylen = lens[0];
+  *value = *buf + lens[0] + 1;
+  *vallen = lens[1];
+  memmove(*value, *buf + lens[0], lens[1]);
+  (*key)[*keylen] = '\0';
+  (*value)[*vallen] = '\0';
+  return 1;
+}
+
+/* Returns why a PUT of KEY and VALUE, of KEYLEN and VALLEN bytes, would be
+ * rejected, or NULL if it would not be. */
+static const char *entry_problem(char *key, size_t keylen, char *value,
+    size_t vallen) {
+  if (keylen == 0 || memchr(key, '\0', keylen) != NULL)
+    return "empty key, or key containing NUL";
+  if (keylen > MAX_KEYLEN)
+    return "key too long";
+  if (vallen > MAX_VALLEN)
+    return "value too long";
+  if (memchr(value, '\0', vallen) != NULL)
+    return "value containing NUL";
+  return NULL;
+}
+
+/* Copies SIZE bytes of DATA into the memory of BATCH, returning the copy,
+ * or NULL if memory runs out. */
+static char *batch_copy(batch_t *batch, const char *data, size_t size) {
+  char **blocks, *copy;
+  if (batch->num_blocks == 0 || batch->used + size > ARENA_BLOCK) {
+    blocks = realloc(batch->blocks, (batch->num_blocks + 1) * sizeof(char *));
+    if (blocks == NULL)
+      return NULL;
+    batch->blocks = blocks;
+    if ((batch->blocks[batch->num_blocks] = malloc(ARENA_BLOCK)) == NULL)
+      return NULL;
+    batch->num_blocks++;
+    batch->used = 0;
+  }
+  copy = batch->blocks[batch->num_blocks - 1] + batch->used;
+  memcpy(copy, data, size);
+  batch->used += size;
+  batch->bytes += size;
+  return copy;
+}
+
+/* Adds the entry KEY, VALUE (of KEYLEN and VALLEN bytes, null terminated),
+ * at position SEQ of the input, to BATCH. Returns 0 if successful, else
+ * ENOMEM. */
+static int batch_add(ingest_t *ingest, batch_t *batch, char *key,
+    size_t keylen, char *value, size_t vallen, uint64_t seq) {
+  entry_t *entries, *entry;
+  kvkey_t desc;
+  if (batch->count == batch->cap) {
+    batch->cap = batch->cap ? batch->cap * 2 : 4096;
+    if ((entries = realloc(batch->entries, batch->cap * sizeof(entry_t)))
+        == NULL)
+      return ENOMEM;
+    batch->entries = entries;
+  }
+  entry = &batch->entries[batch->count];
+  if ((entry->key = batch_copy(batch, key, keylen + 1)) == NULL ||
+      (entry->value = batch_copy(batch, value, vallen + 1)) == NULL)
+    return ENOMEM;
+  entry->seq = seq;
+  kvkey_init(&desc, entry->key);
+  entry->store = kvserver_store_index(&desc, ingest->num_stores);
+  batch->count++;
+  /* Sorting needs room for a second copy of the entries. */
+  batch->bytes += 2 * sizeof(entry_t);
+  return 0;
+}
+
+/* Frees the entries of BATCH and the memory holding them. */
+static void batch_reset(batch_t *batch) {
+  unsigned int i;
+  for (i = 0; i < batch->num_blocks; i++)
+    free(batch->blocks[i]);
+  free(batch->blocks);
+  free(batch->entries);
+  memset(batch, 0, sizeof(batch_t));
+}
+
+/* A part of sorting a batch: merges SRC[LO, MID) and SRC[MID, HI) into
+ * DST[LO, HI) if MERGE is set, else sorts SRC[LO, HI) in place. */
+typedef struct {
+  entry_t *src;
+  entry_t *dst;
+  size_t lo;
+  size_t mid;
+  size_t hi;
+  bool merge;
+} sort_task_t;
+
+/* Performs the sort_task_t ARG. */
+static void *sort_task(void *arg) {
+  sort_task_t *task = arg;
+  size_t i, j, k;
+  if (!task->merge) {
+    qsort(task->src + task->lo, task->hi - task->lo, sizeof(entry_t),
+        entry_qsort_cmp);
+    return NULL;
+  }
+  i = task->lo;
+  j = task->mid;
+  for (k = task->lo; k < task->hi; k++) {
+    if (j == task->hi ||
+        (i < task->mid && entry_cmp(&task->src[i], &task->src[j]) <= 0))
+      task->dst[k] = task->src[i++];
+    else
+      task->dst[k] = task->src[j++];
+  }
+  return NULL;
+}
+
+/* Sorts the COUNT ENTRIES with THREADS threads, each sorting a slice which
+ * are then merged pairwise, also in parallel. Returns the sorted entries,
+ * which are either ENTRIES or TMP (which has room for COUNT entries). */
+static entry_t *sort_entries(entry_t *entries, entry_t *tmp, size_t count,
+    unsigned int threads) {
+  pthread_t tids[threads];
+  sort_task_t tasks[threads];
+  size_t bounds[threads + 1];
+  unsigned int i, n, width;
+  entry_t *swap;
+  for (i = 0; i <= threads; i++)
+    bounds[i] = count * i / threads;
+  for (i = 0; i < threads; i++) {
+    tasks[i] = (sort_task_t) { entries, NULL, bounds[i], 0, bounds[i + 1],
+        false };
+    if (pthread_create(&tids[i], NULL, sort_task, &tasks[i]) != 0) {
+      sort_task(&tasks[i]);
+      tids[i] = 0;
+    }
+  }
+  for (i = 0; i < threads; i++) {
+    if (tids[i])
+      pthread_join(tids[i], NULL);
+  }
+  for (width = 1; width < threads; width *= 2) {
+    for (i = n = 0; i < threads; i += 2 * width, n++) {
+      tasks[n] = (sort_task_t) { entries, tmp, bounds[i],
+          bounds[(i + width < threads) ? i + width : threads],
+          bounds[(i + 2 * width < threads) ? i + 2 * width : threads], true };
+      if (pthread_create(&tids[n], NULL, sort_task, &tasks[n]) != 0) {
+        sort_task(&tasks[n]);
+        tids[n] = 0;
+      }
+    }
+    while (n-- > 0) {
+      if (tids[n])
+        pthread_join(tids[n], NULL);
+    }
+    swap = entries;
+    entries = tmp;
+    tmp = swap;
+  }
+  return entries;
+}
+
+/* Sorts BATCH and adds it to the runs of INGEST, writing it out to a run
+ * file unless IN_MEMORY is set, in which case BATCH must not be reset until
+ * the run has been written to tables. Returns 0 if successful, else a
+ * negative error code (or ENOMEM). */
+static int batch_finish(ingest_t *ingest, batch_t *batch, bool in_memory) {
+  char filename[MAX_FILENAME];
+  entry_t *tmp, *sorted;
+  run_record_t record;
+  run_t *runs, *run;
+  uint64_t offset = 0;
+  size_t i;
+  FILE *out;
+  int ret = 0;
+  if ((runs = realloc(ingest->runs, (ingest->num_runs + 1) * sizeof(run_t)))
+      == NULL)
+    return ENOMEM;
+  ingest->runs = runs;
+  run = &ingest->runs[ingest->num_runs];
+  memset(run, 0, sizeof(run_t));
+  run->fd = -1;
+  if ((tmp = malloc((batch->count + 1) * sizeof(entry_t))) == NULL)
+    return ENOMEM;
+  sorted = sort_entries(batch->entries, tmp, batch->count,
+      ingest->num_threads);
+  run->num_samples = (batch->count + SAMPLE_INTERVAL - 1) / SAMPLE_INTERVAL;
+  if ((run->samples = calloc(run->num_samples + 1, sizeof(sample_t))) == NULL) {
+    free(tmp);
+    return ENOMEM;
+  }
+  if (in_memory) {
+    /* The batch keeps whichever copy is sorted. */
+    if (sorted == tmp) {
+      tmp = batch->entries;
+      batch->entries = sorted;
+    }
+    free(tmp);
+    run->entries = batch->entries;
+    run->count = batch->count;
+    for (i = 0; i < run->num_samples; i++) {
+      run->samples[i].store = run->entries[i * SAMPLE_INTERVAL].store;
+      run->samples[i].key = run->entries[i * SAMPLE_INTERVAL].key;
+      run->samples[i].pos = i * SAMPLE_INTERVAL;
+    }
+    ingest->num_runs++;
+    return 0;
+  }
+
+  sprintf(filename, "%s/run-%u.tmp", ingest->outdir, ingest->num_runs);
+  if ((run->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+    free(tmp);
+    free(run->samples);
+    return ERRFILCRT;
+  }
+  /* The file is only needed while it is open. */
+  unlink(filename);
+  if ((out = fdopen(dup(run->fd), "w")) == NULL) {
+    close(run->fd);
+    free(tmp);
+    free(run->samples);
+    return ERRFILACCESS;
+  }
+  setvbuf(out, NULL, _IOFBF, RUN_BUFFER);
+  memset(&record, 0, sizeof(run_record_t));
+  for (i = 0; i < batch->count && ret == 0; i++) {
+    record.seq = sorted[i].seq;
+    record.store = sorted[i].store;
+    record.keylen = strlen(sorted[i].key);
+    record.vallen = strlen(sorted[i].value);
+    if (i % SAMPLE_INTERVAL == 0) {
+      run->samples[i / SAMPLE_INTERVAL].store = record.store;
+      run->samples[i / SAMPLE_INTERVAL].pos = offset;
+      if ((run->samples[i / SAMPLE_INTERVAL].key =
+          strdup(sorted[i].key)) == NULL)
+        ret = ENOMEM;
+    }
+    if (fwrite(&record, sizeof(run_record_t), 1, out) != 1 ||
+        fwrite(sorted[i].key, 1, record.keylen, out) != record.keylen ||
+        fwrite(sorted[i].value, 1, record.vallen, out) != record.vallen)
+      ret = ERRFILACCESS;
+    offset += sizeof(run_record_t) + record.keylen + record.vallen;
+  }
+  if (fclose(out) != 0 && ret == 0)
+    ret = ERRFILACCESS;
+  free(tmp);
+  run->size = offset;
+  ingest->num_runs++;
+  return ret;
+}
+
+/* Reads through one run, within one range. */
+typedef struct {
+  run_t *run;                   /* The run being read. */
+  range_t *range;               /* The range being read. */
+  bool valid;                   /* false once the cursor has left the range or the run. */
+  entry_t entry;                /* The current entry. */
+  uint64_t pos;                 /* The index of the current entry, or its offset within the run file. */
+  char *buf;                    /* Holds the run file from offset BUF_POS, if it is not in memory. */
+  uint64_t buf_pos;             /* The offset within the run file of BUF. */
+  size_t buf_len;               /* The number of bytes in BUF. */
+  char key[MAX_KEYLEN + 1];     /* Holds the key of the current entry, if the run is not in memory. */
+  char value[MAX_VALLEN + 1];   /* Holds the value of the current entry, if the run is not in memory. */
+} cursor_t;
+
+/* Returns true if an entry of STORE with KEY lies before the start of
+ * RANGE. */
+static bool before_range(range_t *range, unsigned int store, char *key) {
+  return store < range->store || (store == range->store &&
+      range->lo != NULL && strcmp(key, range->lo) < 0);
+}
+
+/* Loads the entry of the run of CURSOR at its position. Returns 0 if
+ * successful (setting VALID to false past the end of the run), else a
+ * negative error code. */
+static int cursor_load(cursor_t *cursor) {
+  run_t *run = cursor->run;
+  run_record_t record;
+  size_t at, need;
+  ssize_t len;
+  cursor->valid = false;
+  if (run->fd < 0) {
+    if (cursor->pos < run->count) {
+      cursor->entry = run->entries[cursor->pos];
+      cursor->valid = true;
+    }
+    return 0;
+  }
+  if (cursor->pos >= (uint64_t) run->size)
+    return 0;
+  need = sizeof(run_record_t);
+  for (;;) {
+    at = cursor->pos - cursor->buf_pos;
+    if (cursor->pos < cursor->buf_pos || at + need > cursor->buf_len) {
+      /* Refill the buffer from the current entry. */
+      cursor->buf_pos = cursor->pos;
+      if ((len = pread(run->fd, cursor->buf, RUN_BUFFER, cursor->pos)) < 0)
+        return ERRFILACCESS;
+      cursor->buf_len = len;
+      at = 0;
+      if (need > cursor->buf_len)
+        return ERRFILACCESS;
+    }
+    /* Entries are packed, so the header may not be aligned. */
+    memcpy(&record, cursor->buf + at, sizeof(run_record_t));
+    if (need > sizeof(run_record_t))
+      break;
+    if (record.keylen > MAX_KEYLEN || record.vallen > MAX_VALLEN)
+      return ERRFILACCESS;
+    need += record.keylen + record.vallen;
+  }
+  at += sizeof(run_record_t);
+  memcpy(cursor->key, cursor->buf + at, record.keylen);
+  cursor->key[record.keylen] = '\0';
+  memcpy(cursor->value, cursor->buf + at + record.keylen, record.vallen);
+  cursor->value[record.vallen] = '\0';
+  cursor->entry.key = cursor->key;
+  cursor->entry.value = cursor->value;
+  cursor->entry.seq = record.seq;
+  cursor->entry.store = record.store;
+  cursor->valid = true;
+  return 0;
+}
+
+/* Moves CURSOR to the next entry of its run, setting VALID to false if that
+ * lies beyond its range. Returns 0 if successful, else a negative error
+ * code. */
+static int cursor_next(cursor_t *cursor) {
+  range_t *range = cursor->range;
+  int ret;
+  if (cursor->run->fd < 0)
+    cursor->pos++;
+  else
+    cursor->pos += sizeof(run_record_t) + strlen(cursor->key) +
+        strlen(cursor->value);
+  if ((ret = cursor_load(cursor)) != 0)
+    return ret;
+  if (cursor->valid && (cursor->entry.store != range->store ||
+      (range->hi != NULL && strcmp(cursor->entry.key, range->hi) >= 0)))
+    cursor->valid = false;
+  return 0;
+}
+
+/* Positions CURSOR at the first entry of RUN within RANGE, starting from the
+ * last sample before the range. Returns 0 if successful, else a negative
+ * error code. */
+static int cursor_seek(cursor_t *cursor, run_t *run, range_t *range) {
+  size_t lo = 0, hi = run->num_samples, mid;
+  int ret;
+  cursor->run = run;
+  cursor->range = range;
+  cursor->buf_pos = 0;
+  cursor->buf_len = 0;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (before_range(range, run->samples[mid].store, run->samples[mid].key))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  cursor->pos = (lo > 0) ? run->samples[lo - 1].pos : 0;
+  if ((ret = cursor_load(cursor)) != 0)
+    return ret;
+  while (cursor->valid &&
+      before_range(range, cursor->entry.store, cursor->entry.key)) {
+    if (cursor->run->fd < 0)
+      cursor->pos++;
+    else
+      cursor->pos += sizeof(run_record_t) + strlen(cursor->key) +
+          strlen(cursor->value);
+    if ((ret = cursor_load(cursor)) != 0)
+      return ret;
+  }
+  if (cursor->valid && (cursor->entry.store != range->store ||
+      (range->hi != NULL && strcmp(cursor->entry.key, range->hi) >= 0)))
+    cursor->valid = false;
+  return 0;
+}
+
+/* Records that table ID was written for STORE. Returns 0 if successful,
+ * else ENOMEM. */
+static int add_table(ingest_t *ingest, unsigned int store, unsigned int id) {
+  unsigned int *ids;
+  int ret = 0;
+  pthread_mutex_lock(&ingest->lock);
+  ids = realloc(ingest->ids[store],
+      (ingest->num_ids[store] + 1) * sizeof(unsigned int));
+  if (ids == NULL) {
+    ret = ENOMEM;
+  } else {
+    ingest->ids[store] = ids;
+    ids[ingest->num_ids[store]++] = id;
+  }
+  pthread_mutex_unlock(&ingest->lock);
+  return ret;
+}
+
+/* Finishes the table being written by BUILDER for STORE, recording it.
+ * Returns 0 if successful, else a negative error code. */
+static int finish_table(ingest_t *ingest, unsigned int store,
+    kvsstable_builder_t *builder) {
+  kvsstable_t *table;
+  int ret;
+  if ((ret = kvsstable_builder_finish(builder, &table)) != 0 ||
+      table == NULL)
+    return ret;
+  ret = add_table(ingest, store, table->id);
+  kvsstable_close(table, false);
+  return ret;
+}
+
+/* Merges the entries of every run within RANGE, keeping the last entry of
+ * each key, into tables of about KVLSMSTORE_TABLE_SIZE bytes. Returns 0 if
+ * successful, else a negative error code. */
+static int write_range(ingest_t *ingest, range_t *range) {
+  char dirname[MAX_FILENAME], key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  cursor_t *cursors, *min;
+  kvsstable_builder_t builder;
+  bool building = false, pending = false;
+  uint64_t written = 0;
+  unsigned int i;
+  int ret = 0;
+  sprintf(dirname, "%s/%u", ingest->outdir, range->store);
+  if ((cursors = calloc(ingest->num_runs, sizeof(cursor_t))) == NULL)
+    return ENOMEM;
+  for (i = 0; i < ingest->num_runs && ret == 0; i++) {
+    if (ingest->runs[i].fd >= 0 &&
+        (cursors[i].buf = malloc(RUN_BUFFER)) == NULL)
+      ret = ENOMEM;
+    else
+      ret = cursor_seek(&cursors[i], &ingest->runs[i], range);
+  }
+  while (ret == 0) {
+    min = NULL;
+    for (i = 0; i < ingest->num_runs; i++) {
+      if (cursors[i].valid &&
+          (min == NULL || entry_cmp(&cursors[i].entry, &min->entry) < 0))
+        min = &cursors[i];
+    }
+    /* Entries of a key come in input order, so a later one replaces the
+     * pending entry rather than being written after it. */
+    if (pending && (min == NULL || strcmp(min->entry.key, key) != 0)) {
+      if (!building) {
+        if ((ret = kvsstable_builder_init(&builder, &ingest->io, dirname,
+            __atomic_fetch_add(&ingest->next_id[range->store], 1,
+            __ATOMIC_RELAXED))) != 0)
+          break;
+        building = true;
+      }
+      if ((ret = kvsstable_builder_add(&builder, key, value, false)) != 0)
+        break;
+      written++;
+      if (kvsstable_builder_size(&builder) >= KVLSMSTORE_TABLE_SIZE) {
+        building = false;
+        if ((ret = finish_table(ingest, range->store, &builder)) != 0)
+          break;
+      }
+      pending = false;
+    }
+    if (min == NULL)
+      break;
+    strcpy(key, min->entry.key);
+    strcpy(value, min->entry.value);
+    pending = true;
+    ret = cursor_next(min);
+  }
+  if (building) {
+    if (ret == 0)
+      ret = finish_table(ingest, range->store, &builder);
+    else
+      kvsstable_builder_abandon(&builder);
+  }
+  for (i = 0; i < ingest->num_runs; i++)
+    free(cursors[i].buf);
+  free(cursors);
+  __atomic_fetch_add(&ingest->written, written, __ATOMIC_RELAXED);
+  return ret;
+}
+
+/* The body of each thread which writes tables, which writes ranges of the
+ * ingest_t ARG until none are left or one fails. */
+static void *write_ranges(void *arg) {
+  ingest_t *ingest = arg;
+  unsigned int i;
+  int ret, none = 0;
+  while ((i = __atomic_fetch_add(&ingest->next_range, 1, __ATOMIC_RELAXED))
+      < ingest->num_ranges) {
+    if (__atomic_load_n(&ingest->error, __ATOMIC_RELAXED) != 0)
+      break;
+    if ((ret = write_range(ingest, &ingest->ranges[i])) != 0) {
+      __atomic_compare_exchange_n(&ingest->error, &none, ret, false,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Splits the keys of each store into ranges holding about equal numbers of
+ * entries, going by the samples of every run. Returns 0 if successful, else
+ * ENOMEM. */
+static int make_ranges(ingest_t *ingest) {
+  unsigned int store, per_store, i, j;
+  size_t num_keys, k;
+  char **keys = NULL, **tmp, *last;
+  range_t *ranges;
+  per_store = (ingest->num_threads * RANGES_PER_THREAD +
+      ingest->num_stores - 1) / ingest->num_stores;
+  for (store = 0; store < ingest->num_stores; store++) {
+    num_keys = 0;
+    for (i = 0; i < ingest->num_runs; i++) {
+      for (k = 0; k < ingest->runs[i].num_samples; k++) {
+        if (ingest->runs[i].samples[k].store != store)
+          continue;
+        if ((tmp = realloc(keys, (num_keys + 1) * sizeof(char *))) == NULL) {
+          free(keys);
+          return ENOMEM;
+        }
+        keys = tmp;
+        keys[num_keys++] = ingest->runs[i].samples[k].key;
+      }
+    }
+    qsort(keys, num_keys, sizeof(char *), key_cmp);
+    last = NULL;
+    for (j = 0; j < per_store; j++) {
+      if ((ranges = realloc(ingest->ranges,
+          (ingest->num_ranges + 1) * sizeof(range_t))) == NULL) {
+        free(keys);
+        return ENOMEM;
+      }
+      ingest->ranges = ranges;
+      ranges[ingest->num_ranges].store = store;
+      ranges[ingest->num_ranges].lo = last;
+      ranges[ingest->num_ranges].hi = NULL;
+      /* Split at the next sampled key which differs from the last split. */
+      for (k = num_keys * (j + 1) / per_store; j + 1 < per_store &&
+          k < num_keys; k++) {
+        if (last == NULL || strcmp(keys[k], last) > 0) {
+          ranges[ingest->num_ranges].hi = last = keys[k];
+          break;
+        }
+      }
+      ingest->num_ranges++;
+      if (ranges[ingest->num_ranges - 1].hi == NULL)
+        break;
+    }
+  }
+  free(keys);
+  return 0;
+}
+
+/* Writes the list of tables of each store, and then its shard file, syncing
+ * them. Returns 0 if successful, else a negative error code. */
+static int write_lists(ingest_t *ingest) {
+  char filename[MAX_FILENAME];
+  unsigned int store, i;
+  FILE *file;
+  int fd, ret = 0;
+  for (store = 0; store < ingest->num_stores && ret == 0; store++) {
+    sprintf(filename, "%s/%u/%s", ingest->outdir, store,
+        KVLSMSTORE_INGEST_LIST);
+    if ((file = fopen(filename, "w")) == NULL)
+      return ERRFILCRT;
+    for (i = 0; i < ingest->num_ids[store]; i++)
+      fprintf(file, "%u\n", ingest->ids[store][i]);
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0)
+      ret = ERRFILACCESS;
+    fclose(file);
+    if (ret != 0)
+      break;
+    sprintf(filename, "%s/%u/%s", ingest->outdir, store,
+        KVSERVER_SHARD_FILENAME);
+    if ((file = fopen(filename, "w")) == NULL)
+      return ERRFILCRT;
+    fprintf(file, "%u/%u\n", store, ingest->num_stores);
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0)
+      ret = ERRFILACCESS;
+    fclose(file);
+    sprintf(filename, "%s/%u", ingest->outdir, store);
+    if ((fd = open(filename, O_RDONLY)) >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+  return ret;
+}
+
+/* Asks the slave listening on PORT of this host to ingest DIRNAME, which
+ * must be within its ingest root. Returns 0 if it did, else -1. */
+static int attach(char *dirname, int port) {
+  char path[PATH_MAX];
+  kvmessage_t reqmsg, *respmsg;
+  int sockfd, ret = -1;
+  if (realpath(dirname, path) == NULL)
+    return -1;
+  if ((sockfd = connect_to("localhost", port, 0)) < 0) {
+    printf("Could not connect to slave at port %d\n", port);
+    return -1;
+  }
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = INGESTREQ;
+  reqmsg.key = strrchr(path, '/') + 1;
+  if (kvmessage_send(&reqmsg, sockfd) > 0 &&
+      (respmsg = kvmessage_parse(sockfd)) != NULL) {
+    printf("Slave at port %d: %s\n", port,
+        respmsg->message ? respmsg->message : ERRMSG_GENERIC_ERROR);
+    if (respmsg->message != NULL &&
+        strcmp(respmsg->message, MSG_SUCCESS) == 0)
+      ret = 0;
+    kvmessage_free(respmsg);
+  }
+  close(sockfd);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  char filename[MAX_FILENAME], *buf = NULL, *key, *value;
+  size_t cap = 0, keylen, vallen, budget = 1024;
+  const char *problem;
+  unsigned int i, tables = 0;
+  bool binary = false;
+  int port = 0, opt_ind, c, ret = 0;
+  pthread_t *tids;
+  uint64_t seq = 0;
+  ingest_t ingest;
+  batch_t batch;
+  FILE *in;
+  struct option long_options[] = {{"binary", no_argument, NULL, 'b'},
+      {"stores", required_argument, NULL, 'n'},
+      {"threads", required_argument, NULL, 'j'},
+      {"memory", required_argument, NULL, 'm'},
+      {"attach", required_argument, NULL, 'a'},
+      {0,0,0,0}};
+
+  memset(&ingest, 0, sizeof(ingest_t));
+  memset(&batch, 0, sizeof(batch_t));
+  ingest.num_stores = 1;
+  ingest.num_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+      sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  while ((c = getopt_long(argc, argv, "bn:j:m:a:", long_options, &opt_ind))
+      != -1) {
+    switch (c) {
+      case 'b':
+        binary = true;
+        break;
+      case 'n':
+        ingest.num_stores = atoi(optarg);
+        if (ingest.num_stores == 0 ||
+            ingest.num_stores > KVSERVER_MAX_STORES)
+          goto usage;
+        break;
+      case 'j':
+        if ((ingest.num_threads = atoi(optarg)) == 0)
+          goto usage;
+        break;
+      case 'm':
+        if ((budget = atol(optarg)) == 0)
+          goto usage;
+        break;
+      case 'a':
+        if ((port = atoi(optarg)) <= 0)
+          goto usage;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (argc - optind != 2)
+    goto usage;
+  budget *= 1024 * 1024;
+  ingest.outdir = argv[optind + 1];
+  if (strlen(ingest.outdir) + 32 > MAX_FILENAME) {
+    printf("Output directory name too long\n");
+    return 1;
+  }
+  if (strcmp(argv[optind], "-") == 0) {
+    in = stdin;
+  } else if ((in = fopen(argv[optind], "r")) == NULL) {
+    printf("Could not open %s\n", argv[optind]);
+    return 1;
+  }
+  if (mkdir(ingest.outdir, 0700) < 0 && errno != EEXIST) {
+    printf("Could not create %s\n", ingest.outdir);
+    return 1;
+  }
+  for (i = 0; i < ingest.num_stores; i++) {
+    sprintf(filename, "%s/%u", ingest.outdir, i);
+    if (mkdir(filename, 0700) < 0 && errno != EEXIST) {
+      printf("Could not create %s\n", filename);
+      return 1;
+    }
+  }
+  pthread_mutex_init(&ingest.lock, NULL);
+  if ((ret = kvio_init(&ingest.io, 0)) != 0) {
+    printf("Could not initialize I/O: error %d\n", ret);
+    return 1;
+  }
+
+  /* Read and sort the input, batch by batch. */
+  while ((ret = read_entry(in, binary, &buf, &cap, &key, &keylen, &value,
+      &vallen)) > 0) {
+    if ((problem = entry_problem(key, keylen, value, vallen)) != NULL) {
+      printf("Entry %llu: %s\n", (unsigned long long) seq + 1, problem);
+      return 1;
+    }
+    if (batch.bytes >= budget) {
+      if ((ret = batch_finish(&ingest, &batch, false)) != 0) {
+        printf("Could not write a sorted batch: error %d\n", ret);
+        return 1;
+      }
+      batch_reset(&batch);
+    }
+    if (batch_add(&ingest, &batch, key, keylen, value, vallen, seq++) != 0) {
+      printf("Out of memory\n");
+      return 1;
+    }
+  }
+  if (ret < 0) {
+    printf("Entry %llu: malformed\n", (unsigned long long) seq + 1);
+    return 1;
+  }
+  free(buf);
+  if (in != stdin)
+    fclose(in);
+  if ((ret = batch_finish(&ingest, &batch, true)) != 0) {
+    printf("Could not sort the last batch: error %d\n", ret);
+    return 1;
+  }
+
+  /* Merge the batches into tables, range by range. */
+  if (make_ranges(&ingest) != 0 ||
+      (tids = calloc(ingest.num_threads, sizeof(pthread_t))) == NULL) {
+    printf("Out of memory\n");
+    return 1;
+  }
+  for (i = 1; i < ingest.num_threads; i++) {
+    if (pthread_create(&tids[i], NULL, write_ranges, &ingest) != 0)
+      tids[i] = 0;
+  }
+  /* This thread writes ranges too, so that all of them are written even if
+   * no other thread could be started. */
+  write_ranges(&ingest);
+  for (i = 1; i < ingest.num_threads; i++) {
+    if (tids[i])
+      pthread_join(tids[i], NULL);
+  }
+  if ((ret = ingest.error) != 0 || (ret = write_lists(&ingest)) != 0) {
+    printf("Could not write tables to %s: error %d\n", ingest.outdir, ret);
+    return 1;
+  }
+  for (i = 0; i < ingest.num_stores; i++)
+    tables += ingest.num_ids[i];
+  printf("Wrote %llu entries of %llu read to %u tables for %u store%s in "
+      "%s\n", (unsigned long long) ingest.written, (unsigned long long) seq,
+      tables, ingest.num_stores, ingest.num_stores > 1 ? "s" : "",
+      ingest.outdir);
+  if (port > 0 && attach(ingest.outdir, port) != 0)
+    return 1;
+  return 0;
+
+usage:
+  printf("%s\n", USAGE);
+  return 1;
+}
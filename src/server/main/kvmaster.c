@@ -19,7 +19,8 @@ int main(int argc, char** argv) {
   }
   server.master = 1;
   server.max_threads = 3;
-  tpcmaster_init(&server.tpcmaster, 2, 2, 4, 4);
+  tpcmaster_init(&server.tpcmaster, 2, 2, 4, KVCACHE_DEFAULT_BYTES,
+      KVCACHE_DEFAULT_POLICY);
   printf("TPC Master server started listening on port %d...\n", port);
   server_run("localhost", port, &server, NULL);
 }
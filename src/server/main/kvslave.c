@@ -1,65 +1,155 @@
 #include <string.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #include "socket_server.h"
 #include "kvserver.h"
 
 const char *USAGE = "Usage: kvslave "
     "[-t] [--tpc] "
+    "[-e engine] [--engine=log|file|mem|lsm|btree] "
+    "[-s mode] [--sync=none|batch|always] "
+    "[-V on|off] [--verify=on|off] "
+    "[-Z on|off] [--compress=on|off] "
+    "[-d dir]... [--dir=dir]... "
+    "[-c bytes] [--cache=bytes[k|m|g] (default=64m)] "
+    "[-p policy] [--cache-policy=clock|tinylfu] "
+    "[-I dir] [--ingest-root=dir] "
+    "[-S dir] [--snapshot-root=dir] "
     "[slave_port (default=9000)] "
     "[master_port (default=8888)]";
 
+/* Parses STR, a number of bytes optionally followed by k, m or g, into
+ * BYTES. Returns 0 if successful, else -1. */
+static int parse_bytes(const char *str, size_t *bytes) {
+  unsigned long long n;
+  char *end;
+  errno = 0;
+  n = strtoull(str, &end, 10);
+  if (errno != 0 || end == str || str[0] == '-')
+    return -1;
+  if (*end == 'k' || *end == 'K')
+    n <<= 10;
+  else if (*end == 'm' || *end == 'M')
+    n <<= 20;
+  else if (*end == 'g' || *end == 'G')
+    n <<= 30;
+  if (*end != '\0' && *++end != '\0')
+    return -1;
+  *bytes = n;
+  return 0;
+}
+
+/* The signals which shut the server down, blocked in every thread. */
+static sigset_t shutdown_signals;
+
+/* Waits for one of SHUTDOWN_SIGNALS, then closes the kvserver_t pointed to
+ * by ARG (so that state which is slow to rebuild, such as the Bloom filter
+ * of its store, is saved) and exits. */
+static void *shutdown_thread(void *arg) {
+  int sig;
+  sigwait(&shutdown_signals, &sig);
+  printf("Shutting down...\n");
+  kvserver_close(arg);
+  exit(0);
+}
+
 int main(int argc, char **argv) {
   int tpc_mode = 0,
       slave_port = 9000,
       master_port = 8888;
   char *mode = "";
+  char *engine = NULL;
+  int sync_mode = KVSYNC_DEFAULT_MODE;
+  bool verify = true;
+  bool compress = false;
+  char *dirnames[KVSERVER_MAX_STORES];
+  unsigned int num_dirs = 0;
+  size_t cache_bytes = KVCACHE_DEFAULT_BYTES;
+  int cache_policy = KVCACHE_DEFAULT_POLICY;
+  char *ingest_root = NULL, *snapshot_root = NULL;
   char *slave_hostname = "localhost", *master_hostname = "localhost";
-  int index = 0;
   int opt_ind;
   int c;
   struct option long_options[] = {{"tpc", no_argument, &tpc_mode, 1},
+      {"engine", required_argument, NULL, 'e'},
+      {"sync", required_argument, NULL, 's'},
+      {"verify", required_argument, NULL, 'V'},
+      {"compress", required_argument, NULL, 'Z'},
+      {"dir", required_argument, NULL, 'd'},
+      {"cache", required_argument, NULL, 'c'},
+      {"cache-policy", required_argument, NULL, 'p'},
+      {"ingest-root", required_argument, NULL, 'I'},
+      {"snapshot-root", required_argument, NULL, 'S'},
       {0,0,0,0}};
-  if ((c = getopt_long (argc, argv, "t", long_options, &opt_ind)) != -1) {
+  while ((c = getopt_long (argc, argv, "te:s:V:Z:d:c:p:I:S:", long_options, &opt_ind)) != -1) {
     switch (c) {
       case 0:
         break;
       case 't':
         tpc_mode = 1;
-        mode = "(tpc)";
-        index += 1;
         break;
-      default:
-        goto usage;
-    }
-  }
-  if (index < argc) {
-    switch (argc - index - 1) {
-      case 1:
-        index += 1;
-        if (argv[index][0] != '-') {
-          slave_port = atoi(argv[index]);
-          break;
-        } else {
+      case 'e':
+        engine = optarg;
+        if (kvstore_engine_lookup(engine) == NULL)
           goto usage;
-        }
-      case 2:
-        index += 1;
-        if (argv[index][0] != '-') {
-          slave_port = atoi(argv[index]);
-        } else {
+        break;
+      case 's':
+        if ((sync_mode = kvsync_mode_lookup(optarg)) < 0)
           goto usage;
-        }
-
-        if (argv[index + 1][0] != '-') {
-          master_port = atoi(argv[index + 1]);
-        } else {
+        break;
+      case 'V':
+        if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0)
+          goto usage;
+        verify = strcmp(optarg, "on") == 0;
+        break;
+      case 'Z':
+        if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0)
           goto usage;
-        }
+        compress = strcmp(optarg, "on") == 0;
         break;
+      case 'd':
+        if (num_dirs == KVSERVER_MAX_STORES)
+          goto usage;
+        dirnames[num_dirs++] = optarg;
+        break;
+      case 'c':
+        if (parse_bytes(optarg, &cache_bytes) != 0)
+          goto usage;
+        break;
+      case 'p':
+        if ((cache_policy = kvcache_policy_lookup(optarg)) < 0)
+          goto usage;
+        break;
+      case 'I':
+        ingest_root = optarg;
+        break;
+      case 'S':
+        snapshot_root = optarg;
+        break;
+      default:
+        goto usage;
     }
   }
+  if (tpc_mode)
+    mode = "(tpc)";
+  if (argc - optind > 2)
+    goto usage;
+  if (optind < argc) {
+    if (argv[optind][0] == '-')
+      goto usage;
+    slave_port = atoi(argv[optind]);
+  }
+  if (optind + 1 < argc) {
+    if (argv[optind + 1][0] == '-')
+      goto usage;
+    master_port = atoi(argv[optind + 1]);
+  }
 
   if (tpc_mode) {
     printf("Slave server %s started on %d listening for master at "
@@ -68,16 +158,41 @@ int main(int argc, char **argv) {
     printf("Single Node server started on port %d...\n", slave_port);
   }
 
-  kvserver_t slave;
   server_t server;
+  kvserver_t *slave = &server.kvserver;
+  pthread_t shutdown_tid;
   server.master = 0;
   server.max_threads = 3;
 
+  /* Block the shutdown signals before any thread starts, so that only
+   * shutdown_thread ever receives them. */
+  sigemptyset(&shutdown_signals);
+  sigaddset(&shutdown_signals, SIGINT);
+  sigaddset(&shutdown_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+  /* A client which hangs up while a long value streams to it must not kill
+   * the server. */
+  signal(SIGPIPE, SIG_IGN);
+
   char slave_name[20];
   sprintf(slave_name, "slave-port%d", slave_port);
+  /* Without -d, entries are kept in a single directory named for the port. */
+  if (num_dirs == 0)
+    dirnames[num_dirs++] = slave_name;
 
-  kvserver_init(&slave, slave_name, 4, 4, 2, slave_hostname, slave_port,
-      tpc_mode);
+  int err = kvserver_init(slave, dirnames, num_dirs, engine, sync_mode,
+      verify, compress, 4, cache_bytes, cache_policy, 2, slave_hostname,
+      slave_port, tpc_mode);
+  if (err == ERRENGINE) {
+    printf("Unknown storage engine %s\n", engine);
+    return 1;
+  } else if (err != 0) {
+    printf("Error initializing slave storage in %s%s\n", dirnames[0],
+        num_dirs > 1 ? " and the other directories given" : "");
+    return 1;
+  }
+  slave->ingest_root = ingest_root;
+  slave->snapshot_root = snapshot_root;
   if (tpc_mode) {
     /* Need to send registration to the master.*/
     int ret, sockfd = connect_to(master_hostname, master_port, 0);
@@ -87,7 +202,7 @@ int main(int argc, char **argv) {
           master_hostname, master_port);
       return 1;
     }
-    ret = kvserver_register_master(&slave, sockfd);
+    ret = kvserver_register_master(slave, sockfd);
     if (ret < 0) {
       printf("Error registering slave with master! "
           "Received an error message back from master.\n");
@@ -95,7 +210,7 @@ int main(int argc, char **argv) {
     }
     close(sockfd);
   }
-  server.kvserver = slave;
+  pthread_create(&shutdown_tid, NULL, shutdown_thread, slave);
   server_run(slave_hostname, slave_port, &server, NULL);
   return 0;
 
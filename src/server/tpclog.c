@@ -5,10 +5,21 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include "kvconstants.h"
 #include "tpclog.h"
+#include "kvcrc32c.h"
+
+/* The size of the header of entries written before logentry_t had one,
+ * which held nothing but the type and the length. */
+#define LEGACY_HEADER_SIZE (sizeof(logentry_t) - offsetof(logentry_t, type))
+
+/* Returns the checksum of ENTRY, which covers its TYPE, LENGTH and DATA. */
+static uint32_t entry_checksum(logentry_t *entry) {
+  return kvcrc32c(0, &entry->type, LEGACY_HEADER_SIZE + entry->length);
+}
 
 /* Initialize TPCLog LOG to use the provided DIRNAME to store its associated
  * entries. Sets LOG's NEXTID field based on the entries that currently exist
@@ -63,12 +74,16 @@ int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
     pthread_rwlock_unlock(&log->lock);
     return ENOMEM;
   }
+  entry->magic = TPCLOG_MAGIC;
+  entry->version = TPCLOG_VERSION;
+  entry->pad = 0;
   entry->type = type;
   entry->length = keylen + vallen;
   if (type == PUTREQ || type == DELREQ)
     strcpy(entry->data, key);
   if (type == PUTREQ)
     strcpy(entry->data + keylen, value);
+  entry->checksum = entry_checksum(entry);
   errno = 0;
   if (write(fd, entry, size) < size) {
     pthread_rwlock_unlock(&log->lock);
@@ -82,27 +97,61 @@ int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
 
 /* Load the logentry located at FILENAME into ENTRY, which will be set to
  * malloc()d memory which should be later free()d. Returns 0 if successful,
- * else a negative error code (and ENTRY will be NULL). */
+ * else a negative error code (and ENTRY will be NULL): ERRCHECKSUM if the
+ * file does not hold an intact entry. */
 int tpclog_load_entry(logentry_t **entry, char *filename) {
-  logentry_t tmp;
-  int fd;
-  size_t size;
+  struct stat st;
+  char *buf;
+  size_t header, offset = sizeof(logentry_t) - LEGACY_HEADER_SIZE;
+  ssize_t got;
+  int fd, ret = 0;
 
+  *entry = NULL;
   if ((fd = open(filename, O_RDONLY)) < 0)
     return ERRFILACCESS;
-  if (read(fd, &tmp, sizeof(logentry_t)) < sizeof(logentry_t))
+  if (fstat(fd, &st) < 0) {
+    close(fd);
     return ERRFILACCESS;
-  lseek(fd, SEEK_SET, 0);
-  size = tmp.length + sizeof(logentry_t);
-  *entry = malloc(size);
-  if (*entry == NULL)
+  }
+  if (st.st_size < (off_t) LEGACY_HEADER_SIZE ||
+      st.st_size > (off_t) (sizeof(logentry_t) + MAX_KEYLEN + MAX_VALLEN + 2)) {
+    close(fd);
+    return ERRCHECKSUM;
+  }
+  /* Read into the tail of a full header, so that an entry without one ends
+   * up with its fields in place. */
+  if ((buf = malloc(offset + st.st_size)) == NULL) {
+    close(fd);
     return ENOMEM;
-  if (read(fd, *entry, size) < size) {
-    free(*entry);
-    return ERRFILACCESS;
   }
+  got = read(fd, buf + offset, st.st_size);
   close(fd);
-  return 0;
+  if (got != st.st_size) {
+    free(buf);
+    return ERRFILACCESS;
+  }
+  *entry = (logentry_t *) buf;
+  if (*(uint32_t *) (buf + offset) == TPCLOG_MAGIC) {
+    memmove(buf, buf + offset, st.st_size);
+    header = sizeof(logentry_t);
+    if (st.st_size < (off_t) header || (*entry)->version != TPCLOG_VERSION)
+      ret = ERRCHECKSUM;
+  } else {
+    header = LEGACY_HEADER_SIZE;
+    (*entry)->magic = TPCLOG_MAGIC;
+    (*entry)->version = 0;
+    (*entry)->checksum = 0;
+  }
+  if (ret == 0 && (*entry)->length != st.st_size - (off_t) header)
+    ret = ERRCHECKSUM;
+  if (ret == 0 && (*entry)->version != 0 &&
+      (*entry)->checksum != entry_checksum(*entry))
+    ret = ERRCHECKSUM;
+  if (ret != 0) {
+    free(buf);
+    *entry = NULL;
+  }
+  return ret;
 }
 
 /* Prepare LOG to be iterated over. Once this is called, use the functions
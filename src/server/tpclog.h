@@ -2,6 +2,7 @@
 #define __TPC_LOG__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "kvconstants.h"
 
@@ -20,11 +21,21 @@
  * tpclog_clear_log periodically to clear the log. This will erase all entries
  * in the log, so it should only be called when the server is confident that it
  * will not need any existing entry to recreate state.
+ *
+ * Each entry starts with a versioned header carrying a CRC-32C of the rest of
+ * the entry (see kvcrc32c.h). tpclog_load_entry checks the header, that the
+ * length of the entry matches the size of its file, and the checksum, so a
+ * torn or damaged entry is reported with ERRCHECKSUM rather than replayed.
+ * Entries written before the header existed are still loaded, unchecked.
  */
 
 /* Filetype to use as an extension for the filenames of entries in the TPCLog. */
 #define TPCLOG_FILETYPE ".log"
 
+/* The MAGIC and VERSION of the header of entries. */
+#define TPCLOG_MAGIC 0x4b56544cU
+#define TPCLOG_VERSION 1
+
 /* A TPCLog. */
 typedef struct {
   char *dirname;             /* The name of the directory in which to store log entries. */
@@ -41,6 +52,10 @@ typedef struct {
  *   key_string \0 value_string \0
  *   (that is, two concatenated and null terminated strings) */
 typedef struct {
+  uint32_t magic;          /* Always TPCLOG_MAGIC. */
+  uint16_t version;        /* The version of the entry format, TPCLOG_VERSION. */
+  uint16_t pad;
+  uint32_t checksum;       /* CRC-32C of TYPE, LENGTH and DATA. */
   msgtype_t type;          /* The type of message this log entry represents. */
   int length;              /* Stores the total length of DATA, including null terminators. */
   char data[0];            /* Described above. */
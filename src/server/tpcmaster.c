@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -15,11 +17,13 @@
  * code if not. SLAVE_CAPACITY indicates the maximum number of slaves that
  * the master will support. REDUNDANCY is the number of replicas (slaves) that
  * each key will be stored in. The master's cache will have NUM_SETS cache sets,
- * each with ELEM_PER_SET elements. */
+ * which share a budget of CACHE_BYTES bytes and keep entries according to
+ * CACHE_POLICY. */
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
-    unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set) {
+    unsigned int redundancy, unsigned int num_sets, size_t cache_bytes,
+    kvcache_policy_t cache_policy) {
   int ret;
-  ret = kvcache_init(&master->cache, num_sets, elem_per_set);
+  ret = kvcache_init(&master->cache, num_sets, cache_bytes, cache_policy);
   if (ret < 0) return ret;
   ret = pthread_rwlock_init(&master->slave_lock, NULL);
   if (ret < 0) return ret;
@@ -102,14 +106,15 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
   DL_SORT(master->slaves_head, cmp);
 }
 
-/* Hashes KEY and finds the first slave that should contain it.
+/* Finds the first slave that should contain KEY, by its RING_HASH (which is
+ * hash_64_bit() of the key, see kvkey.h).
  * It should return the first slave whose ID is greater than the
  * KEY's hash, and the one with lowest ID if none matches the
  * requirement.
  *
  * Checkpoint 2 only. */
-tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key) {
-  int64_t key_hash = hash_64_bit(key);
+tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, kvkey_t *key) {
+  int64_t key_hash = key->ring_hash;
   tpcslave_t *slave = master->head;
   while(slave && slave->id < key_hash){
 	  slave = slave->next;
@@ -133,10 +138,10 @@ tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
  * Checkpoint 2 only. */
 void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
-  char *key = reqmsg->key;
+  kvkey_t *key = &reqmsg->key_desc;
   char *value;
   // get from master's cache
-  int ret = kvcache_get(master->cache, reqmsg->key, &value); 
+  int ret = kvcache_get(master->cache, key, &value); 
   respmsg->message = MSG_SUCCESS;
   if(ret < 0){
 	  // get from primary slave
@@ -155,6 +160,174 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
   }
 }
 
+/* The keys of an MGET which are owned by a single slave. */
+typedef struct {
+  tpcslave_t *primary;          /* The slave which owns the keys. */
+  tpcslave_t *successor;        /* The slave which is asked if PRIMARY fails. */
+  char **keys;                  /* The keys. */
+  char **values;                /* The values fetched for KEYS, or NULL for keys which are absent. */
+  unsigned int *pos;            /* The position of each key within the whole MGET. */
+  unsigned int count;           /* The number of keys. */
+  int error;                    /* -1 if neither slave answered, else 0. */
+  pthread_t thread;             /* The thread fetching the values. */
+} mget_group_t;
+
+/* Asks SLAVE for the values of the COUNT KEYS with a single MGETREQ, placing
+ * them into VALUES. Returns 0 if successful, else -1. */
+static int mget_from(tpcslave_t *slave, char **keys, unsigned int count,
+    char **values) {
+  kvmessage_t reqmsg, *respmsg;
+  unsigned int i;
+  int sockfd, ret = -1;
+  if ((sockfd = connect_to(slave->host, slave->port, TIME_OUT)) < 0)
+    return -1;
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = MGETREQ;
+  reqmsg.keys = keys;
+  reqmsg.num_entries = count;
+  kvmessage_send(&reqmsg, sockfd);
+  respmsg = kvmessage_parse(sockfd);
+  close(sockfd);
+  if (respmsg == NULL)
+    return -1;
+  if (respmsg->type == MGETRESP && respmsg->values != NULL &&
+      respmsg->num_entries == count) {
+    for (i = 0; i < count; i++) {
+      values[i] = respmsg->values[i];
+      respmsg->values[i] = NULL;
+    }
+    ret = 0;
+  }
+  kvmessage_free(respmsg);
+  return ret;
+}
+
+/* Fetches the values of the mget_group_t ARG from its primary, or from its
+ * successor if the primary cannot answer, setting its ERROR if neither can. */
+static void *mget_fetch(void *arg) {
+  mget_group_t *group = arg;
+  if (mget_from(group->primary, group->keys, group->count, group->values) < 0)
+    group->error = mget_from(group->successor, group->keys, group->count,
+        group->values);
+  return NULL;
+}
+
+/* Handles an incoming MGET request REQMSG, and populates the appropriate
+ * fields of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
+ * kvmessage_t structs. Keys which are not in the master's cache are split up
+ * by the slave which owns them, and every slave is asked for all of its keys
+ * at once, in parallel. If the keys of any slave cannot be fetched from it or
+ * from its successor, the whole MGET fails with an error rather than report
+ * those keys as absent. */
+void tpcmaster_handle_mget(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  unsigned int count = reqmsg->num_entries, num_groups = 0, i, j;
+  mget_group_t *groups = NULL, *group;
+  unsigned int *group_of = NULL;
+  tpcslave_t *primary;
+  bool failed = false;
+  char **values;
+  if (reqmsg->key_descs == NULL || count == 0 || count > MAX_BATCH_ENTRIES) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if ((values = calloc(count, sizeof(char *))) == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  if (kvcache_mget(&master->cache, reqmsg->key_descs, count, values) == count)
+    goto done;
+  groups = calloc(master->slave_count + 1, sizeof(mget_group_t));
+  group_of = malloc(count * sizeof(unsigned int));
+  if (groups == NULL || group_of == NULL)
+    goto fail;
+
+  /* Work out which slave owns each missing key. */
+  pthread_rwlock_rdlock(&master->slave_lock);
+  if (master->slaves_head == NULL) {
+    pthread_rwlock_unlock(&master->slave_lock);
+    goto fail;
+  }
+  for (i = 0; i < count; i++) {
+    if (values[i] != NULL)
+      continue;
+    primary = tpcmaster_get_primary(master, &reqmsg->key_descs[i]);
+    for (j = 0; j < num_groups && groups[j].primary != primary; j++)
+      ;
+    if (j == num_groups) {
+      groups[j].primary = primary;
+      groups[j].successor = tpcmaster_get_successor(master, primary);
+      num_groups++;
+    }
+    group_of[i] = j;
+    groups[j].count++;
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  for (j = 0; j < num_groups; j++) {
+    group = &groups[j];
+    group->keys = malloc(group->count * sizeof(char *));
+    group->values = calloc(group->count, sizeof(char *));
+    group->pos = malloc(group->count * sizeof(unsigned int));
+    if (group->keys == NULL || group->values == NULL || group->pos == NULL)
+      goto fail;
+    group->count = 0;
+  }
+  for (i = 0; i < count; i++) {
+    if (values[i] != NULL)
+      continue;
+    group = &groups[group_of[i]];
+    group->keys[group->count] = reqmsg->keys[i];
+    group->pos[group->count++] = i;
+  }
+
+  /* Ask every slave at once, fetching from one of them on this thread if
+   * another cannot be started. */
+  for (j = 0; j < num_groups; j++) {
+    if (pthread_create(&groups[j].thread, NULL, mget_fetch, &groups[j]) != 0)
+      groups[j].thread = pthread_self();
+  }
+  for (j = 0; j < num_groups; j++) {
+    if (pthread_equal(groups[j].thread, pthread_self()))
+      mget_fetch(&groups[j]);
+    else
+      pthread_join(groups[j].thread, NULL);
+    if (groups[j].error < 0)
+      failed = true;
+    for (i = 0; i < groups[j].count; i++) {
+      if ((values[groups[j].pos[i]] = groups[j].values[i]) != NULL)
+        kvcache_put(&master->cache, &reqmsg->key_descs[groups[j].pos[i]],
+            groups[j].values[i]);
+    }
+  }
+  if (!failed)
+    goto done;
+
+fail:
+  for (i = 0; i < count; i++)
+    free(values[i]);
+  free(values);
+  values = NULL;
+  respmsg->message = ERRMSG_GENERIC_ERROR;
+done:
+  if (groups != NULL) {
+    for (j = 0; j < num_groups; j++) {
+      free(groups[j].keys);
+      free(groups[j].values);
+      free(groups[j].pos);
+    }
+  }
+  free(groups);
+  free(group_of);
+  if (values == NULL)
+    return;
+  respmsg->type = MGETRESP;
+  respmsg->message = MSG_SUCCESS;
+  respmsg->keys = reqmsg->keys;
+  respmsg->values = values;
+  respmsg->num_entries = count;
+  reqmsg->keys = NULL;
+}
+
 /* Handles an incoming TPC request REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Implements the TPC algorithm, polling all the slaves
@@ -173,7 +346,7 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
  * Checkpoint 2 only. */
 void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg, callback_t callback) {
-  char *key = reqmsg->key;
+  kvkey_t *key = &reqmsg->key_desc;
   // pharse 1, ask associated slave commit or abort
   tpcslave_t *primary = tpcmaster_get_primary(master, key);
   int sock_primary = connect_to(primary->hostname, primary->port, TIME_OUT);
@@ -257,6 +430,11 @@ void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
   }
   if (reqmsg->type == INFO) {
     tpcmaster_info(master, reqmsg, &respmsg);
+  } else if (reqmsg->type == MGETREQ) {
+    tpcmaster_handle_mget(master, reqmsg, &respmsg);
+  } else if (reqmsg->type == MPUTREQ || reqmsg->type == MDELREQ ||
+      reqmsg->type == INGESTREQ || reqmsg->type == SNAPSHOTREQ) {
+    respmsg.message = ERRMSG_NOT_IMPLEMENTED;
   } else if (reqmsg == NULL || reqmsg->key == NULL) {
     respmsg.message = ERRMSG_INVALID_REQUEST;
   } else if (reqmsg->type == REGISTER) {
@@ -270,6 +448,7 @@ void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
   kvmessage_free(reqmsg);
   if (respmsg.key != NULL)
     free(respmsg.key);
+  kvmessage_free_entries(&respmsg);
 }
 
 /* Completely clears this TPCMaster's cache. For testing purposes. */
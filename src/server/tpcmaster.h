@@ -20,6 +20,11 @@
  * The TPCMaster has an associated KVCache, which should be updated on PUT
  * and DEL requests, and accessed on GET requests before going to the slaves.
  *
+ * An MGET request is answered from the cache where possible. The remaining
+ * keys are grouped by the slave which owns them, and each of those slaves is
+ * sent a single MGET for its group, all in parallel. Batched PUTs and DELs
+ * are not supported by the master, since they would need a multi-key commit.
+ *
  * For this project, you can assume that the TPCMaster will never fail. Thus,
  * you don't need to maintain a TPCLog for it.
  * 
@@ -53,11 +58,12 @@ typedef struct tpcmaster {
 } tpcmaster_t;
 
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
-    unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set);
+    unsigned int redundancy, unsigned int num_sets, size_t cache_bytes,
+    kvcache_policy_t cache_policy);
 
 void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
-tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key);
+tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, kvkey_t *key);
 tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
     tpcslave_t *predecessor);
 
@@ -65,6 +71,8 @@ void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback);
 
 void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
+void tpcmaster_handle_mget(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg);
 void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg, callback_t callback);
 
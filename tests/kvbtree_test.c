@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "kvtests.h"
+
+/* Enough keys to split leaves and branches several times over. */
+#define NUM_KEYS 20000
+
+/* Returns 0 if KEY holds EXPECTED in STORE, or is absent if EXPECTED is
+ * NULL, else 1. */
+static int check(kvstore_t *store, char *key, char *expected) {
+  kvkey_t desc;
+  char *value = NULL;
+  int ret;
+  kvkey_init(&desc, key);
+  ret = kvstore_get(store, &desc, &value);
+  if (expected == NULL)
+    ret = (ret == ERRNOKEY) ? 0 : 1;
+  else
+    ret = (ret == 0 && strcmp(value, expected) == 0) ? 0 : 1;
+  free(value);
+  return ret;
+}
+
+/* Counts the entries passed to it into the int ARG, failing if they are out
+ * of order. */
+static int count_ordered(char *key, char *value, void *arg) {
+  static char last[MAX_KEYLEN + 1];
+  int *count = arg;
+  if (*count > 0 && strcmp(last, key) >= 0)
+    return -1;
+  strcpy(last, key);
+  (*count)++;
+  return 0;
+}
+
+/* PUT, GET, overwrite (with a longer value) and DEL of a single key. */
+static int btree_basic(void) {
+  kvstore_t store;
+  kvkey_t key;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "btree", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  kvkey_init(&key, "apple");
+  ASSERT(kvstore_put(&store, &key, "red") == 0);
+  ASSERT(check(&store, "apple", "red") == 0);
+  ASSERT(kvstore_put(&store, &key, "a much longer shade of green") == 0);
+  ASSERT(check(&store, "apple", "a much longer shade of green") == 0);
+  ASSERT(check(&store, "banana", NULL) == 0);
+  ASSERT(kvstore_del(&store, &key) == 0);
+  ASSERT(check(&store, "apple", NULL) == 0);
+  ASSERT(kvstore_del(&store, &key) == ERRNOKEY);
+  kvstore_clean(&store);
+  return 0;
+}
+
+/* Keys inserted out of order split the tree, are all found again, are
+ * scanned in order, and stay gone once deleted, both in the store and in a
+ * snapshot of it opened as a store of its own. */
+static int btree_split_and_reopen(void) {
+  char key[MAX_KEYLEN + 1], value[32];
+  kvstore_t store, copy;
+  kvkey_t desc;
+  int i, count = 0;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "btree", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  for (i = 0; i < NUM_KEYS; i++) {
+    /* 7919 is prime, so this visits every key once, out of order. */
+    sprintf(key, "key%06d", (i * 7919) % NUM_KEYS);
+    sprintf(value, "value%d", (i * 7919) % NUM_KEYS);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_put(&store, &desc, value) == 0);
+  }
+  for (i = 0; i < NUM_KEYS; i += 2) {
+    sprintf(key, "key%06d", i);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_del(&store, &desc) == 0);
+  }
+  ASSERT(kvstore_scan(&store, NULL, NULL, 0, count_ordered, &count) ==
+      NUM_KEYS / 2);
+  ASSERT(count == NUM_KEYS / 2);
+  ASSERT(kvstore_snapshot(&store, KVTEST_SNAPSHOT) == 0);
+  ASSERT(kvstore_init(&copy, KVTEST_SNAPSHOT, "btree", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  for (i = 0; i < NUM_KEYS; i++) {
+    sprintf(key, "key%06d", i);
+    sprintf(value, "value%d", i);
+    ASSERT(check(&store, key, (i % 2 == 0) ? NULL : value) == 0);
+    ASSERT(check(&copy, key, (i % 2 == 0) ? NULL : value) == 0);
+  }
+  kvstore_clean(&copy);
+  kvstore_clean(&store);
+  return 0;
+}
+
+/* A scan stops at the end of its range and after its limit. */
+static int btree_scan_range(void) {
+  char key[MAX_KEYLEN + 1];
+  kvstore_t store;
+  kvkey_t desc;
+  int i, count = 0;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "btree", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  for (i = 0; i < 100; i++) {
+    sprintf(key, "k%02d", i);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_put(&store, &desc, "v") == 0);
+  }
+  ASSERT(kvstore_scan(&store, "k10", "k20", 0, count_ordered, &count) == 10);
+  count = 0;
+  ASSERT(kvstore_scan(&store, "k90", NULL, 5, count_ordered, &count) == 5);
+  ASSERT(count == 5);
+  kvstore_clean(&store);
+  return 0;
+}
+
+const kvtest_t kvbtree_tests[] = {
+  { "basic", btree_basic },
+  { "split_and_reopen", btree_split_and_reopen },
+  { "scan_range", btree_scan_range },
+  { NULL, NULL }
+};
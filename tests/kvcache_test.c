@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "kvcache.h"
+#include "kvconstants.h"
+#include "kvtests.h"
+
+/* The number of keys used over and over, and of keys read once. */
+#define HOT_KEYS 100
+#define SCAN_KEYS 20000
+
+/* PUTs KEY with VALUE into CACHE. Returns 0 if successful. */
+static int put(kvcache_t *cache, char *key, char *value) {
+  kvkey_t desc;
+  kvkey_init(&desc, key);
+  return kvcache_put(cache, &desc, value);
+}
+
+/* Returns 1 if KEY is in CACHE, else 0. Counts as a GET. */
+static int cached(kvcache_t *cache, char *key) {
+  kvkey_t desc;
+  kvbuf_t *buf;
+  kvkey_init(&desc, key);
+  if (kvcache_get_buf(cache, &desc, &buf) != 0)
+    return 0;
+  kvbuf_unref(buf);
+  return 1;
+}
+
+/* Frees CACHE, which nothing else uses. */
+static void destroy(kvcache_t *cache) {
+  unsigned int i;
+  for (i = 0; i < cache->num_sets; i++)
+    kvcacheset_destroy(&cache->sets[i]);
+  free(cache->sets);
+}
+
+/* Reads HOT_KEYS keys ROUNDS times each from CACHE, PUTting those which miss
+ * as a server would, then SCAN_KEYS keys once each. Returns how many of the
+ * HOT_KEYS keys are still cached. */
+static int scan(kvcache_t *cache, int rounds) {
+  char key[32];
+  int i, round, kept = 0;
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < HOT_KEYS; i++) {
+      sprintf(key, "hot%d", i);
+      if (!cached(cache, key))
+        put(cache, key, "value");
+    }
+  }
+  for (i = 0; i < SCAN_KEYS; i++) {
+    sprintf(key, "scan%d", i);
+    if (!cached(cache, key))
+      put(cache, key, "value");
+  }
+  for (i = 0; i < HOT_KEYS; i++) {
+    sprintf(key, "hot%d", i);
+    kept += cached(cache, key);
+  }
+  return kept;
+}
+
+/* A set holds no more than its budget in bytes, evicting entries to make
+ * room for new ones, and an entry which is read between PUTs gets a second
+ * chance each time the clock passes it, so it is never the one evicted. */
+static int cache_eviction(void) {
+  kvcache_t cache;
+  char key[32];
+  int i;
+  ASSERT(kvcache_init(&cache, 1, 2 * KVCACHESET_SLAB_SIZE, KVCACHE_CLOCK)
+      == 0);
+  ASSERT(put(&cache, "hot", "value") == 0);
+  for (i = 0; i < SCAN_KEYS; i++) {
+    ASSERT(cached(&cache, "hot"));
+    sprintf(key, "key%d", i);
+    ASSERT(put(&cache, key, "value") == 0);
+    ASSERT(cached(&cache, key));
+  }
+  ASSERT(cache.sets[0].bytes <= cache.sets[0].max_bytes);
+  ASSERT(cache.sets[0].num_entries > 0 &&
+      cache.sets[0].num_entries < SCAN_KEYS / 2);
+  ASSERT(!cached(&cache, "key0"));
+  kvcache_clear(&cache);
+  ASSERT(cache.sets[0].num_entries == 0 && !cached(&cache, "hot"));
+  ASSERT(put(&cache, "hot", "value") == 0 && cached(&cache, "hot"));
+  destroy(&cache);
+  ASSERT(kvcache_init(&cache, 4, 4 * KVCACHESET_SLAB_SIZE - 1, KVCACHE_CLOCK)
+      != 0);
+  ASSERT(kvcache_init(&cache, 0, KVCACHE_DEFAULT_BYTES, KVCACHE_CLOCK) != 0);
+  return 0;
+}
+
+/* A scan of keys read once flushes the keys used over and over out of a
+ * CLOCK cache, but with TinyLFU the scan only churns the window, and those
+ * keys stay cached. */
+static int cache_admission(void) {
+  kvcache_t cache;
+  int clock_kept, tinylfu_kept;
+  ASSERT(kvcache_policy_lookup("clock") == KVCACHE_CLOCK);
+  ASSERT(kvcache_policy_lookup("tinylfu") == KVCACHE_TINYLFU);
+  ASSERT(kvcache_policy_lookup("lru") == -1);
+  ASSERT(kvcache_init(&cache, 1, 4 * KVCACHESET_SLAB_SIZE, KVCACHE_CLOCK)
+      == 0);
+  clock_kept = scan(&cache, 8);
+  destroy(&cache);
+  ASSERT(kvcache_init(&cache, 1, 4 * KVCACHESET_SLAB_SIZE, KVCACHE_TINYLFU)
+      == 0);
+  tinylfu_kept = scan(&cache, 8);
+  destroy(&cache);
+  ASSERT(clock_kept < HOT_KEYS / 2);
+  ASSERT(tinylfu_kept >= HOT_KEYS * 3 / 4);
+  return 0;
+}
+
+const kvtest_t kvcache_tests[] = {
+  { "eviction", cache_eviction },
+  { "admission", cache_admission },
+  { NULL, NULL }
+};
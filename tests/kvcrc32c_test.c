@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <string.h>
+#include "kvcrc32c.h"
+#include "kvtests.h"
+
+/* The check value of CRC-32C, the checksum of "123456789". */
+static int crc32c_check_value(void) {
+  ASSERT(kvcrc32c(0, "123456789", 9) == 0xe3069283U);
+  ASSERT(kvcrc32c(0, "", 0) == 0);
+  return 0;
+}
+
+/* Checksumming in pieces, at every alignment, matches checksumming at
+ * once. */
+static int crc32c_pieces(void) {
+  char buf[1024];
+  uint32_t whole, crc;
+  size_t i, split;
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = (char) (i * 31 + 7);
+  whole = kvcrc32c(0, buf, sizeof(buf));
+  for (split = 0; split <= 16; split++) {
+    crc = kvcrc32c(0, buf, split);
+    ASSERT(kvcrc32c(crc, buf + split, sizeof(buf) - split) == whole);
+  }
+  ASSERT(kvcrc32c(0, buf + 1, 9) != kvcrc32c(0, buf, 9));
+  return 0;
+}
+
+const kvtest_t kvcrc32c_tests[] = {
+  { "check_value", crc32c_check_value },
+  { "pieces", crc32c_pieces },
+  { NULL, NULL }
+};
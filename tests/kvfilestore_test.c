@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvfilestore.h"
+#include "kvstore.h"
+#include "kvtests.h"
+
+/* Pieces of key whose hashes are all equal, so that keys made of the same
+ * number of them share a hash chain. */
+static char *pieces[] = { "Ac", "BB", "C!" };
+#define NUM_PIECES 3
+#define NUM_KEYS (NUM_PIECES * NUM_PIECES)
+
+/* The positions within the chain of the keys which are deleted: from the
+ * front, the middle and the end. */
+static const int deleted[] = { 0, 4, NUM_KEYS - 1 };
+#define NUM_DELETED 3
+
+/* Places the Ith key of the chain into KEY. */
+static void chain_key(int i, char *key) {
+  sprintf(key, "%s%s", pieces[i / NUM_PIECES], pieces[i % NUM_PIECES]);
+}
+
+/* Returns true if the Ith key of the chain is one which is deleted. */
+static bool is_deleted(int i) {
+  int j;
+  for (j = 0; j < NUM_DELETED; j++) {
+    if (deleted[j] == i)
+      return true;
+  }
+  return false;
+}
+
+/* Returns 0 if KEY holds itself as its value in STORE, or is absent if
+ * ABSENT is set, else 1. */
+static int check(kvstore_t *store, char *key, bool absent) {
+  kvkey_t desc;
+  char *value = NULL;
+  int ret;
+  kvkey_init(&desc, key);
+  ret = kvstore_get(store, &desc, &value);
+  if (absent)
+    ret = (ret == ERRNOKEY) ? 0 : 1;
+  else
+    ret = (ret == 0 && strcmp(value, key) == 0) ? 0 : 1;
+  free(value);
+  return ret;
+}
+
+/* Returns 1 if the entry at CHAINPOS of the chain of HASHVAL exists. */
+static int has_entry(unsigned long hashval, int chainpos) {
+  char filename[MAX_FILENAME];
+  sprintf(filename, "%s/%lu-%d%s", KVTEST_STORE, hashval, chainpos,
+      KVFILESTORE_FILETYPE);
+  return access(filename, F_OK) == 0;
+}
+
+/* A DEL leaves a tombstone which hides its key at once, wherever it is in
+ * its chain, and the background thread then compacts the chain so that it
+ * holds only the live entries, still without holes. */
+static int file_reclaim(void) {
+  kvstore_t store;
+  kvfilestore_t *files;
+  char key[MAX_KEYLEN + 1];
+  unsigned long hashval;
+  kvkey_t desc;
+  int i, waited;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "file", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  files = store.state;
+  for (i = 0; i < NUM_KEYS; i++) {
+    chain_key(i, key);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_put(&store, &desc, key) == 0);
+  }
+  hashval = desc.hash;
+  ASSERT(has_entry(hashval, NUM_KEYS - 1) && !has_entry(hashval, NUM_KEYS));
+  for (i = 0; i < NUM_DELETED; i++) {
+    chain_key(deleted[i], key);
+    kvkey_init(&desc, key);
+    ASSERT(desc.hash == hashval);
+    ASSERT(kvstore_del(&store, &desc) == 0);
+    ASSERT(check(&store, key, true) == 0);
+  }
+  for (waited = 0; __atomic_load_n(&files->reclaimed, __ATOMIC_RELAXED) <
+      NUM_DELETED && waited < 1000; waited++)
+    usleep(10000);
+  ASSERT(files->reclaimed == NUM_DELETED);
+  ASSERT(files->tombstones == NUM_DELETED);
+  ASSERT(has_entry(hashval, NUM_KEYS - NUM_DELETED - 1));
+  ASSERT(!has_entry(hashval, NUM_KEYS - NUM_DELETED));
+  for (i = 0; i < NUM_KEYS; i++) {
+    chain_key(i, key);
+    ASSERT(check(&store, key, is_deleted(i)) == 0);
+  }
+  /* A deleted key can be written again, at the end of the chain. */
+  chain_key(deleted[0], key);
+  kvkey_init(&desc, key);
+  ASSERT(kvstore_put(&store, &desc, key) == 0);
+  ASSERT(check(&store, key, false) == 0);
+  ASSERT(has_entry(hashval, NUM_KEYS - NUM_DELETED));
+  kvstore_clean(&store);
+  return 0;
+}
+
+const kvtest_t kvfilestore_tests[] = {
+  { "reclaim", file_reclaim },
+  { NULL, NULL }
+};
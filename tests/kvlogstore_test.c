@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvlogstore.h"
+#include "kvstore.h"
+#include "kvtests.h"
+
+/* The segment the first records of a store are written to. */
+#define SEGMENT KVTEST_STORE "/0" KVLOGSTORE_FILETYPE
+
+/* Overwrites the first byte of STR within the file FILENAME. Returns 0 if
+ * successful, else 1. */
+static int damage(const char *filename, const char *str) {
+  char buf[4096], *found;
+  ssize_t size;
+  int fd, ret = 1;
+  if ((fd = open(filename, O_RDWR)) < 0)
+    return 1;
+  if ((size = pread(fd, buf, sizeof(buf), 0)) > 0 &&
+      (found = memmem(buf, size, str, strlen(str))) != NULL &&
+      pwrite(fd, "X", 1, found - buf) == 1)
+    ret = 0;
+  close(fd);
+  return ret;
+}
+
+/* With verification on, a GET or MGET of a damaged record fails with
+ * ERRCHECKSUM rather than returning the damaged value, and the records
+ * around it are still read. */
+static int log_verify(void) {
+  kvstore_t store;
+  kvkey_t key, keys[3];
+  char *value, *values[3];
+  kvkey_init(&keys[0], "a");
+  kvkey_init(&keys[1], "b");
+  kvkey_init(&keys[2], "c");
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "log", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  ASSERT(kvstore_put(&store, &keys[0], "alpha") == 0);
+  ASSERT(kvstore_put(&store, &keys[1], "bravo") == 0);
+  ASSERT(kvstore_put(&store, &keys[2], "charlie") == 0);
+  ASSERT(kvstore_mget(&store, keys, 3, values) == 0);
+  ASSERT(strcmp(values[1], "bravo") == 0);
+  free(values[0]);
+  free(values[1]);
+  free(values[2]);
+  ASSERT(damage(SEGMENT, "bravo") == 0);
+  kvkey_init(&key, "b");
+  ASSERT(kvstore_get(&store, &key, &value) == ERRCHECKSUM);
+  ASSERT(kvstore_mget(&store, keys, 3, values) == ERRCHECKSUM);
+  kvkey_init(&key, "c");
+  ASSERT(kvstore_get(&store, &key, &value) == 0);
+  ASSERT(strcmp(value, "charlie") == 0);
+  free(value);
+  kvstore_clean(&store);
+  return 0;
+}
+
+/* A store reopened without its index stops replaying at a damaged record,
+ * so what was written before it is kept and nothing after it is trusted. */
+static int log_replay_damaged(void) {
+  kvstore_t store;
+  kvkey_t key;
+  char *value = NULL;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "log", KVSYNC_DEFAULT_MODE,
+      false, false) == 0);
+  kvkey_init(&key, "a");
+  ASSERT(kvstore_put(&store, &key, "alpha") == 0);
+  kvkey_init(&key, "b");
+  ASSERT(kvstore_put(&store, &key, "bravo") == 0);
+  kvkey_init(&key, "c");
+  ASSERT(kvstore_put(&store, &key, "charlie") == 0);
+  ASSERT(kvstore_close(&store) == 0);
+  ASSERT(damage(SEGMENT, "bravo") == 0);
+  unlink(KVTEST_STORE "/" KVLOGSTORE_INDEX);
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "log", KVSYNC_DEFAULT_MODE,
+      false, false) == 0);
+  kvkey_init(&key, "a");
+  ASSERT(kvstore_get(&store, &key, &value) == 0);
+  ASSERT(strcmp(value, "alpha") == 0);
+  free(value);
+  kvkey_init(&key, "b");
+  ASSERT(kvstore_get(&store, &key, &value) == ERRNOKEY);
+  kvkey_init(&key, "c");
+  ASSERT(kvstore_get(&store, &key, &value) == ERRNOKEY);
+  kvstore_clean(&store);
+  return 0;
+}
+
+const kvtest_t kvlogstore_tests[] = {
+  { "verify", log_verify },
+  { "replay_damaged", log_replay_damaged },
+  { NULL, NULL }
+};
@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "kvtests.h"
+
+/* Enough entries of VALLEN bytes to fill more than one memtable. */
+#define NUM_ENTRIES 6000
+#define VALLEN 1000
+
+/* Returns 0 if KEY holds EXPECTED in STORE, or is absent if EXPECTED is
+ * NULL, else 1. */
+static int check(kvstore_t *store, char *key, char *expected) {
+  kvkey_t desc;
+  char *value = NULL;
+  int ret;
+  kvkey_init(&desc, key);
+  ret = kvstore_get(store, &desc, &value);
+  if (expected == NULL)
+    ret = (ret == ERRNOKEY) ? 0 : 1;
+  else
+    ret = (ret == 0 && strcmp(value, expected) == 0) ? 0 : 1;
+  free(value);
+  return ret;
+}
+
+/* Places the key and value of the Ith entry into KEY and VALUE. */
+static void entry(int i, char *key, char *value) {
+  sprintf(key, "key%06d", i);
+  memset(value, 'a' + i % 26, VALLEN);
+  sprintf(value, "%d", i);
+  value[strlen(value)] = '-';
+  value[VALLEN] = '\0';
+}
+
+/* PUT, GET, overwrite and DEL within the memtable. */
+static int lsm_basic(void) {
+  kvstore_t store;
+  kvkey_t key;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "lsm", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  kvkey_init(&key, "apple");
+  ASSERT(kvstore_put(&store, &key, "red") == 0);
+  ASSERT(check(&store, "apple", "red") == 0);
+  ASSERT(kvstore_put(&store, &key, "green") == 0);
+  ASSERT(check(&store, "apple", "green") == 0);
+  ASSERT(check(&store, "banana", NULL) == 0);
+  ASSERT(kvstore_del(&store, &key) == 0);
+  ASSERT(check(&store, "apple", NULL) == 0);
+  ASSERT(kvstore_del(&store, &key) == ERRNOKEY);
+  kvstore_clean(&store);
+  return 0;
+}
+
+/* Entries survive being flushed from the memtable into tables, deletes of
+ * flushed entries hide them, and a snapshot opened as a store of its own
+ * holds the same entries. */
+static int lsm_flush_and_reopen(void) {
+  char key[MAX_KEYLEN + 1], value[VALLEN + 1];
+  kvstore_t store, copy;
+  kvkey_t desc;
+  int i;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "lsm", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  for (i = 0; i < NUM_ENTRIES; i++) {
+    entry(i, key, value);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_put(&store, &desc, value) == 0);
+  }
+  for (i = 0; i < NUM_ENTRIES; i += 3) {
+    entry(i, key, value);
+    kvkey_init(&desc, key);
+    ASSERT(kvstore_del(&store, &desc) == 0);
+  }
+  for (i = 0; i < NUM_ENTRIES; i++) {
+    entry(i, key, value);
+    ASSERT(check(&store, key, (i % 3 == 0) ? NULL : value) == 0);
+  }
+  ASSERT(kvstore_snapshot(&store, KVTEST_SNAPSHOT) == 0);
+  ASSERT(kvstore_init(&copy, KVTEST_SNAPSHOT, "lsm",
+      KVSYNC_DEFAULT_MODE, true, false) == 0);
+  for (i = 0; i < NUM_ENTRIES; i++) {
+    entry(i, key, value);
+    ASSERT(check(&copy, key, (i % 3 == 0) ? NULL : value) == 0);
+  }
+  kvstore_clean(&copy);
+  kvstore_clean(&store);
+  return 0;
+}
+
+/* The number of threads, and of keys each writes, in lsm_concurrent. */
+#define NUM_THREADS 4
+#define THREAD_KEYS 500
+
+/* Arguments to writer. */
+typedef struct {
+  kvstore_t *store;
+  int id;
+  int ret;
+} writer_arg_t;
+
+/* PUTs keys of its own into the store given by the writer_arg_t ARG,
+ * deleting every other one again straight away. */
+static void *writer(void *arg) {
+  writer_arg_t *w = arg;
+  char key[MAX_KEYLEN + 1];
+  kvkey_t desc;
+  int i;
+  for (i = 0; i < THREAD_KEYS && w->ret == 0; i++) {
+    sprintf(key, "t%d-%04d", w->id, i);
+    kvkey_init(&desc, key);
+    w->ret = kvstore_put(w->store, &desc, key);
+    if (w->ret == 0 && i % 2 == 0)
+      w->ret = kvstore_del(w->store, &desc);
+  }
+  return NULL;
+}
+
+/* Concurrent PUTs and DELs of different keys all take effect. */
+static int lsm_concurrent(void) {
+  writer_arg_t args[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  char key[MAX_KEYLEN + 1];
+  kvstore_t store;
+  int t, i;
+  ASSERT(kvstore_init(&store, KVTEST_STORE, "lsm", KVSYNC_DEFAULT_MODE,
+      true, false) == 0);
+  for (t = 0; t < NUM_THREADS; t++) {
+    args[t].store = &store;
+    args[t].id = t;
+    args[t].ret = 0;
+    ASSERT(pthread_create(&threads[t], NULL, writer, &args[t]) == 0);
+  }
+  for (t = 0; t < NUM_THREADS; t++)
+    pthread_join(threads[t], NULL);
+  for (t = 0; t < NUM_THREADS; t++) {
+    ASSERT(args[t].ret == 0);
+    for (i = 0; i < THREAD_KEYS; i++) {
+      sprintf(key, "t%d-%04d", t, i);
+      ASSERT(check(&store, key, (i % 2 == 0) ? NULL : key) == 0);
+    }
+  }
+  kvstore_clean(&store);
+  return 0;
+}
+
+const kvtest_t kvlsmstore_tests[] = {
+  { "basic", lsm_basic },
+  { "flush_and_reopen", lsm_flush_and_reopen },
+  { "concurrent", lsm_concurrent },
+  { NULL, NULL }
+};
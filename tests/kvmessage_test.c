@@ -0,0 +1,120 @@
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvmessage.h"
+#include "kvtests.h"
+
+/* Sends JSON as a message to kvmessage_parse over a socket pair, returning
+ * whatever it parses, or NULL if it rejects the message. */
+static kvmessage_t *parse(const char *json) {
+  kvmessage_t *message = NULL;
+  uint32_t size = htonl(strlen(json));
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return NULL;
+  if (write(fds[0], &size, 4) == 4 &&
+      write(fds[0], json, strlen(json)) == (ssize_t) strlen(json))
+    message = kvmessage_parse(fds[1]);
+  close(fds[0]);
+  close(fds[1]);
+  return message;
+}
+
+/* Returns a message of TYPE carrying KEYS and then, if VALUES is not NULL,
+ * the JSON array VALUES. The result should later be freed. */
+static char *batch(msgtype_t type, const char *keys, const char *values) {
+  char *json = malloc(strlen(keys) + (values ? strlen(values) : 0) + 64);
+  if (json == NULL)
+    return NULL;
+  if (values != NULL)
+    sprintf(json, "{\"type\": %d, \"keys\": %s, \"values\": %s}", type, keys,
+        values);
+  else
+    sprintf(json, "{\"type\": %d, \"keys\": %s}", type, keys);
+  return json;
+}
+
+/* Returns 1 if kvmessage_parse accepts a message of TYPE with KEYS and
+ * VALUES, else 0. */
+static int accepted(msgtype_t type, const char *keys, const char *values) {
+  kvmessage_t *message;
+  char *json = batch(type, keys, values);
+  if (json == NULL)
+    return 0;
+  message = parse(json);
+  free(json);
+  if (message == NULL)
+    return 0;
+  kvmessage_free(message);
+  return 1;
+}
+
+/* A batch whose keys each have a value, or a null for none, is parsed entry
+ * by entry, and one of keys alone has no values. */
+static int message_batch(void) {
+  kvmessage_t *message;
+  char *json = batch(MPUTREQ, "[\"a\", \"b\", \"c\"]", "[\"1\", null, \"3\"]");
+  ASSERT(json != NULL);
+  message = parse(json);
+  free(json);
+  ASSERT(message != NULL);
+  ASSERT(message->type == MPUTREQ && message->num_entries == 3);
+  ASSERT(strcmp(message->keys[0], "a") == 0 &&
+      strcmp(message->keys[2], "c") == 0);
+  ASSERT(strcmp(message->values[0], "1") == 0 && message->values[1] == NULL &&
+      strcmp(message->values[2], "3") == 0);
+  ASSERT(message->key_descs != NULL && message->key_descs[1].len == 1);
+  kvmessage_free(message);
+  json = batch(MGETREQ, "[\"a\", \"b\"]", NULL);
+  ASSERT(json != NULL);
+  message = parse(json);
+  free(json);
+  ASSERT(message != NULL);
+  ASSERT(message->num_entries == 2 && message->values == NULL);
+  kvmessage_free(message);
+  return 0;
+}
+
+/* A batch is rejected rather than cut short or padded when it has more or
+ * fewer values than keys, and so is one whose entries are not strings. */
+static int message_batch_mismatch(void) {
+  ASSERT(!accepted(MPUTREQ, "[\"a\", \"b\", \"c\"]", "[\"1\", \"2\"]"));
+  ASSERT(!accepted(MPUTREQ, "[\"a\"]", "[\"1\", \"2\"]"));
+  ASSERT(!accepted(MPUTREQ, "[]", "[\"1\"]"));
+  ASSERT(!accepted(MPUTREQ, "\"a\"", "[\"1\"]"));
+  ASSERT(!accepted(MPUTREQ, "[\"a\"]", "\"1\""));
+  ASSERT(!accepted(MPUTREQ, "[\"a\", 2]", "[\"1\", \"2\"]"));
+  ASSERT(!accepted(MPUTREQ, "[\"a\", \"b\"]", "[\"1\", 2]"));
+  ASSERT(accepted(MPUTREQ, "[]", "[]"));
+  return 0;
+}
+
+/* A batch of MAX_BATCH_ENTRIES keys is parsed, and one of any more is
+ * rejected. */
+static int message_batch_limit(void) {
+  char *keys = malloc((MAX_BATCH_ENTRIES + 1) * 16 + 2), *end;
+  int i, ret;
+  ASSERT(keys != NULL);
+  end = keys + sprintf(keys, "[\"k0\"");
+  for (i = 1; i < MAX_BATCH_ENTRIES; i++)
+    end += sprintf(end, ", \"k%d\"", i);
+  strcpy(end, "]");
+  ret = accepted(MGETREQ, keys, NULL);
+  sprintf(end, ", \"k%d\"]", i);
+  ret = ret && !accepted(MGETREQ, keys, NULL);
+  free(keys);
+  ASSERT(ret);
+  return 0;
+}
+
+const kvtest_t kvmessage_tests[] = {
+  { "batch", message_batch },
+  { "batch_mismatch", message_batch_mismatch },
+  { "batch_limit", message_batch_limit },
+  { NULL, NULL }
+};
@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvserver.h"
+#include "kvtests.h"
+
+/* Names which are not a single component of a path, and so may not be
+ * given to an INGEST or SNAPSHOT request. */
+static char *bad_names[] = { "", ".", "..", "../escaped", "/tmp", "a/b",
+    "a/", NULL };
+
+/* INGEST and SNAPSHOT refuse every name when their root is not set, and
+ * refuse names which would reach outside it when it is, creating nothing;
+ * a plain name is taken within the root. */
+static int server_root_path(void) {
+  kvserver_t server;
+  char *dirnames[] = { KVTEST_STORE };
+  unsigned int s;
+  int i;
+  ASSERT(kvserver_init(&server, dirnames, 1, NULL, KVSYNC_DEFAULT_MODE, true,
+      false, 1, KVCACHESET_SLAB_SIZE, KVCACHE_DEFAULT_POLICY, 1, "localhost",
+      0, false) == 0);
+  ASSERT(kvserver_snapshot(&server, "snapshot") == ERRINVLDMSG);
+  ASSERT(kvserver_ingest(&server, "ingest") == ERRINVLDMSG);
+  server.snapshot_root = KVTEST_DIRNAME;
+  server.ingest_root = KVTEST_DIRNAME;
+  for (i = 0; bad_names[i] != NULL; i++) {
+    ASSERT(kvserver_snapshot(&server, bad_names[i]) == ERRINVLDMSG);
+    ASSERT(kvserver_ingest(&server, bad_names[i]) == ERRINVLDMSG);
+  }
+  ASSERT(access(KVTEST_DIRNAME "/a", F_OK) != 0);
+  ASSERT(access("escaped", F_OK) != 0);
+  ASSERT(kvserver_snapshot(&server, "snapshot") == 0);
+  ASSERT(access(KVTEST_SNAPSHOT "/0", F_OK) == 0);
+  ASSERT(kvserver_snapshot(&server, "snapshot") == ERRFILCRT);
+  kvserver_clean(&server);
+  for (s = 0; s < server.cache.num_sets; s++)
+    kvcacheset_destroy(&server.cache.sets[s]);
+  free(server.cache.sets);
+  free(server.hostname);
+  return 0;
+}
+
+const kvtest_t kvserver_tests[] = {
+  { "root_path", server_root_path },
+  { NULL, NULL }
+};
@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "kvstore.h"
+#include "kvtests.h"
+
+/* A suite of tests, and the checkpoint it belongs to. */
+typedef struct {
+  const char *name;
+  const char *checkpoint;
+  const kvtest_t *tests;
+} kvsuite_t;
+
+static const kvsuite_t suites[] = {
+  { "kvlsmstore", "checkpoint1", kvlsmstore_tests },
+  { "kvbtree", "checkpoint1", kvbtree_tests },
+  { "kvmessage", "checkpoint1", kvmessage_tests },
+  { "kvcrc32c", "checkpoint1", kvcrc32c_tests },
+  { "kvlogstore", "checkpoint1", kvlogstore_tests },
+  { "kvcache", "checkpoint1", kvcache_tests },
+  { "kvfilestore", "checkpoint1", kvfilestore_tests },
+  { "kvserver", "checkpoint1", kvserver_tests },
+  { NULL, NULL, NULL }
+};
+
+/* Runs every test of SUITE, counting them into RUN and those which fail
+ * into FAILED. */
+static void run_suite(const kvsuite_t *suite, int *run, int *failed) {
+  const kvtest_t *test;
+  bool ok;
+  for (test = suite->tests; test->name != NULL; test++) {
+    kvstore_remove_tree(KVTEST_DIRNAME);
+    ok = mkdir(KVTEST_DIRNAME, 0700) == 0 && test->run() == 0;
+    kvstore_remove_tree(KVTEST_DIRNAME);
+    printf("%-6s %s.%s\n", ok ? "PASS" : "FAIL", suite->name, test->name);
+    (*run)++;
+    if (!ok)
+      (*failed)++;
+  }
+}
+
+/* Runs the suites of the checkpoint named by the first argument, or every
+ * suite if there is none. Exits with 1 if any test fails. */
+int main(int argc, char **argv) {
+  const kvsuite_t *suite;
+  int run = 0, failed = 0;
+  for (suite = suites; suite->name != NULL; suite++) {
+    if (argc < 2 || strcmp(argv[1], suite->checkpoint) == 0)
+      run_suite(suite, &run, &failed);
+  }
+  printf("%d of %d tests passed\n", run - failed, run);
+  return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#ifndef __KV_TESTS__
+#define __KV_TESTS__
+
+#include <stdio.h>
+
+/* The tests are built into one binary by `make test` and run by `make
+ * check1` (checkpoint1), `make check2` (checkpoint2) or `make check` (every
+ * suite). Each suite is a NULL terminated array of kvtest_t, listed in
+ * kvtests.c along with the checkpoint it belongs to. A test returns 0 if it
+ * passes, else nonzero, and keeps whatever files it needs under
+ * KVTEST_DIRNAME, which is created empty before each test and removed after.
+ */
+
+/* The directory within which tests keep their stores. */
+#define KVTEST_DIRNAME "test_tmp_dir"
+
+/* The directory of the store a test opens, and of a snapshot taken of it. */
+#define KVTEST_STORE KVTEST_DIRNAME "/store"
+#define KVTEST_SNAPSHOT KVTEST_DIRNAME "/snapshot"
+
+/* Fails the running test, reporting where, unless COND holds. */
+#define ASSERT(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, \
+          #cond); \
+      return 1; \
+    } \
+  } while (0)
+
+/* A single test. */
+typedef struct {
+  const char *name;             /* The name reported for this test. */
+  int (*run)(void);             /* Runs this test, returning 0 if it passes. */
+} kvtest_t;
+
+extern const kvtest_t kvlsmstore_tests[];
+extern const kvtest_t kvbtree_tests[];
+extern const kvtest_t kvmessage_tests[];
+extern const kvtest_t kvcrc32c_tests[];
+extern const kvtest_t kvlogstore_tests[];
+extern const kvtest_t kvcache_tests[];
+extern const kvtest_t kvfilestore_tests[];
+extern const kvtest_t kvserver_tests[];
+
+#endif